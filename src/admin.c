@@ -56,6 +56,7 @@
 #include <sys/utsname.h>
 #endif
 
+#include "common/thread/thread.h"
 #include "common/net/sock.h"
 
 #include "admin.h"
@@ -74,6 +75,8 @@
 #include "reportxml.h"
 #include "reportxml_helper.h"
 #include "xml2json.h"
+#include "buffer.h"
+#include "metrics.h"
 
 #include "format.h"
 
@@ -126,6 +129,8 @@
 #define STREAMLIST_HTML_REQUEST             "streamlist.xsl"
 #define STREAMLIST_JSON_REQUEST             "streamlist.json"
 #define STREAMLIST_PLAINTEXT_REQUEST        "streamlist.txt"
+/* longest a stream list request may wait for changes, in seconds */
+#define STREAMLIST_MAX_WAIT                 300
 #define LISTENSOCKETLIST_RAW_REQUEST        "listensocketlist"
 #define LISTENSOCKETLIST_HTML_REQUEST       "listensocketlist.xsl"
 #define MOVECLIENTS_RAW_REQUEST             "moveclients"
@@ -158,6 +163,7 @@
 #define DEFAULT_RAW_REQUEST                 ""
 #define DEFAULT_HTML_REQUEST                ""
 #define BUILDM3U_RAW_REQUEST                "buildm3u"
+#define METRICS_PLAINTEXT_REQUEST           "metrics"
 
 typedef enum {
     ADMIN_DASHBOARD_STATUS_OK = 0,
@@ -191,6 +197,7 @@ static void command_show_log            (client_t *client, source_t *source, adm
 static void command_mark_log            (client_t *client, source_t *source, admin_format_t response);
 static void command_dashboard           (client_t *client, source_t *source, admin_format_t response);
 static void command_version             (client_t *client, source_t *source, admin_format_t response);
+static void command_metrics             (client_t *client, source_t *source, admin_format_t response);
 
 static const admin_command_handler_t handlers[] = {
     { "*",                                  ADMINTYPE_GENERAL,      ADMIN_FORMAT_HTML,          ADMINSAFE_UNSAFE,   NULL, NULL}, /* for ACL framework */
@@ -225,9 +232,9 @@ static const admin_command_handler_t handlers[] = {
     { MOVECLIENTS_RAW_REQUEST,              ADMINTYPE_MOUNT,        ADMIN_FORMAT_RAW,           ADMINSAFE_HYBRID,   command_move_clients, NULL},
     { MOVECLIENTS_HTML_REQUEST,             ADMINTYPE_HYBRID,       ADMIN_FORMAT_HTML,          ADMINSAFE_HYBRID,   command_move_clients, NULL},
     { MOVECLIENTS_JSON_REQUEST,             ADMINTYPE_HYBRID,       ADMIN_FORMAT_JSON,          ADMINSAFE_HYBRID,   command_move_clients, NULL},
-    { KILLCLIENT_RAW_REQUEST,               ADMINTYPE_MOUNT,        ADMIN_FORMAT_RAW,           ADMINSAFE_UNSAFE,   command_kill_client, NULL},
-    { KILLCLIENT_HTML_REQUEST,              ADMINTYPE_MOUNT,        ADMIN_FORMAT_HTML,          ADMINSAFE_UNSAFE,   command_kill_client, NULL},
-    { KILLCLIENT_JSON_REQUEST,              ADMINTYPE_MOUNT,        ADMIN_FORMAT_JSON,          ADMINSAFE_UNSAFE,   command_kill_client, NULL},
+    { KILLCLIENT_RAW_REQUEST,               ADMINTYPE_HYBRID,       ADMIN_FORMAT_RAW,           ADMINSAFE_UNSAFE,   command_kill_client, NULL},
+    { KILLCLIENT_HTML_REQUEST,              ADMINTYPE_HYBRID,       ADMIN_FORMAT_HTML,          ADMINSAFE_UNSAFE,   command_kill_client, NULL},
+    { KILLCLIENT_JSON_REQUEST,              ADMINTYPE_HYBRID,       ADMIN_FORMAT_JSON,          ADMINSAFE_UNSAFE,   command_kill_client, NULL},
     { KILLSOURCE_RAW_REQUEST,               ADMINTYPE_MOUNT,        ADMIN_FORMAT_RAW,           ADMINSAFE_UNSAFE,   command_kill_source, NULL},
     { KILLSOURCE_HTML_REQUEST,              ADMINTYPE_MOUNT,        ADMIN_FORMAT_HTML,          ADMINSAFE_UNSAFE,   command_kill_source, NULL},
     { KILLSOURCE_JSON_REQUEST,              ADMINTYPE_MOUNT,        ADMIN_FORMAT_JSON,          ADMINSAFE_UNSAFE,   command_kill_source, NULL},
@@ -249,6 +256,7 @@ static const admin_command_handler_t handlers[] = {
     { DASHBOARD_JSON_REQUEST,               ADMINTYPE_GENERAL,      ADMIN_FORMAT_JSON,          ADMINSAFE_SAFE,     command_dashboard, NULL},
     { VERSION_RAW_REQUEST,                  ADMINTYPE_GENERAL,      ADMIN_FORMAT_RAW,           ADMINSAFE_SAFE,     command_version, NULL},
     { VERSION_HTML_REQUEST,                 ADMINTYPE_GENERAL,      ADMIN_FORMAT_HTML,          ADMINSAFE_SAFE,     command_version, NULL},
+    { METRICS_PLAINTEXT_REQUEST,            ADMINTYPE_GENERAL,      ADMIN_FORMAT_PLAINTEXT,     ADMINSAFE_SAFE,     command_metrics, NULL},
     { DEFAULT_HTML_REQUEST,                 ADMINTYPE_HYBRID,       ADMIN_FORMAT_HTML,          ADMINSAFE_SAFE,     command_default_selector, NULL},
     { DEFAULT_RAW_REQUEST,                  ADMINTYPE_HYBRID,       ADMIN_FORMAT_HTML,          ADMINSAFE_SAFE,     command_default_selector, NULL}
 };
@@ -829,7 +837,31 @@ static void command_move_clients(client_t   *client,
     admin_send_response_simple(client, source, response, buf, 1);
 }
 
+static void __add_memory_usage(xmlNodePtr parent, const char *name, const client_memory_usage_t *usage, size_t listeners)
+{
+    xmlNodePtr node = xmlNewChild(parent, NULL, XMLSTR(name), NULL);
+    size_t total = usage->connection + usage->parser + usage->buffer + usage->format;
+    char buf[22];
+
+    snprintf(buf, sizeof(buf), "%zu", usage->connection);
+    xmlNewTextChild(node, NULL, XMLSTR("connection"), XMLSTR(buf));
+    snprintf(buf, sizeof(buf), "%zu", usage->parser);
+    xmlNewTextChild(node, NULL, XMLSTR("parser"), XMLSTR(buf));
+    snprintf(buf, sizeof(buf), "%zu", usage->buffer);
+    xmlNewTextChild(node, NULL, XMLSTR("buffer"), XMLSTR(buf));
+    snprintf(buf, sizeof(buf), "%zu", usage->format);
+    xmlNewTextChild(node, NULL, XMLSTR("format"), XMLSTR(buf));
+    snprintf(buf, sizeof(buf), "%zu", total);
+    xmlNewTextChild(node, NULL, XMLSTR("total"), XMLSTR(buf));
+
+    if (listeners) {
+        snprintf(buf, sizeof(buf), "%zu", total / listeners);
+        xmlNewTextChild(node, NULL, XMLSTR("per_listener"), XMLSTR(buf));
+    }
+}
+
 static inline xmlNodePtr __add_listener(client_t        *client,
+                                        source_t        *source,
                                         xmlNodePtr      parent,
                                         time_t          now,
                                         operation_mode  mode)
@@ -891,6 +923,13 @@ static inline xmlNodePtr __add_listener(client_t        *client,
         }
     } while (0);
 
+    do {
+        client_memory_usage_t usage;
+
+        client_get_memory_usage(client, source, &usage);
+        __add_memory_usage(node, "memory", &usage, 0);
+    } while (0);
+
     return node;
 }
 
@@ -904,10 +943,34 @@ void admin_add_listeners_to_mount(source_t          *source,
     avl_tree_rlock(source->client_tree);
     client_node = avl_get_first(source->client_tree);
     while(client_node) {
-        __add_listener((client_t *)client_node->key, parent, now, mode);
+        __add_listener((client_t *)client_node->key, source, parent, now, mode);
+        client_node = avl_get_next(client_node);
+    }
+    avl_tree_unlock(source->client_tree);
+}
+
+void admin_add_listener_memory_to_mount(source_t *source, xmlNodePtr parent)
+{
+    client_memory_usage_t sum = {0, 0, 0, 0};
+    size_t listeners = 0;
+    avl_node *client_node;
+
+    avl_tree_rlock(source->client_tree);
+    client_node = avl_get_first(source->client_tree);
+    while(client_node) {
+        client_memory_usage_t usage;
+
+        client_get_memory_usage((client_t *)client_node->key, source, &usage);
+        sum.connection += usage.connection;
+        sum.parser += usage.parser;
+        sum.buffer += usage.buffer;
+        sum.format += usage.format;
+        listeners++;
         client_node = avl_get_next(client_node);
     }
     avl_tree_unlock(source->client_tree);
+
+    __add_memory_usage(parent, "listener_memory", &sum, listeners);
 }
 
 static void command_show_listeners(client_t *client,
@@ -969,6 +1032,27 @@ xmlNodePtr admin_add_role_to_authentication(auth_t *auth, xmlNodePtr parent)
     xmlSetProp(rolenode, XMLSTR("can-deleteuser"), XMLSTR(auth->deleteuser ? "true" : "false"));
     xmlSetProp(rolenode, XMLSTR("can-listuser"), XMLSTR(auth->listuser ? "true" : "false"));
 
+    thread_mutex_lock(&auth->lock);
+    snprintf(idbuf, sizeof(idbuf), "%d", auth->pending_count);
+    xmlNewTextChild(rolenode, NULL, XMLSTR("queue-depth"), XMLSTR(idbuf));
+    snprintf(idbuf, sizeof(idbuf), "%zu", auth->in_flight);
+    xmlNewTextChild(rolenode, NULL, XMLSTR("in-flight"), XMLSTR(idbuf));
+    snprintf(idbuf, sizeof(idbuf), "%llu", (unsigned long long int)auth->stats_requests);
+    xmlNewTextChild(rolenode, NULL, XMLSTR("requests"), XMLSTR(idbuf));
+    snprintf(idbuf, sizeof(idbuf), "%.3f", auth->stats_requests ? auth->stats_latency_total / (double)auth->stats_requests / 1000. : 0.);
+    xmlNewTextChild(rolenode, NULL, XMLSTR("latency-average"), XMLSTR(idbuf));
+    snprintf(idbuf, sizeof(idbuf), "%.3f", auth->stats_latency_max / 1000.);
+    xmlNewTextChild(rolenode, NULL, XMLSTR("latency-max"), XMLSTR(idbuf));
+    if (auth->cache_ttl || auth->cache_deny_ttl) {
+        snprintf(idbuf, sizeof(idbuf), "%lu", auth->cache ? (unsigned long int)auth->cache->length : 0UL);
+        xmlNewTextChild(rolenode, NULL, XMLSTR("cache-entries"), XMLSTR(idbuf));
+        snprintf(idbuf, sizeof(idbuf), "%llu", (unsigned long long int)auth->stats_cache_hits);
+        xmlNewTextChild(rolenode, NULL, XMLSTR("cache-hits"), XMLSTR(idbuf));
+        snprintf(idbuf, sizeof(idbuf), "%llu", (unsigned long long int)auth->stats_cache_misses);
+        xmlNewTextChild(rolenode, NULL, XMLSTR("cache-misses"), XMLSTR(idbuf));
+    }
+    thread_mutex_unlock(&auth->lock);
+
     return rolenode;
 }
 
@@ -1036,6 +1120,8 @@ static void command_manageauth(client_t *client, source_t *source, admin_format_
             }
 
             ret = auth->adduser(auth, username, password);
+            if (ret == AUTH_USERADDED)
+                auth_cache_flush(auth);
             if (response == ADMIN_FORMAT_JSON || client->mode == OMODE_STRICT) {
                 if (ret == AUTH_FAILED) {
                     admin_send_response_simple(client, source, response, "User add failed - check the icecast error log", 0);
@@ -1063,6 +1149,8 @@ static void command_manageauth(client_t *client, source_t *source, admin_format_
             }
 
             ret = auth->deleteuser(auth, username);
+            if (ret == AUTH_USERDELETED)
+                auth_cache_flush(auth);
             if (response == ADMIN_FORMAT_JSON || client->mode == OMODE_STRICT) {
                 if (ret == AUTH_FAILED) {
                     admin_send_response_simple(client, source, response, "User delete failed - check the icecast error log", 0);
@@ -1073,6 +1161,17 @@ static void command_manageauth(client_t *client, source_t *source, admin_format_
                 auth_release(auth);
                 return;
             }
+        } else if (!strcmp(action, "flushcache")) {
+            if (admin_enforce_unsafe(client))
+                return;
+
+            auth_cache_flush(auth);
+            if (response == ADMIN_FORMAT_JSON || client->mode == OMODE_STRICT) {
+                admin_send_response_simple(client, source, response, "Cache flushed", 1);
+                config_release_config();
+                auth_release(auth);
+                return;
+            }
         }
 
         doc = xmlNewDoc(XMLSTR("1.0"));
@@ -1110,30 +1209,49 @@ static void command_kill_source(client_t *client,
     admin_send_response_simple(client, source, response, "Source Removed", 1);
 }
 
+static int __kill_client(client_t *client, void *userdata)
+{
+    (void)userdata;
+
+    /* This tags it for removal by whatever is handling the client */
+    client->con->error = 1;
+
+    return 0;
+}
+
 static void command_kill_client(client_t *client,
                                 source_t *source,
                                 admin_format_t response)
 {
     const char *idtext;
     int id;
-    client_t *listener;
+    int found;
     char buf[50] = "";
 
     COMMAND_REQUIRE(client, "id", idtext);
 
     id = atoi(idtext);
 
-    listener = source_find_client(source, id);
+    if (source) {
+        client_t *listener = source_find_client(source, id);
+
+        found = listener != NULL;
+        if (listener) {
+            /* This tags it for removal on the next iteration of the main source
+             * loop
+             */
+            listener->con->error = 1;
+        }
+    } else {
+        /* without a mount any client can be removed */
+        found = client_registry_find(id, __kill_client, NULL) == 0;
+    }
 
     ICECAST_LOG_DEBUG("Response is %d", response);
 
-    if (listener != NULL) {
+    if (found) {
         ICECAST_LOG_INFO("Admin request: client %d removed", id);
 
-        /* This tags it for removal on the next iteration of the main source
-         * loop
-         */
-        listener->con->error = 1;
         memset(buf, '\000', sizeof(buf));
         snprintf(buf, sizeof(buf)-1, "Client %d removed", id);
         admin_send_response_simple(client, source, response, buf, 1);
@@ -1318,28 +1436,60 @@ static void command_queue_reload(client_t *client, source_t *source, admin_forma
 }
 
 
+/* Sends the plain text stream list. A client that already has the current
+ * list (If-None-Match) gets a 304.
+ */
+static void admin_send_streamlist(client_t *client)
+{
+    const char *match = httpp_getvar(client->parser, "if-none-match");
+    char etag[64];
+    refbuf_t *list = stats_get_streams(etag, sizeof(etag));
+    int status = (match && strcmp(match, etag) == 0) ? 304 : 200;
+    ssize_t ret = util_http_build_header(client->refbuf->data,
+                                         PER_CLIENT_REFBUF_SIZE, 0,
+                                         0, status, NULL,
+                                         "text/plain", "utf-8",
+                                         NULL, NULL, client);
+
+    if (ret != -1 && ret < PER_CLIENT_REFBUF_SIZE)
+        ret += snprintf(client->refbuf->data + ret, PER_CLIENT_REFBUF_SIZE - ret, "ETag: %s\r\n\r\n", etag);
+
+    if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        refbuf_release(list);
+        client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
+        return;
+    }
+
+    client->refbuf->len = strlen (client->refbuf->data);
+    client->respcode = status;
+
+    if (status == 200) {
+        client->refbuf->next = list;
+    } else {
+        refbuf_release(list);
+    }
+    fserve_add_client (client, NULL);
+}
+
 static void command_list_mounts(client_t *client, source_t *source, admin_format_t response)
 {
     ICECAST_LOG_DEBUG("List mounts request");
 
     if (response == ADMIN_FORMAT_PLAINTEXT) {
-        ssize_t ret = util_http_build_header(client->refbuf->data,
-                                             PER_CLIENT_REFBUF_SIZE, 0,
-                                             0, 200, NULL,
-                                             "text/plain", "utf-8",
-                                             "", NULL, client);
-
-        if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
-            ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
-            client_send_error_by_id(client, ICECAST_ERROR_GEN_HEADER_GEN_FAILED);
-            return;
+        const char *match = httpp_getvar(client->parser, "if-none-match");
+        const char *wait;
+        int seconds;
+
+        /* long-polling slaves are parked until the list changes */
+        COMMAND_OPTIONAL(client, "wait", wait);
+        seconds = wait ? atoi(wait) : 0;
+        if (seconds > 0 && seconds <= STREAMLIST_MAX_WAIT && match) {
+            if (stats_wait_streams(client, match, seconds, admin_send_streamlist) == 0)
+                return;
         }
 
-        client->refbuf->len = strlen (client->refbuf->data);
-        client->respcode = 200;
-
-        client->refbuf->next = stats_get_streams ();
-        fserve_add_client (client, NULL);
+        admin_send_streamlist(client);
     } else {
         xmlDocPtr doc;
         avl_tree_rlock(global.source_tree);
@@ -1655,6 +1805,7 @@ static void command_dashboard           (client_t *client, source_t *source, adm
     bool has_too_many_clients;
     bool has_legacy_sources;
     bool inet6_enabled;
+    int clients;
 
 
     resource = reportxml_node_new(REPORTXML_NODE_TYPE_RESOURCE, NULL, NULL, NULL);
@@ -1673,12 +1824,13 @@ static void command_dashboard           (client_t *client, source_t *source, adm
     node = reportxml_node_new(REPORTXML_NODE_TYPE_VALUE, NULL, NULL, NULL);
     reportxml_node_set_attribute(node, "type", "structure");
     reportxml_node_set_attribute(node, "member", "global-current");
+    clients = __atomic_load_n(&global.clients, __ATOMIC_RELAXED);
     global_lock();
-    reportxml_helper_add_value_int(node, "clients", global.clients);
+    reportxml_helper_add_value_int(node, "clients", clients);
     reportxml_helper_add_value_int(node, "sources", global.sources);
     has_sources = global.sources > 0;
-    has_many_clients = global.clients > ((75 * config->client_limit) / 100);
-    has_too_many_clients = global.clients > ((90 * config->client_limit) / 100);
+    has_many_clients = clients > ((75 * config->client_limit) / 100);
+    has_too_many_clients = clients > ((90 * config->client_limit) / 100);
     has_legacy_sources = global.sources_legacy > 0;
     inet6_enabled = listensocket_container_is_family_included(global.listensockets, SOCK_FAMILY_INET6);
     global_unlock();
@@ -1940,6 +2092,22 @@ static void command_version             (client_t *client, source_t *source, adm
     refobject_unref(report);
 }
 
+static void command_metrics             (client_t *client, source_t *source, admin_format_t response)
+{
+    buffer_t *buffer = buffer_new(16384, NULL, NULL, REFOBJECT_NULL);
+    const void *data;
+    size_t length;
+
+    if (!buffer || metrics_render(buffer) != 0 || buffer_get_data(buffer, &data, &length) != 0) {
+        refobject_unref(buffer);
+        client_send_error_by_id(client, ICECAST_ERROR_GEN_MEMORY_EXHAUSTED);
+        return;
+    }
+
+    client_send_buffer(client, 200, "text/plain; version=0.0.4", "utf-8", data, length, NULL);
+    refobject_unref(buffer);
+}
+
 static void ui_command(client_t * client, source_t * source, admin_format_t format, resourcematch_extract_t *parameters)
 {
     int is_valid = 0;
@@ -60,6 +60,8 @@ void admin_send_response(xmlDocPtr       doc,
 void admin_add_listeners_to_mount(source_t       *source,
                                   xmlNodePtr      parent,
                                   operation_mode  mode);
+/* Adds the memory used by the listeners of the source, summed up by component. */
+void admin_add_listener_memory_to_mount(source_t *source, xmlNodePtr parent);
 
 xmlNodePtr admin_add_role_to_authentication(auth_t *auth, xmlNodePtr parent);
 
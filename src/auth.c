@@ -34,6 +34,9 @@
 #include "fserve.h"
 #include "admin.h"
 #include "acl.h"
+#include "digest.h"
+#include "metrics.h"
+#include "probes.h"
 
 #include "logging.h"
 #define CATMODULE "auth"
@@ -47,7 +50,7 @@ struct auth_stack_tag {
 };
 
 /* code */
-static void __handle_auth_client(auth_t *auth, auth_client *auth_user);
+static auth_result __handle_auth_client(auth_t *auth, auth_client *auth_user);
 
 static mutex_t _auth_lock; /* protects _current_id */
 static volatile unsigned long _current_id = 0;
@@ -74,7 +77,8 @@ static const struct {
     {.result = AUTH_NOMATCH,        .string = "no match"},
     {.result = AUTH_USERADDED,      .string = "user added"},
     {.result = AUTH_USEREXISTS,     .string = "user exists"},
-    {.result = AUTH_USERDELETED,    .string = "user deleted"}
+    {.result = AUTH_USERDELETED,    .string = "user deleted"},
+    {.result = AUTH_PENDING,        .string = "pending"}
 };
 
 static const char *auth_result2str(auth_result res)
@@ -137,8 +141,8 @@ static auth_client *auth_client_setup (client_t *client)
             *tmp = 0;
             username = userpass;
             password = tmp+1;
-            client->username = strdup(username);
-            client->password = strdup(password);
+            client->username = connection_strdup(client->con, username);
+            client->password = connection_strdup(client->con, password);
             free (userpass);
             break;
         }
@@ -151,6 +155,189 @@ static auth_client *auth_client_setup (client_t *client)
 }
 
 
+typedef struct auth_cache_entry_tag auth_cache_entry_t;
+struct auth_cache_entry_tag {
+    unsigned char key[AUTH_CACHE_KEY_LENGTH];
+    auth_result result;
+    time_t expire;
+    /* entries in the order they were stored */
+    auth_cache_entry_t *newer;
+    auth_cache_entry_t *older;
+};
+
+static int auth_cache_compare(void *arg, void *a, void *b)
+{
+    (void)arg;
+    return memcmp(((auth_cache_entry_t*)a)->key, ((auth_cache_entry_t*)b)->key, AUTH_CACHE_KEY_LENGTH);
+}
+
+static int auth_cache_entry_free(void *key)
+{
+    free(key);
+    return 1;
+}
+
+static inline void auth_cache_key_write(digest_t *digest, const char *str)
+{
+    if (str) {
+        digest_write(digest, "\1", 1);
+        digest_write(digest, str, strlen(str) + 1);
+    } else {
+        digest_write(digest, "\0", 1);
+    }
+}
+
+/* Builds the cache key for the client. The password only enters the key as part of a hash. */
+static int auth_cache_key(client_t *client, unsigned char key[AUTH_CACHE_KEY_LENGTH])
+{
+    digest_t *digest = digest_new(DIGEST_ALGO_SHA3_256);
+    const char *uri;
+    ssize_t ret;
+
+    if (!digest)
+        return -1;
+
+    uri = httpp_getvar(client->parser, HTTPP_VAR_RAWURI);
+    if (!uri)
+        uri = httpp_getvar(client->parser, HTTPP_VAR_URI);
+
+    auth_cache_key_write(digest, client->username);
+    auth_cache_key_write(digest, client->password);
+    auth_cache_key_write(digest, uri);
+    auth_cache_key_write(digest, client->con->ip);
+
+    ret = digest_read(digest, key, AUTH_CACHE_KEY_LENGTH);
+    refobject_unref(digest);
+
+    return ret == AUTH_CACHE_KEY_LENGTH ? 0 : -1;
+}
+
+/* Removes and frees an entry, must be called with the lock held. */
+static void auth_cache_unlink(auth_t *auth, auth_cache_entry_t *entry)
+{
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        auth->cache_oldest = entry->newer;
+    }
+
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        auth->cache_newest = entry->older;
+    }
+
+    avl_delete(auth->cache, entry, auth_cache_entry_free);
+}
+
+/* Returns the cached result for the key or AUTH_UNDEFINED. */
+static auth_result auth_cache_lookup(auth_t *auth, const unsigned char key[AUTH_CACHE_KEY_LENGTH])
+{
+    auth_cache_entry_t search;
+    void *result = NULL;
+    auth_result ret = AUTH_UNDEFINED;
+
+    memcpy(search.key, key, AUTH_CACHE_KEY_LENGTH);
+
+    thread_mutex_lock(&auth->lock);
+    if (auth->cache && avl_get_by_key(auth->cache, &search, &result) == 0) {
+        auth_cache_entry_t *entry = result;
+        if (entry->expire > time(NULL)) {
+            ret = entry->result;
+        } else {
+            auth_cache_unlink(auth, entry);
+        }
+    }
+    if (ret == AUTH_UNDEFINED) {
+        auth->stats_cache_misses++;
+    } else {
+        auth->stats_cache_hits++;
+    }
+    thread_mutex_unlock(&auth->lock);
+
+    return ret;
+}
+
+static void auth_cache_store(auth_t *auth, const unsigned char key[AUTH_CACHE_KEY_LENGTH], auth_result result)
+{
+    auth_cache_entry_t *entry;
+    void *old = NULL;
+    unsigned int ttl;
+    time_t now;
+
+    switch (result) {
+        case AUTH_OK:
+            ttl = auth->cache_ttl;
+        break;
+        case AUTH_FAILED:
+        case AUTH_FORBIDDEN:
+        case AUTH_NOMATCH:
+            ttl = auth->cache_deny_ttl;
+        break;
+        default:
+            return;
+        break;
+    }
+
+    if (!ttl || !auth->cache_size)
+        return;
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        return;
+
+    now = time(NULL);
+    memcpy(entry->key, key, AUTH_CACHE_KEY_LENGTH);
+    entry->result = result;
+    entry->expire = now + ttl;
+
+    thread_mutex_lock(&auth->lock);
+    if (!auth->cache)
+        auth->cache = avl_tree_new(auth_cache_compare, NULL);
+
+    if (auth->cache) {
+        auth_cache_entry_t *oldest;
+
+        if (avl_get_by_key(auth->cache, entry, &old) == 0)
+            auth_cache_unlink(auth, old);
+
+        /* drop expired entries at the old end, and make room if still full */
+        while ((oldest = auth->cache_oldest) && (oldest->expire <= now || auth->cache->length >= auth->cache_size))
+            auth_cache_unlink(auth, oldest);
+
+        avl_insert(auth->cache, entry);
+        entry->older = auth->cache_newest;
+        if (auth->cache_newest) {
+            ((auth_cache_entry_t*)auth->cache_newest)->newer = entry;
+        } else {
+            auth->cache_oldest = entry;
+        }
+        auth->cache_newest = entry;
+        entry = NULL;
+    }
+    thread_mutex_unlock(&auth->lock);
+
+    free(entry);
+}
+
+void auth_cache_flush(auth_t *auth)
+{
+    avl_tree *cache;
+
+    if (!auth)
+        return;
+
+    thread_mutex_lock(&auth->lock);
+    cache = auth->cache;
+    auth->cache = NULL;
+    auth->cache_oldest = NULL;
+    auth->cache_newest = NULL;
+    thread_mutex_unlock(&auth->lock);
+
+    if (cache)
+        avl_tree_free(cache, auth_cache_entry_free);
+}
+
 static void queue_auth_client (auth_client *auth_user)
 {
     auth_t *auth;
@@ -165,14 +352,18 @@ static void queue_auth_client (auth_client *auth_user)
     }
     auth = auth_user->client->auth;
     ICECAST_LOG_DDEBUG("...refcount on auth_t %s is now %d", auth->mount, (int)auth->refcount);
+    ICECAST_PROBE3(auth_queued, auth_user->client->con->id, auth->mount, auth->role);
     if (auth->immediate) {
         __handle_auth_client(auth, auth_user);
     } else {
+        auth_user->queued = metrics_time();
         thread_mutex_lock (&auth->lock);
         *auth->tailp = auth_user;
         auth->tailp = &auth_user->next;
         auth->pending_count++;
+        metrics_gauge_add(METRICS_GAUGE_AUTH_QUEUE_DEPTH, 1);
         ICECAST_LOG_INFO("auth on %s has %d pending", auth->mount, auth->pending_count);
+        thread_cond_signal(&auth->cond);
         thread_mutex_unlock (&auth->lock);
     }
 }
@@ -196,16 +387,23 @@ void auth_release (auth_t *authenticator) {
         return;
     }
 
-    /* cleanup auth thread attached to this auth */
+    /* cleanup auth threads attached to this auth */
     if (authenticator->running) {
         authenticator->running = 0;
+        thread_cond_broadcast(&authenticator->cond);
         thread_mutex_unlock(&authenticator->lock);
-        thread_join(authenticator->thread);
+        for (i = 0; i < authenticator->workers; i++) {
+            if (authenticator->threads[i])
+                thread_join(authenticator->threads[i]);
+        }
         thread_mutex_lock(&authenticator->lock);
     }
+    free(authenticator->threads);
 
     if (authenticator->free)
         authenticator->free(authenticator);
+    if (authenticator->cache)
+        avl_tree_free(authenticator->cache, auth_cache_entry_free);
     if (authenticator->type)
         xmlFree (authenticator->type);
     if (authenticator->role)
@@ -218,6 +416,7 @@ void auth_release (auth_t *authenticator) {
         xmlFree (authenticator->deny_arg);
     thread_mutex_unlock(&authenticator->lock);
     thread_mutex_destroy(&authenticator->lock);
+    thread_cond_destroy(&authenticator->cond);
     if (authenticator->mount)
         free(authenticator->mount);
     acl_release(authenticator->acl);
@@ -266,6 +465,19 @@ static int is_client_connected (client_t *client) {
     return 1;
 }
 
+static auth_result auth_new_client_finish (auth_t *auth, auth_client *auth_user, auth_result result)
+{
+    client_t *client = auth_user->client;
+
+    (void)auth;
+
+    if (result != AUTH_OK) {
+        auth_release (client->auth);
+        client->auth = NULL;
+    }
+    return result;
+}
+
 static auth_result auth_new_client (auth_t *auth, auth_client *auth_user) {
     client_t *client = auth_user->client;
     auth_result ret = AUTH_FAILED;
@@ -277,34 +489,27 @@ static auth_result auth_new_client (auth_t *auth, auth_client *auth_user) {
         client->respcode = 400;
         auth_release (client->auth);
         client->auth = NULL;
+        auth_user->no_cache = 1;
         return AUTH_FAILED;
     }
 
     if (auth->authenticate_client) {
         ret = auth->authenticate_client(auth_user);
-        if (ret != AUTH_OK)
-        {
-            auth_release (client->auth);
-            client->auth = NULL;
+        if (ret == AUTH_PENDING)
             return ret;
-        }
+        return auth_new_client_finish(auth, auth_user, ret);
     }
+    auth_user->no_cache = 1;
     return ret;
 }
 
 
-/* wrapper function for auth thread to drop client connections
- */
-static auth_result auth_remove_client(auth_t *auth, auth_client *auth_user)
+static auth_result auth_remove_client_finish(auth_t *auth, auth_client *auth_user, auth_result result)
 {
     client_t *client = auth_user->client;
-    auth_result ret = AUTH_RELEASED;
 
     (void)auth;
 
-    if (client->auth->release_client)
-        ret = client->auth->release_client(auth_user);
-
     auth_release(client->auth);
     client->auth = NULL;
 
@@ -312,7 +517,23 @@ static auth_result auth_remove_client(auth_t *auth, auth_client *auth_user)
     acl_release(client->acl);
     client->acl = NULL;
 
-    return ret;
+    return result;
+}
+
+/* wrapper function for auth thread to drop client connections
+ */
+static auth_result auth_remove_client(auth_t *auth, auth_client *auth_user)
+{
+    client_t *client = auth_user->client;
+    auth_result ret = AUTH_RELEASED;
+
+    if (client->auth->release_client)
+        ret = client->auth->release_client(auth_user);
+
+    if (ret == AUTH_PENDING)
+        return ret;
+
+    return auth_remove_client_finish(auth, auth_user, ret);
 }
 
 static inline int __handle_auth_client_alter(client_t *client, auth_alter_t action, const char *arg)
@@ -360,24 +581,17 @@ static inline int __handle_auth_client_alter(client_t *client, auth_alter_t acti
     return -1;
 }
 
-static void __handle_auth_client (auth_t *auth, auth_client *auth_user) {
-    auth_result result;
-
-    if (auth_user->process) {
-        result = auth_user->process(auth, auth_user);
-    } else {
-        ICECAST_LOG_ERROR("client auth process not set");
-        result = AUTH_FAILED;
-    }
-
+static void __handle_auth_client_result(auth_t *auth, auth_client *auth_user, auth_result result)
+{
     ICECAST_LOG_DEBUG("client %p on auth %p role %s processed: %s", auth_user->client, auth, auth->role, auth_result2str(result));
+    ICECAST_PROBE3(auth_decided, auth_user->client->con->id, (int)result, auth->role);
 
     if (result == AUTH_OK) {
         if (auth_user->client->acl)
             acl_release(auth_user->client->acl);
         acl_addref(auth_user->client->acl = auth->acl);
         if (auth->role && !auth_user->client->role) /* TODO: Handle errors here */
-            auth_user->client->role = strdup(auth->role);
+            auth_user->client->role = connection_strdup(auth_user->client->con, auth->role);
     }
 
     if (result != AUTH_NOMATCH) {
@@ -394,46 +608,107 @@ static void __handle_auth_client (auth_t *auth, auth_client *auth_user) {
     auth_client_free (auth_user);
 }
 
+/* Called for each result returned by the backend. */
+static void __handle_auth_client_done(auth_t *auth, auth_client *auth_user, auth_result result)
+{
+    uint64_t latency = metrics_time() - auth_user->started;
+
+    thread_mutex_lock(&auth->lock);
+    auth->stats_requests++;
+    auth->stats_latency_total += latency;
+    if (latency > auth->stats_latency_max)
+        auth->stats_latency_max = latency;
+    thread_mutex_unlock(&auth->lock);
+
+    /* Results that altered the client (e.g. set a time limit) are not cached,
+     * neither are failures that did not come from the backend.
+     */
+    if (auth_user->cache_key_set && !auth_user->no_cache && auth_user->alter_client_action == AUTH_ALTER_NOOP && auth_user->client->con->discon_time == 0)
+        auth_cache_store(auth, auth_user->cache_key, result);
+
+    __handle_auth_client_result(auth, auth_user, result);
+}
+
+static auth_result __handle_auth_client (auth_t *auth, auth_client *auth_user) {
+    auth_result result;
+
+    auth_user->started = metrics_time();
+
+    if (auth_user->process) {
+        result = auth_user->process(auth, auth_user);
+    } else {
+        ICECAST_LOG_ERROR("client auth process not set");
+        auth_user->no_cache = 1;
+        result = AUTH_FAILED;
+    }
+
+    if (result != AUTH_PENDING)
+        __handle_auth_client_done(auth, auth_user, result);
+
+    return result;
+}
+
+void auth_client_complete(auth_t *auth, auth_client *auth_user, auth_result result)
+{
+    auth_user->result = result;
+
+    thread_mutex_lock(&auth->lock);
+    auth_user->next = auth->completed;
+    auth->completed = auth_user;
+    thread_cond_signal(&auth->cond);
+    thread_mutex_unlock(&auth->lock);
+}
+
 /* The auth thread main loop. */
 static void *auth_run_thread (void *arg)
 {
     auth_t *auth = arg;
 
     ICECAST_LOG_INFO("Authentication thread started");
-    while (1) {
-        thread_mutex_lock(&auth->lock);
-
-        if (!auth->running) {
+    thread_mutex_lock(&auth->lock);
+    while (auth->running) {
+        if (auth->completed) {
+            auth_client *auth_user = auth->completed;
+            auth_result result = auth_user->result;
+
+            auth->completed = auth_user->next;
+            auth->in_flight--;
             thread_mutex_unlock(&auth->lock);
-            break;
-        }
+            auth_user->next = NULL;
 
-        if (auth->head) {
-            auth_client *auth_user;
+            if (auth_user->finish)
+                result = auth_user->finish(auth, auth_user, result);
+
+            __handle_auth_client_done(auth, auth_user, result);
+        } else if (auth->head && auth->in_flight < auth->concurrency) {
+            auth_client *auth_user = auth->head;
 
-            /* may become NULL before lock taken */
-            auth_user = (auth_client*)auth->head;
-            if (auth_user == NULL)
-            {
-                thread_mutex_unlock (&auth->lock);
-                continue;
-            }
             ICECAST_LOG_DDEBUG("%d client(s) pending on %s (role %s)", auth->pending_count, auth->mount, auth->role);
             auth->head = auth_user->next;
             if (auth->head == NULL)
                 auth->tailp = &auth->head;
             auth->pending_count--;
+            /* taken before the request is started so other workers see it */
+            auth->in_flight++;
             thread_mutex_unlock(&auth->lock);
             auth_user->next = NULL;
 
-            __handle_auth_client(auth, auth_user);
+            metrics_gauge_add(METRICS_GAUGE_AUTH_QUEUE_DEPTH, -1);
+            metrics_histogram_observe(METRICS_HISTOGRAM_AUTH_QUEUE, metrics_time() - auth_user->queued);
 
-            continue;
+            if (__handle_auth_client(auth, auth_user) != AUTH_PENDING) {
+                thread_mutex_lock(&auth->lock);
+                auth->in_flight--;
+                thread_mutex_unlock(&auth->lock);
+            }
         } else {
-            thread_mutex_unlock(&auth->lock);
+            /* The timeout is only a safety net, we are signaled on new clients and completed requests. */
+            thread_cond_timedwait_mutex(&auth->cond, &auth->lock, 1000);
+            continue;
         }
-        thread_sleep (150000);
+        thread_mutex_lock(&auth->lock);
     }
+    thread_mutex_unlock(&auth->lock);
     ICECAST_LOG_INFO("Authentication thread shutting down");
     return NULL;
 }
@@ -522,9 +797,24 @@ static void auth_add_client(auth_t *auth, client_t *client, void (*on_no_match)(
     auth_addref(client->auth = auth);
     auth_user = auth_client_setup(client);
     auth_user->process = auth_new_client;
+    auth_user->finish = auth_new_client_finish;
     auth_user->on_no_match = on_no_match;
     auth_user->on_result = on_result;
     auth_user->userdata = userdata;
+
+    if ((auth->cache_ttl || auth->cache_deny_ttl) && auth_cache_key(client, auth_user->cache_key) == 0) {
+        auth_result result = auth_cache_lookup(auth, auth_user->cache_key);
+
+        if (result != AUTH_UNDEFINED) {
+            ICECAST_LOG_DEBUG("client %p on auth %p role %s got cached result: %s", client, auth, auth->role, auth_result2str(result));
+            result = auth_new_client_finish(auth, auth_user, result);
+            __handle_auth_client_result(auth, auth_user, result);
+            return;
+        }
+
+        auth_user->cache_key_set = 1;
+    }
+
     ICECAST_LOG_DDEBUG("adding client %p for authentication on %p", client, auth);
     queue_auth_client(auth_user);
 }
@@ -546,6 +836,7 @@ int auth_release_client (client_t *client) {
     if (client->auth && client->auth->release_client) {
         auth_client *auth_user = auth_client_setup(client);
         auth_user->process = auth_remove_client;
+        auth_user->finish = auth_remove_client_finish;
         auth_user->on_result = __auth_on_result_destroy_client;
         queue_auth_client(auth_user);
         return 1;
@@ -810,7 +1101,11 @@ auth_t *auth_get_authenticator(ice_config_t *configuration, xmlNodePtr node)
         return NULL;
 
     thread_mutex_create(&auth->lock);
+    thread_cond_create(&auth->cond);
     auth->refcount = 1;
+    auth->concurrency = 1;
+    auth->workers = 1;
+    auth->cache_size = 1024;
     auth->id = _next_auth_id();
     auth->type = (char*)xmlGetProp(node, XMLSTR("type"));
     auth->role = (char*)xmlGetProp(node, XMLSTR("name"));
@@ -906,6 +1201,33 @@ auth_t *auth_get_authenticator(ice_config_t *configuration, xmlNodePtr node)
     auth_get_authenticator__permission_alter(auth, node, "may-alter", AUTH_MATCHTYPE_MATCH);
     auth_get_authenticator__permission_alter(auth, node, "may-not-alter", AUTH_MATCHTYPE_NOMATCH);
 
+    tmp = (char*)xmlGetProp(node, XMLSTR("workers"));
+    if (tmp) {
+        auth->workers = util_str_to_unsigned_int(tmp, 1);
+        if (auth->workers < 1)
+            auth->workers = 1;
+        xmlFree(tmp);
+    }
+
+    tmp = (char*)xmlGetProp(node, XMLSTR("cache-ttl"));
+    if (tmp) {
+        auth->cache_ttl = util_str_to_unsigned_int(tmp, 0);
+        auth->cache_deny_ttl = auth->cache_ttl;
+        xmlFree(tmp);
+    }
+
+    tmp = (char*)xmlGetProp(node, XMLSTR("cache-deny-ttl"));
+    if (tmp) {
+        auth->cache_deny_ttl = util_str_to_unsigned_int(tmp, 0);
+        xmlFree(tmp);
+    }
+
+    tmp = (char*)xmlGetProp(node, XMLSTR("cache-size"));
+    if (tmp) {
+        auth->cache_size = util_str_to_unsigned_int(tmp, auth->cache_size);
+        xmlFree(tmp);
+    }
+
     /* sub node parsing */
     child = node->xmlChildrenNode;
     do {
@@ -983,8 +1305,20 @@ auth_t *auth_get_authenticator(ice_config_t *configuration, xmlNodePtr node)
         } else {
             auth->tailp = &auth->head;
             if (!auth->immediate) {
-                auth->running = 1;
-                auth->thread = thread_create("auth thread", auth_run_thread, auth, THREAD_ATTACHED);
+                if (auth->concurrency > 1 && auth->workers > 1) {
+                    ICECAST_LOG_WARN("Role %#H of type %#H runs its requests concurrently by itself, using a single worker.", auth->role, auth->type);
+                    auth->workers = 1;
+                }
+                auth->threads = calloc(auth->workers, sizeof(*auth->threads));
+                if (auth->threads) {
+                    auth->running = 1;
+                    for (i = 0; i < auth->workers; i++)
+                        auth->threads[i] = thread_create("auth thread", auth_run_thread, auth, THREAD_ATTACHED);
+                } else {
+                    auth->workers = 0;
+                    auth_release(auth);
+                    auth = NULL;
+                }
             }
         }
     }
@@ -1089,14 +1423,16 @@ void          auth_stack_add_client(auth_stack_t *stack, client_t *client, void
 }
 
 void          auth_stack_release(auth_stack_t *stack) {
+    size_t refcount;
+
     if (!stack)
         return;
 
     thread_mutex_lock(&stack->lock);
-    stack->refcount--;
+    refcount = --stack->refcount;
     thread_mutex_unlock(&stack->lock);
 
-    if (stack->refcount)
+    if (refcount)
         return;
 
     auth_release(stack->auth);
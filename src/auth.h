@@ -24,6 +24,7 @@
 
 #include "common/thread/thread.h"
 #include "common/httpp/httpp.h"
+#include "common/avl/avl.h"
 
 #include "icecasttypes.h"
 #include "cfgfile.h"
@@ -38,6 +39,9 @@
 
 #define MAX_ADMIN_COMMANDS 32
 
+/* length of the keys of the decision cache, see auth_cache_key() */
+#define AUTH_CACHE_KEY_LENGTH 32
+
 typedef enum
 {
     /* XXX: ??? */
@@ -55,7 +59,9 @@ typedef enum
     /* status codes for database changes */
     AUTH_USERADDED,
     AUTH_USEREXISTS,
-    AUTH_USERDELETED
+    AUTH_USERDELETED,
+    /* the request is in flight, auth_client_complete() will be called later */
+    AUTH_PENDING
 } auth_result;
 
 typedef enum {
@@ -88,12 +94,26 @@ typedef struct auth_client_tag auth_client;
 struct auth_client_tag {
     client_t     *client;
     auth_result (*process)(auth_t *auth, auth_client *auth_user);
+    /* called by auth_client_complete() when process() returned AUTH_PENDING */
+    auth_result (*finish)(auth_t *auth, auth_client *auth_user, auth_result result);
     void        (*on_no_match)(client_t *client, void (*on_result)(client_t *client, void *userdata, auth_result result), void *userdata);
     void        (*on_result)(client_t *client, void *userdata, auth_result result);
     void         *userdata;
     void         *authbackend_userdata;
     auth_alter_t  alter_client_action;
     char         *alter_client_arg;
+    /* when the client was queued and when processing started, see metrics_time() */
+    uint64_t      queued;
+    uint64_t      started;
+    /* key for the decision cache, only valid if cache_key_set is set */
+    int           cache_key_set;
+    unsigned char cache_key[AUTH_CACHE_KEY_LENGTH];
+    /* set if the result is not the backend's answer but a local or transport
+     * failure, such results are not cached
+     */
+    int           no_cache;
+    /* result passed to auth_client_complete() */
+    auth_result   result;
     auth_client  *next;
 };
 
@@ -144,6 +164,13 @@ struct auth_tag
     auth_result (*authenticate_client)(auth_client *aclient);
     auth_result (*release_client)(auth_client *auth_user);
 
+    /* Backends that keep several requests in flight may return AUTH_PENDING
+     * from authenticate_client() and release_client() and call
+     * auth_client_complete() once the request is done.
+     */
+    /* maximum number of requests in flight */
+    size_t concurrency;
+
     /* auth state-specific free call */
     void (*free)(auth_t *self);
 
@@ -152,14 +179,39 @@ struct auth_tag
     auth_result (*listuser)(auth_t *auth, xmlNodePtr srcnode);
 
     mutex_t lock;
+    /* signaled when a client was queued or the workers should stop */
+    cond_t cond;
     int running;
     size_t refcount;
 
-    thread_type *thread;
+    /* worker threads, backends with a concurrency above 1 always have one */
+    thread_type **threads;
+    size_t workers;
 
     /* per-auth queue for clients */
     auth_client *head, **tailp;
     int pending_count;
+    size_t in_flight;
+    /* requests passed to auth_client_complete(), handled by the workers */
+    auth_client *completed;
+
+    /* statistics, latency is in microseconds */
+    uint64_t stats_requests;
+    uint64_t stats_latency_total;
+    uint64_t stats_latency_max;
+
+    /* decision cache, keyed by username, password, mount and IP.
+     * A TTL of 0 disables caching of the respective results.
+     */
+    unsigned int cache_ttl;
+    unsigned int cache_deny_ttl;
+    size_t cache_size;
+    avl_tree *cache;
+    /* cache entries in the order they were stored, the oldest is evicted first */
+    void *cache_oldest;
+    void *cache_newest;
+    uint64_t stats_cache_hits;
+    uint64_t stats_cache_misses;
 
     void *state;
     char *type;
@@ -191,6 +243,12 @@ void    auth_release(auth_t *authenticator);
 void    auth_addref(auth_t *authenticator);
 
 int auth_release_client(client_t *client);
+/* Called by backends once a request that returned AUTH_PENDING is done.
+ * May be called from any thread, the result is handled by the auth thread.
+ */
+void auth_client_complete(auth_t *auth, auth_client *auth_user, auth_result result);
+/* Drops all cached decisions of the given auth. */
+void auth_cache_flush(auth_t *auth);
 
 void auth_stack_add_client(auth_stack_t  *stack,
                            client_t      *client,
@@ -13,6 +13,13 @@
 
 /**
  * Client authentication functions
+ *
+ * Users are kept in the hash index of htpasswd_index.c. Lookups hold the
+ * index lock for reading. Writers serialize on the state lock and only take
+ * the index lock for writing while they change the index, so anything they
+ * replaced can be freed as soon as they released it.
+ * The file is checked for changes by a thread of its own, which builds a
+ * new index without holding any lock and then publishes it.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -27,6 +34,7 @@
 #include <sys/stat.h>
 
 #include "auth.h"
+#include "htpasswd_index.h"
 #include "source.h"
 #include "client.h"
 #include "cfgfile.h"
@@ -43,27 +51,47 @@
 static auth_result htpasswd_adduser (auth_t *auth, const char *username, const char *password);
 static auth_result htpasswd_deleteuser(auth_t *auth, const char *username);
 static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode);
-static int _free_user (void *key);
 
-typedef struct {
-    char *name;
-    char *pass;
-} htpasswd_user;
+/* default for the number of seconds between checks of the file */
+#define HTPASSWD_DEFAULT_CHECK_INTERVAL     1
 
 typedef struct {
     char *filename;
-    rwlock_t file_rwlock;
-    avl_tree *users;
+    unsigned int check_interval;
+
+    /* protects all fields below, all changes to the file and to the index */
+    mutex_t lock;
+    cond_t cond;
+    int running;
+    thread_type *thread;
+    /* state of the file the index is based on */
     time_t mtime;
+    off_t size;
+    /* incremented on every change done by us */
+    unsigned long generation;
+
+    /* Current index, changed with both the lock and index_lock held for writing. */
+    rwlock_t index_lock;
+    htpasswd_index *index;
 } htpasswd_auth_state;
 
 static void htpasswd_clear(auth_t *self)
 {
     htpasswd_auth_state *state = self->state;
+
+    if (state->thread) {
+        thread_mutex_lock(&state->lock);
+        state->running = 0;
+        thread_cond_broadcast(&state->cond);
+        thread_mutex_unlock(&state->lock);
+        thread_join(state->thread);
+    }
+
     free(state->filename);
-    if (state->users)
-        avl_tree_free (state->users, _free_user);
-    thread_rwlock_destroy(&state->file_rwlock);
+    htpasswd_index_free(state->index, 1);
+    thread_rwlock_destroy(&state->index_lock);
+    thread_cond_destroy(&state->cond);
+    thread_mutex_destroy(&state->lock);
     free(state);
 }
 
@@ -83,94 +111,169 @@ static char *get_hash(const char *data, int len)
     return util_bin_to_hex(digest, 16);
 }
 
-
-static int compare_users(void *arg, void *a, void *b)
+/* Publishes a new index and returns the old one, which no reader uses anymore.
+ * Must be called with the lock held.
+ */
+static htpasswd_index *htpasswd_publish(htpasswd_auth_state *state, htpasswd_index *index)
 {
-    htpasswd_user *user1 = (htpasswd_user *)a;
-    htpasswd_user *user2 = (htpasswd_user *)b;
+    htpasswd_index *old;
 
-    (void)arg;
+    thread_rwlock_wlock(&state->index_lock);
+    old = state->index;
+    state->index = index;
+    thread_rwlock_unlock(&state->index_lock);
 
-    return strcmp (user1->name, user2->name);
+    return old;
 }
 
-
-static int _free_user(void *key)
+/* Reads the file into a new index, returns NULL if the file can not be read. */
+static htpasswd_index *htpasswd_load(const char *filename)
 {
-    htpasswd_user *user = (htpasswd_user *)key;
+    FILE *passwdfile;
+    htpasswd_index *index;
+    htpasswd_user **users = NULL;
+    size_t count = 0;
+    size_t alloced = 0;
+    size_t i;
+    int num = 0;
+    long offset;
+    char *sep;
+    char line [MAX_LINE_LEN];
+
+    passwdfile = fopen (filename, "rb");
+    if (passwdfile == NULL) {
+        ICECAST_LOG_WARN("Failed to open authentication database \"%s\": %s",
+                filename, strerror(errno));
+        return NULL;
+    }
+
+    offset = ftell(passwdfile);
+    while (get_line(passwdfile, line, MAX_LINE_LEN)) {
+        htpasswd_user *entry;
+        long line_offset = offset;
+
+        offset = ftell(passwdfile);
+        num++;
+        if (!line[0] || line[0] == '#')
+            continue;
+
+        sep = strrchr (line, ':');
+        if (sep == NULL) {
+            ICECAST_LOG_WARN("No separator on line %d (%s)", num, filename);
+            continue;
+        }
+        *sep = 0;
 
-    free (user->name); /* ->pass is part of same buffer */
-    free (user);
-    return 1;
+        entry = htpasswd_user_new(line, sep + 1);
+        if (!entry)
+            break;
+        entry->offset = line_offset;
+
+        if (count == alloced) {
+            htpasswd_user **n = realloc(users, (alloced + 1024) * sizeof(*users));
+            if (!n) {
+                htpasswd_user_free(entry);
+                break;
+            }
+            users = n;
+            alloced += 1024;
+        }
+        users[count++] = entry;
+    }
+    fclose (passwdfile);
+
+    index = htpasswd_index_new(count);
+    for (i = 0; i < count; i++) {
+        if (index && htpasswd_index_lookup(index, users[i]->name)) {
+            index->duplicates = 1;
+            htpasswd_user_free(users[i]);
+        } else if (!index || htpasswd_index_insert(index, users[i]) != 0) {
+            htpasswd_user_free(users[i]);
+        }
+    }
+    free(users);
+
+    return index;
 }
 
+static inline int htpasswd_file_unchanged(htpasswd_auth_state *htpasswd, struct stat *file_stat)
+{
+    return file_stat->st_mtime == htpasswd->mtime && file_stat->st_size == htpasswd->size;
+}
 
+/* Reloads the file if it changed. Must be called without the lock held. */
 static void htpasswd_recheckfile(htpasswd_auth_state *htpasswd)
 {
-    FILE *passwdfile;
-    avl_tree *new_users;
-    int num = 0;
+    htpasswd_index *index;
     struct stat file_stat;
-    char *sep;
-    char line [MAX_LINE_LEN];
+    unsigned long generation;
 
     if (htpasswd->filename == NULL)
         return;
     if (stat (htpasswd->filename, &file_stat) < 0) {
         ICECAST_LOG_WARN("failed to check status of %s", htpasswd->filename);
-
-        /* Create a dummy users tree for things to use later */
-        thread_rwlock_wlock (&htpasswd->file_rwlock);
-        if(!htpasswd->users)
-            htpasswd->users = avl_tree_new(compare_users, NULL);
-        thread_rwlock_unlock (&htpasswd->file_rwlock);
-
         return;
     }
 
-    if (file_stat.st_mtime == htpasswd->mtime) {
+    thread_mutex_lock(&htpasswd->lock);
+    if (htpasswd_file_unchanged(htpasswd, &file_stat)) {
         /* common case, no update to file */
+        thread_mutex_unlock(&htpasswd->lock);
         return;
     }
+    generation = htpasswd->generation;
+    thread_mutex_unlock(&htpasswd->lock);
+
     ICECAST_LOG_INFO("re-reading htpasswd file \"%s\"", htpasswd->filename);
-    passwdfile = fopen (htpasswd->filename, "rb");
-    if (passwdfile == NULL) {
-        ICECAST_LOG_WARN("Failed to open authentication database \"%s\": %s",
-                htpasswd->filename, strerror(errno));
+    index = htpasswd_load(htpasswd->filename);
+    if (!index)
+        return;
+
+    thread_mutex_lock(&htpasswd->lock);
+    if (generation != htpasswd->generation) {
+        /* We changed the file while it was read. Try again next time. */
+        htpasswd->mtime = 0;
+        thread_mutex_unlock(&htpasswd->lock);
+        htpasswd_index_free(index, 1);
         return;
     }
     htpasswd->mtime = file_stat.st_mtime;
+    htpasswd->size = file_stat.st_size;
+    index = htpasswd_publish(htpasswd, index);
+    thread_mutex_unlock(&htpasswd->lock);
 
-    new_users = avl_tree_new (compare_users, NULL);
+    htpasswd_index_free(index, 1);
+}
 
-    while (get_line(passwdfile, line, MAX_LINE_LEN)) {
-        int len;
-        htpasswd_user *entry;
+/* Records the state of the file after we changed it, if it was unchanged before. */
+static void htpasswd_record_change(htpasswd_auth_state *htpasswd, int unchanged)
+{
+    struct stat file_stat;
 
-        num++;
-        if (!line[0] || line[0] == '#')
-            continue;
+    htpasswd->generation++;
 
-        sep = strrchr (line, ':');
-        if (sep == NULL) {
-            ICECAST_LOG_WARN("No separator on line %d (%s)", num, htpasswd->filename);
-            continue;
-        }
-        entry = calloc (1, sizeof (htpasswd_user));
-        len = strlen (line) + 1;
-        entry->name = malloc (len);
-        *sep = 0;
-        memcpy (entry->name, line, len);
-        entry->pass = entry->name + (sep-line) + 1;
-        avl_insert (new_users, entry);
+    if (unchanged && stat(htpasswd->filename, &file_stat) == 0) {
+        htpasswd->mtime = file_stat.st_mtime;
+        htpasswd->size = file_stat.st_size;
     }
-    fclose (passwdfile);
+}
+
+static void *htpasswd_check_thread(void *arg)
+{
+    htpasswd_auth_state *htpasswd = arg;
+
+    thread_mutex_lock(&htpasswd->lock);
+    while (htpasswd->running) {
+        thread_cond_timedwait_mutex(&htpasswd->cond, &htpasswd->lock, htpasswd->check_interval * 1000);
+        if (!htpasswd->running)
+            break;
+        thread_mutex_unlock(&htpasswd->lock);
+        htpasswd_recheckfile(htpasswd);
+        thread_mutex_lock(&htpasswd->lock);
+    }
+    thread_mutex_unlock(&htpasswd->lock);
 
-    thread_rwlock_wlock (&htpasswd->file_rwlock);
-    if (htpasswd->users)
-        avl_tree_free (htpasswd->users, _free_user);
-    htpasswd->users = new_users;
-    thread_rwlock_unlock (&htpasswd->file_rwlock);
+    return NULL;
 }
 
 
@@ -179,8 +282,9 @@ static auth_result htpasswd_auth (auth_client *auth_user)
     auth_t *auth = auth_user->client->auth;
     htpasswd_auth_state *htpasswd = auth->state;
     client_t *client = auth_user->client;
-    htpasswd_user entry;
-    void *result;
+    htpasswd_user *found;
+    char *hashed_pw;
+    int match;
 
     if (!client->username || !client->password)
         return AUTH_NOMATCH;
@@ -189,31 +293,32 @@ static auth_result htpasswd_auth (auth_client *auth_user)
         ICECAST_LOG_ERROR("No filename given in options for authenticator.");
         return AUTH_NOMATCH;
     }
-    htpasswd_recheckfile (htpasswd);
 
-    if (htpasswd->users == NULL) {
+    /* hash outside of the lock to keep writers waiting as short as possible */
+    hashed_pw = get_hash (client->password, strlen (client->password));
+
+    thread_rwlock_rlock(&htpasswd->index_lock);
+    if (htpasswd->index == NULL) {
+        thread_rwlock_unlock(&htpasswd->index_lock);
+        free (hashed_pw);
         ICECAST_LOG_ERROR("No user list.");
         return AUTH_NOMATCH;
     }
 
-    thread_rwlock_rlock (&htpasswd->file_rwlock);
-    entry.name = client->username;
-    if (avl_get_by_key (htpasswd->users, &entry, &result) == 0) {
-        htpasswd_user *found = result;
-        char *hashed_pw;
+    found = htpasswd_index_lookup(htpasswd->index, client->username);
+    match = found && hashed_pw && strcmp (found->pass, hashed_pw) == 0;
+    thread_rwlock_unlock(&htpasswd->index_lock);
+    free (hashed_pw);
 
-        thread_rwlock_unlock (&htpasswd->file_rwlock);
-        hashed_pw = get_hash (client->password, strlen (client->password));
-        if (strcmp (found->pass, hashed_pw) == 0) {
-            free (hashed_pw);
-            return AUTH_OK;
-        }
-        free (hashed_pw);
+    if (match)
+        return AUTH_OK;
+
+    if (found) {
         ICECAST_LOG_DEBUG("incorrect password for client with username: %s", client->username);
         return AUTH_FAILED;
     }
+
     ICECAST_LOG_DEBUG("no such username: %s", client->username);
-    thread_rwlock_unlock (&htpasswd->file_rwlock);
     return AUTH_NOMATCH;
 }
 
@@ -229,11 +334,16 @@ int  auth_get_htpasswd_auth (auth_t *authenticator, config_options_t *options)
     authenticator->immediate = 1;
 
     state = calloc(1, sizeof(htpasswd_auth_state));
+    state->check_interval = HTPASSWD_DEFAULT_CHECK_INTERVAL;
 
     while(options) {
         if(!strcmp(options->name, "filename")) {
             free (state->filename);
             state->filename = strdup(options->value);
+        } else if (!strcmp(options->name, "check_interval")) {
+            state->check_interval = util_str_to_unsigned_int(options->value, HTPASSWD_DEFAULT_CHECK_INTERVAL);
+            if (state->check_interval < 1)
+                state->check_interval = 1;
         }
         options = options->next;
     }
@@ -247,9 +357,20 @@ int  auth_get_htpasswd_auth (auth_t *authenticator, config_options_t *options)
 
     authenticator->state = state;
 
-    thread_rwlock_create(&state->file_rwlock);
+    thread_mutex_create(&state->lock);
+    thread_cond_create(&state->cond);
+    thread_rwlock_create(&state->index_lock);
     htpasswd_recheckfile(state);
 
+    /* Create a dummy users index for things to use later */
+    if (!state->index)
+        state->index = htpasswd_index_new(0);
+
+    if (state->filename) {
+        state->running = 1;
+        state->thread = thread_create("htpasswd Check Thread", htpasswd_check_thread, state, THREAD_ATTACHED);
+    }
+
     return 0;
 }
 
@@ -259,81 +380,108 @@ static auth_result htpasswd_adduser (auth_t *auth, const char *username, const c
     FILE *passwdfile;
     char *hashed_password = NULL;
     htpasswd_auth_state *state = auth->state;
-    htpasswd_user entry;
-    void *result;
+    htpasswd_index *index;
+    htpasswd_user *user;
+    struct stat file_stat;
+    int unchanged;
+    int inserted;
+    long offset;
 
     if (state->filename == NULL) {
         ICECAST_LOG_ERROR("No filename given in options for authenticator.");
         return AUTH_FAILED;
     }
 
-    htpasswd_recheckfile (state);
+    thread_mutex_lock(&state->lock);
 
-    if (state->users == NULL) {
+    if (state->index == NULL) {
+        thread_mutex_unlock(&state->lock);
         ICECAST_LOG_ERROR("No user list.");
         return AUTH_FAILED;
     }
 
-    thread_rwlock_wlock (&state->file_rwlock);
-
-    entry.name = (char*)username;
-    if (avl_get_by_key (state->users, &entry, &result) == 0) {
-        thread_rwlock_unlock (&state->file_rwlock);
+    if (htpasswd_index_lookup(state->index, username)) {
+        thread_mutex_unlock(&state->lock);
         return AUTH_USEREXISTS;
     }
 
+    hashed_password = get_hash(password, strlen(password));
+    user = hashed_password ? htpasswd_user_new(username, hashed_password) : NULL;
+    free(hashed_password);
+    if (!user) {
+        thread_mutex_unlock(&state->lock);
+        ICECAST_LOG_ERROR("Can not allocate memory for new user. BAD.");
+        return AUTH_FAILED;
+    }
+
+    unchanged = stat(state->filename, &file_stat) == 0 && htpasswd_file_unchanged(state, &file_stat);
+
     passwdfile = fopen(state->filename, "ab");
 
     if (passwdfile == NULL) {
-        thread_rwlock_unlock (&state->file_rwlock);
+        thread_mutex_unlock(&state->lock);
         ICECAST_LOG_WARN("Failed to open authentication database \"%s\": %s",
                 state->filename, strerror(errno));
+        htpasswd_user_free(user);
         return AUTH_FAILED;
     }
 
-    hashed_password = get_hash(password, strlen(password));
-    if (hashed_password) {
-        fprintf(passwdfile, "%s:%s\n", username, hashed_password);
-        free(hashed_password);
+    fseek(passwdfile, 0, SEEK_END);
+    offset = ftell(passwdfile);
+    if (fprintf(passwdfile, "%s:%s\n", user->name, user->pass) < 0 || fclose(passwdfile) != 0) {
+        ICECAST_LOG_WARN("Failed to write authentication database \"%s\": %s",
+                state->filename, strerror(errno));
+        /* let the check thread find out what is in the file */
+        state->mtime = 0;
+        thread_mutex_unlock(&state->lock);
+        htpasswd_user_free(user);
+        return AUTH_FAILED;
+    }
+    user->offset = offset;
+
+    /* Update the index in place if there is room, otherwise publish a larger copy. */
+    thread_rwlock_wlock(&state->index_lock);
+    inserted = htpasswd_index_insert(state->index, user) == 0;
+    thread_rwlock_unlock(&state->index_lock);
+
+    if (!inserted) {
+        index = htpasswd_index_copy(state->index, state->index->count + 1);
+        if (index && htpasswd_index_insert(index, user) == 0) {
+            index = htpasswd_publish(state, index);
+            htpasswd_index_free(index, 0);
+        } else {
+            ICECAST_LOG_ERROR("Can not allocate memory for user index, reloading file.");
+            state->mtime = 0;
+            htpasswd_index_free(index, 0);
+            htpasswd_user_free(user);
+        }
     }
 
-    fclose(passwdfile);
-    thread_rwlock_unlock (&state->file_rwlock);
+    htpasswd_record_change(state, unchanged);
+    thread_mutex_unlock(&state->lock);
 
     return AUTH_USERADDED;
 }
 
 
-static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
+/* Removes all lines of the user by rewriting the file.
+ * Must be called with the lock held.
+ */
+static auth_result htpasswd_deleteuser_rewrite(htpasswd_auth_state *state, const char *username)
 {
     FILE *passwdfile;
     FILE *tmp_passwdfile;
-    htpasswd_auth_state *state;
     char line[MAX_LINE_LEN];
     char *sep;
     char *tmpfile = NULL;
     int tmpfile_len = 0;
     struct stat file_info;
 
-    state = auth->state;
-
-    if (!state->filename) {
-        ICECAST_LOG_ERROR("No filename given in options for authenticator.");
-        return AUTH_FAILED;
-    }
-
-    if (state->users == NULL) {
-        ICECAST_LOG_ERROR("No user list.");
-        return AUTH_FAILED;
-    }
-
-    thread_rwlock_wlock (&state->file_rwlock);
     passwdfile = fopen(state->filename, "rb");
 
     if(passwdfile == NULL) {
         ICECAST_LOG_WARN("Failed to open authentication database \"%s\": %s",
                 state->filename, strerror(errno));
-        thread_rwlock_unlock (&state->file_rwlock);
         return AUTH_FAILED;
     }
     tmpfile_len = strlen(state->filename) + 6;
@@ -343,7 +491,6 @@ static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
         ICECAST_LOG_WARN("temp file \"%s\" exists, rejecting operation", tmpfile);
         free (tmpfile);
         fclose (passwdfile);
-        thread_rwlock_unlock (&state->file_rwlock);
         return AUTH_FAILED;
     }
 
@@ -354,7 +501,6 @@ static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
                 tmpfile, strerror(errno));
         fclose(passwdfile);
         free(tmpfile);
-        thread_rwlock_unlock (&state->file_rwlock);
         return AUTH_FAILED;
     }
 
@@ -394,18 +540,70 @@ static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
         }
     }
     free(tmpfile);
-    thread_rwlock_unlock(&state->file_rwlock);
-    htpasswd_recheckfile(state);
 
     return AUTH_USERDELETED;
 }
 
+static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
+{
+    htpasswd_auth_state *state;
+    htpasswd_user *user;
+    struct stat file_stat;
+    int unchanged;
+    auth_result ret;
+
+    state = auth->state;
+
+    if (!state->filename) {
+        ICECAST_LOG_ERROR("No filename given in options for authenticator.");
+        return AUTH_FAILED;
+    }
+
+    thread_mutex_lock(&state->lock);
+
+    if (state->index == NULL) {
+        thread_mutex_unlock(&state->lock);
+        ICECAST_LOG_ERROR("No user list.");
+        return AUTH_FAILED;
+    }
+
+    unchanged = stat(state->filename, &file_stat) == 0 && htpasswd_file_unchanged(state, &file_stat);
+    user = htpasswd_index_lookup(state->index, username);
+
+    if (user && !state->index->duplicates && htpasswd_user_delete_inplace(state->filename, user) == 0) {
+        thread_rwlock_wlock(&state->index_lock);
+        htpasswd_index_remove(state->index, username);
+        thread_rwlock_unlock(&state->index_lock);
+        htpasswd_record_change(state, unchanged);
+        thread_mutex_unlock(&state->lock);
+        htpasswd_user_free(user);
+        return AUTH_USERDELETED;
+    }
+
+    /* The file is not what we expect, so fall back to rewriting it and reload it. */
+    ret = htpasswd_deleteuser_rewrite(state, username);
+    state->mtime = 0;
+    thread_mutex_unlock(&state->lock);
+
+    htpasswd_recheckfile(state);
+
+    return ret;
+}
+
+
+static int htpasswd_compare_names(const void *a, const void *b)
+{
+    return strcmp((*(const htpasswd_user * const *)a)->name, (*(const htpasswd_user * const *)b)->name);
+}
 
 static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode)
 {
     htpasswd_auth_state *state;
+    htpasswd_index *index;
+    htpasswd_user **users;
     xmlNodePtr newnode;
-    avl_node *node;
+    size_t count = 0;
+    size_t i;
 
     state = auth->state;
 
@@ -414,22 +612,32 @@ static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode)
         return AUTH_FAILED;
     }
 
-    htpasswd_recheckfile(state);
-
-    if (state->users == NULL) {
+    /* Hold the lock so no user is freed while we list them. */
+    thread_mutex_lock(&state->lock);
+    index = state->index;
+    if (index == NULL) {
+        thread_mutex_unlock(&state->lock);
         ICECAST_LOG_ERROR("No user list.");
         return AUTH_FAILED;
     }
 
-    thread_rwlock_rlock(&state->file_rwlock);
-    node = avl_get_first(state->users);
-    while (node) {
-        htpasswd_user *user = (htpasswd_user *)node->key;
+    users = calloc(index->count + 1, sizeof(*users));
+    if (!users) {
+        thread_mutex_unlock(&state->lock);
+        return AUTH_FAILED;
+    }
+
+    count = htpasswd_index_users(index, users, index->count);
+
+    qsort(users, count, sizeof(*users), htpasswd_compare_names);
+
+    for (i = 0; i < count; i++) {
         newnode = xmlNewChild(srcnode, NULL, XMLSTR("user"), NULL);
-        xmlNewTextChild(newnode, NULL, XMLSTR("username"), XMLSTR(user->name));
-        node = avl_get_next(node);
+        xmlNewTextChild(newnode, NULL, XMLSTR("username"), XMLSTR(users[i]->name));
     }
-    thread_rwlock_unlock(&state->file_rwlock);
+    thread_mutex_unlock(&state->lock);
+
+    free(users);
 
     return AUTH_OK;
 }
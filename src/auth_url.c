@@ -49,6 +49,10 @@
  * As admin requests can come in for a stream (eg metadata update) these requests
  * can be issued while stream is active. For these &admin=1 is added to the POST
  * details.
+ *
+ * Requests are performed by the HTTP client thread (see curl.h), so several
+ * of them can be in flight at the same time and connections to the backend
+ * are kept alive and reused between requests.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -89,6 +93,21 @@
 #define DEFAULT_HEADER_NEW_ALTER_ACTION     "x-icecast-auth-alter-action"
 #define DEFAULT_HEADER_NEW_ALTER_ARGUMENT   "x-icecast-auth-alter-argument"
 
+/* Default maximum number of requests in flight */
+#define DEFAULT_CONCURRENCY                 8
+
+typedef struct auth_url_request_tag auth_url_request_t;
+
+struct auth_url_request_tag {
+    auth_client        *auth_user;
+    CURL               *handle;
+    const char         *url;
+    char               *userpwd;
+    char                post[4096];
+    char                errormsg[CURL_ERROR_SIZE];
+    auth_result         result;
+};
+
 typedef struct {
     char       *pass_headers; // headers passed from client to addurl.
     char       *prefix_headers; // prefix for passed headers.
@@ -112,9 +131,8 @@ typedef struct {
     char       *header_alter_argument;
 
     char       *userpwd;
-    CURL       *handle;
-    char        errormsg[CURL_ERROR_SIZE];
-    auth_result result;
+
+    size_t      concurrency;
 } auth_url;
 
 typedef struct {
@@ -130,6 +148,14 @@ static inline const char * __str_or_default(const char *str, const char *def)
     return def;
 }
 
+static void auth_url_request_free(auth_url_request_t *request)
+{
+    if (request->handle)
+        icecast_curl_free(request->handle);
+    free(request->userpwd);
+    free(request);
+}
+
 static void auth_url_clear(auth_t *self)
 {
     auth_url *url;
@@ -137,7 +163,6 @@ static void auth_url_clear(auth_t *self)
     ICECAST_LOG_INFO("Doing auth URL cleanup");
     url = self->state;
     self->state = NULL;
-    icecast_curl_free(url->handle);
     free(url->username);
     free(url->password);
     free(url->pass_headers);
@@ -172,8 +197,9 @@ static void auth_user_url_clear(auth_client *auth_user)
     auth_user->authbackend_userdata = NULL;
 }
 
-static void handle_returned_header__complete(auth_client *auth_user)
+static void handle_returned_header__complete(auth_url_request_t *request)
 {
+    auth_client *auth_user = request->auth_user;
     auth_user_url_t *au_url = auth_user->authbackend_userdata;
     const char *tmp;
     const char *action;
@@ -197,6 +223,8 @@ static void handle_returned_header__complete(auth_client *auth_user)
     tmp = httpp_getvar(au_url->parser, HTTPP_VAR_ERROR_CODE);
     if (tmp[0] == '2') {
         ICECAST_LOG_DEBUG("Got final status: %#H", tmp);
+        /* the result is the backend's answer from here on */
+        auth_user->no_cache = 0;
     } else {
         ICECAST_LOG_DEBUG("Got non-final status: %#H", tmp);
         httpp_destroy(au_url->parser);
@@ -208,7 +236,7 @@ static void handle_returned_header__complete(auth_client *auth_user)
     if (url->header_auth) {
         tmp = httpp_getvar(au_url->parser, url->header_auth);
         if (tmp) {
-            url->result = auth_str2result(tmp);
+            request->result = auth_str2result(tmp);
         }
     }
 
@@ -247,7 +275,7 @@ static void handle_returned_header__complete(auth_client *auth_user)
             tmp = httpp_getvar(au_url->parser, DEFAULT_HEADER_OLD_MESSAGE);
     }
     if (tmp) {
-        snprintf(url->errormsg, sizeof(url->errormsg), "%s", tmp);
+        snprintf(request->errormsg, sizeof(request->errormsg), "%s", tmp);
     }
 }
 
@@ -257,7 +285,8 @@ static size_t handle_returned_header(void      *ptr,
                                      void      *stream)
 {
     size_t len = size * nmemb;
-    auth_client *auth_user = stream;
+    auth_url_request_t *request = stream;
+    auth_client *auth_user = request->auth_user;
     client_t *client = auth_user->client;
     auth_t *auth;
     auth_url *url;
@@ -289,7 +318,7 @@ static size_t handle_returned_header(void      *ptr,
     ICECAST_LOG_DEBUG("Got header: %* #H", (int)(size * nmemb + 2), ptr);
 
     if (url->auth_header && len >= url->auth_header_len && strncasecmp(ptr, url->auth_header, url->auth_header_len) == 0) {
-        url->result = AUTH_OK;
+        request->result = AUTH_OK;
     }
 
     if (url->timelimit_header && len > url->timelimit_header_len && strncasecmp(ptr, url->timelimit_header, url->timelimit_header_len) == 0) {
@@ -312,12 +341,12 @@ static size_t handle_returned_header(void      *ptr,
     if (len == 1) {
         const char *c = ptr;
         if (c[0] == '\r' || c[0] == '\n') {
-            handle_returned_header__complete(auth_user);
+            handle_returned_header__complete(request);
         }
     } else if (len == 2) {
         const char *c = ptr;
         if ((c[0] == '\r' || c[0] == '\n') && (c[1] == '\r' || c[1] == '\n')) {
-            handle_returned_header__complete(auth_user);
+            handle_returned_header__complete(request);
         }
     }
 
@@ -325,6 +354,58 @@ static size_t handle_returned_header(void      *ptr,
     return len;
 }
 
+static void auth_url_request_done(CURL *handle, CURLcode result, void *userdata);
+
+/* Sets up the request on a new easy handle and submits it to the HTTP client thread. */
+static auth_result auth_url_request_start(auth_url *url, auth_url_request_t *request, const char *target)
+{
+    client_t *client = request->auth_user->client;
+    auth_t *auth = client->auth;
+
+    request->handle = icecast_curl_new(NULL, NULL);
+    if (!request->handle) {
+        ICECAST_LOG_ERROR("Can not create curl handle for auth request on client %p.", client);
+        return AUTH_FAILED;
+    }
+    curl_easy_setopt(request->handle, CURLOPT_HEADERFUNCTION, handle_returned_header);
+
+    request->url = target;
+    request->result = AUTH_FAILED;
+    request->errormsg[0] = '\0';
+
+    if (strchr(target, '@') == NULL) {
+        if (url->userpwd) {
+            curl_easy_setopt(request->handle, CURLOPT_USERPWD, url->userpwd);
+        } else {
+            /* auth'd requests may not have a user/pass, but may use query args */
+            if (client->username && client->password) {
+                size_t len = strlen(client->username) + strlen(client->password) + 2;
+                request->userpwd = malloc(len);
+                snprintf(request->userpwd, len, "%s:%s",
+                    client->username, client->password);
+                curl_easy_setopt(request->handle, CURLOPT_USERPWD, request->userpwd);
+            } else {
+                curl_easy_setopt(request->handle, CURLOPT_USERPWD, "");
+            }
+        }
+    } else {
+        /* url has user/pass but libcurl may need to clear any existing settings */
+        curl_easy_setopt(request->handle, CURLOPT_USERPWD, "");
+    }
+    curl_easy_setopt(request->handle, CURLOPT_URL, target);
+    curl_easy_setopt(request->handle, CURLOPT_POSTFIELDS, request->post);
+    curl_easy_setopt(request->handle, CURLOPT_WRITEHEADER, request);
+    curl_easy_setopt(request->handle, CURLOPT_ERRORBUFFER, request->errormsg);
+
+    /* the request may be done and freed before this returns */
+    if (icecast_curl_submit(request->handle, target, url->concurrency, auth_url_request_done, request) != 0) {
+        ICECAST_LOG_ERROR("Can not start auth request on client %p (role %#H).", client, auth->role);
+        return AUTH_FAILED;
+    }
+
+    return AUTH_PENDING;
+}
+
 static auth_result url_remove_client(auth_client *auth_user)
 {
     client_t       *client      = auth_user->client;
@@ -338,8 +419,7 @@ static auth_result url_remove_client(auth_client *auth_user)
     const char     *mountreq;
     ice_config_t   *config;
     int             port;
-    char           *userpwd     = NULL,
-                    post[4096];
+    auth_url_request_t *request;
     const char     *agent;
     char           *user_agent,
                    *ipaddr;
@@ -348,6 +428,13 @@ static auth_result url_remove_client(auth_client *auth_user)
     if (url->removeurl == NULL)
         return AUTH_OK;
 
+    request = calloc(1, sizeof(*request));
+    if (!request) {
+        ICECAST_LOG_ERROR("Can not allocate auth request for client %p.", client);
+        return AUTH_OK;
+    }
+    request->auth_user = auth_user;
+
     config = config_get_config();
     server = util_url_escape(config->hostname);
     port = config->port;
@@ -379,7 +466,7 @@ static auth_result url_remove_client(auth_client *auth_user)
     mount = util_url_escape(mountreq);
     ipaddr = util_url_escape(client->con->ip);
 
-    ret = snprintf(post, sizeof(post),
+    ret = snprintf(request->post, sizeof(request->post),
             "action=%s&server=%s&port=%d&client=%lu&mount=%s"
             "&user=%s&pass=%s&duration=%lu&ip=%s&agent=%s",
             url->removeaction, /* already escaped */
@@ -393,44 +480,20 @@ static auth_result url_remove_client(auth_client *auth_user)
     free(ipaddr);
     free(user_agent);
 
-    if (ret <= 0 || ret >= (ssize_t)sizeof(post)) {
+    if (ret <= 0 || ret >= (ssize_t)sizeof(request->post)) {
         ICECAST_LOG_ERROR("Authentication failed for client %p as header POST data is too long.", client);
+        auth_url_request_free(request);
         auth_user_url_clear(auth_user);
         return AUTH_FAILED;
     }
 
-    if (strchr (url->removeurl, '@') == NULL) {
-        if (url->userpwd) {
-            curl_easy_setopt(url->handle, CURLOPT_USERPWD, url->userpwd);
-        } else {
-            /* auth'd requests may not have a user/pass, but may use query args */
-            if (client->username && client->password) {
-                size_t len = strlen(client->username) +
-                    strlen(client->password) + 2;
-                userpwd = malloc(len);
-                snprintf(userpwd, len, "%s:%s",
-                    client->username, client->password);
-                curl_easy_setopt(url->handle, CURLOPT_USERPWD, userpwd);
-            } else {
-                curl_easy_setopt(url->handle, CURLOPT_USERPWD, "");
-            }
-        }
-    } else {
-        /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt(url->handle, CURLOPT_USERPWD, "");
+    if (auth_url_request_start(url, request, url->removeurl) != AUTH_PENDING) {
+        auth_url_request_free(request);
+        auth_user_url_clear(auth_user);
+        return AUTH_OK;
     }
-    curl_easy_setopt(url->handle, CURLOPT_URL, url->removeurl);
-    curl_easy_setopt(url->handle, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt(url->handle, CURLOPT_WRITEHEADER, auth_user);
-
-    if (curl_easy_perform (url->handle))
-        ICECAST_LOG_WARN("auth to server %s failed with %s",
-            url->removeurl, url->errormsg);
 
-    free(userpwd);
-    auth_user_url_clear(auth_user);
-
-    return AUTH_OK;
+    return AUTH_PENDING;
 }
 
 
@@ -439,8 +502,7 @@ static auth_result url_add_client(auth_client *auth_user)
     client_t       *client      = auth_user->client;
     auth_t         *auth        = client->auth;
     auth_url       *url         = auth->state;
-    int             res         = 0,
-                    port;
+    int             port;
     const char     *agent;
     char           *user_agent,
                    *username,
@@ -450,7 +512,8 @@ static auth_result url_add_client(auth_client *auth_user)
                    *ipaddr,
                    *server;
     ice_config_t   *config;
-    char           *userpwd    = NULL, post [4096];
+    auth_url_request_t *request;
+    char           *post;
     ssize_t         post_offset;
     char           *pass_headers,
                    *cur_header,
@@ -461,6 +524,17 @@ static auth_result url_add_client(auth_client *auth_user)
     if (url->addurl == NULL)
         return AUTH_OK;
 
+    /* only a parsed response of the backend may be cached */
+    auth_user->no_cache = 1;
+
+    request = calloc(1, sizeof(*request));
+    if (!request) {
+        ICECAST_LOG_ERROR("Can not allocate auth request for client %p.", client);
+        return AUTH_FAILED;
+    }
+    request->auth_user = auth_user;
+    post = request->post;
+
     config = config_get_config();
     server = util_url_escape(config->hostname);
     port = config->port;
@@ -492,7 +566,7 @@ static auth_result url_add_client(auth_client *auth_user)
     mount = util_url_escape(mountreq);
     ipaddr = util_url_escape(client->con->ip);
 
-    post_offset = snprintf(post, sizeof (post),
+    post_offset = snprintf(post, sizeof(request->post),
             "action=%s&server=%s&port=%d&client=%lu&mount=%s"
             "&user=%s&pass=%s&ip=%s&agent=%s",
             url->addaction, /* already escaped */
@@ -507,8 +581,9 @@ static auth_result url_add_client(auth_client *auth_user)
     free(ipaddr);
 
 
-    if (post_offset <= 0 || post_offset >= (ssize_t)sizeof(post)) {
+    if (post_offset <= 0 || post_offset >= (ssize_t)sizeof(request->post)) {
         ICECAST_LOG_ERROR("Authentication failed for client %p as header POST data is too long.", client);
+        auth_url_request_free(request);
         auth_user_url_clear(auth_user);
         return AUTH_FAILED;
     }
@@ -527,12 +602,12 @@ static auth_result url_add_client(auth_client *auth_user)
 
             header_val = httpp_getvar (client->parser, cur_header);
             if (header_val) {
-                size_t left = sizeof(post) - post_offset;
+                size_t left = sizeof(request->post) - post_offset;
                 int ret;
 
                 header_valesc = util_url_escape (header_val);
                 ret = snprintf(post + post_offset,
-                                        sizeof(post) - post_offset,
+                                        sizeof(request->post) - post_offset,
                                         "&%s%s=%s",
                                         url->prefix_headers ? url->prefix_headers : "",
                                         cur_header, header_valesc);
@@ -541,6 +616,7 @@ static auth_result url_add_client(auth_client *auth_user)
                 if (ret <= 0 || (size_t)ret >= left) {
                     ICECAST_LOG_ERROR("Authentication failed for client %p as header \"%H\" is too long.", client, cur_header);
                     free(pass_headers);
+                    auth_url_request_free(request);
                     auth_user_url_clear(auth_user);
                     return AUTH_FAILED;
                 } else {
@@ -553,47 +629,54 @@ static auth_result url_add_client(auth_client *auth_user)
         free(pass_headers);
     }
 
-    if (strchr(url->addurl, '@') == NULL) {
-        if (url->userpwd) {
-            curl_easy_setopt(url->handle, CURLOPT_USERPWD, url->userpwd);
-        } else {
-            /* auth'd requests may not have a user/pass, but may use query args */
-            if (client->username && client->password) {
-                size_t len = strlen(client->username) + strlen(client->password) + 2;
-                userpwd = malloc (len);
-                snprintf(userpwd, len, "%s:%s",
-                    client->username, client->password);
-                curl_easy_setopt(url->handle, CURLOPT_USERPWD, userpwd);
-            } else {
-                curl_easy_setopt (url->handle, CURLOPT_USERPWD, "");
-            }
-        }
-    } else {
-        /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt(url->handle, CURLOPT_USERPWD, "");
+    if (auth_url_request_start(url, request, url->addurl) != AUTH_PENDING) {
+        auth_url_request_free(request);
+        auth_user_url_clear(auth_user);
+        return AUTH_FAILED;
     }
-    curl_easy_setopt(url->handle, CURLOPT_URL, url->addurl);
-    curl_easy_setopt(url->handle, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt(url->handle, CURLOPT_WRITEHEADER, auth_user);
-    url->errormsg[0] = '\0';
 
-    url->result = AUTH_FAILED;
-    res = curl_easy_perform(url->handle);
+    return AUTH_PENDING;
+}
 
-    free(userpwd);
-    auth_user_url_clear(auth_user);
+/* Evaluates a finished request. */
+static auth_result auth_url_request_result(auth_url *url, auth_url_request_t *request, CURLcode res)
+{
+    if (request->url == url->removeurl) {
+        if (res != CURLE_OK)
+            ICECAST_LOG_WARN("auth to server %s failed with %s",
+                url->removeurl, request->errormsg);
+        return AUTH_OK;
+    }
 
-    if (res) {
+    if (res != CURLE_OK) {
         ICECAST_LOG_WARN("auth to server %s failed with %s",
-            url->addurl, url->errormsg);
+            url->addurl, request->errormsg);
+        request->auth_user->no_cache = 1;
         return AUTH_FAILED;
     }
     /* we received a response, lets see what it is */
-    if (url->result == AUTH_FAILED) {
+    if (request->result == AUTH_FAILED) {
         ICECAST_LOG_INFO("client auth (%s) failed with \"%s\"",
-            url->addurl, url->errormsg);
+            url->addurl, request->errormsg);
     }
-    return url->result;
+    return request->result;
+}
+
+/* Called by the HTTP client thread, the result is handled by the auth thread. */
+static void auth_url_request_done(CURL *handle, CURLcode res, void *userdata)
+{
+    auth_url_request_t *request = userdata;
+    auth_client *auth_user = request->auth_user;
+    auth_t *auth = auth_user->client->auth;
+    auth_result result;
+
+    (void)handle;
+
+    result = auth_url_request_result(auth->state, request, res);
+
+    auth_url_request_free(request);
+    auth_user_url_clear(auth_user);
+    auth_client_complete(auth, auth_user, result);
 }
 
 static auth_result auth_url_adduser(auth_t      *auth,
@@ -630,6 +713,8 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
     /* force auth thread to call function. this makes sure the auth_t is attached to client */
     authenticator->authenticate_client = url_add_client;
 
+    url_info->concurrency = DEFAULT_CONCURRENCY;
+
     while(options) {
         if(strcmp(options->name, "username") == 0) {
             util_replace_string(&(url_info->username), options->value);
@@ -667,6 +752,13 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
         } else if (strcmp(options->name, "header_alter_argument") == 0) {
             util_replace_string(&(url_info->header_alter_argument), options->value);
             util_strtolower(url_info->header_alter_argument);
+        } else if (strcmp(options->name, "concurrency") == 0) {
+            int concurrency = util_str_to_int(options->value, DEFAULT_CONCURRENCY);
+            if (concurrency < 1) {
+                ICECAST_LOG_ERROR("Invalid concurrency %#H, using %d.", options->value, DEFAULT_CONCURRENCY);
+                concurrency = DEFAULT_CONCURRENCY;
+            }
+            url_info->concurrency = concurrency;
         } else {
             ICECAST_LOG_ERROR("Unknown option: %s", options->name);
         }
@@ -676,11 +768,7 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
     url_info->addaction = util_url_escape(addaction);
     url_info->removeaction = util_url_escape(removeaction);
 
-    url_info->handle = icecast_curl_new(NULL, &url_info->errormsg[0]);
-    if (url_info->handle == NULL) {
-        auth_url_clear(authenticator);
-        return -1;
-    }
+    authenticator->concurrency = url_info->concurrency;
 
     /* default headers */
     if (url_info->auth_header) {
@@ -703,8 +791,6 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
     if (url_info->timelimit_header)
         url_info->timelimit_header_len = strlen (url_info->timelimit_header);
 
-    curl_easy_setopt(url_info->handle, CURLOPT_HEADERFUNCTION, handle_returned_header);
-
     if (url_info->username && url_info->password) {
         int len = strlen(url_info->username) + strlen(url_info->password) + 2;
         url_info->userpwd = malloc(len);
@@ -45,6 +45,7 @@
 #include "fserve.h"
 #include "stats.h"
 #include "connection.h"
+#include "client.h"
 #include "main.h"
 #include "slave.h"
 #include "xslt.h"
@@ -99,6 +100,12 @@
 #define CONFIG_DEFAULT_RELAY_SERVER     "127.0.0.1"
 #define CONFIG_DEFAULT_RELAY_PORT       80
 #define CONFIG_DEFAULT_RELAY_MOUNT      "/"
+#define CONFIG_DEFAULT_TLS_SESSION_CACHE_SIZE   (20*1024)
+#define CONFIG_MAX_TLS_SESSION_CACHE_SIZE       (1024*1024)
+#define CONFIG_DEFAULT_TLS_TICKET_KEY_ROTATION  3600
+#define CONFIG_MAX_TLS_TICKET_KEY_ROTATION      (7*24*3600)
+#define CONFIG_DEFAULT_TLS_HANDSHAKE_WORKERS    2
+#define CONFIG_MAX_TLS_HANDSHAKE_WORKERS        64
 #define CONFIG_DEFAULT_CIPHER_LIST      "ECDHE-ECDSA-CHACHA20-POLY1305:" \
                                         "ECDHE-RSA-CHACHA20-POLY1305:" \
                                         "ECDHE-ECDSA-AES128-GCM-SHA256:" \
@@ -908,6 +915,7 @@ void config_clear(ice_config_t *c)
     if (c->adminroot_dir)   xmlFree(c->adminroot_dir);
     if (c->null_device)     xmlFree(c->null_device);
     if (c->pidfile)         xmlFree(c->pidfile);
+    if (c->statsmap_file)   xmlFree(c->statsmap_file);
     if (c->banfile)         xmlFree(c->banfile);
     if (c->proxy_file)      xmlFree(c->proxy_file);
     if (c->allowfile)       xmlFree(c->allowfile);
@@ -1001,6 +1009,7 @@ void config_reread_config(void)
         prng_configure(config);
         main_config_reload(config);
         connection_reread_config(config);
+        client_recheck_config(config);
         yp_recheck_config(config);
         fserve_recheck_mime_types(config);
         stats_global(config);
@@ -1173,6 +1182,12 @@ static void _set_defaults(ice_config_t *configuration)
         ->burst_size = CONFIG_DEFAULT_BURST_SIZE;
     configuration->tls_context
         .cipher_list = (char *) xmlCharStrdup(CONFIG_DEFAULT_CIPHER_LIST);
+    configuration->tls_context
+        .session_cache_size = CONFIG_DEFAULT_TLS_SESSION_CACHE_SIZE;
+    configuration->tls_context
+        .ticket_key_rotation = CONFIG_DEFAULT_TLS_TICKET_KEY_ROTATION;
+    configuration->tls_context
+        .handshake_workers = CONFIG_DEFAULT_TLS_HANDSHAKE_WORKERS;
 }
 
 static inline void __check_hostname(ice_config_t *configuration)
@@ -1289,6 +1304,8 @@ static void _parse_root(xmlDocPtr       doc,
             configuration->on_demand = util_str_to_bool(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("relays-on-demand-warm")) == 0) {
+            __read_int(configuration, doc, node, &configuration->on_demand_warm, 0, 1024);
         } else if (xmlStrcmp(node->name, XMLSTR("hostname")) == 0) {
             if (configuration->hostname)
                 xmlFree(configuration->hostname);
@@ -1329,6 +1346,8 @@ static void _parse_root(xmlDocPtr       doc,
             __read_int(configuration, doc, node, &configuration->master_server_port, RANGE_PORT);
         } else if (xmlStrcmp(node->name, XMLSTR("master-update-interval")) == 0) {
             __read_int(configuration, doc, node, &configuration->master_update_interval, 15, 3600);
+        } else if (xmlStrcmp(node->name, XMLSTR("master-long-poll")) == 0) {
+            __read_int(configuration, doc, node, &configuration->master_long_poll, 0, 300);
         } else if (xmlStrcmp(node->name, XMLSTR("shoutcast-mount")) == 0) {
             if (configuration->shoutcast_mount)
                 xmlFree(configuration->shoutcast_mount);
@@ -2171,6 +2190,11 @@ static void _parse_relay(xmlDocPtr      doc,
             relay->on_demand = util_str_to_bool(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("hot-standby")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            relay->hot_standby = util_str_to_bool(tmp);
+            if (tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("upstream")) == 0) {
             tmp = (char *)xmlGetProp(node, XMLSTR("type"));
 
@@ -2615,6 +2639,10 @@ static void _parse_paths(xmlDocPtr      doc,
             if (configuration->pidfile)
                 xmlFree(configuration->pidfile);
             configuration->pidfile = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("stats-map")) == 0) {
+            if (configuration->statsmap_file)
+                xmlFree(configuration->statsmap_file);
+            configuration->statsmap_file = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
         } else if (xmlStrcmp(node->name, XMLSTR("nulldevice")) == 0) {
             if (configuration->null_device)
                 xmlFree(configuration->null_device);
@@ -2836,6 +2864,25 @@ static void _parse_tls_context(xmlDocPtr       doc,
             if (context->cipher_list)
                 xmlFree(context->cipher_list);
             context->cipher_list = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-session-cache-size")) == 0) {
+            __read_int(configuration, doc, node, &(context->session_cache_size), 0, CONFIG_MAX_TLS_SESSION_CACHE_SIZE);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-ticket-key-rotation")) == 0) {
+            __read_int(configuration, doc, node, &(context->ticket_key_rotation), 0, CONFIG_MAX_TLS_TICKET_KEY_ROTATION);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-handshake-workers")) == 0) {
+            __read_int(configuration, doc, node, &(context->handshake_workers), 0, CONFIG_MAX_TLS_HANDSHAKE_WORKERS);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-kernel-offload")) == 0) {
+            char *tmp;
+
+            if (__check_node_impl(node, "openssl") != 0) {
+                ICECAST_LOG_WARN("Node %s uses unsupported implementation.", node->name);
+                __found_bad_tag(configuration, node, BTR_INVALID, NULL);
+                continue;
+            }
+
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            context->ktls = util_str_to_bool(tmp);
+            if (tmp)
+                xmlFree(tmp);
         } else {
             __found_bad_tag(configuration, node, BTR_UNKNOWN, NULL);
         }
@@ -194,6 +194,14 @@ typedef struct _config_tls_context {
     char *cert_file;
     char *key_file;
     char *cipher_list;
+    /* hand the record layer to the kernel after the handshake if possible */
+    int ktls;
+    /* sessions kept for resumption, 0 disables the cache */
+    int session_cache_size;
+    /* seconds after which a new ticket key is used, 0 disables tickets */
+    int ticket_key_rotation;
+    /* threads doing handshakes of incoming connections, 0 does them in the request queue */
+    int handshake_workers;
 } config_tls_context_t;
 
 typedef struct {
@@ -209,6 +217,8 @@ typedef struct {
 typedef struct {
     char *localmount;
     int on_demand;
+    /* keep a second upstream connected to take over on failure */
+    int hot_standby;
     size_t upstreams;
     relay_config_upstream_t *upstream;
     relay_config_upstream_t upstream_default;
@@ -249,6 +259,8 @@ struct ice_config_tag {
     int body_timeout;
     int fileserve;
     int on_demand; /* global setting for all relays */
+    /* number of on-demand relays to keep connected while idle, see slave.c */
+    int on_demand_warm;
 
     char *shoutcast_mount;
     char *shoutcast_user;
@@ -266,6 +278,8 @@ struct ice_config_tag {
     char *master_server;
     int master_server_port;
     int master_update_interval;
+    /* seconds the master holds a stream list request waiting for changes, 0 to poll */
+    int master_long_poll;
     char *master_username;
     char *master_password;
 
@@ -280,6 +294,7 @@ struct ice_config_tag {
     char *base_dir;
     char *log_dir;
     char *pidfile;
+    char *statsmap_file;
     char *null_device;
     char *banfile;
     char *allowfile;
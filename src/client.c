@@ -65,7 +65,29 @@
 #undef CATMODULE
 #define CATMODULE "client"
 
-avl_tree *global_client_list;
+/* All clients are kept in a registry that is sharded by connection ID so
+ * clients connecting and disconnecting on different threads rarely meet on
+ * the same lock. Connection IDs are sequential, so the low bits select the
+ * shard and the following bits the bucket within the shard.
+ */
+#define CLIENT_REGISTRY_SHARD_BITS  6
+#define CLIENT_REGISTRY_SHARDS      (1 << CLIENT_REGISTRY_SHARD_BITS)
+#define CLIENT_REGISTRY_BUCKETS_MIN 16
+
+typedef struct {
+    spin_t lock;
+    /* the number of buckets is a power of two */
+    client_t **buckets;
+    size_t buckets_len;
+    size_t clients;
+} client_registry_shard_t;
+
+static client_registry_shard_t _client_registry[CLIENT_REGISTRY_SHARDS];
+
+/* copy of the configured client limit so admission needs no lock,
+ * set by client_recheck_config()
+ */
+static int _client_limit = 0;
 
 static inline void client_send_500(client_t *client, const char *message);
 
@@ -121,41 +143,153 @@ int client_compare(void *compare_arg, void *a, void *b)
 
 void client_initialize(void)
 {
-    global_client_list = avl_tree_new(client_compare, NULL);
+    size_t i;
+
+    for (i = 0; i < CLIENT_REGISTRY_SHARDS; i++) {
+        client_registry_shard_t *shard = &(_client_registry[i]);
+
+        thread_spin_create(&(shard->lock));
+        shard->buckets = calloc(CLIENT_REGISTRY_BUCKETS_MIN, sizeof(*shard->buckets));
+        if (!shard->buckets)
+            abort();
+        shard->buckets_len = CLIENT_REGISTRY_BUCKETS_MIN;
+        shard->clients = 0;
+    }
 }
 
 void client_shutdown(void)
 {
-    avl_tree_free(global_client_list, NULL);
+    size_t i;
+
+    for (i = 0; i < CLIENT_REGISTRY_SHARDS; i++) {
+        client_registry_shard_t *shard = &(_client_registry[i]);
+
+        thread_spin_destroy(&(shard->lock));
+        free(shard->buckets);
+        shard->buckets = NULL;
+        shard->buckets_len = 0;
+    }
+}
+
+void client_recheck_config(ice_config_t *config)
+{
+    __atomic_store_n(&_client_limit, config->client_limit, __ATOMIC_RELAXED);
+}
+
+static inline client_registry_shard_t *client_registry_shard(connection_id_t id)
+{
+    return &(_client_registry[id & (CLIENT_REGISTRY_SHARDS - 1)]);
+}
+
+static inline client_t **client_registry_bucket(client_registry_shard_t *shard, connection_id_t id)
+{
+    return &(shard->buckets[(id >> CLIENT_REGISTRY_SHARD_BITS) & (shard->buckets_len - 1)]);
+}
+
+/* Must be called with the shard locked. On failure the old buckets are kept. */
+static void client_registry_grow(client_registry_shard_t *shard)
+{
+    client_t **old = shard->buckets;
+    size_t old_len = shard->buckets_len;
+    size_t i;
+
+    shard->buckets = calloc(old_len * 2, sizeof(*shard->buckets));
+    if (!shard->buckets) {
+        shard->buckets = old;
+        return;
+    }
+    shard->buckets_len = old_len * 2;
+
+    for (i = 0; i < old_len; i++) {
+        client_t *client = old[i];
+
+        while (client) {
+            client_t *next = client->registry_next;
+            client_t **bucket = client_registry_bucket(shard, client->con->id);
+
+            client->registry_next = *bucket;
+            *bucket = client;
+            client = next;
+        }
+    }
+
+    free(old);
+}
+
+static void client_registry_add(client_t *client)
+{
+    client_registry_shard_t *shard = client_registry_shard(client->con->id);
+    client_t **bucket;
+
+    thread_spin_lock(&(shard->lock));
+    if (shard->clients >= (shard->buckets_len * 2))
+        client_registry_grow(shard);
+    bucket = client_registry_bucket(shard, client->con->id);
+    client->registry_next = *bucket;
+    *bucket = client;
+    shard->clients++;
+    thread_spin_unlock(&(shard->lock));
+}
+
+static void client_registry_remove(client_t *client)
+{
+    client_registry_shard_t *shard = client_registry_shard(client->con->id);
+    client_t **prev;
+
+    thread_spin_lock(&(shard->lock));
+    for (prev = client_registry_bucket(shard, client->con->id); *prev; prev = &((*prev)->registry_next)) {
+        if (*prev == client) {
+            *prev = client->registry_next;
+            client->registry_next = NULL;
+            shard->clients--;
+            break;
+        }
+    }
+    thread_spin_unlock(&(shard->lock));
+}
+
+int client_registry_find(connection_id_t id, client_registry_callback_t callback, void *userdata)
+{
+    client_registry_shard_t *shard = client_registry_shard(id);
+    client_t *client;
+    int ret = -1;
+
+    thread_spin_lock(&(shard->lock));
+    for (client = *client_registry_bucket(shard, id); client; client = client->registry_next) {
+        if (client->con->id == id) {
+            ret = callback(client, userdata);
+            break;
+        }
+    }
+    thread_spin_unlock(&(shard->lock));
+
+    return ret;
 }
 
 /* create a client_t with the provided connection and parser details. Return
  * 0 on success, -1 if server limit has been reached.  In either case a
- * client_t is returned just in case a message needs to be returned. Should
- * be called with global lock held.
+ * client_t is returned just in case a message needs to be returned.
+ * The client is allocated from the connection and freed with it.
  */
 int client_create(client_t **c_ptr, connection_t *con, http_parser_t *parser)
 {
-    ice_config_t    *config;
-    client_t        *client = (client_t *) calloc(1, sizeof(client_t));
+    client_t        *client = connection_alloc(con, sizeof(client_t));
     const listener_t *listener_real, *listener_effective;
     int              ret    = -1;
+    int              clients, limit;
 
     if (client == NULL)
         abort();
 
-    config = config_get_config();
-
-    global.clients++;
-    if (config->client_limit < global.clients) {
-        ICECAST_LOG_WARN("Server's configured global client limit reached (%d of %d), rejecting client", global.clients, config->client_limit);
+    clients = __atomic_add_fetch(&global.clients, 1, __ATOMIC_RELAXED);
+    limit = __atomic_load_n(&_client_limit, __ATOMIC_RELAXED);
+    if (limit < clients) {
+        ICECAST_LOG_WARN("Server's configured global client limit reached (%d of %d), rejecting client", clients, limit);
     } else {
         ret = 0;
     }
 
-    config_release_config ();
-
-    stats_event_args (NULL, "clients", "%d", global.clients);
+    stats_event_inc(NULL, "clients");
     client->con = con;
     client->parser = parser;
     client->protocol = ICECAST_PROTOCOL_HTTP;
@@ -169,9 +303,7 @@ int client_create(client_t **c_ptr, connection_t *con, http_parser_t *parser)
     navigation_history_init(&(client->history));
     *c_ptr = client;
 
-    avl_tree_wlock(global_client_list);
-    avl_insert(global_client_list, client);
-    avl_tree_unlock(global_client_list);
+    client_registry_add(client);
 
     listener_real = listensocket_get_listener(con->listensocket_real);
     listener_effective = listensocket_get_listener(con->listensocket_effective);
@@ -179,7 +311,7 @@ int client_create(client_t **c_ptr, connection_t *con, http_parser_t *parser)
             client, con, (long long unsigned int)con->id, con->sock,
             con->listensocket_real, con->listensocket_real ? listener_real->id : NULL,
             con->listensocket_effective, con->listensocket_effective ? listener_effective->id : NULL,
-            global.clients, config->client_limit
+            clients, limit
             );
     listensocket_release_listener(con->listensocket_effective);
     listensocket_release_listener(con->listensocket_real);
@@ -262,7 +394,7 @@ static inline void client_reuseconnection(client_t *client) {
     }
 
     ICECAST_LOG_DEBUG("Reusing connection %p (connection ID: %llu, sock=%R) of old client %p", con, (long long unsigned int)con->id, con->sock, client);
-    con = connection_create(con->sock, con->listensocket_real, con->listensocket_effective, strdup(con->ip));
+    con = connection_create(con->sock, con->listensocket_real, con->listensocket_effective, con->ip);
     client->con->sock = SOCK_ERROR;
 
     /* handle to keep the TLS connection */
@@ -305,10 +437,6 @@ void client_destroy(client_t *client)
 
     fastevent_emit(FASTEVENT_TYPE_CLIENT_DESTROY, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_CLIENT, client);
 
-    avl_tree_wlock(global_client_list);
-    avl_delete(global_client_list, client, NULL);
-    avl_tree_unlock(global_client_list);
-
     if (client->reuse != ICECAST_REUSE_CLOSE && !client->con->error) {
         /* only reuse the client if we reached the body's EOF. */
         if (client_body_eof(client) == 1) {
@@ -317,6 +445,8 @@ void client_destroy(client_t *client)
         }
     }
 
+    client_registry_remove(client);
+
     /* release the buffer now, as the buffer could be on the source queue
      * and may of disappeared after auth completes */
     client_set_queue(client, NULL);
@@ -329,32 +459,57 @@ void client_destroy(client_t *client)
      */
     if (client->respcode && client->parser)
         logging_access(client);
-    if (client->con)
-        connection_close(client->con);
     if (client->parser)
         httpp_destroy(client->parser);
     if (client->encoding)
         httpp_encoding_release(client->encoding);
 
-    global_lock();
-    global.clients--;
-    stats_event_args(NULL, "clients", "%d", global.clients);
-    global_unlock();
+    __atomic_sub_fetch(&global.clients, 1, __ATOMIC_RELAXED);
+    stats_event_dec(NULL, "clients");
 
     /* we need to free client specific format data (if any) */
     if (client->free_client_data)
         client->free_client_data(client);
 
     refobject_unref(client->handler_module);
-    free(client->handler_function);
     free(client->uri);
-    free(client->username);
-    free(client->password);
-    free(client->role);
     acl_release(client->acl);
     navigation_history_clear(&(client->history));
 
-    free(client);
+    /* this also frees the client and its strings */
+    connection_close(client->con);
+}
+
+void client_compact(client_t *client)
+{
+    if (!client || !client->parser)
+        return;
+
+    client->parser = httpp_compact(client->parser);
+}
+
+void client_get_memory_usage(client_t *client, source_t *source, client_memory_usage_t *usage)
+{
+    memset(usage, 0, sizeof(*usage));
+
+    if (!client)
+        return;
+
+    usage->connection = connection_memory_usage(client->con);
+    if (client->uri)
+        usage->connection += strlen(client->uri) + 1;
+
+    usage->parser = httpp_memory_usage(client->parser);
+
+    /* buffers of the source's queue are referenced by the queue as well */
+    if (client->refbuf && client->refbuf->_count == 1) {
+        usage->buffer = sizeof(refbuf_t) + client->refbuf->len;
+        if (client->refbuf->_pooled && usage->buffer < (sizeof(refbuf_t) + PER_CLIENT_REFBUF_SIZE))
+            usage->buffer = sizeof(refbuf_t) + PER_CLIENT_REFBUF_SIZE;
+    }
+
+    if (client->format_data && source && source->format)
+        usage->format = source->format->client_data_size;
 }
 
 /* helper function for reading data from a client */
@@ -19,10 +19,12 @@
 #ifndef __CLIENT_H__
 #define __CLIENT_H__
 
+#include "common/avl/avl.h"
 #include "common/httpp/httpp.h"
 #include "common/httpp/encoding.h"
 
 #include "icecasttypes.h"
+#include "connection.h"
 #include "navigation.h"
 #include "errors.h"
 #include "refbuf.h"
@@ -96,13 +98,9 @@ struct _client_tag {
     /* authentication instances we still need to go thru */
     struct auth_stack_tag *authstack;
 
-    /* Client username */
+    /* Client username, password and role, allocated with connection_alloc() */
     char *username;
-
-    /* Client password */
     char *password;
-
-    /* Client role */
     char *role;
 
     /* active ACL, set as soon as the client is authenticated */
@@ -111,7 +109,7 @@ struct _client_tag {
     /* URI */
     char *uri;
 
-    /* Handler module and function */
+    /* Handler module and function, the function is allocated with connection_alloc() */
     module_t *handler_module;
     char *handler_function;
 
@@ -141,21 +139,48 @@ struct _client_tag {
 
     /* function to check if refbuf needs updating */
     int (*check_buffer)(source_t *source, client_t *client);
+
+    /* next client in the same bucket of the client registry */
+    client_t *registry_next;
 };
 
-extern avl_tree *global_client_list;
+/* Bytes allocated for a client, by component */
+typedef struct {
+    /* connection block with the client and its strings, see connection_alloc() */
+    size_t connection;
+    /* request headers */
+    size_t parser;
+    /* buffer of the client unless it is shared with the source's queue */
+    size_t buffer;
+    /* data of the format plugin */
+    size_t format;
+} client_memory_usage_t;
+
+/* Called for a client found in the registry. The client can not be destroyed
+ * while this runs, it must not block and must not destroy the client.
+ */
+typedef int (*client_registry_callback_t)(client_t *client, void *userdata);
 
 protocol_t client_protocol_from_string(const char *str);
 const char * client_protocol_to_string(protocol_t protocol);
 
 void client_initialize(void);
 void client_shutdown(void);
+void client_recheck_config(ice_config_t *config);
 
 int client_compare(void *compare_arg, void *a, void *b); // for avl.
 
 int client_create (client_t **c_ptr, connection_t *con, http_parser_t *parser);
 void client_complete(client_t *client);
 void client_destroy(client_t *client);
+/* Looks up the client by connection ID and calls callback on it.
+ * Returns the result of the callback or -1 if there is no such client.
+ */
+int client_registry_find(connection_id_t id, client_registry_callback_t callback, void *userdata);
+/* Drops state only needed while the request is processed, called once a listener is streaming */
+void client_compact(client_t *client);
+/* source may be NULL if the client is not a listener */
+void client_get_memory_usage(client_t *client, source_t *source, client_memory_usage_t *usage);
 void client_send_error_by_id(client_t *client, icecast_error_id_t id);
 void client_send_error_by_uuid(client_t *client, const char *uuid);
 void client_send_101(client_t *client, reuse_t reuse);
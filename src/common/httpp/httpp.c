@@ -38,26 +38,58 @@
 #include <strings.h>
 #endif
 
-#include <avl/avl.h>
 #include "httpp.h"
 
 #define MAX_HEADERS 32
 
+/* size of the arena chunk allocated together with the parser,
+ * enough for the request and headers of most clients.
+ */
+#define HTTPP_ARENA_INLINE  4096
+/* minimum size of further arena chunks */
+#define HTTPP_ARENA_CHUNK   2048
+/* keep everything aligned for pointers */
+#define HTTPP_ARENA_ALIGN(x)    (((x) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+typedef struct httpp_arena_chunk_tag httpp_arena_chunk_t;
+struct httpp_arena_chunk_tag {
+    httpp_arena_chunk_t *next;
+    size_t size;
+    size_t used;
+    /* data follows */
+};
+
+struct httpp_arena_tag {
+    httpp_arena_chunk_t *chunks;
+};
+
+/* parser, arena and first chunk are allocated at once */
+typedef struct {
+    http_parser_t parser;
+    httpp_arena_t arena;
+    httpp_arena_chunk_t chunk;
+} httpp_block_t;
+
+static const char * const _known_names[HTTPP_KNOWN_MAX] = {
+    [HTTPP_KNOWN_HOST]          = "host",
+    [HTTPP_KNOWN_USER_AGENT]    = "user-agent",
+    [HTTPP_KNOWN_AUTHORIZATION] = "authorization",
+    [HTTPP_KNOWN_ICY_METADATA]  = "icy-metadata",
+    [HTTPP_KNOWN_CONTENT_TYPE]  = "content-type",
+    [HTTPP_KNOWN_RANGE]         = "range"
+};
+
 /* internal functions */
 
 /* misc */
 static char *_lowercase(char *str);
 
-/* for avl trees */
-static int _compare_vars(void *compare_arg, void *a, void *b);
-static int _free_vars(void *key);
-
-/* For avl tree manipulation */
-static void parse_query(avl_tree *tree, const char *query, size_t len);
-static const char *_httpp_get_param(avl_tree *tree, const char *name);
-static void _httpp_set_param_nocopy(avl_tree *tree, char *name, char *value, int replace);
-static void _httpp_set_param(avl_tree *tree, const char *name, const char *value);
-static http_var_t *_httpp_get_param_var(avl_tree *tree, const char *name);
+/* For variable table manipulation */
+static void parse_query(http_parser_t *parser, http_vartable_t *table, const char *query, size_t len);
+static const char *_httpp_get_param(http_vartable_t *table, const char *name);
+static void _httpp_set_param_nocopy(http_parser_t *parser, http_vartable_t *table, char *name, char *value, int replace);
+static void _httpp_set_param(http_parser_t *parser, http_vartable_t *table, const char *name, const char *value);
+static http_var_t *_httpp_get_param_var(http_vartable_t *table, const char *name);
 
 httpp_request_info_t httpp_request_info(httpp_request_type_e req)
 {
@@ -116,20 +148,245 @@ httpp_request_info_t httpp_request_info(httpp_request_type_e req)
     }
 }
 
-http_parser_t *httpp_create_parser(void)
+static void *_arena_alloc(httpp_arena_t *arena, size_t len)
+{
+    httpp_arena_chunk_t *chunk = arena->chunks;
+    void *ret;
+
+    len = HTTPP_ARENA_ALIGN(len);
+
+    if (!chunk || (chunk->size - chunk->used) < len) {
+        size_t size = len > HTTPP_ARENA_CHUNK ? len : HTTPP_ARENA_CHUNK;
+
+        chunk = malloc(sizeof(*chunk) + size);
+        if (!chunk)
+            return NULL;
+
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    ret = (char*)(chunk + 1) + chunk->used;
+    chunk->used += len;
+
+    return ret;
+}
+
+static char *_arena_strndup(httpp_arena_t *arena, const char *str, size_t len)
+{
+    char *ret = _arena_alloc(arena, len + 1);
+
+    if (!ret)
+        return NULL;
+
+    memcpy(ret, str, len);
+    ret[len] = 0;
+
+    return ret;
+}
+
+static inline char *_arena_strdup(httpp_arena_t *arena, const char *str)
+{
+    return _arena_strndup(arena, str, strlen(str));
+}
+
+static void _arena_free(httpp_arena_t *arena, httpp_arena_chunk_t *keep)
+{
+    while (arena->chunks) {
+        httpp_arena_chunk_t *chunk = arena->chunks;
+
+        arena->chunks = chunk->next;
+        if (chunk != keep)
+            free(chunk);
+    }
+}
+
+static http_parser_t *_httpp_create_parser(size_t inline_size)
 {
-    http_parser_t *parser = calloc(1, sizeof(http_parser_t));
+    httpp_block_t *block = malloc(sizeof(httpp_block_t) + inline_size);
+    http_parser_t *parser;
+
+    if (!block)
+        return NULL;
+
+    memset(block, 0, sizeof(*block));
+    block->chunk.size = inline_size;
+    block->arena.chunks = &(block->chunk);
 
+    parser = &(block->parser);
     parser->refc = 1;
     parser->req_type = httpp_req_none;
     parser->uri = NULL;
-    parser->vars = avl_tree_new(_compare_vars, NULL);
-    parser->queryvars = avl_tree_new(_compare_vars, NULL);
-    parser->postvars = avl_tree_new(_compare_vars, NULL);
+    parser->arena = &(block->arena);
 
     return parser;
 }
 
+http_parser_t *httpp_create_parser(void)
+{
+    return _httpp_create_parser(HTTPP_ARENA_INLINE);
+}
+
+http_parser_t *httpp_compact(http_parser_t *parser)
+{
+    http_parser_t *ret;
+    size_t size;
+    size_t i, j;
+
+    if (!parser || parser->refc != 1)
+        return parser;
+
+    size = HTTPP_ARENA_ALIGN(sizeof(http_var_t) * parser->vars.len);
+    for (i = 0; i < parser->vars.len; i++) {
+        const http_var_t *var = &(parser->vars.var[i]);
+
+        size += HTTPP_ARENA_ALIGN(sizeof(char*) * var->values);
+        size += HTTPP_ARENA_ALIGN(strlen(var->name) + 1);
+        for (j = 0; j < var->values; j++)
+            size += HTTPP_ARENA_ALIGN(strlen(var->value[j]) + 1);
+    }
+
+    ret = _httpp_create_parser(size);
+    if (!ret)
+        return parser;
+
+    /* all of this fits the inline chunk, so none of the allocations can fail */
+    ret->req_type = parser->req_type;
+    ret->vars.var = _arena_alloc(ret->arena, sizeof(http_var_t) * parser->vars.len);
+    ret->vars.len = ret->vars.alloc = parser->vars.len;
+    for (i = 0; i < parser->vars.len; i++) {
+        const http_var_t *src = &(parser->vars.var[i]);
+        http_var_t *dst = &(ret->vars.var[i]);
+
+        dst->name = _arena_strdup(ret->arena, src->name);
+        dst->values = src->values;
+        dst->value = _arena_alloc(ret->arena, sizeof(char*) * src->values);
+        for (j = 0; j < src->values; j++)
+            dst->value[j] = _arena_strdup(ret->arena, src->value[j]);
+    }
+    memcpy(ret->known, parser->known, sizeof(ret->known));
+
+    if (parser->uri) {
+        const http_var_t *var = _httpp_get_param_var(&(ret->vars), HTTPP_VAR_URI);
+        if (var && var->values)
+            ret->uri = var->value[0];
+    }
+
+    httpp_release(parser);
+
+    return ret;
+}
+
+size_t httpp_memory_usage(http_parser_t *parser)
+{
+    httpp_block_t *block = (httpp_block_t *)parser;
+    httpp_arena_chunk_t *chunk;
+    size_t ret;
+
+    if (!parser)
+        return 0;
+
+    ret = sizeof(*block);
+    for (chunk = parser->arena->chunks; chunk; chunk = chunk->next) {
+        ret += chunk->size;
+        if (chunk != &(block->chunk))
+            ret += sizeof(*chunk);
+    }
+
+    return ret;
+}
+
+static int _known_index(const char *name)
+{
+    int i;
+
+    switch (name[0]) {
+        case 'h':
+            i = HTTPP_KNOWN_HOST;
+        break;
+        case 'u':
+            i = HTTPP_KNOWN_USER_AGENT;
+        break;
+        case 'a':
+            i = HTTPP_KNOWN_AUTHORIZATION;
+        break;
+        case 'i':
+            i = HTTPP_KNOWN_ICY_METADATA;
+        break;
+        case 'c':
+            i = HTTPP_KNOWN_CONTENT_TYPE;
+        break;
+        case 'r':
+            i = HTTPP_KNOWN_RANGE;
+        break;
+        default:
+            return -1;
+        break;
+    }
+
+    if (strcmp(name, _known_names[i]) != 0)
+        return -1;
+
+    return i;
+}
+
+/* Rebuilds the index of well known headers, needed after variables got removed. */
+static void _known_reindex(http_parser_t *parser)
+{
+    size_t i;
+
+    memset(parser->known, 0, sizeof(parser->known));
+
+    for (i = 0; i < parser->vars.len; i++) {
+        int known = _known_index(parser->vars.var[i].name);
+        if (known >= 0)
+            parser->known[known] = i + 1;
+    }
+}
+
+/* Appends a new variable to the table, returns NULL on failure. */
+static http_var_t *_table_append(http_parser_t *parser, http_vartable_t *table)
+{
+    http_var_t *var;
+
+    if (table->len == table->alloc) {
+        size_t alloc = table->alloc ? table->alloc * 2 : 16;
+        http_var_t *n = _arena_alloc(parser->arena, sizeof(*n) * alloc);
+
+        if (!n)
+            return NULL;
+
+        /* the old table stays in the arena until the parser is released */
+        if (table->len)
+            memcpy(n, table->var, sizeof(*n) * table->len);
+        table->var = n;
+        table->alloc = alloc;
+    }
+
+    var = &(table->var[table->len++]);
+    memset(var, 0, sizeof(*var));
+
+    return var;
+}
+
+/* Adds a value to the variable, returns -1 on failure. */
+static int _var_add_value(http_parser_t *parser, http_var_t *var, char *value)
+{
+    char **n = _arena_alloc(parser->arena, sizeof(*n) * (var->values + 1));
+
+    if (!n)
+        return -1;
+
+    if (var->values)
+        memcpy(n, var->value, sizeof(*n) * var->values);
+    n[var->values++] = value;
+    var->value = n;
+
+    return 0;
+}
+
 void httpp_initialize(http_parser_t *parser, http_varlist_t *defaults)
 {
     http_varlist_t *list;
@@ -177,6 +434,34 @@ static int split_headers(char *data, unsigned long len, char **line)
     return lines;
 }
 
+/* Sets a variable without copying name and value, they must be in the arena. */
+static void _httpp_setvar_nocopy(http_parser_t *parser, char *name, char *value)
+{
+    http_var_t *var = _httpp_get_param_var(&(parser->vars), name);
+    int known;
+
+    if (var) {
+        /* replace the value */
+        var->values = 0;
+        _var_add_value(parser, var, value);
+        return;
+    }
+
+    var = _table_append(parser, &(parser->vars));
+    if (!var)
+        return;
+
+    var->name = name;
+    if (_var_add_value(parser, var, value) != 0) {
+        parser->vars.len--;
+        return;
+    }
+
+    known = _known_index(name);
+    if (known >= 0)
+        parser->known[known] = parser->vars.len;
+}
+
 static void parse_headers(http_parser_t *parser, char **line, int lines)
 {
     int i, l;
@@ -209,7 +494,7 @@ static void parse_headers(http_parser_t *parser, char **line, int lines)
         }
         
         if (name != NULL && value != NULL) {
-            httpp_setvar(parser, _lowercase(name), value);
+            _httpp_setvar_nocopy(parser, _lowercase(name), value);
             name = NULL; 
             value = NULL;
         }
@@ -226,11 +511,11 @@ int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned
     if(http_data == NULL)
         return 0;
 
-    /* make a local copy of the data, including 0 terminator */
-    data = (char *)malloc(len+1);
+    /* make a local copy of the data, including 0 terminator.
+     * It is kept in the arena as the headers point into it.
+     */
+    data = _arena_strndup(parser->arena, http_data, len);
     if (data == NULL) return 0;
-    memcpy(data, http_data, len);
-    data[len] = 0;
 
     lines = split_headers(data, len, line);
 
@@ -256,7 +541,6 @@ int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned
     }
 
     if(version == NULL || resp_code == NULL || message == NULL) {
-        free(data);
         return 0;
     }
 
@@ -271,8 +555,6 @@ int httpp_parse_response(http_parser_t *parser, const char *http_data, unsigned
 
     parse_headers(parser, line, lines);
 
-    free(data);
-
     return 1;
 }
 
@@ -287,7 +569,7 @@ int httpp_parse_postdata(http_parser_t *parser, const char *body_data, size_t le
         return -1;
     }
 
-    parse_query(parser->postvars, body_data, len);
+    parse_query(parser, &(parser->postvars), body_data, len);
 
     return 0;
 }
@@ -304,14 +586,17 @@ static int hex(char c)
         return -1;
 }
 
-static char *url_unescape(const char *src, size_t len)
+static char *url_unescape(httpp_arena_t *arena, const char *src, size_t len)
 {
     unsigned char *decoded;
     size_t i;
     char *dst;
     int done = 0;
 
-    decoded = calloc(1, len + 1);
+    /* on failure the memory just stays in the arena */
+    decoded = _arena_alloc(arena, len + 1);
+    if (!decoded)
+        return NULL;
 
     dst = (char *)decoded;
 
@@ -319,11 +604,9 @@ static char *url_unescape(const char *src, size_t len)
         switch(src[i]) {
         case '%':
             if(i+2 >= len) {
-                free(decoded);
                 return NULL;
             }
             if(hex(src[i+1]) == -1 || hex(src[i+2]) == -1 ) {
-                free(decoded);
                 return NULL;
             }
 
@@ -337,7 +620,6 @@ static char *url_unescape(const char *src, size_t len)
             done = 1;
             break;
         case 0:
-            free(decoded);
             return NULL;
             break;
         default:
@@ -353,7 +635,7 @@ static char *url_unescape(const char *src, size_t len)
     return (char *)decoded;
 }
 
-static void parse_query_element(avl_tree *tree, const char *start, const char *mid, const char *end)
+static void parse_query_element(http_parser_t *parser, http_vartable_t *table, const char *start, const char *mid, const char *end)
 {
     size_t keylen;
     char *key;
@@ -373,16 +655,13 @@ static void parse_query_element(avl_tree *tree, const char *start, const char *m
     if (!keylen || !valuelen)
         return;
 
-    key = malloc(keylen + 1);
-    memcpy(key, start, keylen);
-    key[keylen] = 0;
+    key = _arena_strndup(parser->arena, start, keylen);
+    value = url_unescape(parser->arena, mid + 1, valuelen);
 
-    value = url_unescape(mid + 1, valuelen);
-
-    _httpp_set_param_nocopy(tree, key, value, 0);
+    _httpp_set_param_nocopy(parser, table, key, value, 0);
 }
 
-static void parse_query(avl_tree *tree, const char *query, size_t len)
+static void parse_query(http_parser_t *parser, http_vartable_t *table, const char *query, size_t len)
 {
     const char *start = query;
     const char *mid = NULL;
@@ -394,7 +673,7 @@ static void parse_query(avl_tree *tree, const char *query, size_t len)
     for (i = 0; i < len; i++) {
         switch (query[i]) {
             case '&':
-                parse_query_element(tree, start, mid, &(query[i]));
+                parse_query_element(parser, table, start, mid, &(query[i]));
                 start = &(query[i + 1]);
                 mid = NULL;
             break;
@@ -404,7 +683,7 @@ static void parse_query(avl_tree *tree, const char *query, size_t len)
         }
     }
 
-    parse_query_element(tree, start, mid, &(query[i]));
+    parse_query_element(parser, table, start, mid, &(query[i]));
 }
 
 int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
@@ -421,11 +700,11 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
     if (http_data == NULL)
         return 0;
 
-    /* make a local copy of the data, including 0 terminator */
-    data = (char *)malloc(len+1);
+    /* make a local copy of the data, including 0 terminator.
+     * It is kept in the arena as the headers point into it.
+     */
+    data = _arena_strndup(parser->arena, http_data, len);
     if (data == NULL) return 0;
-    memcpy(data, http_data, len);
-    data[len] = 0;
 
     lines = split_headers(data, len, line);
 
@@ -457,7 +736,6 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
                     break;
                     case 3:
                         /* There is an extra element in the request line. This is not HTTP. */
-                        free(data);
                         return 0;
                     break;
                 }
@@ -474,12 +752,11 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
             httpp_setvar(parser, HTTPP_VAR_QUERYARGS, query);
             *query = 0;
             query++;
-            parse_query(parser->queryvars, query, strlen(query));
+            parse_query(parser, &(parser->queryvars), query, strlen(query));
         }
 
-        parser->uri = strdup(uri);
+        parser->uri = uri;
     } else {
-        free(data);
         return 0;
     }
 
@@ -489,11 +766,9 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
             httpp_setvar(parser, HTTPP_VAR_PROTOCOL, version);
             httpp_setvar(parser, HTTPP_VAR_VERSION, &tmp[1]);
         } else {
-            free(data);
             return 0;
         }
     } else {
-        free(data);
         return 0;
     }
 
@@ -536,160 +811,132 @@ int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len)
             break;
         }
     } else {
-        free(data);
         return 0;
     }
 
     if (parser->uri != NULL) {
         httpp_setvar(parser, HTTPP_VAR_URI, parser->uri);
     } else {
-        free(data);
         return 0;
     }
 
     parse_headers(parser, line, lines);
 
-    free(data);
-
     return 1;
 }
 
 void httpp_deletevar(http_parser_t *parser, const char *name)
 {
-    http_var_t var;
+    http_var_t *var;
+    size_t i;
 
     if (parser == NULL || name == NULL)
         return;
-    memset(&var, 0, sizeof(var));
 
-    var.name = (char*)name;
+    var = _httpp_get_param_var(&(parser->vars), name);
+    if (!var)
+        return;
+
+    i = var - parser->vars.var;
+    memmove(var, var + 1, sizeof(*var) * (parser->vars.len - i - 1));
+    parser->vars.len--;
 
-    avl_delete(parser->vars, (void *)&var, _free_vars);
+    _known_reindex(parser);
 }
 
 void httpp_setvar(http_parser_t *parser, const char *name, const char *value)
 {
     http_var_t *var;
+    char *name_copy;
+    char *value_copy;
 
     if (name == NULL || value == NULL)
         return;
 
-    var = (http_var_t *)calloc(1, sizeof(http_var_t));
-    if (var == NULL) return;
-
-    var->value = calloc(1, sizeof(*var->value));
-    if (!var->value) {
-        free(var);
-        return;
+    /* only new variables need a copy of the name */
+    var = _httpp_get_param_var(&(parser->vars), name);
+    if (var) {
+        name_copy = var->name;
+    } else {
+        name_copy = _arena_strdup(parser->arena, name);
     }
+    value_copy = _arena_strdup(parser->arena, value);
 
-    var->name = strdup(name);
-    var->values = 1;
-    var->value[0] = strdup(value);
-
-    //printf("httpp_setvar '%s'='%s'\n", var->name, var->value[0]);
+    if (!name_copy || !value_copy)
+        return;
 
-    if (httpp_getvar(parser, name) == NULL) {
-        avl_insert(parser->vars, (void *)var);
-    } else {
-        avl_delete(parser->vars, (void *)var, _free_vars);
-        avl_insert(parser->vars, (void *)var);
-    }
+    _httpp_setvar_nocopy(parser, name_copy, value_copy);
 }
 
 const char *httpp_getvar(http_parser_t *parser, const char *name)
 {
-    http_var_t var;
-    http_var_t *found;
-    void *fp;
+    const http_var_t *found;
+    int known;
 
     if (parser == NULL || name == NULL)
         return NULL;
 
-    fp = &found;
-    memset(&var, 0, sizeof(var));
-    var.name = (char*)name;
-
-    if (avl_get_by_key(parser->vars, &var, fp) == 0) {
-        if (!found->values)
+    known = _known_index(name);
+    if (known >= 0) {
+        if (!parser->known[known])
             return NULL;
-        return found->value[0];
+        found = &(parser->vars.var[parser->known[known] - 1]);
     } else {
-        return NULL;
+        found = _httpp_get_param_var(&(parser->vars), name);
     }
+
+    if (!found || !found->values)
+        return NULL;
+
+    return found->value[0];
 }
 
-static void _httpp_set_param_nocopy(avl_tree *tree, char *name, char *value, int replace)
+static void _httpp_set_param_nocopy(http_parser_t *parser, http_vartable_t *table, char *name, char *value, int replace)
 {
-    http_var_t *var, *found;
-    char **n;
+    http_var_t *var;
 
     if (name == NULL || value == NULL)
         return;
 
-    found = _httpp_get_param_var(tree, name);
+    var = _httpp_get_param_var(table, name);
 
-    if (replace || !found) {
-        var = (http_var_t *)calloc(1, sizeof(http_var_t));
-        if (var == NULL) {
-            free(name);
-            free(value);
+    if (!var) {
+        var = _table_append(parser, table);
+        if (!var)
             return;
-        }
-
         var->name = name;
-    } else {
-        free(name);
-        var = found;
-    }
-
-    n = realloc(var->value, sizeof(*n)*(var->values + 1));
-    if (!n) {
-        if (replace || !found) {
-            free(name);
-            free(var);
-        }
-        free(value);
-        return;
+    } else if (replace) {
+        var->values = 0;
     }
 
-    var->value = n;
-    var->value[var->values++] = value;
-
-    if (replace && found) {
-        avl_delete(tree, (void *)found, _free_vars);
-        avl_insert(tree, (void *)var);
-    } else if (!found) {
-        avl_insert(tree, (void *)var);
-    }
+    if (_var_add_value(parser, var, value) != 0 && !var->values)
+        table->len--;
 }
 
-static void _httpp_set_param(avl_tree *tree, const char *name, const char *value)
+static void _httpp_set_param(http_parser_t *parser, http_vartable_t *table, const char *name, const char *value)
 {
     if (name == NULL || value == NULL)
         return;
 
-    _httpp_set_param_nocopy(tree, strdup(name), url_unescape(value, strlen(value)), 1);
+    _httpp_set_param_nocopy(parser, table, _arena_strdup(parser->arena, name), url_unescape(parser->arena, value, strlen(value)), 1);
 }
 
-static http_var_t *_httpp_get_param_var(avl_tree *tree, const char *name)
+static http_var_t *_httpp_get_param_var(http_vartable_t *table, const char *name)
 {
-    http_var_t var;
-    http_var_t *found;
-    void *fp;
+    size_t i;
 
-    fp = &found;
-    memset(&var, 0, sizeof(var));
-    var.name = (char *)name;
+    for (i = 0; i < table->len; i++) {
+        http_var_t *var = &(table->var[i]);
 
-    if (avl_get_by_key(tree, (void *)&var, fp) == 0)
-        return found;
-    else
-        return NULL;
+        if (var->name[0] == name[0] && strcmp(var->name, name) == 0)
+            return var;
+    }
+
+    return NULL;
 }
-static const char *_httpp_get_param(avl_tree *tree, const char *name)
+static const char *_httpp_get_param(http_vartable_t *table, const char *name)
 {
-    http_var_t *res = _httpp_get_param_var(tree, name);
+    http_var_t *res = _httpp_get_param_var(table, name);
 
     if (!res)
         return NULL;
@@ -702,123 +949,122 @@ static const char *_httpp_get_param(avl_tree *tree, const char *name)
 
 void httpp_set_query_param(http_parser_t *parser, const char *name, const char *value)
 {
-    return _httpp_set_param(parser->queryvars, name, value);
+    return _httpp_set_param(parser, &(parser->queryvars), name, value);
 }
 
 const char *httpp_get_query_param(http_parser_t *parser, const char *name)
 {
-    return _httpp_get_param(parser->queryvars, name);
+    return _httpp_get_param(&(parser->queryvars), name);
 }
 
 void httpp_set_post_param(http_parser_t *parser, const char *name, const char *value)
 {
-    return _httpp_set_param(parser->postvars, name, value);
+    return _httpp_set_param(parser, &(parser->postvars), name, value);
 }
 
 const char *httpp_get_post_param(http_parser_t *parser, const char *name)
 {
-    return _httpp_get_param(parser->postvars, name);
+    return _httpp_get_param(&(parser->postvars), name);
 }
 
 const http_var_t *httpp_get_param_var(http_parser_t *parser, const char *name)
 {
-    http_var_t *ret = _httpp_get_param_var(parser->postvars, name);
+    http_var_t *ret = _httpp_get_param_var(&(parser->postvars), name);
 
     if (ret)
         return ret;
 
-    return _httpp_get_param_var(parser->queryvars, name);
+    return _httpp_get_param_var(&(parser->queryvars), name);
 }
 
-const http_var_t *httpp_get_any_var(http_parser_t *parser, httpp_ns_t ns, const char *name)
+static http_vartable_t *_httpp_get_table(http_parser_t *parser, httpp_ns_t ns)
 {
-    avl_tree *tree = NULL;
-
-    if (!parser || !name)
-        return NULL;
-
     switch (ns) {
         case HTTPP_NS_VAR:
-            if (name[0] != '_' || name[1] != '_')
-                return NULL;
-            tree = parser->vars;
-        break;
         case HTTPP_NS_HEADER:
-            if (name[0] == '_' && name[1] == '_')
-                return NULL;
-            tree = parser->vars;
+            return &(parser->vars);
         break;
         case HTTPP_NS_QUERY_STRING:
-            tree = parser->queryvars;
+            return &(parser->queryvars);
         break;
         case HTTPP_NS_POST_BODY:
-            tree = parser->postvars;
+            return &(parser->postvars);
         break;
     }
 
-    if (!tree)
-        return NULL;
+    return NULL;
+}
 
-    return _httpp_get_param_var(tree, name);
+/* VAR and HEADER share a table, variables are told apart by the "__" prefix. */
+static inline int _httpp_in_ns(const char *name, httpp_ns_t ns)
+{
+    if (ns == HTTPP_NS_VAR) {
+        return name[0] == '_' && name[1] == '_';
+    } else if (ns == HTTPP_NS_HEADER) {
+        return name[0] != '_' || name[1] != '_';
+    }
+
+    return 1;
 }
 
-char ** httpp_get_any_key(http_parser_t *parser, httpp_ns_t ns)
+const http_var_t *httpp_get_any_var(http_parser_t *parser, httpp_ns_t ns, const char *name)
 {
-    avl_tree *tree = NULL;
-    avl_node *avlnode;
-    char **ret;
-    size_t len;
-    size_t pos = 0;
+    http_vartable_t *table;
 
-    if (!parser)
+    if (!parser || !name)
         return NULL;
 
-    switch (ns) {
-        case HTTPP_NS_VAR:
-        case HTTPP_NS_HEADER:
-            tree = parser->vars;
-        break;
-        case HTTPP_NS_QUERY_STRING:
-            tree = parser->queryvars;
-        break;
-        case HTTPP_NS_POST_BODY:
-            tree = parser->postvars;
-        break;
-    }
+    if (!_httpp_in_ns(name, ns))
+        return NULL;
 
-    if (!tree)
+    table = _httpp_get_table(parser, ns);
+    if (!table)
         return NULL;
 
-    ret = calloc(8, sizeof(*ret));
-    if (!ret)
+    return _httpp_get_param_var(table, name);
+}
+
+const http_var_t *httpp_next_any_var(http_parser_t *parser, httpp_ns_t ns, size_t *pos)
+{
+    http_vartable_t *table;
+
+    if (!parser || !pos)
         return NULL;
 
-    len = 8;
+    table = _httpp_get_table(parser, ns);
+    if (!table)
+        return NULL;
 
-    for (avlnode = avl_get_first(tree); avlnode; avlnode = avl_get_next(avlnode)) {
-        http_var_t *var = avlnode->key;
+    while (*pos < table->len) {
+        const http_var_t *var = &(table->var[(*pos)++]);
 
-        if (ns == HTTPP_NS_VAR) {
-            if (var->name[0] != '_' || var->name[1] != '_') {
-                continue;
-            }
-        } else if (ns == HTTPP_NS_HEADER) {
-            if (var->name[0] == '_' && var->name[1] == '_') {
-                continue;
-            }
-        }
+        if (_httpp_in_ns(var->name, ns))
+            return var;
+    }
 
-        if (pos == (len-1)) {
-            char **n = realloc(ret, sizeof(*ret)*(len + 8));
-            if (!n) {
-                httpp_free_any_key(ret);
-                return NULL;
-            }
-            memset(n + len, 0, sizeof(*n)*8);
-            ret = n;
-            len += 8;
-        }
+    return NULL;
+}
 
+char ** httpp_get_any_key(http_parser_t *parser, httpp_ns_t ns)
+{
+    const http_var_t *var;
+    char **ret;
+    size_t len = 1;
+    size_t pos = 0;
+    size_t i = 0;
+
+    if (!parser)
+        return NULL;
+
+    while (httpp_next_any_var(parser, ns, &i))
+        len++;
+
+    ret = calloc(len, sizeof(*ret));
+    if (!ret)
+        return NULL;
+
+    i = 0;
+    while ((var = httpp_next_any_var(parser, ns, &i))) {
         ret[pos] = strdup(var->name);
         if (!ret[pos]) {
             httpp_free_any_key(ret);
@@ -846,24 +1092,25 @@ void httpp_free_any_key(char **keys)
 
 const char *httpp_get_param(http_parser_t *parser, const char *name)
 {
-    const char *ret = _httpp_get_param(parser->postvars, name);
+    const char *ret = _httpp_get_param(&(parser->postvars), name);
 
     if (ret)
         return ret;
 
-    return _httpp_get_param(parser->queryvars, name);
+    return _httpp_get_param(&(parser->queryvars), name);
 }
 
 static void httpp_clear(http_parser_t *parser)
 {
+    httpp_block_t *block = (httpp_block_t *)parser;
+
     parser->req_type = httpp_req_none;
-    if (parser->uri)
-        free(parser->uri);
     parser->uri = NULL;
-    avl_tree_free(parser->vars, _free_vars);
-    avl_tree_free(parser->queryvars, _free_vars);
-    avl_tree_free(parser->postvars, _free_vars);
-    parser->vars = NULL;
+    memset(&(parser->vars), 0, sizeof(parser->vars));
+    memset(&(parser->queryvars), 0, sizeof(parser->queryvars));
+    memset(&(parser->postvars), 0, sizeof(parser->postvars));
+    memset(parser->known, 0, sizeof(parser->known));
+    _arena_free(parser->arena, &(block->chunk));
 }
 
 int httpp_addref(http_parser_t *parser)
@@ -900,34 +1147,6 @@ static char *_lowercase(char *str)
     return str;
 }
 
-static int _compare_vars(void *compare_arg, void *a, void *b)
-{
-    http_var_t *vara, *varb;
-
-    vara = (http_var_t *)a;
-    varb = (http_var_t *)b;
-
-    //printf("_compare_vars '%s' <=> '%s' = %d\n", vara->name, varb->name, strcmp(vara->name, varb->name));
-
-    return strcmp(vara->name, varb->name);
-}
-
-static int _free_vars(void *key)
-{
-    http_var_t *var = (http_var_t *)key;
-    size_t i;
-
-    free(var->name);
-
-    for (i = 0; i < var->values; i++) {
-        free(var->value[i]);
-    }
-    free(var->value);
-    free(var);
-
-    return 1;
-}
-
 httpp_request_type_e httpp_str_to_method(const char * method) {
     if (strcasecmp("GET", method) == 0) {
         return httpp_req_get;
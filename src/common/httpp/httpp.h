@@ -27,7 +27,7 @@
 #ifndef __HTTPP_H
 #define __HTTPP_H
 
-#include <avl/avl.h>
+#include <stddef.h>
 
 #define HTTPP_VAR_PROTOCOL "__protocol"
 #define HTTPP_VAR_VERSION "__version"
@@ -88,18 +88,49 @@ typedef struct http_varlist_tag {
     struct http_varlist_tag *next;
 } http_varlist_t;
 
+/* Headers that are looked up without searching the header table */
+typedef enum {
+    HTTPP_KNOWN_HOST = 0,
+    HTTPP_KNOWN_USER_AGENT,
+    HTTPP_KNOWN_AUTHORIZATION,
+    HTTPP_KNOWN_ICY_METADATA,
+    HTTPP_KNOWN_CONTENT_TYPE,
+    HTTPP_KNOWN_RANGE,
+    /* Number of well known headers. MUST BE LAST ONE IN LIST. */
+    HTTPP_KNOWN_MAX
+} httpp_known_t;
+
+typedef struct httpp_arena_tag httpp_arena_t;
+
+/* Variables in the order they were set.
+ * Pointers into the table are only valid until the next change to it.
+ */
+typedef struct http_vartable_tag {
+    http_var_t *var;
+    size_t len;
+    size_t alloc;
+} http_vartable_t;
+
 typedef struct http_parser_tag {
     size_t refc;
     httpp_request_type_e req_type;
     char *uri;
-    avl_tree *vars;
-    avl_tree *queryvars;
-    avl_tree *postvars;
+    /* all memory used by the parser is taken from the arena
+     * and is freed at once when the parser is released.
+     */
+    httpp_arena_t *arena;
+    http_vartable_t vars;
+    http_vartable_t queryvars;
+    http_vartable_t postvars;
+    /* index + 1 into vars for the well known headers, 0 if not set */
+    size_t known[HTTPP_KNOWN_MAX];
 } http_parser_t;
 
 #ifdef _mangle
 # define httpp_request_info _mangle(httpp_request_info)
 # define httpp_create_parser _mangle(httpp_create_parser)
+# define httpp_compact _mangle(httpp_compact)
+# define httpp_memory_usage _mangle(httpp_memory_usage)
 # define httpp_initialize _mangle(httpp_initialize)
 # define httpp_parse _mangle(httpp_parse)
 # define httpp_parse_icy _mangle(httpp_parse_icy)
@@ -112,6 +143,7 @@ typedef struct http_parser_tag {
 # define httpp_set_post_param _mangle(httpp_set_post_param)
 # define httpp_get_post_param _mangle(httpp_get_post_param)
 # define httpp_get_param _mangle(httpp_get_param)
+# define httpp_next_any_var _mangle(httpp_next_any_var)
 # define httpp_release _mangle(httpp_release)
 # define httpp_destroy _mangle(httpp_release)
 # define httpp_addref _mangle(httpp_addref)
@@ -123,6 +155,14 @@ typedef struct http_parser_tag {
 httpp_request_info_t httpp_request_info(httpp_request_type_e req);
 
 http_parser_t *httpp_create_parser(void);
+/* Returns a copy of the parser with only the variables and headers, in a
+ * single allocation of the size needed. Query and post parameters are
+ * dropped. The parser passed is released, or returned if it can not be
+ * compacted (e.g. it has more than one reference).
+ */
+http_parser_t *httpp_compact(http_parser_t *parser);
+/* Returns the number of bytes allocated for the parser */
+size_t httpp_memory_usage(http_parser_t *parser);
 void httpp_initialize(http_parser_t *parser, http_varlist_t *defaults);
 int httpp_parse(http_parser_t *parser, const char *http_data, unsigned long len);
 int httpp_parse_icy(http_parser_t *parser, const char *http_data, unsigned long len);
@@ -138,6 +178,8 @@ const char *httpp_get_post_param(http_parser_t *parser, const char *name);
 const char *httpp_get_param(http_parser_t *parser, const char *name);
 const http_var_t *httpp_get_param_var(http_parser_t *parser, const char *name);
 const http_var_t *httpp_get_any_var(http_parser_t *parser, httpp_ns_t ns, const char *name);
+/* Iterates the variables of a namespace, *pos must be 0 for the first call. Returns NULL at the end. */
+const http_var_t *httpp_next_any_var(http_parser_t *parser, httpp_ns_t ns, size_t *pos);
 char ** httpp_get_any_key(http_parser_t *parser, httpp_ns_t ns);
 void httpp_free_any_key(char **keys);
 int httpp_addref(http_parser_t *parser);
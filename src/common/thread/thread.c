@@ -525,18 +525,40 @@ void thread_cond_broadcast_c(cond_t *cond, int line, char *file)
     pthread_cond_broadcast(&cond->sys_cond);
 }
 
+/* pthread_cond_timedwait() takes an absolute time */
+static void _cond_deadline(struct timespec *deadline, int millis)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    deadline->tv_sec = now.tv_sec + millis/1000;
+    deadline->tv_nsec = now.tv_usec*1000 + (long)(millis%1000)*1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
 void thread_cond_timedwait_c(cond_t *cond, int millis, int line, char *file)
 {
     struct timespec time;
 
-    time.tv_sec = millis/1000;
-    time.tv_nsec = (millis - time.tv_sec*1000)*1000000;
+    _cond_deadline(&time, millis);
 
     pthread_mutex_lock(&cond->cond_mutex);
     pthread_cond_timedwait(&cond->sys_cond, &cond->cond_mutex, &time);
     pthread_mutex_unlock(&cond->cond_mutex);
 }
 
+void thread_cond_timedwait_mutex_c(cond_t *cond, mutex_t *mutex, int millis, int line, char *file)
+{
+    struct timespec time;
+
+    _cond_deadline(&time, millis);
+
+    pthread_cond_timedwait(&cond->sys_cond, &mutex->sys_mutex, &time);
+}
+
 void thread_cond_wait_c(cond_t *cond, int line, char *file)
 {
     pthread_mutex_lock(&cond->cond_mutex);
@@ -120,7 +120,8 @@ typedef mutex_t spin_t;
 #define thread_cond_signal(x) thread_cond_signal_c(x,__LINE__,__FILE__)
 #define thread_cond_broadcast(x) thread_cond_broadcast_c(x,__LINE__,__FILE__)
 #define thread_cond_wait(x) thread_cond_wait_c(x,__LINE__,__FILE__)
-#define thread_cond_timedwait(x,t) thread_cond_wait_c(x,t,__LINE__,__FILE__)
+#define thread_cond_timedwait(x,t) thread_cond_timedwait_c(x,t,__LINE__,__FILE__)
+#define thread_cond_timedwait_mutex(x,m,t) thread_cond_timedwait_mutex_c(x,m,t,__LINE__,__FILE__)
 #define thread_rwlock_create(x) thread_rwlock_create_c(x,__LINE__,__FILE__)
 #define thread_rwlock_rlock(x) thread_rwlock_rlock_c(x,__LINE__,__FILE__)
 #define thread_rwlock_wlock(x) thread_rwlock_wlock_c(x,__LINE__,__FILE__)
@@ -147,6 +148,7 @@ typedef mutex_t spin_t;
 # define thread_cond_broadcast_c _mangle(thread_cond_broadcast_c)
 # define thread_cond_wait_c _mangle(thread_cond_wait_c)
 # define thread_cond_timedwait_c _mangle(thread_cond_timedwait_c)
+# define thread_cond_timedwait_mutex_c _mangle(thread_cond_timedwait_mutex_c)
 # define thread_cond_destroy _mangle(thread_cond_destroy)
 # define thread_rwlock_create_c _mangle(thread_rwlock_create_c)
 # define thread_rwlock_rlock_c _mangle(thread_rwlock_rlock_c)
@@ -179,6 +181,10 @@ void thread_cond_signal_c(cond_t *cond, int line, char *file);
 void thread_cond_broadcast_c(cond_t *cond, int line, char *file);
 void thread_cond_wait_c(cond_t *cond, int line, char *file);
 void thread_cond_timedwait_c(cond_t *cond, int millis, int line, char *file);
+/* Waits for up to millis ms. mutex must be locked by the caller and protects
+ * the condition waited for, it is unlocked while waiting.
+ */
+void thread_cond_timedwait_mutex_c(cond_t *cond, mutex_t *mutex, int millis, int line, char *file);
 void thread_cond_destroy(cond_t *cond);
 void thread_rwlock_create_c(rwlock_t *rwlock, int line, char *file);
 void thread_rwlock_rlock_c(rwlock_t *rwlock, int line, char *file);
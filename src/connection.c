@@ -63,6 +63,8 @@
 #include "listensocket.h"
 #include "fastevent.h"
 #include "navigation.h"
+#include "metrics.h"
+#include "probes.h"
 
 #define CATMODULE "connection"
 
@@ -81,6 +83,7 @@
    Icecast auth style uses HTTP and Basic Authorization.
 */
 
+/* Nodes are allocated from the client's connection, see connection_alloc(). */
 typedef struct client_queue_tag {
     client_t *client;
     int offset;
@@ -89,16 +92,56 @@ typedef struct client_queue_tag {
     char *bodybuffer;
     size_t bodybufferlen;
     int tried_body;
+    /* set once the handshake threads are done with the TLS handshake */
+    int tls_ready;
+    /* when the node was handed to the handshake threads, see metrics_time() */
+    uint64_t handshake_queued;
     struct client_queue_tag *next;
 } client_queue_t;
 
-static spin_t _connection_lock; // protects _current_id, _con_queue, _con_queue_tail
-static volatile connection_id_t _current_id = 0;
+/* Connections are allocated as blocks of CONNECTION_BLOCK_SIZE bytes. The
+ * connection_t is at the start of the block, the rest is handed out by
+ * connection_alloc() for the client, the queue node and strings. Connections
+ * that need more get extra chunks. Blocks of closed connections are pooled.
+ */
+#define CONNECTION_BLOCK_SIZE   1024
+#define CONNECTION_CHUNK_MIN    512
+#define CONNECTION_POOL_MAX     256
+#define CONNECTION_ALIGN(x)     (((x) + (size_t)15) & ~(size_t)15)
+
+typedef struct connection_chunk_tag {
+    struct connection_chunk_tag *next;
+    size_t size;
+} connection_chunk_t;
+
+static spin_t _connection_lock; // protects _con_queue, _con_queue_tail
+static connection_id_t _current_id = 0;
 static int _initialized = 0;
 
+static spin_t _connection_pool_lock; // protects _connection_pool, _connection_pool_len
+static connection_chunk_t *_connection_pool = NULL;
+static size_t _connection_pool_len = 0;
+
 static volatile client_queue_t *_req_queue = NULL, **_req_queue_tail = &_req_queue;
 static volatile client_queue_t *_con_queue = NULL, **_con_queue_tail = &_con_queue;
 static volatile client_queue_t *_body_queue = NULL, **_body_queue_tail = &_body_queue;
+
+/* TLS handshakes are done by a pool of handshake threads. Nodes wait in
+ * _handshake_queue for a thread and are put in _handshake_done_queue once
+ * the handshake completed. process_request_queue() takes them back from there.
+ */
+#define HANDSHAKE_THREAD_CLIENTS    128
+#define HANDSHAKE_POLL_INTERVAL     10 /* ms */
+
+static mutex_t _handshake_lock; // protects _handshake_queue, _handshake_done_queue, _handshake_running
+static cond_t _handshake_cond;
+static client_queue_t *_handshake_queue = NULL, **_handshake_queue_tail = &_handshake_queue;
+static client_queue_t *_handshake_done_queue = NULL, **_handshake_done_queue_tail = &_handshake_done_queue;
+static int _handshake_running = 0;
+static size_t _handshake_clients = 0; // nodes owned by the handshake threads, atomic
+static thread_type **_handshake_threads = NULL;
+static size_t _handshake_threads_count = 0;
+
 static bool tls_ok = false;
 static tls_ctx_t *tls_ctx;
 
@@ -110,6 +153,8 @@ rwlock_t _source_shutdown_rwlock;
 static int  _update_admin_command(client_t *client);
 static void _handle_connection(void);
 static void get_tls_certificate(ice_config_t *config);
+static void _add_request_queue(client_queue_t *node);
+static int connection_send(connection_t *con, const void *buf, size_t len);
 
 void connection_initialize(void)
 {
@@ -117,15 +162,22 @@ void connection_initialize(void)
         return;
 
     thread_spin_create (&_connection_lock);
+    thread_spin_create (&_connection_pool_lock);
     thread_mutex_create(&move_clients_mutex);
     thread_rwlock_create(&_source_shutdown_rwlock);
     thread_cond_create(&global.shutdown_cond);
+    thread_mutex_create(&_handshake_lock);
+    thread_cond_create(&_handshake_cond);
     _req_queue = NULL;
     _req_queue_tail = &_req_queue;
     _con_queue = NULL;
     _con_queue_tail = &_con_queue;
     _body_queue = NULL;
     _body_queue_tail = &_body_queue;
+    _handshake_queue = NULL;
+    _handshake_queue_tail = &_handshake_queue;
+    _handshake_done_queue = NULL;
+    _handshake_done_queue_tail = &_handshake_done_queue;
 
     _initialized = 1;
 }
@@ -140,12 +192,24 @@ void connection_shutdown(void)
     matchfile_release(allowed_ip);
     matchfile_release(proxy_ip);
 
+    thread_cond_destroy(&_handshake_cond);
+    thread_mutex_destroy(&_handshake_lock);
     thread_cond_destroy(&global.shutdown_cond);
     thread_rwlock_destroy(&_source_shutdown_rwlock);
     thread_spin_destroy (&_connection_lock);
     thread_mutex_destroy(&move_clients_mutex);
 
     _initialized = 0;
+
+    thread_spin_lock(&_connection_pool_lock);
+    while (_connection_pool) {
+        connection_chunk_t *block = _connection_pool;
+        _connection_pool = block->next;
+        free(block);
+    }
+    _connection_pool_len = 0;
+    thread_spin_unlock(&_connection_pool_lock);
+    thread_spin_destroy (&_connection_pool_lock);
 }
 
 void connection_reread_config(ice_config_t *config)
@@ -156,13 +220,127 @@ void connection_reread_config(ice_config_t *config)
 
 static connection_id_t _next_connection_id(void)
 {
-    connection_id_t id;
+    return __atomic_fetch_add(&_current_id, 1, __ATOMIC_RELAXED);
+}
 
-    thread_spin_lock(&_connection_lock);
-    id = _current_id++;
-    thread_spin_unlock(&_connection_lock);
+static connection_t *_connection_block_get(void)
+{
+    connection_chunk_t *block = NULL;
+    connection_t *con;
 
-    return id;
+    if (_initialized) {
+        thread_spin_lock(&_connection_pool_lock);
+        block = _connection_pool;
+        if (block) {
+            _connection_pool = block->next;
+            _connection_pool_len--;
+        }
+        thread_spin_unlock(&_connection_pool_lock);
+    }
+
+    if (!block) {
+        block = malloc(CONNECTION_BLOCK_SIZE);
+        if (!block)
+            return NULL;
+        metrics_counter_inc(METRICS_COUNTER_CONNECTION_BLOCK_ALLOC);
+    }
+
+    con = (connection_t *)block;
+    memset(con, 0, sizeof(*con));
+    con->arena_ptr = (char *)block + CONNECTION_ALIGN(sizeof(*con));
+    con->arena_left = CONNECTION_BLOCK_SIZE - CONNECTION_ALIGN(sizeof(*con));
+
+    return con;
+}
+
+static void _connection_block_put(connection_t *con)
+{
+    connection_chunk_t *block = (connection_chunk_t *)con;
+    connection_chunk_t *chunk = con->arena_chunks;
+
+    while (chunk) {
+        connection_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    if (_initialized) {
+        thread_spin_lock(&_connection_pool_lock);
+        if (_connection_pool_len < CONNECTION_POOL_MAX) {
+            block->next = _connection_pool;
+            _connection_pool = block;
+            _connection_pool_len++;
+            block = NULL;
+        }
+        thread_spin_unlock(&_connection_pool_lock);
+    }
+
+    free(block);
+}
+
+void *connection_alloc(connection_t *con, size_t len)
+{
+    void *ret;
+
+    if (!con)
+        return NULL;
+
+    len = CONNECTION_ALIGN(len);
+
+    if (len > con->arena_left) {
+        size_t size = len > CONNECTION_CHUNK_MIN ? len : CONNECTION_CHUNK_MIN;
+        connection_chunk_t *chunk = malloc(CONNECTION_ALIGN(sizeof(*chunk)) + size);
+
+        if (!chunk)
+            return NULL;
+
+        metrics_counter_inc(METRICS_COUNTER_CONNECTION_CHUNK_ALLOC);
+
+        chunk->next = con->arena_chunks;
+        chunk->size = CONNECTION_ALIGN(sizeof(*chunk)) + size;
+        con->arena_chunks = chunk;
+        con->arena_ptr = (char *)chunk + CONNECTION_ALIGN(sizeof(*chunk));
+        con->arena_left = size;
+    }
+
+    ret = con->arena_ptr;
+    con->arena_ptr += len;
+    con->arena_left -= len;
+
+    memset(ret, 0, len);
+
+    return ret;
+}
+
+size_t connection_memory_usage(connection_t *con)
+{
+    connection_chunk_t *chunk;
+    size_t ret;
+
+    if (!con)
+        return 0;
+
+    ret = CONNECTION_BLOCK_SIZE + con->readbufferlen;
+    for (chunk = con->arena_chunks; chunk; chunk = chunk->next)
+        ret += chunk->size;
+
+    return ret;
+}
+
+char *connection_strdup(connection_t *con, const char *str)
+{
+    size_t len;
+    char *ret;
+
+    if (!str)
+        return NULL;
+
+    len = strlen(str) + 1;
+    ret = connection_alloc(con, len);
+    if (ret)
+        memcpy(ret, str, len);
+
+    return ret;
 }
 
 
@@ -184,6 +362,16 @@ static void get_tls_certificate(ice_config_t *config)
         return;
     }
 
+    tls_ctx_set_session_cache(tls_ctx, config->tls_context.session_cache_size, config->tls_context.ticket_key_rotation);
+
+    if (config->tls_context.ktls) {
+        if (tls_ctx_enable_ktls(tls_ctx) == 0) {
+            ICECAST_LOG_INFO("Using kernel TLS where supported");
+        } else {
+            ICECAST_LOG_WARN("Kernel TLS is not supported by the TLS library, using TLS in userspace");
+        }
+    }
+
     tls_ok = true;
 }
 
@@ -205,7 +393,17 @@ static int connection_read_tls(connection_t *con, void *buf, size_t len)
 
 static int connection_send_tls(connection_t *con, const void *buf, size_t len)
 {
-    ssize_t bytes = tls_write(con->tls, buf, len);
+    ssize_t bytes;
+
+    /* once the kernel does the encryption the socket is written to like a plain one */
+    if (tls_ktls_send(con->tls) == 1) {
+        ICECAST_LOG_DEBUG("Connection %lu uses kernel TLS for sending", con->id);
+        metrics_counter_inc(METRICS_COUNTER_TLS_KTLS_SEND);
+        con->send = connection_send;
+        return connection_send(con, buf, len);
+    }
+
+    bytes = tls_write(con->tls, buf, len);
 
     if (bytes < 0) {
         con->error = 1;
@@ -253,14 +451,14 @@ static int connection_send(connection_t *con, const void *buf, size_t len)
     return bytes;
 }
 
-connection_t *connection_create(sock_t sock, listensocket_t *listensocket_real, listensocket_t* listensocket_effective, char *ip)
+connection_t *connection_create(sock_t sock, listensocket_t *listensocket_real, listensocket_t* listensocket_effective, const char *ip)
 {
     connection_t *con;
 
     if (!matchfile_match_allow_deny(allowed_ip, banned_ip, ip))
         return NULL;
 
-    con = (connection_t *)calloc(1, sizeof(connection_t));
+    con = _connection_block_get();
     if (con) {
         refobject_ref(listensocket_real);
         refobject_ref(listensocket_effective);
@@ -269,11 +467,14 @@ connection_t *connection_create(sock_t sock, listensocket_t *listensocket_real,
         con->listensocket_real = listensocket_real;
         con->listensocket_effective = listensocket_effective;
         con->con_time   = time(NULL);
+        con->accept_time = metrics_time();
         con->id         = _next_connection_id();
-        con->ip         = ip;
+        con->ip         = connection_strdup(con, ip);
         con->tlsmode    = ICECAST_TLSMODE_AUTO;
         con->read       = connection_read;
         con->send       = connection_send;
+
+        ICECAST_PROBE2(connection_create, con->id, con->ip);
     }
 
     fastevent_emit(FASTEVENT_TYPE_CONNECTION_CREATE, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_CONNECTION, con);
@@ -308,6 +509,14 @@ ssize_t connection_send_bytes(connection_t *con, const void *buf, size_t len)
 {
     ssize_t ret = con->send(con, buf, len);
 
+    if (ret > 0) {
+        if (con->sent_bytes == (uint64_t)ret)
+            metrics_histogram_observe(METRICS_HISTOGRAM_FIRST_BYTE, metrics_time() - con->accept_time);
+    } else if (len && !con->error) {
+        /* recoverable error, or TLS wanting to write later */
+        metrics_counter_inc(METRICS_COUNTER_SEND_EAGAIN);
+    }
+
     fastevent_emit(FASTEVENT_TYPE_CONNECTION_WRITE, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_OBRD, con, buf, len, ret);
 
     return ret;
@@ -370,6 +579,9 @@ int connection_read_put_back(connection_t *con, const void *buf, size_t len)
 
     fastevent_emit(FASTEVENT_TYPE_CONNECTION_PUTBACK, FASTEVENT_FLAG_MODIFICATION_ALLOWED, FASTEVENT_DATATYPE_OBR, con, buf, len);
 
+    if (!len)
+        return 0;
+
     if (con->readbufferlen) {
         n = realloc(con->readbuffer, con->readbufferlen + len);
         if (!n)
@@ -429,6 +641,252 @@ static client_queue_t *_get_connection(void)
 }
 
 
+/* hand a TLS connection to the handshake threads */
+static void _add_handshake_client(client_queue_t *node)
+{
+    ICECAST_LOG_DDEBUG("Putting client %p in handshake queue.", node->client);
+
+    node->next = NULL;
+    node->handshake_queued = metrics_time();
+    __atomic_add_fetch(&_handshake_clients, 1, __ATOMIC_RELAXED);
+    metrics_gauge_add(METRICS_GAUGE_TLS_HANDSHAKE_QUEUE_DEPTH, 1);
+
+    thread_mutex_lock(&_handshake_lock);
+    *_handshake_queue_tail = node;
+    _handshake_queue_tail = &node->next;
+    thread_cond_signal(&_handshake_cond);
+    thread_mutex_unlock(&_handshake_lock);
+}
+
+/* called by the handshake threads once they are done with a node */
+static void _handshake_client_done(client_queue_t *node, bool ok)
+{
+    metrics_gauge_add(METRICS_GAUGE_TLS_HANDSHAKE_QUEUE_DEPTH, -1);
+
+    if (!ok) {
+        ICECAST_LOG_DEBUG("TLS handshake of client %p failed", node->client);
+        client_destroy(node->client);
+        __atomic_sub_fetch(&_handshake_clients, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    metrics_histogram_observe(METRICS_HISTOGRAM_TLS_HANDSHAKE, metrics_time() - node->handshake_queued);
+    node->tls_ready = 1;
+    node->next = NULL;
+
+    thread_mutex_lock(&_handshake_lock);
+    *_handshake_done_queue_tail = node;
+    _handshake_done_queue_tail = &node->next;
+    thread_mutex_unlock(&_handshake_lock);
+}
+
+/* move clients that completed their handshake back to the request queue */
+static void _take_handshake_clients(void)
+{
+    client_queue_t *node;
+
+    if (!__atomic_load_n(&_handshake_clients, __ATOMIC_RELAXED))
+        return;
+
+    thread_mutex_lock(&_handshake_lock);
+    node = _handshake_done_queue;
+    _handshake_done_queue = NULL;
+    _handshake_done_queue_tail = &_handshake_done_queue;
+    thread_mutex_unlock(&_handshake_lock);
+
+    while (node) {
+        client_queue_t *next = node->next;
+
+        node->next = NULL;
+        _add_request_queue(node);
+        __atomic_sub_fetch(&_handshake_clients, 1, __ATOMIC_RELAXED);
+        node = next;
+    }
+}
+
+/* waits up to timeout ms for any of the sockets to become ready, ready[] is set for those that are */
+static void _handshake_wait(client_queue_t **nodes, const int *want_write, int *ready, size_t count, int timeout)
+{
+    size_t i;
+#ifdef HAVE_POLL
+    struct pollfd ufds[HANDSHAKE_THREAD_CLIENTS];
+
+    for (i = 0; i < count; i++) {
+        ufds[i].fd = nodes[i]->client->con->sock;
+        ufds[i].events = want_write[i] ? POLLOUT : POLLIN;
+        ufds[i].revents = 0;
+    }
+
+    if (poll(ufds, count, timeout) < 0) {
+        for (i = 0; i < count; i++)
+            ready[i] = 0;
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+        ready[i] = ufds[i].revents != 0;
+#else
+    fd_set rfds, wfds;
+    sock_t max = SOCK_ERROR;
+    struct timeval tv;
+    int ret;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    for (i = 0; i < count; i++) {
+        sock_t sock = nodes[i]->client->con->sock;
+
+        FD_SET(sock, want_write[i] ? &wfds : &rfds);
+        if (max == SOCK_ERROR || sock > max)
+            max = sock;
+    }
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    ret = select(max + 1, &rfds, &wfds, NULL, &tv);
+    for (i = 0; i < count; i++) {
+        sock_t sock = nodes[i]->client->con->sock;
+
+        ready[i] = ret > 0 && (FD_ISSET(sock, &rfds) || FD_ISSET(sock, &wfds));
+    }
+#endif
+}
+
+/* Each handshake thread drives the handshakes of up to HANDSHAKE_THREAD_CLIENTS
+ * connections at once and takes new ones from the queue as there is room.
+ */
+static void *_handshake_thread(void *arg)
+{
+    client_queue_t *nodes[HANDSHAKE_THREAD_CLIENTS];
+    int want_write[HANDSHAKE_THREAD_CLIENTS];
+    int ready[HANDSHAKE_THREAD_CLIENTS];
+    size_t count = 0;
+    size_t i;
+
+    (void)arg;
+
+    thread_mutex_lock(&_handshake_lock);
+    while (_handshake_running) {
+        ice_config_t *config;
+        time_t now;
+        int timeout;
+
+        while (_handshake_queue && count < HANDSHAKE_THREAD_CLIENTS) {
+            client_queue_t *node = _handshake_queue;
+
+            _handshake_queue = node->next;
+            if (!_handshake_queue)
+                _handshake_queue_tail = &_handshake_queue;
+            node->next = NULL;
+
+            metrics_histogram_observe(METRICS_HISTOGRAM_TLS_HANDSHAKE_QUEUE, metrics_time() - node->handshake_queued);
+            nodes[count] = node;
+            want_write[count] = 0;
+            ready[count] = 1;
+            count++;
+        }
+
+        if (!count) {
+            thread_cond_timedwait_mutex(&_handshake_cond, &_handshake_lock, 1000);
+            continue;
+        }
+        thread_mutex_unlock(&_handshake_lock);
+
+        config = config_get_config();
+        timeout = config->header_timeout;
+        config_release_config();
+        now = time(NULL);
+
+        for (i = 0; i < count; ) {
+            client_queue_t *node = nodes[i];
+            int ret = 0;
+
+            if (ready[i])
+                ret = tls_handshake(node->client->con->tls, &(want_write[i]));
+
+            if (ret == 0 && node->client->con->con_time + timeout <= now)
+                ret = -1;
+
+            if (ret == 0) {
+                i++;
+                continue;
+            }
+
+            _handshake_client_done(node, ret == 1);
+            count--;
+            nodes[i] = nodes[count];
+            want_write[i] = want_write[count];
+            ready[i] = ready[count];
+        }
+
+        if (count)
+            _handshake_wait(nodes, want_write, ready, count, HANDSHAKE_POLL_INTERVAL);
+
+        thread_mutex_lock(&_handshake_lock);
+    }
+    thread_mutex_unlock(&_handshake_lock);
+
+    for (i = 0; i < count; i++)
+        _handshake_client_done(nodes[i], false);
+
+    return NULL;
+}
+
+static void _handshake_threads_start(ice_config_t *config)
+{
+    size_t i;
+
+    if (config->tls_context.handshake_workers < 1)
+        return;
+
+    _handshake_threads = calloc(config->tls_context.handshake_workers, sizeof(*_handshake_threads));
+    if (!_handshake_threads) {
+        ICECAST_LOG_ERROR("Can not allocate TLS handshake threads, doing handshakes in the request queue.");
+        return;
+    }
+
+    _handshake_running = 1;
+    for (i = 0; i < (size_t)config->tls_context.handshake_workers; i++) {
+        _handshake_threads[i] = thread_create("TLS handshake thread", _handshake_thread, NULL, THREAD_ATTACHED);
+        if (!_handshake_threads[i])
+            break;
+    }
+    _handshake_threads_count = i;
+
+    ICECAST_LOG_DEBUG("Started %zu TLS handshake threads", _handshake_threads_count);
+}
+
+static void _handshake_threads_stop(void)
+{
+    client_queue_t *node;
+    size_t i;
+
+    thread_mutex_lock(&_handshake_lock);
+    _handshake_running = 0;
+    thread_cond_broadcast(&_handshake_cond);
+    thread_mutex_unlock(&_handshake_lock);
+
+    for (i = 0; i < _handshake_threads_count; i++)
+        thread_join(_handshake_threads[i]);
+    free(_handshake_threads);
+    _handshake_threads = NULL;
+    _handshake_threads_count = 0;
+
+    while ((node = _handshake_queue)) {
+        _handshake_queue = node->next;
+        _handshake_client_done(node, false);
+    }
+    _handshake_queue_tail = &_handshake_queue;
+
+    while ((node = _handshake_done_queue)) {
+        _handshake_done_queue = node->next;
+        client_destroy(node->client);
+        __atomic_sub_fetch(&_handshake_clients, 1, __ATOMIC_RELAXED);
+    }
+    _handshake_done_queue_tail = &_handshake_done_queue;
+}
+
 /* run along queue checking for any data that has come in or a timeout */
 static void process_request_queue (void)
 {
@@ -441,6 +899,8 @@ static void process_request_queue (void)
     timeout = config->header_timeout;
     config_release_config();
 
+    _take_handshake_clients();
+
     while (*node_ref) {
         client_queue_t *node = *node_ref;
         client_t *client = node->client;
@@ -449,7 +909,8 @@ static void process_request_queue (void)
 
         ICECAST_LOG_DDEBUG("Checking on client %p", client);
 
-        if (client->con->tlsmode == ICECAST_TLSMODE_AUTO || client->con->tlsmode == ICECAST_TLSMODE_AUTO_NO_PLAIN) {
+        /* only sniff until the first byte arrived, after that we know */
+        if (node->offset == 0 && !client->con->tls && (client->con->tlsmode == ICECAST_TLSMODE_AUTO || client->con->tlsmode == ICECAST_TLSMODE_AUTO_NO_PLAIN)) {
             if (recv(client->con->sock, &peak, 1, MSG_PEEK) == 1) {
                 if (peak == 0x16) { /* TLS Record Protocol Content type 0x16 == Handshake */
                     connection_uses_tls(client->con);
@@ -457,6 +918,19 @@ static void process_request_queue (void)
             }
         }
 
+        if (client->con->tls && !node->tls_ready) {
+            if (tls_handshake_done(client->con->tls) == 1) {
+                /* e.g. a reused keep-alive connection */
+                node->tls_ready = 1;
+            } else if (_handshake_threads_count) {
+                if ((client_queue_t **)_req_queue_tail == &(node->next))
+                    _req_queue_tail = (volatile client_queue_t **)node_ref;
+                *node_ref = node->next;
+                _add_handshake_client(node);
+                continue;
+            }
+        }
+
         if (len > 0) {
             if (client->con->con_time + timeout <= time(NULL)) {
                 len = 0;
@@ -511,6 +985,7 @@ static void process_request_queue (void)
             ICECAST_LOG_DDEBUG("Client %p has buffer: %H", client, client->refbuf->data);
 
             if (pass_it) {
+                metrics_histogram_observe(METRICS_HISTOGRAM_HEADER_WAIT, metrics_time() - client->con->accept_time);
                 if (stream_offset != -1) {
                     connection_read_put_back(client->con, client->refbuf->data + stream_offset, node->offset - stream_offset);
                     node->offset = stream_offset;
@@ -528,7 +1003,6 @@ static void process_request_queue (void)
                     _req_queue_tail = (volatile client_queue_t **)node_ref;
                 *node_ref = node->next;
                 client_destroy(client);
-                free(node);
                 continue;
             }
         }
@@ -639,7 +1113,7 @@ static void _add_request_queue(client_queue_t *node)
 
 static client_queue_t *create_client_node(client_t *client)
 {
-    client_queue_t *node = calloc (1, sizeof (client_queue_t));
+    client_queue_t *node = connection_alloc(client->con, sizeof(client_queue_t));
     const listener_t *listener;
 
     if (!node)
@@ -656,7 +1130,7 @@ static client_queue_t *create_client_node(client_t *client)
         if (listener->tls == ICECAST_TLSMODE_RFC2818 && tls_ok)
             connection_uses_tls(client->con);
         if (listener->shoutcast_mount)
-            node->shoutcast_mount = strdup(listener->shoutcast_mount);
+            node->shoutcast_mount = connection_strdup(client->con, listener->shoutcast_mount);
     }
 
     listensocket_release_listener(client->con->listensocket_effective);
@@ -669,9 +1143,7 @@ void connection_queue(connection_t *con)
     client_queue_t *node;
     client_t *client = NULL;
 
-    global_lock();
     if (client_create(&client, con, NULL) < 0) {
-        global_unlock();
         client_send_error_by_id(client, ICECAST_ERROR_GEN_CLIENT_LIMIT);
         /* don't be too eager as this is an imposed hard limit */
         thread_sleep(400000);
@@ -682,13 +1154,11 @@ void connection_queue(connection_t *con)
     client->refbuf->data[PER_CLIENT_REFBUF_SIZE-1] = '\000';
 
     if (sock_set_blocking(client->con->sock, 0) || sock_set_nodelay(client->con->sock)) {
-        global_unlock();
         ICECAST_LOG_WARN("Failed to set tcp options on client connection, dropping");
         client_destroy(client);
         return;
     }
     node = create_client_node(client);
-    global_unlock();
 
     if (node == NULL) {
         client_destroy(client);
@@ -707,6 +1177,7 @@ void connection_accept_loop(void)
 
     config = config_get_config();
     get_tls_certificate(config);
+    _handshake_threads_start(config);
     config_release_config();
 
     while (global.running == ICECAST_RUNNING) {
@@ -716,13 +1187,15 @@ void connection_accept_loop(void)
             connection_queue(con);
             duration = 5;
         } else {
-            if (_req_queue == NULL)
+            if (_req_queue == NULL && !__atomic_load_n(&_handshake_clients, __ATOMIC_RELAXED))
                 duration = 300; /* use longer timeouts when nothing waiting */
         }
         process_request_queue();
         process_request_body_queue();
     }
 
+    _handshake_threads_stop();
+
     /* Give all the other threads notification to shut down */
     thread_cond_broadcast(&global.shutdown_cond);
 
@@ -964,12 +1437,13 @@ static void _apply_client_proxy_ip(client_t *client)
     }
 
     int len = strcspn(str, ",") + 1;
-    char *ip = malloc(len);
+    char *ip = connection_alloc(client->con, len);
+    if (!ip)
+        return;
     snprintf(ip, len, "%s", str);
 
     ICECAST_LOG_DEBUG("Apply forwarded ip \"%s\" to client \"%s\"", ip, client->con->ip);
 
-    free(client->con->ip);
     client->con->ip = ip;
 }
 
@@ -1021,6 +1495,7 @@ static void _apply_client_proxy_ip(client_t *client)
         /* enable on-demand relay to start, wake up the slave thread */
         ICECAST_LOG_DEBUG("kicking off on-demand relay");
         source->on_demand_req = 1;
+        slave_wakeup();
     }
     ICECAST_LOG_DEBUG("Added client to %s", source->mount);
 }
@@ -1186,15 +1661,13 @@ static void _handle_shoutcast_compatible(client_queue_t *node)
 
         if (ptr == NULL){
             client_destroy(client);
-            free(node->shoutcast_mount);
-            free(node);
             return;
         }
         *ptr = '\0';
 
-        client->password = strdup(client->refbuf->data);
+        client->password = connection_strdup(client->con, client->refbuf->data);
         config = config_get_config();
-        client->username = strdup(config->shoutcast_user);
+        client->username = connection_strdup(client->con, config->shoutcast_user);
         config_release_config();
         node->offset -= (headers - client->refbuf->data);
         memmove(client->refbuf->data, headers, node->offset+1);
@@ -1227,14 +1700,11 @@ static void _handle_shoutcast_compatible(client_queue_t *node)
         client->parser = parser;
         client->protocol = ICECAST_PROTOCOL_SHOUTCAST;
         node->shoutcast = 0;
-        return;
     } else {
         httpp_destroy(parser);
         client_destroy(client);
     }
     free(http_compliant);
-    free(node->shoutcast_mount);
-    free(node);
     return;
 }
 
@@ -1246,20 +1716,21 @@ static int _handle_resources(client_t *client, char **uri)
     const char *http_host = httpp_getvar(client->parser, "host");
     char *serverhost = NULL;
     int   serverport = 0;
+    char  vhost_buffer[256];
     char *vhost = NULL;
-    char *vhost_colon;
     char *new_uri = NULL;
     ice_config_t *config;
     const listener_t *listen_sock;
     resource_t *resource;
 
     if (http_host) {
-        vhost = strdup(http_host);
-        if (vhost) {
-            vhost_colon = strstr(vhost, ":");
-            if (vhost_colon)
-                *vhost_colon = 0;
-        }
+        size_t len = strcspn(http_host, ":");
+        /* no valid host name is that long, make sure it matches no vhost */
+        if (len >= sizeof(vhost_buffer))
+            len = 0;
+        memcpy(vhost_buffer, http_host, len);
+        vhost_buffer[len] = 0;
+        vhost = vhost_buffer;
     }
 
     config = config_get_config();
@@ -1326,9 +1797,8 @@ static int _handle_resources(client_t *client, char **uri)
         }
 
         if (resource->handler) {
-            char *func = strdup(resource->handler);
+            char *func = connection_strdup(client->con, resource->handler);
             if (func) {
-                free(client->handler_function);
                 client->handler_function = func;
             } else {
                 ICECAST_LOG_ERROR("Can not allocate memory.");
@@ -1347,9 +1817,6 @@ static int _handle_resources(client_t *client, char **uri)
         *uri = new_uri;
     }
 
-    if (vhost)
-        free(vhost);
-
     return 0;
 }
 
@@ -1580,7 +2047,7 @@ static void __prepare_shoutcast_admin_cgi_request(client_t *client)
     listensocket_release_listener(client->con->listensocket_effective);
 
     httpp_setvar(client->parser, HTTPP_VAR_PROTOCOL, "ICY");
-    client->password = strdup(pass);
+    client->password = connection_strdup(client->con, pass);
     config_release_config();
     global_unlock();
 }
@@ -1663,6 +2130,8 @@ static void _handle_connection(void)
                 char *uri;
                 const char *upgrade, *connection;
 
+                ICECAST_PROBE3(connection_headers, client->con->id, (int)parser->req_type, parser->uri);
+
                 client->refbuf->len = 0;
 
                 /* early check if we need more data */
@@ -1698,8 +2167,6 @@ static void _handle_connection(void)
                     httpp_set_query_param (client->parser, "mount", node->shoutcast_mount);
 
                 free (node->bodybuffer);
-                free (node->shoutcast_mount);
-                free (node);
 
                 if (strcmp("ICE",  httpp_getvar(parser, HTTPP_VAR_PROTOCOL)) &&
                     strcmp("HTTP", httpp_getvar(parser, HTTPP_VAR_PROTOCOL))) {
@@ -1752,7 +2219,6 @@ static void _handle_connection(void)
 
                 _handle_authentication(client);
             } else {
-                free (node);
                 ICECAST_LOG_ERROR("HTTP request parsing failed");
                 client_destroy (client);
             }
@@ -1826,13 +2292,11 @@ void connection_close(connection_t *con)
     tls_unref(con->tls);
     if (con->sock != SOCK_ERROR)
         sock_close(con->sock);
-    if (con->ip)
-        free(con->ip);
     if (con->readbuffer)
         free(con->readbuffer);
     refobject_unref(con->listensocket_real);
     refobject_unref(con->listensocket_effective);
-    free(con);
+    _connection_block_put(con);
 }
 
 void connection_queue_client(client_t *client)
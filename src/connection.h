@@ -34,6 +34,8 @@ struct connection_tag {
 
     /* Timestamp of client connecting */
     time_t con_time;
+    /* Monotonic timestamp of client connecting in microseconds, see metrics_time() */
+    uint64_t accept_time;
     /* Timestamp of when the client must be disconnected (reached listentime limit) OR 0 for no limit. */
     time_t discon_time;
     /* Bytes sent on this connection */
@@ -64,6 +66,11 @@ struct connection_tag {
 
     /* IP Address of the client as seen by the server */
     char *ip;
+
+    /* Region for data living as long as the connection, see connection_alloc(). */
+    char *arena_ptr;
+    size_t arena_left;
+    void *arena_chunks;
 };
 
 void connection_initialize(void);
@@ -72,7 +79,7 @@ void connection_reread_config(ice_config_t *config);
 void connection_accept_loop(void);
 void connection_setup_sockets(ice_config_t *config);
 void connection_close(connection_t *con);
-connection_t *connection_create(sock_t sock, listensocket_t *listensocket_real, listensocket_t* listensocket_effective, char *ip);
+connection_t *connection_create(sock_t sock, listensocket_t *listensocket_real, listensocket_t* listensocket_effective, const char *ip);
 int connection_complete_source(source_t *source, int response);
 void connection_queue(connection_t *con);
 void connection_queue_client(client_t *client);
@@ -82,6 +89,14 @@ ssize_t connection_send_bytes(connection_t *con, const void *buf, size_t len);
 ssize_t connection_read_bytes(connection_t *con, void *buf, size_t len);
 int connection_read_put_back(connection_t *con, const void *buf, size_t len);
 
+/* Allocates zeroed memory that is freed by connection_close().
+ * The memory must not be passed to free().
+ */
+void *connection_alloc(connection_t *con, size_t len);
+char *connection_strdup(connection_t *con, const char *str);
+/* Returns the number of bytes allocated for the connection, this includes the client */
+size_t connection_memory_usage(connection_t *con);
+
 extern rwlock_t _source_shutdown_rwlock;
 
 #endif  /* __CONNECTION_H__ */
@@ -10,6 +10,11 @@
 #include <config.h>
 #endif
 
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/thread/thread.h"
+
 #include "curl.h"
 #include "cfgfile.h"
 #include "global.h"
@@ -17,6 +22,44 @@
 #include "logging.h"
 #define CATMODULE "curl"
 
+/* number of idle connections kept open by the worker */
+#define ICECAST_CURL_MAX_CONNECTS       64
+/* seconds requests are given to finish on shutdown */
+#define ICECAST_CURL_SHUTDOWN_GRACE     2
+
+typedef struct icecast_curl_request_tag icecast_curl_request_t;
+typedef struct icecast_curl_destination_tag icecast_curl_destination_t;
+
+struct icecast_curl_request_tag {
+    CURL *handle;
+    icecast_curl_destination_t *destination;
+    icecast_curl_done_t done;
+    void *userdata;
+    CURLcode result;
+    icecast_curl_request_t *next;
+};
+
+struct icecast_curl_destination_tag {
+    char *name;
+    size_t limit;
+    size_t running;
+    icecast_curl_request_t *queue;
+    icecast_curl_request_t **queue_tail;
+    icecast_curl_destination_t *next;
+};
+
+/* protects all of the below */
+static mutex_t async_lock;
+static cond_t async_cond;
+static int async_accepting;
+static int async_stop;
+static thread_type *async_thread;
+static CURLM *async_multi;
+static icecast_curl_destination_t *async_destinations;
+/* requests added to the multi handle */
+static icecast_curl_request_t *async_active;
+static size_t async_running;
+
 #ifdef CURLOPT_PASSWDFUNCTION
 /* make sure that prompting at the console does not occur */
 static int my_getpass(void *client, char *prompt, char *buffer, int buflen) {
@@ -89,3 +132,318 @@ int icecast_curl_free(CURL *curl)
     curl_easy_cleanup(curl);
     return 0;
 }
+
+static icecast_curl_destination_t *icecast_curl_destination_get(const char *name)
+{
+    icecast_curl_destination_t *destination;
+
+    for (destination = async_destinations; destination; destination = destination->next) {
+        if (strcmp(destination->name, name) == 0)
+            return destination;
+    }
+
+    destination = calloc(1, sizeof(*destination));
+    if (!destination)
+        return NULL;
+
+    destination->name = strdup(name);
+    if (!destination->name) {
+        free(destination);
+        return NULL;
+    }
+
+    destination->limit = 1;
+    destination->queue_tail = &(destination->queue);
+    destination->next = async_destinations;
+    async_destinations = destination;
+
+    return destination;
+}
+
+/* Frees destinations that have nothing running or queued. */
+static void icecast_curl_destination_cleanup(void)
+{
+    icecast_curl_destination_t **prev = &async_destinations;
+
+    while (*prev) {
+        icecast_curl_destination_t *destination = *prev;
+
+        if (destination->running || destination->queue) {
+            prev = &(destination->next);
+            continue;
+        }
+
+        *prev = destination->next;
+        free(destination->name);
+        free(destination);
+    }
+}
+
+/* Moves queued requests to the multi handle as far as the limits allow. */
+static void icecast_curl_start_queued(void)
+{
+    icecast_curl_destination_t *destination;
+
+    for (destination = async_destinations; destination; destination = destination->next) {
+        while (destination->queue && destination->running < destination->limit) {
+            icecast_curl_request_t *request = destination->queue;
+
+            destination->queue = request->next;
+            if (!destination->queue)
+                destination->queue_tail = &(destination->queue);
+
+            curl_easy_setopt(request->handle, CURLOPT_PRIVATE, request);
+            if (curl_multi_add_handle(async_multi, request->handle) != CURLM_OK) {
+                ICECAST_LOG_ERROR("Can not start request to %#H.", destination->name);
+                /* make sure the callback still gets called */
+                request->result = CURLE_FAILED_INIT;
+                request->next = destination->queue;
+                destination->queue = request;
+                if (!request->next)
+                    destination->queue_tail = &(request->next);
+                break;
+            }
+            request->next = async_active;
+            async_active = request;
+            destination->running++;
+            async_running++;
+        }
+    }
+}
+
+/* Takes all requests out of the queues, as well as requests that failed to start. */
+static icecast_curl_request_t *icecast_curl_take_queued(int all)
+{
+    icecast_curl_destination_t *destination;
+    icecast_curl_request_t *list = NULL;
+    icecast_curl_request_t **tail = &list;
+
+    for (destination = async_destinations; destination; destination = destination->next) {
+        while (destination->queue && (all || destination->queue->result != CURLE_OK)) {
+            icecast_curl_request_t *request = destination->queue;
+
+            destination->queue = request->next;
+            if (!destination->queue)
+                destination->queue_tail = &(destination->queue);
+            if (request->result == CURLE_OK)
+                request->result = CURLE_ABORTED_BY_CALLBACK;
+            request->next = NULL;
+            *tail = request;
+            tail = &(request->next);
+        }
+    }
+
+    return list;
+}
+
+/* Removes a request from the multi handle. The caller must unlink it from async_active. */
+static void icecast_curl_finish(icecast_curl_request_t *request, CURLcode result)
+{
+    curl_multi_remove_handle(async_multi, request->handle);
+    curl_easy_setopt(request->handle, CURLOPT_PRIVATE, NULL);
+    request->result = result;
+    request->destination->running--;
+    async_running--;
+}
+
+/* Calls the callbacks of the requests, must be called without the lock held. */
+static void icecast_curl_complete(icecast_curl_request_t *list)
+{
+    while (list) {
+        icecast_curl_request_t *request = list;
+
+        list = request->next;
+        request->done(request->handle, request->result, request->userdata);
+        free(request);
+    }
+}
+
+static void *icecast_curl_worker(void *arg)
+{
+    time_t deadline = 0;
+
+    (void)arg;
+
+    thread_mutex_lock(&async_lock);
+    while (1) {
+        icecast_curl_request_t *done;
+        icecast_curl_request_t **done_tail;
+        CURLMsg *msg;
+        int running = 0;
+        int left;
+
+        if (async_stop) {
+            if (!deadline)
+                deadline = time(NULL) + ICECAST_CURL_SHUTDOWN_GRACE;
+            if (!async_running && !async_destinations)
+                break;
+            if (time(NULL) >= deadline) {
+                icecast_curl_request_t **tail;
+
+                ICECAST_LOG_WARN("Aborting %zu HTTP requests on shutdown.", async_running);
+                done = async_active;
+                for (tail = &done; *tail; tail = &((*tail)->next))
+                    icecast_curl_finish(*tail, CURLE_ABORTED_BY_CALLBACK);
+                *tail = icecast_curl_take_queued(1);
+                async_active = NULL;
+                icecast_curl_destination_cleanup();
+                thread_mutex_unlock(&async_lock);
+                icecast_curl_complete(done);
+                thread_mutex_lock(&async_lock);
+                break;
+            }
+        }
+
+        icecast_curl_start_queued();
+        done = icecast_curl_take_queued(0);
+        if (done) {
+            thread_mutex_unlock(&async_lock);
+            icecast_curl_complete(done);
+            thread_mutex_lock(&async_lock);
+            icecast_curl_destination_cleanup();
+            continue;
+        }
+
+        if (!async_running) {
+            icecast_curl_destination_cleanup();
+            if (!async_stop)
+                thread_cond_timedwait_mutex(&async_cond, &async_lock, 1000);
+            continue;
+        }
+        thread_mutex_unlock(&async_lock);
+
+        curl_multi_perform(async_multi, &running);
+        if (running) {
+#if LIBCURL_VERSION_NUM >= 0x074400
+            /* can be interrupted by icecast_curl_submit() */
+            curl_multi_poll(async_multi, NULL, 0, 1000, NULL);
+#else
+            /* no way to be woken up, so make sure new requests do not wait too long */
+            curl_multi_wait(async_multi, NULL, 0, 50, NULL);
+#endif
+            curl_multi_perform(async_multi, &running);
+        }
+
+        thread_mutex_lock(&async_lock);
+        done = NULL;
+        done_tail = &done;
+        while ((msg = curl_multi_info_read(async_multi, &left))) {
+            icecast_curl_request_t *request = NULL;
+            icecast_curl_request_t **prev;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&request);
+            if (!request) {
+                ICECAST_LOG_ERROR("Got result for unknown request. BAD.");
+                curl_multi_remove_handle(async_multi, msg->easy_handle);
+                continue;
+            }
+
+            for (prev = &async_active; *prev; prev = &((*prev)->next)) {
+                if (*prev == request) {
+                    *prev = request->next;
+                    break;
+                }
+            }
+
+            /* msg is no longer valid after the handle got removed */
+            icecast_curl_finish(request, msg->data.result);
+            request->next = NULL;
+            *done_tail = request;
+            done_tail = &(request->next);
+        }
+
+        if (done) {
+            thread_mutex_unlock(&async_lock);
+            icecast_curl_complete(done);
+            thread_mutex_lock(&async_lock);
+            icecast_curl_destination_cleanup();
+        }
+    }
+    thread_mutex_unlock(&async_lock);
+
+    return NULL;
+}
+
+void  icecast_curl_async_initialize(void)
+{
+    thread_mutex_create(&async_lock);
+    thread_cond_create(&async_cond);
+
+    async_multi = curl_multi_init();
+    if (!async_multi) {
+        ICECAST_LOG_ERROR("Can not create multi handle, HTTP requests will fail.");
+        return;
+    }
+    curl_multi_setopt(async_multi, CURLMOPT_MAXCONNECTS, (long)ICECAST_CURL_MAX_CONNECTS);
+
+    async_accepting = 1;
+    async_thread = thread_create("HTTP Client Thread", icecast_curl_worker, NULL, THREAD_ATTACHED);
+    if (!async_thread)
+        async_accepting = 0;
+}
+
+void  icecast_curl_async_shutdown(void)
+{
+    if (!async_multi)
+        return;
+
+    thread_mutex_lock(&async_lock);
+    async_accepting = 0;
+    async_stop = 1;
+    thread_cond_broadcast(&async_cond);
+    thread_mutex_unlock(&async_lock);
+
+    if (async_thread) {
+#if LIBCURL_VERSION_NUM >= 0x074400
+        curl_multi_wakeup(async_multi);
+#endif
+        thread_join(async_thread);
+        async_thread = NULL;
+    }
+
+    curl_multi_cleanup(async_multi);
+    async_multi = NULL;
+    thread_cond_destroy(&async_cond);
+    thread_mutex_destroy(&async_lock);
+}
+
+int   icecast_curl_submit(CURL *handle, const char *destination, size_t limit, icecast_curl_done_t done, void *userdata)
+{
+    icecast_curl_request_t *request;
+
+    if (!handle || !destination || !done || !async_multi)
+        return -1;
+
+    request = calloc(1, sizeof(*request));
+    if (!request)
+        return -1;
+
+    request->handle = handle;
+    request->done = done;
+    request->userdata = userdata;
+
+    thread_mutex_lock(&async_lock);
+    if (async_accepting)
+        request->destination = icecast_curl_destination_get(destination);
+    if (!request->destination) {
+        thread_mutex_unlock(&async_lock);
+        free(request);
+        return -1;
+    }
+
+    if (limit)
+        request->destination->limit = limit;
+    *(request->destination->queue_tail) = request;
+    request->destination->queue_tail = &(request->next);
+    thread_cond_signal(&async_cond);
+    thread_mutex_unlock(&async_lock);
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_wakeup(async_multi);
+#endif
+
+    return 0;
+}
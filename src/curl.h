@@ -23,4 +23,30 @@ int   icecast_curl_shutdown(void);
 CURL *icecast_curl_new(const char *url, char * errors);
 int   icecast_curl_free(CURL *curl);
 
+/* Requests submitted with icecast_curl_submit() are performed by a single
+ * worker thread that drives all of them on one multi handle, so connections
+ * are shared and reused between requests to the same server.
+ *
+ * At most limit requests with the same destination are performed at the same
+ * time, the others are queued in the order they were submitted.
+ */
+
+/* Called from the worker thread once the request is done. The handle is
+ * owned by the caller again and may be reused or freed. This must not block.
+ */
+typedef void (*icecast_curl_done_t)(CURL *handle, CURLcode result, void *userdata);
+
+/* start/stop the worker thread.
+ * On shutdown requests still running are given a short time to finish
+ * before they are aborted. Once this returns all callbacks have been called.
+ */
+void  icecast_curl_async_initialize(void);
+void  icecast_curl_async_shutdown(void);
+
+/* Submits a request. CURLOPT_PRIVATE of the handle is used while the request
+ * is running. Returns 0 on success and -1 if the request was not accepted,
+ * in which case done is not called.
+ */
+int   icecast_curl_submit(CURL *handle, const char *destination, size_t limit, icecast_curl_done_t done, void *userdata);
+
 #endif
@@ -24,21 +24,68 @@
 #include "connection.h"
 #include "client.h"
 #include "cfgfile.h"
+#include "metrics.h"
 
 #define CATMODULE "event"
 
-static mutex_t event_lock;
-static event_t *event_queue = NULL;
+/* Events are queued in event_queue by event_emit(). The dispatcher thread
+ * hands them to the matching registrations. Each registration has one or
+ * more lanes, a lane with pending deliveries is put in event_run_queue and
+ * is worked on by one of the worker threads at a time. More workers are
+ * started as lanes become active, up to EVENT_WORKERS_MAX. This way a slow
+ * backend only holds back its own events. Lanes of blocking registrations
+ * leave EVENT_WORKERS_RESERVED workers to the other lanes.
+ */
+#define EVENT_WORKERS                       2
+#define EVENT_WORKERS_MAX                   32
+#define EVENT_WORKERS_RESERVED              1
+/* events waiting for the dispatcher at most */
+#define EVENT_QUEUE_LIMIT                   1024
+#define EVENT_REGISTRATION_QUEUE_LIMIT      128
+
+typedef struct event_delivery_tag event_delivery_t;
+
+struct event_delivery_tag {
+    event_t *event;
+    event_delivery_t *next;
+};
+
+struct event_lane_tag {
+    /* registration the lane belongs to */
+    event_registration_t *er;
+    event_delivery_t *head;
+    event_delivery_t **tail;
+    /* set while in event_run_queue or worked on */
+    int scheduled;
+    /* reference to next element in event_run_queue */
+    event_lane_t *next;
+};
+
+static mutex_t event_lock; // protects event_queue, event_queue_tail, event_queue_len, event_running
+static cond_t event_cond;
+static event_t *event_queue = NULL, **event_queue_tail = &event_queue;
+static size_t event_queue_len = 0;
 static int event_running = 0;
 static thread_type *event_thread = NULL;
 
+static mutex_t event_worker_lock; // protects event_run_queue, event_lanes_active, event_workers* and the delivery members of all registrations
+static cond_t event_worker_cond;
+static event_lane_t *event_run_queue = NULL, **event_run_queue_tail = &event_run_queue;
+/* lanes in event_run_queue or worked on */
+static size_t event_lanes_active = 0;
+static int event_workers_running = 0;
+static thread_type *event_workers[EVENT_WORKERS_MAX];
+static size_t event_workers_count = 0;
+/* workers currently in emit() of a blocking registration */
+static size_t event_workers_blocking = 0;
+
+static void *event_worker_thread (void *arg);
+
 /* work with event_t* */
 static void event_addref(event_t *event) {
     if (!event)
         return;
-    thread_mutex_lock(&event_lock);
-    event->refcount++;
-    thread_mutex_unlock(&event_lock);
+    __atomic_add_fetch(&event->refcount, 1, __ATOMIC_RELAXED);
 }
 
 static void event_release(event_t *event) {
@@ -48,12 +95,8 @@ static void event_release(event_t *event) {
     if (!event)
         return;
 
-    thread_mutex_lock(&event_lock);
-    event->refcount--;
-    if (event->refcount) {
-        thread_mutex_unlock(&event_lock);
+    if (__atomic_sub_fetch(&event->refcount, 1, __ATOMIC_ACQ_REL))
         return;
-    }
 
     for (i = 0; i < (sizeof(event->reglist)/sizeof(*event->reglist)); i++)
         event_registration_release(event->reglist[i]);
@@ -66,31 +109,11 @@ static void event_release(event_t *event) {
     free(event->client_useragent);
     to_free = event->next;
     free(event);
-    thread_mutex_unlock(&event_lock);
 
     if (to_free)
         event_release(to_free);
 }
 
-static void event_push(event_t **event, event_t *next) {
-    size_t i = 0;
-
-    if (!event || !next)
-        return;
-
-    while (*event && i < 128) {
-        event = &(*event)->next;
-        i++;
-    }
-
-    if (i == 128) {
-        ICECAST_LOG_ERROR("Can not push event %p into queue. Queue is full.", event);
-        return;
-    }
-
-    *event = next;
-}
-
 static void event_push_reglist(event_t *event, event_registration_t *reglist) {
     size_t i;
 
@@ -131,23 +154,95 @@ static event_t *event_new(const char *trigger) {
 }
 
 /* subsystem functions */
-static inline void _try_event(event_registration_t *er, event_t *event) {
+static inline size_t _lane_of(event_registration_t *er, event_t *event) {
+    const unsigned char *p = (const unsigned char *)event->uri;
+    uint32_t hash = 2166136261U;
+
+    if (er->concurrency < 2 || !p)
+        return 0;
+
+    /* FNV-1a */
+    for (; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619U;
+    }
+
+    return hash % er->concurrency;
+}
+
+/* must be called with event_worker_lock held */
+static void _start_worker(void) {
+    if (event_workers_count >= EVENT_WORKERS_MAX)
+        return;
+
+    event_workers[event_workers_count] = thread_create("events worker thread", event_worker_thread, NULL, THREAD_ATTACHED);
+    if (event_workers[event_workers_count])
+        event_workers_count++;
+}
+
+static void _queue_delivery(event_registration_t *er, event_t *event) {
     /* er is already locked */
-    if (strcmp(er->trigger, event->trigger) != 0)
+    event_delivery_t *delivery = calloc(1, sizeof(*delivery));
+    event_lane_t *lane;
+    size_t dropped;
+    size_t i;
+
+    if (!delivery) {
+        ICECAST_LOG_ERROR("Can not allocate delivery of event %p.", event);
         return;
+    }
+
+    thread_mutex_lock(&event_worker_lock);
+    if (!er->lanes) {
+        er->lanes = calloc(er->concurrency, sizeof(*er->lanes));
+        for (i = 0; er->lanes && i < er->concurrency; i++) {
+            er->lanes[i].er = er;
+            er->lanes[i].tail = &(er->lanes[i].head);
+        }
+    }
 
-    if (er->emit)
-        er->emit(er->state, event);
+    if (!er->lanes || er->queued >= er->queue_limit) {
+        dropped = ++er->dropped;
+        thread_mutex_unlock(&event_worker_lock);
+        free(delivery);
+        metrics_counter_inc(METRICS_COUNTER_EVENT_DROPPED);
+        /* don't flood the log */
+        if ((dropped & (dropped - 1)) == 0)
+            ICECAST_LOG_WARN("Queue of <event type=%#H trigger=%#H> is full, %zu events dropped so far.", er->type, er->trigger, dropped);
+        return;
+    }
+
+    er->refcount++;
+    event_addref(event);
+    delivery->event = event;
+
+    lane = &(er->lanes[_lane_of(er, event)]);
+    *lane->tail = delivery;
+    lane->tail = &delivery->next;
+    er->queued++;
+    metrics_gauge_add(METRICS_GAUGE_EVENT_QUEUE_DEPTH, 1);
+
+    if (!lane->scheduled) {
+        lane->scheduled = 1;
+        *event_run_queue_tail = lane;
+        event_run_queue_tail = &lane->next;
+        event_lanes_active++;
+        if (event_lanes_active > event_workers_count)
+            _start_worker();
+        thread_cond_signal(&event_worker_cond);
+    }
+    thread_mutex_unlock(&event_worker_lock);
 }
 
-static inline void _try_registrations(event_registration_t *er, event_t *event) {
+static inline void _queue_registrations(event_registration_t *er, event_t *event) {
     if (!er)
         return;
 
     thread_mutex_lock(&er->lock);
     while (1) {
         /* try registration */
-        _try_event(er, event);
+        if (er->emit && strcmp(er->trigger, event->trigger) == 0)
+            _queue_delivery(er, event);
 
        /* go to next registration */
        if (er->next) {
@@ -164,55 +259,140 @@ static inline void _try_registrations(event_registration_t *er, event_t *event)
 }
 
 static void *event_run_thread (void *arg) {
-    int running = 0;
-
     (void)arg;
 
-    do {
+    thread_mutex_lock(&event_lock);
+    while (event_running) {
         event_t *event;
         size_t i;
 
-        thread_mutex_lock(&event_lock);
-        running = event_running;
-        if (event_queue) {
-            event = event_queue;
-            event_queue = event_queue->next;
-            event->next = NULL;
-        } else {
-            event = NULL;
+        if (!event_queue) {
+            thread_cond_timedwait_mutex(&event_cond, &event_lock, 1000);
+            continue;
         }
+
+        event = event_queue;
+        event_queue = event->next;
+        if (!event_queue)
+            event_queue_tail = &event_queue;
+        event->next = NULL;
+        event_queue_len--;
         thread_mutex_unlock(&event_lock);
 
-        /* sleep if nothing todo and then try again */
-        if (!event) {
-            thread_sleep(150000);
-            continue;
-        }
+        metrics_gauge_add(METRICS_GAUGE_EVENT_QUEUE_DEPTH, -1);
 
         for (i = 0; i < (sizeof(event->reglist)/sizeof(*event->reglist)); i++)
-            _try_registrations(event->reglist[i], event);
+            _queue_registrations(event->reglist[i], event);
 
         event_release(event);
-    } while (running);
+
+        thread_mutex_lock(&event_lock);
+    }
+    thread_mutex_unlock(&event_lock);
+
+    return NULL;
+}
+
+static void *event_worker_thread (void *arg) {
+    (void)arg;
+
+    thread_mutex_lock(&event_worker_lock);
+    while (event_workers_running) {
+        event_lane_t **link = &event_run_queue;
+        event_lane_t *lane;
+        event_delivery_t *delivery;
+        event_registration_t *er;
+        int blocking;
+
+        /* skip blocking lanes if they would take the reserved workers */
+        if (event_workers_blocking >= (EVENT_WORKERS_MAX - EVENT_WORKERS_RESERVED)) {
+            while (*link && (*link)->er->blocking)
+                link = &((*link)->next);
+        }
+
+        lane = *link;
+        if (!lane) {
+            thread_cond_timedwait_mutex(&event_worker_cond, &event_worker_lock, 1000);
+            continue;
+        }
+
+        *link = lane->next;
+        if (!*link)
+            event_run_queue_tail = link;
+        lane->next = NULL;
+
+        delivery = lane->head;
+        lane->head = delivery->next;
+        if (!lane->head)
+            lane->tail = &lane->head;
+        er = lane->er;
+        er->queued--;
+        blocking = er->blocking;
+        if (blocking)
+            event_workers_blocking++;
+        thread_mutex_unlock(&event_worker_lock);
+
+        metrics_gauge_add(METRICS_GAUGE_EVENT_QUEUE_DEPTH, -1);
+        metrics_histogram_observe(METRICS_HISTOGRAM_EVENT_QUEUE, metrics_time() - delivery->event->emitted);
+
+        er->emit(er->state, delivery->event);
+
+        thread_mutex_lock(&event_worker_lock);
+        if (blocking) {
+            event_workers_blocking--;
+            /* idle workers may have skipped blocking lanes */
+            thread_cond_signal(&event_worker_cond);
+        }
+        if (lane->head) {
+            /* go to the end of the line so other lanes get their turn */
+            *event_run_queue_tail = lane;
+            event_run_queue_tail = &lane->next;
+        } else {
+            lane->scheduled = 0;
+            event_lanes_active--;
+        }
+        thread_mutex_unlock(&event_worker_lock);
+
+        /* lane must not be used after this as er may go away */
+        event_release(delivery->event);
+        event_registration_release(er);
+        free(delivery);
+
+        thread_mutex_lock(&event_worker_lock);
+    }
+    thread_mutex_unlock(&event_worker_lock);
 
     return NULL;
 }
 
 void event_initialise(void) {
+    size_t i;
+
     /* create mutex */
     thread_mutex_create(&event_lock);
+    thread_cond_create(&event_cond);
+    thread_mutex_create(&event_worker_lock);
+    thread_cond_create(&event_worker_cond);
 
     /* initialise everything */
     thread_mutex_lock(&event_lock);
     event_running = 1;
     thread_mutex_unlock(&event_lock);
 
-    /* start thread */
+    /* start threads */
+    thread_mutex_lock(&event_worker_lock);
+    event_workers_running = 1;
+    for (i = 0; i < EVENT_WORKERS; i++)
+        _start_worker();
+    thread_mutex_unlock(&event_worker_lock);
+
     event_thread = thread_create("events thread", event_run_thread, NULL, THREAD_ATTACHED);
 }
 
 void event_shutdown(void) {
     event_t *event_queue_to_free = NULL;
+    event_lane_t *lane;
+    size_t i;
 
     /* stop thread */
     if (!event_running)
@@ -220,21 +400,76 @@ void event_shutdown(void) {
 
     thread_mutex_lock(&event_lock);
     event_running = 0;
+    thread_cond_broadcast(&event_cond);
     thread_mutex_unlock(&event_lock);
 
     /* join thread as soon as it stopped */
     thread_join(event_thread);
 
+    thread_mutex_lock(&event_worker_lock);
+    event_workers_running = 0;
+    thread_cond_broadcast(&event_worker_cond);
+    thread_mutex_unlock(&event_worker_lock);
+
+    /* no new workers are started from here on as the dispatcher is gone */
+    for (i = 0; i < event_workers_count; i++) {
+        thread_join(event_workers[i]);
+        event_workers[i] = NULL;
+    }
+    event_workers_count = 0;
+
     /* shutdown everything */
     thread_mutex_lock(&event_lock);
     event_thread = NULL;
     event_queue_to_free = event_queue;
     event_queue = NULL;
+    event_queue_tail = &event_queue;
+    metrics_gauge_add(METRICS_GAUGE_EVENT_QUEUE_DEPTH, -(int64_t)event_queue_len);
+    event_queue_len = 0;
     thread_mutex_unlock(&event_lock);
 
     event_release(event_queue_to_free);
 
+    /* drop what is left for the registrations */
+    thread_mutex_lock(&event_worker_lock);
+    lane = event_run_queue;
+    event_run_queue = NULL;
+    event_run_queue_tail = &event_run_queue;
+    event_lanes_active = 0;
+    thread_mutex_unlock(&event_worker_lock);
+
+    while (lane) {
+        event_lane_t *next = lane->next;
+        event_registration_t *er = lane->er;
+        event_delivery_t *delivery = lane->head;
+        size_t count = 0;
+
+        lane->head = NULL;
+        lane->tail = &lane->head;
+        lane->scheduled = 0;
+        lane->next = NULL;
+
+        while (delivery) {
+            event_delivery_t *to_free = delivery;
+
+            delivery = delivery->next;
+            event_release(to_free->event);
+            free(to_free);
+            count++;
+        }
+
+        er->queued -= count;
+        metrics_gauge_add(METRICS_GAUGE_EVENT_QUEUE_DEPTH, -(int64_t)count);
+        while (count--)
+            event_registration_release(er);
+
+        lane = next;
+    }
+
     /* destry mutex */
+    thread_cond_destroy(&event_worker_cond);
+    thread_mutex_destroy(&event_worker_lock);
+    thread_cond_destroy(&event_cond);
     thread_mutex_destroy(&event_lock);
 }
 
@@ -249,6 +484,8 @@ event_registration_t * event_new_from_xml_node(xmlNodePtr node) {
         return NULL;
 
     ret->refcount = 1;
+    ret->concurrency = 1;
+    ret->queue_limit = EVENT_REGISTRATION_QUEUE_LIMIT;
 
     /* BEFORE RELEASE 2.5.0 DOCUMENT: Document <event type="..." trigger="..."> */
     ret->type     = (char*)xmlGetProp(node, XMLSTR("type"));
@@ -312,6 +549,8 @@ void event_registration_release(event_registration_t *er) {
     if (er->free)
         er->free(er->state);
 
+    free(er->lanes);
+
     thread_mutex_unlock(&er->lock);
     thread_mutex_destroy(&er->lock);
     free(er);
@@ -350,9 +589,23 @@ void event_registration_push(event_registration_t **er, event_registration_t *ta
 /* event signaling */
 void event_emit(event_t *event) {
     fastevent_emit(FASTEVENT_TYPE_SLOWEVENT, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_EVENT, event);
-    event_addref(event);
+
+    event->emitted = metrics_time();
+
     thread_mutex_lock(&event_lock);
-    event_push(&event_queue, event);
+    if (event_queue_len >= EVENT_QUEUE_LIMIT) {
+        thread_mutex_unlock(&event_lock);
+        metrics_counter_inc(METRICS_COUNTER_EVENT_DROPPED);
+        ICECAST_LOG_ERROR("Can not push event %p into queue. Queue is full.", event);
+        return;
+    }
+
+    event_addref(event);
+    *event_queue_tail = event;
+    event_queue_tail = &event->next;
+    event_queue_len++;
+    metrics_gauge_add(METRICS_GAUGE_EVENT_QUEUE_DEPTH, 1);
+    thread_cond_signal(&event_cond);
     thread_mutex_unlock(&event_lock);
 }
 
@@ -13,6 +13,8 @@
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
+#include <stdint.h>
+
 #include "common/thread/thread.h"
 
 #include "icecasttypes.h"
@@ -30,12 +32,20 @@ typedef struct event_registration_tag event_registration_t;
 
 struct event_tag;
 typedef struct event_tag event_t;
+
+/* per key delivery queue of a registration, see event.c */
+struct event_lane_tag;
+typedef struct event_lane_tag event_lane_t;
+
 /* this has no lock member to protect multiple accesses as every non-readonly access is within event.c
  * and is protected by global lock or on the same thread anyway.
+ * The reference counter is updated atomically.
  */
 struct event_tag {
     /* refernece counter */
     size_t refcount;
+    /* when the event was emitted, see metrics_time() */
+    uint64_t emitted;
     /* reference to next element in chain */
     event_t *next;
 
@@ -82,6 +92,26 @@ struct event_registration_tag {
 
     /* free backend state */
     void (*free)(void *state);
+
+    /* Delivery, protected by the event worker lock in event.c.
+     * Events are delivered in the order they were emitted per lane and
+     * events with the same URI always use the same lane. Lanes are
+     * delivered to in parallel. The backend may change concurrency and
+     * queue_limit when it is set up.
+     */
+    /* number of lanes, defaults to 1 */
+    size_t concurrency;
+    /* events waiting for delivery at most, further ones are dropped */
+    size_t queue_limit;
+    /* events currently waiting for delivery */
+    size_t queued;
+    /* events dropped as the queue was full */
+    size_t dropped;
+    /* set if emit may block for long, e.g. while waiting for a script.
+     * Lanes of such registrations never take the last free worker.
+     */
+    int blocking;
+    event_lane_t *lanes;
 };
 
 /* subsystem functions */
@@ -14,18 +14,38 @@
 #include <errno.h>
 
 #ifndef _WIN32
+#include <unistd.h>
+#include <signal.h>
 #include <sys/wait.h>
-/* for __setup_empty_script_environment() */
+/* for __spawn() */
 #include <sys/stat.h>
 #include <fcntl.h>
+#if defined(HAVE_POSIX_SPAWN) && defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+#include <spawn.h>
+#define EVENT_EXEC_USE_POSIX_SPAWN
 #endif
+#endif
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
 
 #include "event.h"
 #include "global.h"
 #include "source.h"
+#include "util.h"
 #include "logging.h"
 #define CATMODULE "event_exec"
 
+/* scripts running at the same time per registration */
+#define EVENT_EXEC_DEFAULT_CONCURRENCY  4
+#define EVENT_EXEC_MAX_CONCURRENCY      32
+/* seconds a script may run before it is terminated */
+#define EVENT_EXEC_DEFAULT_TIMEOUT      60
+/* seconds a script may still run once we are shutting down */
+#define EVENT_EXEC_SHUTDOWN_TIMEOUT     2
+/* seconds between SIGTERM and SIGKILL */
+#define EVENT_EXEC_KILL_DELAY           2
+
 typedef enum event_exec_argvtype_tag {
     ARGVTYPE_NO_DEFAULTS = 0,
     ARGVTYPE_ONLY_URI,
@@ -42,8 +62,12 @@ typedef struct event_exec {
     /* what to add to argv[] */
     event_exec_argvtype_t argvtype;
 
-    /* actual argv[] */
+    /* actual argv[], the first entries are filled in per event by __setup_argv() */
     char **argv;
+    size_t argc;
+
+    /* seconds a script may run, 0 for no limit */
+    unsigned int timeout;
 } event_exec_t;
 
 /* OS independed code: */
@@ -78,102 +102,217 @@ static inline event_exec_argvtype_t __str2argvtype(const char *str) {
     }
 }
 
-static inline char **__setup_argv(event_exec_t *self, event_t *event) {
-    self->argv[0] = self->executable;
+static inline char **__setup_argv(event_exec_t *self, event_t *event, char **argv) {
+    memcpy(argv, self->argv, self->argc * sizeof(char*));
+    argv[self->argc] = NULL;
+    argv[0] = self->executable;
 
     switch (self->argvtype) {
         case ARGVTYPE_NO_DEFAULTS:
             /* nothing to do */
         break;
         case ARGVTYPE_URI_AND_TRIGGER:
-            self->argv[2] = event->trigger ? event->trigger : "";
+            argv[2] = event->trigger ? event->trigger : "";
         /* fall through */
         case ARGVTYPE_ONLY_URI:
-            self->argv[1] = event->uri ? event->uri : "";
+            argv[1] = event->uri ? event->uri : "";
         break;
         case ARGVTYPE_LEGACY:
             /* This mode is similar to ARGVTYPE_ONLY_URI
              * but if URI is unknown the parameter is skipped!
              */
             if (event->uri) {
-                self->argv[1] = event->uri;
+                argv[1] = event->uri;
             } else {
-                self->argv[1] = self->executable;
-                return &self->argv[1];
+                argv[1] = self->executable;
+                return &argv[1];
             }
         break;
     }
 
-    return self->argv;
+    return argv;
 }
 
 /* OS depended code: */
 #ifdef _WIN32
 /* TODO #2101: Implement script executing on win* */
 #else
+/* environment of the script, all entries are allocated */
+typedef struct {
+    char **envp;
+    size_t len;
+    size_t size;
+} event_exec_environ_t;
+
+extern char **environ;
+
+static void __append_environ(event_exec_environ_t *env, char *entry) {
+    if (!entry)
+        return;
+
+    /* keep room for the terminating NULL */
+    if ((env->len + 1) >= env->size) {
+        size_t size = env->size ? env->size * 2 : 64;
+        char **n = realloc(env->envp, size * sizeof(char*));
+
+        if (!n) {
+            free(entry);
+            return;
+        }
+
+        env->envp = n;
+        env->size = size;
+    }
+
+    env->envp[env->len++] = entry;
+    env->envp[env->len] = NULL;
+}
+
 /* this sets up the new environment for script execution.
  * We ignore most failtures as we can not handle them anyway.
  */
-#ifdef HAVE_SETENV
-static inline void __update_environ(const char *name, const char *value) {
+static void __update_environ(event_exec_environ_t *env, const char *name, const char *value) {
+    size_t namelen;
+    size_t len;
+    size_t i;
+    char *entry;
+
     if (!name || !value) return;
-    setenv(name, value, 1);
+
+    namelen = strlen(name);
+    len = namelen + strlen(value) + 2;
+    entry = malloc(len);
+    if (!entry)
+        return;
+    snprintf(entry, len, "%s=%s", name, value);
+
+    for (i = 0; i < env->len; i++) {
+        if (strncmp(env->envp[i], name, namelen) == 0 && env->envp[i][namelen] == '=') {
+            free(env->envp[i]);
+            env->envp[i] = entry;
+            return;
+        }
+    }
+
+    __append_environ(env, entry);
 }
-#else
-#define __update_environ(x,y)
-#endif
-static inline void __setup_environ(ice_config_t *config, event_exec_t *self, event_t *event) {
+
+static void __free_environ(event_exec_environ_t *env) {
+    size_t i;
+
+    for (i = 0; i < env->len; i++)
+        free(env->envp[i]);
+    free(env->envp);
+}
+
+static inline void __setup_environ(ice_config_t *config, event_exec_environ_t *env, event_t *event) {
     mount_proxy *mountinfo;
     source_t *source;
     char buf[80];
+    size_t i;
+
+    for (i = 0; environ && environ[i]; i++)
+        __append_environ(env, strdup(environ[i]));
 
     /* BEFORE RELEASE 2.5.0 DOCUMENT: Document all those env vars. */
-    __update_environ("ICECAST_VERSION",   ICECAST_VERSION_STRING);
-    __update_environ("ICECAST_HOSTNAME",  config->hostname);
-    __update_environ("ICECAST_ADMIN",     config->admin);
-    __update_environ("ICECAST_LOGDIR",    config->log_dir);
-    __update_environ("EVENT_URI",         event->uri);
-    __update_environ("EVENT_TRIGGER",     event->trigger); /* new name */
-    __update_environ("SOURCE_ACTION",     event->trigger); /* old name (deprecated) */
-    __update_environ("CLIENT_IP",         event->connection_ip);
-    __update_environ("CLIENT_ROLE",       event->client_role);
-    __update_environ("CLIENT_USERNAME",   event->client_username);
-    __update_environ("CLIENT_USERAGENT",  event->client_useragent);
+    __update_environ(env, "ICECAST_VERSION",   ICECAST_VERSION_STRING);
+    __update_environ(env, "ICECAST_HOSTNAME",  config->hostname);
+    __update_environ(env, "ICECAST_ADMIN",     config->admin);
+    __update_environ(env, "ICECAST_LOGDIR",    config->log_dir);
+    __update_environ(env, "EVENT_URI",         event->uri);
+    __update_environ(env, "EVENT_TRIGGER",     event->trigger); /* new name */
+    __update_environ(env, "SOURCE_ACTION",     event->trigger); /* old name (deprecated) */
+    __update_environ(env, "CLIENT_IP",         event->connection_ip);
+    __update_environ(env, "CLIENT_ROLE",       event->client_role);
+    __update_environ(env, "CLIENT_USERNAME",   event->client_username);
+    __update_environ(env, "CLIENT_USERAGENT",  event->client_useragent);
 
     snprintf(buf, sizeof(buf), "%lu", event->connection_id);
-    __update_environ("CLIENT_ID",         buf);
+    __update_environ(env, "CLIENT_ID",         buf);
     snprintf(buf, sizeof(buf), "%lli", (long long int)event->connection_time);
-    __update_environ("CLIENT_CONNECTION_TIME", buf);
+    __update_environ(env, "CLIENT_CONNECTION_TIME", buf);
     snprintf(buf, sizeof(buf), "%i", event->client_admin_command);
-    __update_environ("CLIENT_ADMIN_COMMAND", buf);
+    __update_environ(env, "CLIENT_ADMIN_COMMAND", buf);
 
     mountinfo = config_find_mount(config, event->uri, MOUNT_TYPE_NORMAL);
     if (mountinfo) {
-        __update_environ("MOUNT_NAME",        mountinfo->stream_name);
-        __update_environ("MOUNT_DESCRIPTION", mountinfo->stream_description);
-        __update_environ("MOUNT_URL",         mountinfo->stream_url);
-        __update_environ("MOUNT_GENRE",       mountinfo->stream_genre);
+        __update_environ(env, "MOUNT_NAME",        mountinfo->stream_name);
+        __update_environ(env, "MOUNT_DESCRIPTION", mountinfo->stream_description);
+        __update_environ(env, "MOUNT_URL",         mountinfo->stream_url);
+        __update_environ(env, "MOUNT_GENRE",       mountinfo->stream_genre);
     }
 
     avl_tree_rlock(global.source_tree);
     source = source_find_mount(event->uri);
     if (source) {
-        __update_environ("SOURCE_MOUNTPOINT", source->mount);
-        __update_environ("SOURCE_PUBLIC",     source->yp_public ? "true" : "false");
-        __update_environ("SROUCE_HIDDEN",     source->hidden    ? "true" : "false");
+        __update_environ(env, "SOURCE_MOUNTPOINT", source->mount);
+        __update_environ(env, "SOURCE_PUBLIC",     source->yp_public ? "true" : "false");
+        __update_environ(env, "SROUCE_HIDDEN",     source->hidden    ? "true" : "false");
     }
     avl_tree_unlock(global.source_tree);
 }
 
-static inline void __setup_file_descriptors(ice_config_t *config) {
+#ifdef EVENT_EXEC_USE_POSIX_SPAWN
+/* posix_spawn() does not copy the address space of the server, which is
+ * expensive for a large process with many threads.
+ */
+static pid_t __spawn(const char *executable, char **argv, char **envp, const char *null_device) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    pid_t pid;
+    int err;
+
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        return -1;
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    /* attach null device to stdin, stdout and stderr and close everything else */
+    if (null_device) {
+        posix_spawn_file_actions_addopen(&actions, 0, null_device, O_RDWR, 0);
+        posix_spawn_file_actions_adddup2(&actions, 0, 1);
+        posix_spawn_file_actions_adddup2(&actions, 0, 2);
+        posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+    } else {
+        posix_spawn_file_actions_addclosefrom_np(&actions, 0);
+    }
+
+    /* our threads block most signals and we ignore SIGPIPE, don't pass that on */
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    sigaddset(&sigs, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF);
+
+    err = posix_spawn(&pid, executable, &actions, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0) {
+        ICECAST_LOG_ERROR("Unable to run command %s (%s)", executable, strerror(err));
+        return -1;
+    }
+
+    return pid;
+}
+#else
+static inline void __setup_file_descriptors(const char *null_device) {
     int i;
 
     /* close at least the first 1024 handles */
     for (i = 0; i < 1024; i++)
         close(i);
 
+    if (!null_device)
+        return;
+
     /* open null device */
-    i = open(config->null_device, O_RDWR);
+    i = open(null_device, O_RDWR);
     if (i != -1) {
         /* attach null device to stdin, stdout and stderr */
         if (i != 0)
@@ -189,48 +328,123 @@ static inline void __setup_file_descriptors(ice_config_t *config) {
     }
 }
 
-static inline void __setup_empty_script_environment(event_exec_t *self, event_t *event) {
-    ice_config_t *config = config_get_config();
+static pid_t __spawn(const char *executable, char **argv, char **envp, const char *null_device) {
+    pid_t pid = fork();
 
-    __setup_file_descriptors(config);
-    __setup_environ(config, self, event);
+    switch (pid) {
+        case -1:
+            ICECAST_LOG_ERROR("Unable to fork %s (%s)", executable, strerror(errno));
+        break;
+        case 0: /* child */
+            __setup_file_descriptors(null_device);
+            execve(executable, argv, envp);
+            _exit(1);
+        break;
+    }
 
-    config_release_config();
+    return pid;
 }
+#endif
 
-static void _run_script (event_exec_t *self, event_t *event) {
-    pid_t pid, external_pid;
-
-    /* do a fork twice so that the command has init as parent */
-    external_pid = fork();
-    switch (external_pid)
-    {
-        case 0:
-            switch (pid = fork ())
-            {
-                case -1:
-                    ICECAST_LOG_ERROR("Unable to fork %s (%s)", self->executable, strerror (errno));
-                    break;
-                case 0:  /* child */
-                    if (access(self->executable, R_OK|X_OK) != 0) {
-                        ICECAST_LOG_ERROR("Unable to run command %s (%s)", self->executable, strerror(errno));
-                        exit(1);
-                    }
-                    ICECAST_LOG_DEBUG("Starting command %s", self->executable);
-                    __setup_empty_script_environment(self, event);
-                    execv(self->executable, __setup_argv(self, event));
-                    exit(1);
-                default: /* parent */
-                    break;
+/* Waits for the script to exit. It is terminated if it runs longer than the
+ * timeout of the registration or if we are shutting down.
+ * Returns the result of the last waitpid().
+ */
+static pid_t __wait_script(event_exec_t *self, pid_t pid, int *status) {
+    uint64_t start = timing_get_time();
+    uint64_t deadline = self->timeout ? start + (uint64_t)self->timeout * 1000 : 0;
+    uint64_t killed = 0;
+    unsigned int delay = 1000;
+    pid_t ret;
+
+    while (1) {
+        uint64_t now;
+
+        ret = waitpid(pid, status, WNOHANG);
+        if (ret != 0 && !(ret == -1 && errno == EINTR))
+            return ret;
+
+        now = timing_get_time();
+        if (global.running != ICECAST_RUNNING && (!deadline || deadline > (now + EVENT_EXEC_SHUTDOWN_TIMEOUT * 1000)))
+            deadline = now + EVENT_EXEC_SHUTDOWN_TIMEOUT * 1000;
+
+        if (killed) {
+            if (now >= (killed + EVENT_EXEC_KILL_DELAY * 1000)) {
+                ICECAST_LOG_WARN("Command %s did not exit after SIGTERM, killing it", self->executable);
+                kill(pid, SIGKILL);
+                do {
+                    ret = waitpid(pid, status, 0);
+                } while (ret == -1 && errno == EINTR);
+                return ret;
             }
-            exit (0);
-        case -1:
-            ICECAST_LOG_ERROR("Unable to fork %s", strerror (errno));
-            break;
-        default: /* parent */
-            waitpid (external_pid, NULL, 0);
-            break;
+        } else if (deadline && now >= deadline) {
+            if (global.running == ICECAST_RUNNING) {
+                ICECAST_LOG_WARN("Command %s is running for too long, terminating it", self->executable);
+            } else {
+                ICECAST_LOG_WARN("Command %s is still running on shutdown, terminating it", self->executable);
+            }
+            kill(pid, SIGTERM);
+            killed = now;
+        }
+
+        /* most scripts are quick, so start with short sleeps */
+        thread_sleep(delay);
+        if (delay < 100000)
+            delay *= 2;
+    }
+}
+
+/* Runs the script and waits for it, so the number of scripts running is limited by the concurrency of the registration. */
+static void _run_script (event_exec_t *self, event_t *event) {
+    event_exec_environ_t env = {NULL, 0, 0};
+    ice_config_t *config;
+    char *null_device;
+    char **argv;
+    pid_t pid;
+    pid_t ret;
+    int status;
+
+    if (access(self->executable, R_OK|X_OK) != 0) {
+        ICECAST_LOG_ERROR("Unable to run command %s (%s)", self->executable, strerror(errno));
+        return;
     }
+
+    argv = calloc(self->argc + 1, sizeof(char*));
+    if (!argv) {
+        ICECAST_LOG_ERROR("Can not allocate argv[]");
+        return;
+    }
+
+    config = config_get_config();
+    __setup_environ(config, &env, event);
+    null_device = config->null_device ? strdup(config->null_device) : NULL;
+    config_release_config();
+
+    ICECAST_LOG_DEBUG("Starting command %s", self->executable);
+    if (env.envp) {
+        pid = __spawn(self->executable, __setup_argv(self, event, argv), env.envp, null_device);
+    } else {
+        char *empty[] = {NULL};
+        pid = __spawn(self->executable, __setup_argv(self, event, argv), empty, null_device);
+    }
+
+    if (pid != -1) {
+        ret = __wait_script(self, pid, &status);
+
+        if (ret != pid) {
+            ICECAST_LOG_ERROR("Can not wait for command %s (%s)", self->executable, strerror(errno));
+        } else if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            ICECAST_LOG_DEBUG("Command %s finished", self->executable);
+        } else if (WIFEXITED(status)) {
+            ICECAST_LOG_WARN("Command %s exited with status %i", self->executable, WEXITSTATUS(status));
+        } else if (WIFSIGNALED(status)) {
+            ICECAST_LOG_WARN("Command %s was terminated by signal %i", self->executable, WTERMSIG(status));
+        }
+    }
+
+    free(null_device);
+    __free_environ(&env);
+    free(argv);
 }
 #endif
 
@@ -266,6 +480,10 @@ int event_get_exec(event_registration_t *er, config_options_t *options) {
         return -1;
 
     self->argvtype = ARGVTYPE_DFAULT;
+    self->timeout = EVENT_EXEC_DEFAULT_TIMEOUT;
+    er->concurrency = EVENT_EXEC_DEFAULT_CONCURRENCY;
+    /* the workers wait for the scripts */
+    er->blocking = 1;
 
     if ((cur = options)) {
         do {
@@ -273,11 +491,26 @@ int event_get_exec(event_registration_t *er, config_options_t *options) {
                 /* BEFORE RELEASE 2.5.0 DOCUMENT: Document supported options:
                  * <option name="executable" value="..." />
                  * <option name="default_arguments" value="..." /> (for values see near top of documment)
+                 * <option name="concurrency" value="..." /> (number of scripts running at the same time)
+                 * <option name="queue_size" value="..." /> (number of events waiting for a script at most)
+                 * <option name="timeout" value="..." /> (seconds a script may run, 0 for no limit)
                  */
                 if (strcmp(cur->name, "executable") == 0) {
                     util_replace_string(&(self->executable), cur->value);
                 } else if (strcmp(cur->name, "default_arguments") == 0) {
                     self->argvtype = __str2argvtype(cur->value);
+                } else if (strcmp(cur->name, "concurrency") == 0) {
+                    er->concurrency = util_str_to_unsigned_int(cur->value, EVENT_EXEC_DEFAULT_CONCURRENCY);
+                    if (er->concurrency < 1)
+                        er->concurrency = 1;
+                    if (er->concurrency > EVENT_EXEC_MAX_CONCURRENCY)
+                        er->concurrency = EVENT_EXEC_MAX_CONCURRENCY;
+                } else if (strcmp(cur->name, "timeout") == 0) {
+                    self->timeout = util_str_to_unsigned_int(cur->value, EVENT_EXEC_DEFAULT_TIMEOUT);
+                } else if (strcmp(cur->name, "queue_size") == 0) {
+                    er->queue_limit = util_str_to_unsigned_int(cur->value, er->queue_limit);
+                    if (er->queue_limit < 1)
+                        er->queue_limit = 1;
                 } else {
                     ICECAST_LOG_ERROR("Unknown <option> tag with name %s.", cur->name);
                 }
@@ -329,6 +562,8 @@ int event_get_exec(event_registration_t *er, config_options_t *options) {
         } while ((cur = cur->next));
     }
 
+    self->argc = extra_argc;
+
     er->state = self;
     er->emit = event_exec_emit;
     er->free = event_exec_free;
@@ -12,21 +12,58 @@
 
 #include <string.h>
 
+#include "common/thread/thread.h"
+
 #include "curl.h"
 #include "event.h"
+#include "json.h"
 #include "cfgfile.h"
 #include "util.h"
 #include "logging.h"
 #define CATMODULE "event_url"
 
 
-typedef struct event_url {
+/* default number of requests running at the same time */
+#define EVENT_URL_DEFAULT_CONCURRENCY   2
+/* events kept while the server does not keep up, older ones are dropped */
+#define EVENT_URL_MAX_PENDING           4096
+
+typedef struct event_url_item event_url_item_t;
+typedef struct event_url_request event_url_request_t;
+typedef struct event_url event_url_t;
+
+struct event_url_item {
+    char *body;
+    event_url_item_t *next;
+};
+
+struct event_url_request {
+    event_url_t *self;
+    CURL *handle;
+    struct curl_slist *headers;
+    char errormsg[CURL_ERROR_SIZE];
+};
+
+struct event_url {
     char *url;
     char *action;
     char *userpwd;
-    CURL *handle;
-    char errormsg[CURL_ERROR_SIZE];
-} event_url_t;
+    size_t concurrency;
+    /* maximum number of events sent in one request, JSON is used if > 1 */
+    size_t batch;
+
+    /* protects all of the below */
+    mutex_t lock;
+    /* one for the registration and one for each running request */
+    size_t refcount;
+    size_t running;
+    event_url_item_t *pending;
+    event_url_item_t **pending_tail;
+    size_t pending_len;
+    size_t dropped;
+};
+
+static void event_url_flush(event_url_t *self);
 
 static size_t handle_returned (void *ptr, size_t size, size_t nmemb, void *stream) {
     (void)ptr, (void)stream;
@@ -40,11 +77,10 @@ static inline char *__escape(const char *src, const char *default_value) {
     return strdup(default_value);
 }
 
-static int event_url_emit(void *state, event_t *event) {
-    event_url_t *self = state;
+static char *event_url_format_form(event_url_t *self, event_t *event, time_t duration)
+{
     ice_config_t *config;
     char *action, *mount, *server, *role, *username, *ip, *agent;
-    time_t duration;
     char post[4096];
 
     action   = util_url_escape(self->action ? self->action : event->trigger);
@@ -54,12 +90,6 @@ static int event_url_emit(void *state, event_t *event) {
     ip       = __escape(event->connection_ip, "");
     agent    = __escape(event->client_useragent, "-");
 
-    if (event->connection_time) {
-        duration = time(NULL) - event->connection_time;
-    } else {
-        duration = 0;
-    }
-
     config = config_get_config();
     server   = __escape(config->hostname, "");
 
@@ -77,28 +107,257 @@ static int event_url_emit(void *state, event_t *event) {
     free(ip);
     free(agent);
 
-    if (strchr(self->url, '@') == NULL && self->userpwd) {
-        curl_easy_setopt(self->handle, CURLOPT_USERPWD, self->userpwd);
+    return strdup(post);
+}
+
+static inline void event_url_write_string(json_renderer_t *renderer, const char *key, const char *value, const char *default_value)
+{
+    json_renderer_write_key(renderer, key, JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_string(renderer, value ? value : default_value, JSON_RENDERER_FLAGS_NONE);
+}
+
+/* Same values as event_url_format_form() but as a JSON object. */
+static char *event_url_format_json(event_url_t *self, event_t *event, time_t duration)
+{
+    json_renderer_t *renderer = json_renderer_create(JSON_RENDERER_FLAGS_NONE);
+    ice_config_t *config;
+
+    if (!renderer)
+        return NULL;
+
+    json_renderer_begin(renderer, JSON_ELEMENT_TYPE_OBJECT);
+    event_url_write_string(renderer, "action", self->action ? self->action : event->trigger, "");
+    event_url_write_string(renderer, "mount", event->uri, "");
+    config = config_get_config();
+    event_url_write_string(renderer, "server", config->hostname, "");
+    json_renderer_write_key(renderer, "port", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_int(renderer, config->port);
+    config_release_config();
+    json_renderer_write_key(renderer, "client", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_uint(renderer, event->connection_id);
+    event_url_write_string(renderer, "role", event->client_role, "");
+    event_url_write_string(renderer, "username", event->client_username, "");
+    event_url_write_string(renderer, "ip", event->connection_ip, "");
+    event_url_write_string(renderer, "agent", event->client_useragent, "-");
+    json_renderer_write_key(renderer, "duration", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_int(renderer, duration);
+    json_renderer_write_key(renderer, "admin", JSON_RENDERER_FLAGS_NONE);
+    json_renderer_write_int(renderer, event->client_admin_command);
+    json_renderer_end(renderer);
+
+    return json_renderer_finish(&renderer);
+}
+
+/* Drops a reference, must be called with the lock held. Unlocks. */
+static void event_url_release(event_url_t *self)
+{
+    size_t refcount = --self->refcount;
+
+    thread_mutex_unlock(&(self->lock));
+
+    if (refcount)
+        return;
+
+    while (self->pending) {
+        event_url_item_t *item = self->pending;
+        self->pending = item->next;
+        free(item->body);
+        free(item);
+    }
+
+    thread_mutex_destroy(&(self->lock));
+    free(self->url);
+    free(self->action);
+    free(self->userpwd);
+    free(self);
+}
+
+static void event_url_request_free(event_url_request_t *request)
+{
+    icecast_curl_free(request->handle);
+    curl_slist_free_all(request->headers);
+    free(request);
+}
+
+static void event_url_done(CURL *handle, CURLcode result, void *userdata)
+{
+    event_url_request_t *request = userdata;
+    event_url_t *self = request->self;
+
+    (void)handle;
+
+    if (result)
+        ICECAST_LOG_WARN("event to server %s failed with %s", self->url, request->errormsg);
+
+    event_url_request_free(request);
+
+    thread_mutex_lock(&(self->lock));
+    self->running--;
+    event_url_flush(self);
+    event_url_release(self);
+}
+
+/* Takes up to batch pending events and builds the body for them. */
+static char *event_url_take_body(event_url_t *self)
+{
+    event_url_item_t *item;
+    char *body;
+    size_t len = 3;
+    size_t count = 0;
+
+    if (self->batch == 1) {
+        item = self->pending;
+        self->pending = item->next;
+        if (!self->pending)
+            self->pending_tail = &(self->pending);
+        self->pending_len--;
+        body = item->body;
+        free(item);
+        return body;
+    }
+
+    for (item = self->pending; item && count < self->batch; item = item->next, count++)
+        len += strlen(item->body) + 1;
+
+    body = malloc(len);
+    if (!body)
+        return NULL;
+
+    body[0] = '[';
+    len = 1;
+    while (count--) {
+        size_t itemlen;
+
+        item = self->pending;
+        self->pending = item->next;
+        self->pending_len--;
+
+        if (len > 1)
+            body[len++] = ',';
+        itemlen = strlen(item->body);
+        memcpy(body + len, item->body, itemlen);
+        len += itemlen;
+
+        free(item->body);
+        free(item);
+    }
+    body[len++] = ']';
+    body[len] = 0;
+
+    if (!self->pending)
+        self->pending_tail = &(self->pending);
+
+    return body;
+}
+
+/* Starts requests for pending events as long as there are free slots.
+ * Must be called with the lock held.
+ */
+static void event_url_flush(event_url_t *self)
+{
+    while (self->pending && self->running < self->concurrency) {
+        event_url_request_t *request;
+        char *body;
+
+        request = calloc(1, sizeof(*request));
+        if (!request)
+            return;
+
+        request->self = self;
+        request->handle = icecast_curl_new(self->url, request->errormsg);
+        if (!request->handle) {
+            free(request);
+            return;
+        }
+
+        body = event_url_take_body(self);
+        if (!body) {
+            event_url_request_free(request);
+            return;
+        }
+
+        curl_easy_setopt(request->handle, CURLOPT_HEADERFUNCTION, handle_returned);
+        if (strchr(self->url, '@') == NULL && self->userpwd)
+            curl_easy_setopt(request->handle, CURLOPT_USERPWD, self->userpwd);
+        if (self->batch > 1) {
+            request->headers = curl_slist_append(NULL, "Content-Type: application/json");
+            curl_easy_setopt(request->handle, CURLOPT_HTTPHEADER, request->headers);
+        }
+        curl_easy_setopt(request->handle, CURLOPT_POSTFIELDSIZE, (long)strlen(body));
+        curl_easy_setopt(request->handle, CURLOPT_COPYPOSTFIELDS, body);
+        free(body);
+
+        /* Not accepted, e.g. on shutdown. The others would fail the same
+         * way, so keep them pending.
+         */
+        if (icecast_curl_submit(request->handle, self->url, self->concurrency, event_url_done, request) != 0) {
+            ICECAST_LOG_WARN("event to server %s failed, can not start request, %zu events left pending", self->url, self->pending_len);
+            event_url_request_free(request);
+            return;
+        }
+
+        self->running++;
+        self->refcount++;
+    }
+}
+
+static int event_url_emit(void *state, event_t *event) {
+    event_url_t *self = state;
+    event_url_item_t *item;
+    time_t duration;
+
+    if (event->connection_time) {
+        duration = time(NULL) - event->connection_time;
     } else {
-        curl_easy_setopt(self->handle, CURLOPT_USERPWD, "");
+        duration = 0;
     }
 
-    curl_easy_setopt(self->handle, CURLOPT_URL, self->url);
-    curl_easy_setopt(self->handle, CURLOPT_POSTFIELDS, post);
+    item = calloc(1, sizeof(*item));
+    if (!item)
+        return 0;
 
-    if (curl_easy_perform(self->handle))
-        ICECAST_LOG_WARN("auth to server %s failed with %s", self->url, self->errormsg);
+    if (self->batch > 1) {
+        item->body = event_url_format_json(self, event, duration);
+    } else {
+        item->body = event_url_format_form(self, event, duration);
+    }
+
+    if (!item->body) {
+        free(item);
+        return 0;
+    }
+
+    thread_mutex_lock(&(self->lock));
+    if (self->pending_len >= EVENT_URL_MAX_PENDING) {
+        event_url_item_t *old = self->pending;
+
+        self->pending = old->next;
+        self->pending_len--;
+        free(old->body);
+        free(old);
+        if (!self->dropped++)
+            ICECAST_LOG_WARN("Server %s does not keep up, dropping events.", self->url);
+    } else {
+        self->dropped = 0;
+    }
+
+    *(self->pending_tail) = item;
+    self->pending_tail = &(item->next);
+    self->pending_len++;
+
+    event_url_flush(self);
+    thread_mutex_unlock(&(self->lock));
 
     return 0;
 }
 
+/* Pending events are still sent, the state is freed once that is done. */
 static void event_url_free(void *state) {
     event_url_t *self = state;
-    icecast_curl_free(self->handle);
-    free(self->url);
-    free(self->action);
-    free(self->userpwd);
-    free(self);
+
+    thread_mutex_lock(&(self->lock));
+    event_url_flush(self);
+    event_url_release(self);
 }
 
 int event_get_url(event_registration_t *er, config_options_t *options) {
@@ -109,6 +368,12 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
     if (!self)
         return -1;
 
+    thread_mutex_create(&(self->lock));
+    self->refcount = 1;
+    self->pending_tail = &(self->pending);
+    self->concurrency = EVENT_URL_DEFAULT_CONCURRENCY;
+    self->batch = 1;
+
     if (options) {
         do {
             if (options->type)
@@ -120,6 +385,8 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
              * <option name="username" value="..." />
              * <option name="password" value="..." />
              * <option name="action" value="..." />
+             * <option name="concurrency" value="..." /> (number of requests running at the same time)
+             * <option name="batch" value="..." /> (maximum number of events per request, if > 1 a JSON array is sent)
              */
             if (strcmp(options->name, "url") == 0) {
                 util_replace_string(&(self->url), options->value);
@@ -129,23 +396,26 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
                 password = options->value;
             } else if (strcmp(options->name, "action") == 0) {
                 util_replace_string(&(self->action), options->value);
+            } else if (strcmp(options->name, "concurrency") == 0) {
+                self->concurrency = util_str_to_unsigned_int(options->value, EVENT_URL_DEFAULT_CONCURRENCY);
+                if (self->concurrency < 1)
+                    self->concurrency = 1;
+            } else if (strcmp(options->name, "batch") == 0) {
+                self->batch = util_str_to_unsigned_int(options->value, 1);
+                if (self->batch < 1)
+                    self->batch = 1;
             } else {
                 ICECAST_LOG_ERROR("Unknown <option> tag with name %s.", options->name);
             }
         } while ((options = options->next));
     }
 
-    self->handle = icecast_curl_new(NULL, NULL);
-
     /* check if we are in sane state */
-    if (!self->url || !self->handle) {
+    if (!self->url) {
         event_url_free(self);
         return -1;
     }
 
-    curl_easy_setopt(self->handle, CURLOPT_HEADERFUNCTION, handle_returned);
-    curl_easy_setopt(self->handle, CURLOPT_ERRORBUFFER, self->errormsg);
-
     if (username && password) {
         size_t len = strlen(username) + strlen(password) + 2;
         self->userpwd = malloc(len);
@@ -35,80 +35,142 @@ typedef struct {
     void *userdata;
 } fastevent_registration_t;
 
+/* Rows are never changed once published. Writers replace the row and wait
+ * until no reader can still use the old one before freeing it, so emitting
+ * an event takes no lock.
+ *
+ * Readers count themselves in one of two counters selected by the epoch
+ * and check the epoch again afterwards, as a writer may have flipped it and
+ * found the counter drained in between. A writer flips the epoch after
+ * publishing and waits for the counter of the previous epoch to drain.
+ */
 struct eventrow {
-    size_t length;
     size_t used;
-    fastevent_registration_t **registrations;
+    fastevent_registration_t *registrations[];
 };
 
-static struct eventrow fastevent_registrations[FASTEVENT_TYPE__END];
-static rwlock_t fastevent_lock;
+unsigned int fastevent_active;
+
+static struct eventrow *fastevent_registrations[FASTEVENT_TYPE__END];
+static mutex_t fastevent_lock; // serialises writers
+static unsigned int fastevent_epoch;
+static size_t fastevent_readers[2];
 
-static inline struct eventrow * __get_row(fastevent_type_t type)
+static inline int __valid_type(fastevent_type_t type)
 {
     size_t idx = type;
 
-    if (idx >= FASTEVENT_TYPE__END)
-        return NULL;
+    return idx < FASTEVENT_TYPE__END;
+}
 
-    return &(fastevent_registrations[idx]);
+/* Waits until all readers that may have seen an old row are done.
+ * Must be called with fastevent_lock locked.
+ */
+static void __synchronize(void)
+{
+    unsigned int idx = __atomic_fetch_add(&fastevent_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+    while (__atomic_load_n(&(fastevent_readers[idx]), __ATOMIC_SEQ_CST))
+        thread_sleep(1000);
 }
 
-static int __add_to_row(struct eventrow * row, fastevent_registration_t *registration)
+/* Publishes a new row for the type and frees the old one.
+ * Must be called with fastevent_lock locked.
+ */
+static void __publish_row(fastevent_type_t type, struct eventrow *row)
 {
-    fastevent_registration_t **n;
+    struct eventrow *old = fastevent_registrations[type];
 
-    if (row == NULL)
-        return -1;
+    __atomic_store_n(&(fastevent_registrations[type]), row, __ATOMIC_SEQ_CST);
 
-    /* Check if we need to reallocate row space */
-    if (row->length == row->used) {
-        n = realloc(row->registrations, sizeof(*n)*(row->length + 4));
-        if (n == NULL) {
-            ICECAST_LOG_ERROR("Can not allocate row space.");
-            return -1;
-        }
+    if (row && row->used) {
+        __atomic_or_fetch(&fastevent_active, 1U << type, __ATOMIC_RELAXED);
+    } else {
+        __atomic_and_fetch(&fastevent_active, ~(1U << type), __ATOMIC_RELAXED);
+    }
 
-        row->registrations = n;
-        row->length += 4;
+    __synchronize();
+    free(old);
+}
+
+static struct eventrow * __new_row(size_t used)
+{
+    return malloc(sizeof(struct eventrow) + sizeof(fastevent_registration_t *)*used);
+}
+
+static int __add_to_row(fastevent_type_t type, fastevent_registration_t *registration)
+{
+    struct eventrow *old = fastevent_registrations[type];
+    size_t used = old ? old->used : 0;
+    struct eventrow *row = __new_row(used + 1);
+
+    if (row == NULL) {
+        ICECAST_LOG_ERROR("Can not allocate row space.");
+        return -1;
     }
 
-    row->registrations[row->used++] = registration;
+    if (used)
+        memcpy(row->registrations, old->registrations, sizeof(*(row->registrations))*used);
+    row->registrations[used] = registration;
+    row->used = used + 1;
+
+    __publish_row(type, row);
     return 0;
 }
 
-static int __remove_from_row(struct eventrow * row, fastevent_registration_t *registration)
+static int __remove_from_row(fastevent_type_t type, fastevent_registration_t *registration)
 {
+    struct eventrow *old = fastevent_registrations[type];
+    struct eventrow *row;
     size_t i;
 
-    if (row == NULL)
+    if (old == NULL)
         return -1;
 
-    for (i = 0; i < row->used; i++) {
-        if (row->registrations[i] == registration) {
-            memmove(&(row->registrations[i]), &(row->registrations[i+1]), sizeof(*(row->registrations))*(row->used - i - 1));
-            row->used--;
-            return 0;
-        }
+    for (i = 0; i < old->used; i++) {
+        if (old->registrations[i] == registration)
+            break;
     }
 
-    return -1;
+    if (i == old->used)
+        return -1;
+
+    if (old->used == 1) {
+        __publish_row(type, NULL);
+        return 0;
+    }
+
+    row = __new_row(old->used - 1);
+    if (row == NULL) {
+        /* we can not leave the registration in place as it is about to be freed */
+        ICECAST_LOG_ERROR("Can not allocate row space, dropping all fast events of type %i.", (int)type);
+        __publish_row(type, NULL);
+        return 0;
+    }
+
+    memcpy(row->registrations, old->registrations, sizeof(*(row->registrations))*i);
+    memcpy(&(row->registrations[i]), &(old->registrations[i+1]), sizeof(*(row->registrations))*(old->used - i - 1));
+    row->used = old->used - 1;
+
+    __publish_row(type, row);
+    return 0;
 }
 
 
 static void __unregister(refobject_t self, void **userdata)
 {
     fastevent_registration_t *registration = REFOBJECT_TO_TYPE(self, fastevent_registration_t *);
-    struct eventrow * row;
 
     (void)userdata;
 
-    thread_rwlock_wlock(&fastevent_lock);
-    row = __get_row(registration->type);
-    if (__remove_from_row(row, registration) != 0) {
-        ICECAST_LOG_ERROR("Can not remove fast event from row. BUG.");
+    /* the type is only invalid if the registration failed */
+    if (__valid_type(registration->type)) {
+        thread_mutex_lock(&fastevent_lock);
+        if (__remove_from_row(registration->type, registration) != 0) {
+            ICECAST_LOG_ERROR("Can not remove fast event from row. BUG.");
+        }
+        thread_mutex_unlock(&fastevent_lock);
     }
-    thread_rwlock_unlock(&fastevent_lock);
 
     if (registration->freecb)
         registration->freecb(&(registration->userdata));
@@ -119,7 +181,7 @@ static void __unregister(refobject_t self, void **userdata)
 
 int fastevent_initialize(void)
 {
-    thread_rwlock_create(&fastevent_lock);
+    thread_mutex_create(&fastevent_lock);
     return 0;
 }
 
@@ -127,18 +189,17 @@ int fastevent_shutdown(void)
 {
     size_t i;
 
-    thread_rwlock_wlock(&fastevent_lock);
+    thread_mutex_lock(&fastevent_lock);
     for (i = 0; i < FASTEVENT_TYPE__END; i++) {
-        if (fastevent_registrations[i].used) {
+        if (fastevent_registrations[i] && fastevent_registrations[i]->used) {
             ICECAST_LOG_ERROR("Subsystem shutdown but elements still in use. BUG.");
             continue;
         }
 
-        free(fastevent_registrations[i].registrations);
-        fastevent_registrations[i].registrations = NULL;
+        __publish_row(i, NULL);
     }
-    thread_rwlock_unlock(&fastevent_lock);
-    thread_rwlock_destroy(&fastevent_lock);
+    thread_mutex_unlock(&fastevent_lock);
+    thread_mutex_destroy(&fastevent_lock);
 
     return 0;
 }
@@ -149,67 +210,66 @@ REFOBJECT_DEFINE_PRIVATE_TYPE(fastevent_registration_t,
 
 refobject_t fastevent_register(fastevent_type_t type, fastevent_cb_t cb, fastevent_freecb_t freecb, void *userdata)
 {
-    struct eventrow * row;
     fastevent_registration_t *registration;
 
-    if (cb == NULL)
-        return REFOBJECT_NULL;
-
-    thread_rwlock_wlock(&fastevent_lock);
-    row = __get_row(type);
-
-    if (row == NULL) {
-        thread_rwlock_unlock(&fastevent_lock);
+    if (cb == NULL || !__valid_type(type))
         return REFOBJECT_NULL;
-    }
 
     registration = refobject_new__new(fastevent_registration_t, NULL, NULL, NULL);
 
-    if (!registration) {
-        thread_rwlock_unlock(&fastevent_lock);
+    if (!registration)
         return REFOBJECT_NULL;
-    }
 
     registration->type = type;
     registration->cb = cb;
     registration->freecb = freecb;
     registration->userdata = userdata;
 
-    if (__add_to_row(row, registration) != 0) {
-        thread_rwlock_unlock(&fastevent_lock);
+    thread_mutex_lock(&fastevent_lock);
+    if (__add_to_row(type, registration) != 0) {
+        thread_mutex_unlock(&fastevent_lock);
+        registration->type = FASTEVENT_TYPE__END;
         refobject_unref(REFOBJECT_FROM_TYPE(registration));
         return REFOBJECT_NULL;
     }
+    thread_mutex_unlock(&fastevent_lock);
 
-    thread_rwlock_unlock(&fastevent_lock);
     return REFOBJECT_FROM_TYPE(registration);
 }
 
-void fastevent_emit(fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, ...)
+void fastevent_emit__real(fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, ...)
 {
     struct eventrow * row;
     va_list ap, apx;
+    unsigned int idx;
     size_t i;
 
     ICECAST_LOG_DDEBUG("event: type=%i, flags=%i, datatype=%i, ...", (int)type, (int)flags, (int)datatype);
 
-    thread_rwlock_rlock(&fastevent_lock);
-    row = __get_row(type);
-    if (row == NULL || row->used == 0) {
-        thread_rwlock_unlock(&fastevent_lock);
+    if (!__valid_type(type))
         return;
+
+    while (1) {
+        idx = __atomic_load_n(&fastevent_epoch, __ATOMIC_SEQ_CST) & 1;
+        __atomic_add_fetch(&(fastevent_readers[idx]), 1, __ATOMIC_SEQ_CST);
+        if ((__atomic_load_n(&fastevent_epoch, __ATOMIC_SEQ_CST) & 1) == idx)
+            break;
+        __atomic_sub_fetch(&(fastevent_readers[idx]), 1, __ATOMIC_RELEASE);
     }
 
-    va_start(ap, datatype);
+    row = __atomic_load_n(&(fastevent_registrations[type]), __ATOMIC_SEQ_CST);
+    if (row != NULL) {
+        va_start(ap, datatype);
 
-    for (i = 0; i < row->used; i++) {
-        va_copy(apx, ap);
-        row->registrations[i]->cb(row->registrations[i]->userdata, type, flags, datatype, apx);
-        va_end(apx);
-    }
+        for (i = 0; i < row->used; i++) {
+            va_copy(apx, ap);
+            row->registrations[i]->cb(row->registrations[i]->userdata, type, flags, datatype, apx);
+            va_end(apx);
+        }
 
-    thread_rwlock_unlock(&fastevent_lock);
+        va_end(ap);
+    }
 
-    va_end(ap);
+    __atomic_sub_fetch(&(fastevent_readers[idx]), 1, __ATOMIC_RELEASE);
 }
 #endif
@@ -52,10 +52,20 @@ typedef void (*fastevent_cb_t)(const void *userdata, fastevent_type_t type, fast
 typedef void (*fastevent_freecb_t)(void **userdata);
 
 #ifdef FASTEVENT_ENABLED
+/* Bit (1 << type) is set while there are registrations for the type.
+ * This allows emitting events at no cost if nobody listens.
+ */
+extern unsigned int fastevent_active;
+
 int fastevent_initialize(void);
 int fastevent_shutdown(void);
 refobject_t fastevent_register(fastevent_type_t type, fastevent_cb_t cb, fastevent_freecb_t freecb, void *userdata);
-void fastevent_emit(fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, ...);
+void fastevent_emit__real(fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, ...);
+#define fastevent_emit(type,flags,datatype,...) \
+    do { \
+        if (__atomic_load_n(&fastevent_active, __ATOMIC_RELAXED) & (1U << (type))) \
+            fastevent_emit__real((type), (flags), (datatype), __VA_ARGS__); \
+    } while (0)
 #else
 #define fastevent_initialize() 0
 #define fastevent_shutdown() 0
@@ -249,6 +249,8 @@ int format_check_http_buffer(source_t *source, client_t *client)
         client->check_buffer = format_check_file_buffer;
         client->intro_offset = 0;
         client->pos = refbuf->len = 4096;
+        /* the request is done, only keep what is needed while streaming */
+        client_compact(client);
         return -1;
     }
     return 0;
@@ -340,7 +342,9 @@ static int format_prepare_headers (source_t *source, client_t *client)
     char *ptr;
     int bytes;
     int bitrate_filtered = 0;
-    avl_node *node;
+    const http_var_t *var;
+    size_t pos = 0;
+    size_t current;
 
     remaining = client->refbuf->len;
     ptr = client->refbuf->data;
@@ -379,12 +383,10 @@ static int format_prepare_headers (source_t *source, client_t *client)
     ptr += bytes;
 
     /* iterate through source http headers and send to client */
-    avl_tree_rlock(source->parser->vars);
-    node = avl_get_first(source->parser->vars);
-    while (node)
+    current = pos;
+    while ((var = httpp_next_any_var(source->parser, HTTPP_NS_HEADER, &pos)))
     {
         int next = 1;
-        http_var_t *var = (http_var_t *) node->key;
         bytes = 0;
         if (!strcasecmp(var->name, "ice-audio-info"))
         {
@@ -443,7 +445,6 @@ static int format_prepare_headers (source_t *source, client_t *client)
         }
 
         if (bytes < 0 || (size_t)bytes >= remaining) {
-            avl_tree_unlock(source->parser->vars);
             ICECAST_LOG_ERROR("Can not allocate headers for client %p", client);
             client->respcode = 500;
             return -1;
@@ -452,9 +453,10 @@ static int format_prepare_headers (source_t *source, client_t *client)
         remaining -= bytes;
         ptr += bytes;
         if (next)
-            node = avl_get_next(node);
+            current = pos;
+        else
+            pos = current;
     }
-    avl_tree_unlock(source->parser->vars);
 
     bytes = snprintf(ptr, remaining, "\r\n");
     if (bytes <= 0 || (size_t)bytes >= remaining) {
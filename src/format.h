@@ -49,9 +49,16 @@ typedef struct _format_plugin_tag
     int (*write_buf_to_client)(client_t *client);
     void (*write_buf_to_file)(source_t *source, refbuf_t *refbuf);
     int (*create_client_data)(source_t *source, client_t *client);
+    /* Bytes allocated per client by create_client_data() */
+    size_t client_data_size;
     void (*set_tag)(struct _format_plugin_tag *plugin, const char *tag, const char *value, const char *charset);
     void (*free_plugin)(struct _format_plugin_tag *self);
     void (*apply_settings)(client_t *client, struct _format_plugin_tag *format, mount_proxy *mount);
+    /* Called before the source continues reading from a new client, e.g. the
+     * hot standby of a relay. Drops partially read data of the old client.
+     * Returns 0 if the plugin can continue with the new client.
+     */
+    int (*input_reset)(struct _format_plugin_tag *format, client_t *client);
 
     /* meta data */
     vorbis_comment vc;
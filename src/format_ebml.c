@@ -169,6 +169,7 @@ typedef struct ebml_client_data_st {
 } ebml_client_data_t;
 
 static void ebml_free_plugin(format_plugin_t *plugin);
+static int ebml_input_reset(format_plugin_t *plugin, client_t *client);
 static refbuf_t *ebml_get_buffer(source_t *source);
 static int ebml_write_buf_to_client(client_t *client);
 static void ebml_write_buf_to_file(source_t *source, refbuf_t *refbuf);
@@ -201,13 +202,16 @@ int format_ebml_get_plugin(source_t *source)
     ebml_source_state_t *ebml_source_state = calloc(1, sizeof(ebml_source_state_t));
     format_plugin_t *plugin = calloc(1, sizeof(format_plugin_t));
 
+    plugin->type = FORMAT_TYPE_EBML;
     plugin->get_buffer = ebml_get_buffer;
     plugin->write_buf_to_client = ebml_write_buf_to_client;
     plugin->create_client_data = ebml_create_client_data;
+    plugin->client_data_size = sizeof(ebml_client_data_t);
     plugin->free_plugin = ebml_free_plugin;
     plugin->write_buf_to_file = ebml_write_buf_to_file;
     plugin->set_tag = NULL;
     plugin->apply_settings = NULL;
+    plugin->input_reset = ebml_input_reset;
 
     plugin->contenttype = httpp_getvar(source->parser, "content-type");
 
@@ -232,6 +236,28 @@ static void ebml_free_plugin(format_plugin_t *plugin)
     free(plugin);
 }
 
+/* The new input is expected to start with a Cluster, its header is not
+ * used: the tracks are expected to be the same.
+ */
+static int ebml_input_reset(format_plugin_t *plugin, client_t *client)
+{
+
+    ebml_source_state_t *ebml_source_state = plugin->_state;
+    ebml_t *ebml = ebml_source_state->ebml;
+
+    (void)client;
+
+    /* without a header there is nothing to continue */
+    if (ebml->header_size == 0)
+        return -1;
+
+    ebml->input_position = 0;
+    ebml->copy_len = 0;
+    ebml->parse_state = EBML_STATE_PARSING_CLUSTERS;
+
+    return 0;
+}
+
 /* Write to a client from the header buffer.
  */
 static int send_ebml_header(client_t *client)
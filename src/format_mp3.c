@@ -61,6 +61,7 @@ static int format_mp3_write_buf_to_client(client_t *client);
 static void write_mp3_to_file (source_t *source, refbuf_t *refbuf);
 static void mp3_set_tag (format_plugin_t *plugin, const char *tag, const char *in_value, const char *charset);
 static void format_mp3_apply_settings(client_t *client, format_plugin_t *format, mount_proxy *mount);
+static int format_mp3_input_reset(format_plugin_t *format, client_t *client);
 
 
 typedef struct {
@@ -85,9 +86,11 @@ int format_mp3_get_plugin(source_t *source)
     plugin->write_buf_to_client = format_mp3_write_buf_to_client;
     plugin->write_buf_to_file = write_mp3_to_file;
     plugin->create_client_data = format_mp3_create_client_data;
+    plugin->client_data_size = sizeof(mp3_client_data);
     plugin->free_plugin = format_mp3_free_plugin;
     plugin->set_tag = mp3_set_tag;
     plugin->apply_settings = format_mp3_apply_settings;
+    plugin->input_reset = format_mp3_input_reset;
 
     plugin->contenttype = httpp_getvar(source->parser, "content-type");
     if (plugin->contenttype == NULL) {
@@ -480,6 +483,30 @@ static int format_mp3_write_buf_to_client(client_t *client)
     return written;
 }
 
+static int format_mp3_input_reset(format_plugin_t *format, client_t *client)
+{
+    mp3_state *state = format->_state;
+    const char *metadata = httpp_getvar(client->parser, "icy-metaint");
+
+    refbuf_release(state->read_data);
+    state->read_data = NULL;
+    state->read_count = 0;
+    state->build_metadata_len = 0;
+    state->build_metadata_offset = 0;
+
+    /* the new client may not send inline metadata */
+    state->inline_metadata_interval = metadata ? atoi(metadata) : 0;
+    state->offset = 0;
+    if (state->inline_metadata_interval > 0) {
+        format->get_buffer = mp3_get_filter_meta;
+    } else {
+        format->get_buffer = mp3_get_no_meta;
+    }
+
+    return 0;
+}
+
+
 static void format_mp3_free_plugin(format_plugin_t *self)
 {
     /* free the plugin instance */
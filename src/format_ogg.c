@@ -58,6 +58,7 @@
 struct _ogg_state_tag;
 
 static void format_ogg_free_plugin(format_plugin_t *plugin);
+static int format_ogg_input_reset(format_plugin_t *plugin, client_t *client);
 static int create_ogg_client_data(source_t *source, client_t *client);
 static void free_ogg_client_data(client_t *client);
 
@@ -171,7 +172,9 @@ int format_ogg_get_plugin(source_t *source)
     plugin->write_buf_to_client = write_buf_to_client;
     plugin->write_buf_to_file = write_ogg_to_file;
     plugin->create_client_data = create_ogg_client_data;
+    plugin->client_data_size = sizeof(struct ogg_client);
     plugin->free_plugin = format_ogg_free_plugin;
+    plugin->input_reset = format_ogg_input_reset;
     plugin->set_tag = NULL;
     if (strcmp (httpp_getvar (source->parser, "content-type"), "application/x-ogg") == 0)
         httpp_setvar (source->parser, "content-type", "application/ogg");
@@ -206,6 +209,21 @@ static void format_ogg_free_plugin (format_plugin_t *plugin)
 }
 
 
+/* The new input is expected to start with a new group of BOS pages, which
+ * is handled like any chained stream.
+ */
+static int format_ogg_input_reset(format_plugin_t *plugin, client_t *client)
+{
+    ogg_state_t *state = plugin->_state;
+
+    (void)client;
+
+    ogg_sync_reset(&state->oy);
+
+    return 0;
+}
+
+
 /* a new BOS page has been seen so check which codec it is */
 static int process_initial_page (format_plugin_t *plugin, ogg_page *page)
 {
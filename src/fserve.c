@@ -60,6 +60,7 @@
 #include "cfgfile.h"
 #include "util.h"
 #include "admin.h"
+#include "probes.h"
 
 #undef CATMODULE
 #define CATMODULE "fserve"
@@ -389,6 +390,9 @@ static void fserve_client_destroy(fserve_t *fclient)
 {
     if (fclient)
     {
+        if (fclient->client)
+            ICECAST_PROBE2(fserve_end, fclient->client->con->id, fclient->client->con->sent_bytes);
+
         if (fclient->file)
             fclose (fclient->file);
 
@@ -622,6 +626,8 @@ fail:
  */
 static void fserve_add_pending (fserve_t *fclient)
 {
+    ICECAST_PROBE2(fserve_start, fclient->client->con->id, fclient->file != NULL);
+
     thread_spin_lock (&pending_lock);
     fclient->next = (fserve_t *)pending_list;
     pending_list = fclient;
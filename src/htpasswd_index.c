@@ -0,0 +1,251 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/**
+ * User index of the htpasswd authenticator, see htpasswd_index.h for details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htpasswd_index.h"
+
+/* marks slots of deleted users, so lookups continue probing */
+static htpasswd_user htpasswd_tombstone;
+
+/* FNV-1a */
+static uint32_t htpasswd_hash(const char *name)
+{
+    uint32_t hash = 2166136261U;
+
+    for (; *name; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static inline int htpasswd_slot_is_user(const htpasswd_user *user)
+{
+    return user && user != &htpasswd_tombstone;
+}
+
+htpasswd_user *htpasswd_user_new(const char *name, const char *pass)
+{
+    htpasswd_user *user = calloc(1, sizeof(*user));
+    size_t namelen = strlen(name);
+    size_t passlen = strlen(pass);
+
+    if (!user)
+        return NULL;
+
+    user->name = malloc(namelen + passlen + 2);
+    if (!user->name) {
+        free(user);
+        return NULL;
+    }
+
+    memcpy(user->name, name, namelen + 1);
+    user->pass = user->name + namelen + 1;
+    memcpy(user->pass, pass, passlen + 1);
+    user->hash = htpasswd_hash(name);
+    user->offset = -1;
+    user->length = namelen + passlen + 1;
+
+    return user;
+}
+
+void htpasswd_user_free(htpasswd_user *user)
+{
+    free (user->name); /* ->pass is part of same buffer */
+    free (user);
+}
+
+htpasswd_index *htpasswd_index_new(size_t count)
+{
+    htpasswd_index *index = calloc(1, sizeof(*index));
+
+    if (!index)
+        return NULL;
+
+    index->size = 16;
+    while (index->size < (count * 2))
+        index->size *= 2;
+
+    index->slots = calloc(index->size, sizeof(*index->slots));
+    if (!index->slots) {
+        free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+htpasswd_index *htpasswd_index_copy(htpasswd_index *old, size_t count)
+{
+    htpasswd_index *index = htpasswd_index_new(count);
+    size_t i;
+
+    if (!index)
+        return NULL;
+
+    index->duplicates = old->duplicates;
+
+    for (i = 0; i < old->size; i++) {
+        if (htpasswd_slot_is_user(old->slots[i]) && htpasswd_index_insert(index, old->slots[i]) != 0) {
+            htpasswd_index_free(index, 0);
+            return NULL;
+        }
+    }
+
+    return index;
+}
+
+void htpasswd_index_free(htpasswd_index *index, int free_users)
+{
+    size_t i;
+
+    if (!index)
+        return;
+
+    if (free_users) {
+        for (i = 0; i < index->size; i++) {
+            if (htpasswd_slot_is_user(index->slots[i]))
+                htpasswd_user_free(index->slots[i]);
+        }
+    }
+
+    free(index->slots);
+    free(index);
+}
+
+static htpasswd_user **htpasswd_index_find(htpasswd_index *index, const char *name)
+{
+    uint32_t hash = htpasswd_hash(name);
+    size_t mask = index->size - 1;
+    size_t i = hash & mask;
+    size_t n;
+
+    for (n = 0; n < index->size; n++, i = (i + 1) & mask) {
+        htpasswd_user *user = index->slots[i];
+
+        if (!user)
+            return NULL;
+
+        if (user != &htpasswd_tombstone && user->hash == hash && strcmp(user->name, name) == 0)
+            return &(index->slots[i]);
+    }
+
+    return NULL;
+}
+
+htpasswd_user *htpasswd_index_lookup(htpasswd_index *index, const char *name)
+{
+    htpasswd_user **slot = htpasswd_index_find(index, name);
+
+    return slot ? *slot : NULL;
+}
+
+int htpasswd_index_insert(htpasswd_index *index, htpasswd_user *user)
+{
+    size_t mask = index->size - 1;
+    size_t i = user->hash & mask;
+
+    /* keep at least half of the slots free so probing stays short */
+    if ((index->used + 1) * 2 > index->size)
+        return -1;
+
+    while (htpasswd_slot_is_user(index->slots[i]))
+        i = (i + 1) & mask;
+
+    if (!index->slots[i])
+        index->used++;
+    index->count++;
+    index->slots[i] = user;
+
+    return 0;
+}
+
+htpasswd_user *htpasswd_index_remove(htpasswd_index *index, const char *name)
+{
+    htpasswd_user **slot = htpasswd_index_find(index, name);
+    htpasswd_user *user;
+
+    if (!slot)
+        return NULL;
+
+    user = *slot;
+    *slot = &htpasswd_tombstone;
+    index->count--;
+
+    return user;
+}
+
+size_t htpasswd_index_users(htpasswd_index *index, htpasswd_user **users, size_t count)
+{
+    size_t ret = 0;
+    size_t i;
+
+    for (i = 0; i < index->size && ret < count; i++) {
+        if (htpasswd_slot_is_user(index->slots[i]))
+            users[ret++] = index->slots[i];
+    }
+
+    return ret;
+}
+
+int htpasswd_user_delete_inplace(const char *filename, htpasswd_user *user)
+{
+    FILE *passwdfile;
+    char *line;
+    size_t namelen = strlen(user->name);
+    int ret = -1;
+
+    if (user->offset < 0)
+        return -1;
+
+    line = malloc(user->length);
+    if (!line)
+        return -1;
+
+    passwdfile = fopen(filename, "r+b");
+    if (passwdfile == NULL) {
+        free(line);
+        return -1;
+    }
+
+    do {
+        if (fseek(passwdfile, user->offset, SEEK_SET) != 0)
+            break;
+        if (fread(line, 1, user->length, passwdfile) != user->length)
+            break;
+        if (memcmp(line, user->name, namelen) != 0 || line[namelen] != ':' ||
+            memcmp(line + namelen + 1, user->pass, user->length - namelen - 1) != 0)
+            break;
+
+        memset(line, ' ', user->length);
+        line[0] = '#';
+        if (fseek(passwdfile, user->offset, SEEK_SET) != 0)
+            break;
+        if (fwrite(line, 1, user->length, passwdfile) != user->length)
+            break;
+        ret = 0;
+    } while (0);
+
+    if (fclose(passwdfile) != 0)
+        ret = -1;
+    free(line);
+
+    return ret;
+}
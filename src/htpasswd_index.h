@@ -0,0 +1,69 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/* This file contains the user index of the htpasswd authenticator.
+ *
+ * Users are kept in an open addressing hash table. Deleted users leave a
+ * tombstone in their slot so lookups of other users continue probing. The
+ * index does not do any locking, see auth_htpasswd.c for how it is shared.
+ */
+
+#ifndef __HTPASSWD_INDEX_H__
+#define __HTPASSWD_INDEX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    char *name;
+    char *pass; /* part of same buffer as name */
+    uint32_t hash;
+    /* position and length of the line in the file, offset is -1 if unknown */
+    long offset;
+    size_t length;
+} htpasswd_user;
+
+typedef struct {
+    /* number of slots, a power of two */
+    size_t size;
+    /* number of slots used by users or tombstones */
+    size_t used;
+    /* number of users */
+    size_t count;
+    /* whether the file had more than one line for any user */
+    int duplicates;
+    htpasswd_user **slots;
+} htpasswd_index;
+
+htpasswd_user *htpasswd_user_new(const char *name, const char *pass);
+void htpasswd_user_free(htpasswd_user *user);
+
+/* Returns a new index with room for at least count users. */
+htpasswd_index *htpasswd_index_new(size_t count);
+/* Returns a new index with the users of old and room for count users.
+ * The users are shared with old.
+ */
+htpasswd_index *htpasswd_index_copy(htpasswd_index *old, size_t count);
+void htpasswd_index_free(htpasswd_index *index, int free_users);
+
+htpasswd_user *htpasswd_index_lookup(htpasswd_index *index, const char *name);
+/* Inserts a user that is not yet in the index.
+ * Returns -1 if the index has no room left, it must be copied into a larger one then.
+ */
+int htpasswd_index_insert(htpasswd_index *index, htpasswd_user *user);
+/* Removes the user from the index and returns it, or NULL if there is no such user. */
+htpasswd_user *htpasswd_index_remove(htpasswd_index *index, const char *name);
+/* Stores up to count users into users and returns the number stored. */
+size_t htpasswd_index_users(htpasswd_index *index, htpasswd_user **users, size_t count);
+
+/* Comments out the line of the user without changing the size of the file.
+ * Returns -1 if the file does not have the line at the known position.
+ */
+int htpasswd_user_delete_inplace(const char *filename, htpasswd_user *user);
+
+#endif
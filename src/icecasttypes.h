@@ -101,6 +101,10 @@ typedef enum {
 
 typedef struct relay_tag relay_t;
 
+/* ---[ relay_connect.[ch] ]--- */
+
+typedef struct relay_connect_tag relay_connect_t;
+
 /* ---[ buffer.[ch] ]--- */
 
 typedef struct buffer_tag buffer_t;
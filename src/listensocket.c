@@ -757,20 +757,15 @@ connection_t *              listensocket_accept(listensocket_t *self, listensock
     connection_t *con;
     listensocket_t *effective = NULL;
     sock_t sock;
-    char *ip;
+    char ip[MAX_ADDR_LEN] = "";
 
     if (!self)
         return NULL;
 
-    ip = calloc(MAX_ADDR_LEN, 1);
-    if (!ip)
-        return NULL;
-
     thread_mutex_lock(&self->lock);
-    sock = sock_accept(self->sock, ip, MAX_ADDR_LEN);
+    sock = sock_accept(self->sock, ip, sizeof(ip));
     thread_mutex_unlock(&self->lock);
     if (sock == SOCK_ERROR) {
-        free(ip);
         return NULL;
     }
 
@@ -799,7 +794,6 @@ connection_t *              listensocket_accept(listensocket_t *self, listensock
 
     if (con == NULL) {
         sock_close(sock);
-        free(ip);
         return NULL;
     }
 
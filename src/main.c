@@ -82,6 +82,7 @@
 #include "fastevent.h"
 #include "prng.h"
 #include "navigation.h"
+#include "metrics.h"
 
 #include <libxml/xmlmemory.h>
 
@@ -150,6 +151,7 @@ static void initialize_subsystems(void)
     prng_initialize();
     navigation_initialize();
     global_initialize();
+    metrics_initialize();
 #ifndef FASTEVENT_ENABLED
     fastevent_initialize();
     fastevent_reg = fastevent_register(FASTEVENT_TYPE_SLOWEVENT, __fastevent_cb, NULL, NULL);
@@ -172,14 +174,17 @@ static void shutdown_subsystems(void)
 {
     event_shutdown();
     fserve_shutdown();
-    refbuf_shutdown();
     slave_shutdown();
     auth_shutdown();
     yp_shutdown();
+#ifdef HAVE_CURL
+    icecast_curl_async_shutdown();
+#endif
     stats_shutdown();
 
     connection_shutdown();
     client_shutdown();
+    refbuf_shutdown();
     tls_shutdown();
     prng_deconfigure();
     config_shutdown();
@@ -191,6 +196,7 @@ static void shutdown_subsystems(void)
 #endif
     navigation_shutdown();
     prng_shutdown();
+    metrics_shutdown();
     global_shutdown();
     thread_shutdown();
 
@@ -417,6 +423,7 @@ static int _server_proc_init(void)
     ice_config_t *config = config_get_config_unlocked();
 
     connection_setup_sockets(config);
+    client_recheck_config(config);
 
     if (listensocket_container_sockcount(global.listensockets) < 1) {
         ICECAST_LOG_ERROR("Can not listen on any sockets.");
@@ -684,6 +691,11 @@ int main(int argc, char **argv)
     /* let her rip */
     global.running = ICECAST_RUNNING;
 
+#ifdef HAVE_CURL
+    /* used by YP and events */
+    icecast_curl_async_initialize();
+#endif
+
     /* Startup yp thread */
     yp_initialize();
 
@@ -0,0 +1,359 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/**
+ * Internal metrics with per-thread recording and Prometheus rendering.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common/thread/thread.h"
+#include "common/avl/avl.h"
+
+#include "metrics.h"
+#include "buffer.h"
+#include "global.h"
+#include "source.h"
+
+#include "logging.h"
+#define CATMODULE "metrics"
+
+/* Block of metrics owned by a single thread.
+ * Only the owning thread writes to it. Writes and reads are done using
+ * relaxed atomics so that rendering never sees torn values.
+ */
+typedef struct metrics_block_tag {
+    uint64_t counter[METRICS_COUNTER__END];
+    /* the thread's share of each gauge, may be negative as threads often
+     * remove what other threads added. Stored as two's complement.
+     */
+    uint64_t gauge[METRICS_GAUGE__END];
+    uint64_t histogram[METRICS_HISTOGRAM__END][METRICS_HISTOGRAM_BUCKETS + 1];
+    uint64_t histogram_sum[METRICS_HISTOGRAM__END];
+    struct metrics_block_tag *next;
+} metrics_block_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+} metrics_counter_info_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    /* values are divided by this before rendering (e.g. to get seconds from microseconds) */
+    double scale;
+} metrics_histogram_info_t;
+
+static const metrics_counter_info_t counter_info[METRICS_COUNTER__END] = {
+    {"icecast_send_eagain_total", "Writes to clients that would have blocked."},
+    {"icecast_send_limited_total", "Calls to send_to_listener() that stopped at the per-call limit."},
+    {"icecast_connection_block_alloc_total", "Connection blocks allocated as the pool was empty."},
+    {"icecast_connection_chunk_alloc_total", "Extra chunks allocated for connections that outgrew their block."},
+    {"icecast_tls_ktls_send_total", "TLS connections that send through kernel TLS."},
+    {"icecast_tls_handshake_total", "Completed TLS handshakes."},
+    {"icecast_tls_resumed_total", "TLS handshakes that resumed a session."},
+    {"icecast_tls_ticket_key_rotation_total", "TLS ticket keys that were replaced."},
+    {"icecast_event_dropped_total", "Events dropped as an event queue was full."}
+};
+
+static const metrics_counter_info_t gauge_info[METRICS_GAUGE__END] = {
+    {"icecast_stats_queue_depth", "Stats events waiting for the stats thread."},
+    {"icecast_auth_queue_depth", "Clients waiting for an auth thread."},
+    {"icecast_tls_session_cache_entries", "Sessions in the TLS session cache."},
+    {"icecast_tls_handshake_queue_depth", "TLS connections waiting for their handshake to complete."},
+    {"icecast_event_queue_depth", "Events waiting for the dispatcher or for delivery to a registration."}
+};
+
+static const metrics_histogram_info_t histogram_info[METRICS_HISTOGRAM__END] = {
+    {"icecast_send_to_listener_bytes", "Bytes written per call of send_to_listener().", 1.},
+    {"icecast_send_to_listener_iterations", "Write iterations per call of send_to_listener().", 1.},
+    {"icecast_accept_to_first_byte_seconds", "Time from accepting a connection to the first byte sent.", 1000000.},
+    {"icecast_header_wait_seconds", "Time a client spent in the request queue until its headers were complete.", 1000000.},
+    {"icecast_auth_queue_seconds", "Time a client waited in an auth queue.", 1000000.},
+    {"icecast_tls_handshake_queue_seconds", "Time a TLS connection waited for a handshake thread.", 1000000.},
+    {"icecast_tls_handshake_seconds", "Time a TLS connection spent with the handshake threads until its handshake completed.", 1000000.},
+    {"icecast_event_queue_seconds", "Time from emitting an event until its delivery to a registration started.", 1000000.}
+};
+
+static int _initialized = 0;
+static pthread_key_t _metrics_key;
+/* protects _metrics_blocks and _metrics_retired */
+static mutex_t _metrics_mutex;
+static metrics_block_t *_metrics_blocks;
+/* sum of all blocks of threads that already exited */
+static metrics_block_t _metrics_retired;
+
+static inline void __add(uint64_t *p, uint64_t value)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t __get(const uint64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void __block_sum(metrics_block_t *dst, const metrics_block_t *src)
+{
+    size_t i, j;
+
+    for (i = 0; i < METRICS_COUNTER__END; i++)
+        dst->counter[i] += __get(&(src->counter[i]));
+
+    for (i = 0; i < METRICS_GAUGE__END; i++)
+        dst->gauge[i] += __get(&(src->gauge[i]));
+
+    for (i = 0; i < METRICS_HISTOGRAM__END; i++) {
+        for (j = 0; j < (METRICS_HISTOGRAM_BUCKETS + 1); j++)
+            dst->histogram[i][j] += __get(&(src->histogram[i][j]));
+        dst->histogram_sum[i] += __get(&(src->histogram_sum[i]));
+    }
+}
+
+/* Called on thread exit: fold the thread's block into the retired one. */
+static void __block_destroy(void *arg)
+{
+    metrics_block_t *block = arg;
+    metrics_block_t **ref;
+
+    thread_mutex_lock(&_metrics_mutex);
+    for (ref = &_metrics_blocks; *ref; ref = &((*ref)->next)) {
+        if (*ref == block) {
+            *ref = block->next;
+            break;
+        }
+    }
+    __block_sum(&_metrics_retired, block);
+    thread_mutex_unlock(&_metrics_mutex);
+
+    free(block);
+}
+
+static metrics_block_t *__block_get(void)
+{
+    metrics_block_t *block;
+
+    if (!_initialized)
+        return NULL;
+
+    block = pthread_getspecific(_metrics_key);
+    if (block)
+        return block;
+
+    block = calloc(1, sizeof(*block));
+    if (!block)
+        return NULL;
+
+    thread_mutex_lock(&_metrics_mutex);
+    block->next = _metrics_blocks;
+    _metrics_blocks = block;
+    thread_mutex_unlock(&_metrics_mutex);
+
+    pthread_setspecific(_metrics_key, block);
+
+    return block;
+}
+
+void metrics_initialize(void)
+{
+    if (_initialized)
+        return;
+
+    if (pthread_key_create(&_metrics_key, __block_destroy) != 0) {
+        ICECAST_LOG_ERROR("Can not create thread key, metrics are disabled.");
+        return;
+    }
+
+    thread_mutex_create(&_metrics_mutex);
+    _metrics_blocks = NULL;
+    memset(&_metrics_retired, 0, sizeof(_metrics_retired));
+
+    _initialized = 1;
+}
+
+/* This must be called after all other threads have been stopped. */
+void metrics_shutdown(void)
+{
+    metrics_block_t *block;
+
+    if (!_initialized)
+        return;
+
+    _initialized = 0;
+
+    pthread_setspecific(_metrics_key, NULL);
+    pthread_key_delete(_metrics_key);
+
+    thread_mutex_lock(&_metrics_mutex);
+    while ((block = _metrics_blocks)) {
+        _metrics_blocks = block->next;
+        free(block);
+    }
+    thread_mutex_unlock(&_metrics_mutex);
+    thread_mutex_destroy(&_metrics_mutex);
+}
+
+uint64_t metrics_time(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        return 0;
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_counter_inc(metrics_counter_t counter)
+{
+    metrics_block_t *block;
+
+    if (counter < 0 || counter >= METRICS_COUNTER__END)
+        return;
+
+    block = __block_get();
+    if (block)
+        __add(&(block->counter[counter]), 1);
+}
+
+void metrics_gauge_add(metrics_gauge_t gauge, int64_t value)
+{
+    metrics_block_t *block;
+
+    if (gauge < 0 || gauge >= METRICS_GAUGE__END)
+        return;
+
+    block = __block_get();
+    if (block)
+        __add(&(block->gauge[gauge]), (uint64_t)value);
+}
+
+void metrics_histogram_observe(metrics_histogram_t histogram, uint64_t value)
+{
+    metrics_block_t *block;
+    size_t bucket;
+
+    if (histogram < 0 || histogram >= METRICS_HISTOGRAM__END)
+        return;
+
+    block = __block_get();
+    if (!block)
+        return;
+
+    /* find the smallest i with value <= 2^i */
+    if (value <= 1) {
+        bucket = 0;
+    } else {
+        bucket = 64 - __builtin_clzll(value - 1);
+        if (bucket > METRICS_HISTOGRAM_BUCKETS)
+            bucket = METRICS_HISTOGRAM_BUCKETS;
+    }
+
+    __add(&(block->histogram[histogram][bucket]), 1);
+    __add(&(block->histogram_sum[histogram]), value);
+}
+
+static void __render_label_value(buffer_t *buffer, const char *value)
+{
+    for (; *value; value++) {
+        switch (*value) {
+            case '\\':
+                buffer_push_string(buffer, "\\\\");
+            break;
+            case '"':
+                buffer_push_string(buffer, "\\\"");
+            break;
+            case '\n':
+                buffer_push_string(buffer, "\\n");
+            break;
+            default:
+                buffer_push_data(buffer, value, 1);
+            break;
+        }
+    }
+}
+
+static void __render_histogram(buffer_t *buffer, const metrics_histogram_info_t *info, const uint64_t *buckets, uint64_t sum)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    buffer_push_printf(buffer, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+    for (i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        count += buckets[i];
+        buffer_push_printf(buffer, "%s_bucket{le=\"%.9g\"} %llu\n", info->name, (double)(1ULL << i) / info->scale, (unsigned long long int)count);
+    }
+    count += buckets[METRICS_HISTOGRAM_BUCKETS];
+    buffer_push_printf(buffer, "%s_bucket{le=\"+Inf\"} %llu\n", info->name, (unsigned long long int)count);
+    buffer_push_printf(buffer, "%s_sum %.9g\n", info->name, (double)sum / info->scale);
+    buffer_push_printf(buffer, "%s_count %llu\n", info->name, (unsigned long long int)count);
+}
+
+static void __render_sources(buffer_t *buffer)
+{
+    avl_node *node;
+
+    buffer_push_string(buffer, "# HELP icecast_source_queue_bytes Bytes in the source's queue.\n# TYPE icecast_source_queue_bytes gauge\n");
+
+    avl_tree_rlock(global.source_tree);
+    for (node = avl_get_first(global.source_tree); node; node = avl_get_next(node)) {
+        source_t *source = (source_t *)node->key;
+
+        if (!source->running)
+            continue;
+
+        buffer_push_string(buffer, "icecast_source_queue_bytes{mount=\"");
+        __render_label_value(buffer, source->mount);
+        buffer_push_printf(buffer, "\"} %u\n", source->queue_size);
+    }
+    avl_tree_unlock(global.source_tree);
+}
+
+int metrics_render(buffer_t *buffer)
+{
+    metrics_block_t sum;
+    metrics_block_t *block;
+    size_t i;
+
+    if (!_initialized || !buffer)
+        return -1;
+
+    memset(&sum, 0, sizeof(sum));
+
+    thread_mutex_lock(&_metrics_mutex);
+    __block_sum(&sum, &_metrics_retired);
+    for (block = _metrics_blocks; block; block = block->next)
+        __block_sum(&sum, block);
+    thread_mutex_unlock(&_metrics_mutex);
+
+    for (i = 0; i < METRICS_COUNTER__END; i++) {
+        buffer_push_printf(buffer, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                counter_info[i].name, counter_info[i].help, counter_info[i].name,
+                counter_info[i].name, (unsigned long long int)sum.counter[i]);
+    }
+
+    for (i = 0; i < METRICS_GAUGE__END; i++) {
+        buffer_push_printf(buffer, "# HELP %s %s\n# TYPE %s gauge\n%s %lli\n",
+                gauge_info[i].name, gauge_info[i].help, gauge_info[i].name,
+                gauge_info[i].name, (long long int)(int64_t)sum.gauge[i]);
+    }
+
+    for (i = 0; i < METRICS_HISTOGRAM__END; i++)
+        __render_histogram(buffer, &(histogram_info[i]), sum.histogram[i], sum.histogram_sum[i]);
+
+    __render_sources(buffer);
+
+    return 0;
+}
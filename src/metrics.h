@@ -0,0 +1,99 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/* This file contains the API for the internal metrics.
+ *
+ * Metrics are cheap counters and histograms recorded on the hot paths.
+ * Each thread records into its own block of counters so recording does not
+ * need any locks. Blocks are only summed up when metrics are rendered
+ * (e.g. when /admin/metrics is requested).
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+#include "icecasttypes.h"
+
+/* Number of buckets in each histogram, not counting the +Inf bucket.
+ * Bucket i counts values <= 2^i.
+ */
+#define METRICS_HISTOGRAM_BUCKETS       24
+
+typedef enum {
+    /* Writes to clients that failed with a recoverable error (EAGAIN) */
+    METRICS_COUNTER_SEND_EAGAIN = 0,
+    /* Calls to send_to_listener() that had to stop as the per-call limit was reached */
+    METRICS_COUNTER_SEND_LIMITED,
+    /* Connection blocks that had to be allocated as the pool was empty */
+    METRICS_COUNTER_CONNECTION_BLOCK_ALLOC,
+    /* Extra chunks allocated for connections that outgrew their block */
+    METRICS_COUNTER_CONNECTION_CHUNK_ALLOC,
+    /* TLS connections that send through kernel TLS after the handshake */
+    METRICS_COUNTER_TLS_KTLS_SEND,
+    /* Completed TLS handshakes */
+    METRICS_COUNTER_TLS_HANDSHAKE,
+    /* TLS handshakes that resumed a session from the cache or a ticket */
+    METRICS_COUNTER_TLS_RESUMED,
+    /* TLS ticket keys that were replaced by a new key */
+    METRICS_COUNTER_TLS_TICKET_KEY_ROTATION,
+    /* Events dropped as the event queue or the queue of a registration was full */
+    METRICS_COUNTER_EVENT_DROPPED,
+    METRICS_COUNTER__END /* must be last element */
+} metrics_counter_t;
+
+typedef enum {
+    /* Stats events queued but not yet processed by the stats thread */
+    METRICS_GAUGE_STATS_QUEUE_DEPTH = 0,
+    /* Clients waiting for an auth thread */
+    METRICS_GAUGE_AUTH_QUEUE_DEPTH,
+    /* Sessions in the TLS session cache */
+    METRICS_GAUGE_TLS_SESSION_CACHE,
+    /* TLS connections waiting for a handshake thread or for their handshake to complete */
+    METRICS_GAUGE_TLS_HANDSHAKE_QUEUE_DEPTH,
+    /* Events waiting for the event dispatcher or for delivery to a registration */
+    METRICS_GAUGE_EVENT_QUEUE_DEPTH,
+    METRICS_GAUGE__END /* must be last element */
+} metrics_gauge_t;
+
+typedef enum {
+    /* Bytes written per call of send_to_listener() */
+    METRICS_HISTOGRAM_SEND_BYTES = 0,
+    /* Write iterations per call of send_to_listener() */
+    METRICS_HISTOGRAM_SEND_ITERATIONS,
+    /* Time in microseconds from accept() to the first byte sent */
+    METRICS_HISTOGRAM_FIRST_BYTE,
+    /* Time in microseconds a client spent in the request queue until the headers were complete */
+    METRICS_HISTOGRAM_HEADER_WAIT,
+    /* Time in microseconds a client waited in an auth queue */
+    METRICS_HISTOGRAM_AUTH_QUEUE,
+    /* Time in microseconds a TLS connection waited for a handshake thread */
+    METRICS_HISTOGRAM_TLS_HANDSHAKE_QUEUE,
+    /* Time in microseconds from handing a TLS connection to the handshake threads until its handshake completed */
+    METRICS_HISTOGRAM_TLS_HANDSHAKE,
+    /* Time in microseconds from emitting an event until its delivery to a registration started */
+    METRICS_HISTOGRAM_EVENT_QUEUE,
+    METRICS_HISTOGRAM__END /* must be last element */
+} metrics_histogram_t;
+
+void metrics_initialize(void);
+void metrics_shutdown(void);
+
+/* Returns a monotonic timestamp in microseconds. */
+uint64_t metrics_time(void);
+
+/* Recording functions, those can be called from any thread. */
+void metrics_counter_inc(metrics_counter_t counter);
+void metrics_gauge_add(metrics_gauge_t gauge, int64_t value);
+void metrics_histogram_observe(metrics_histogram_t histogram, uint64_t value);
+
+/* Renders all metrics in the Prometheus text exposition format. */
+int  metrics_render(buffer_t *buffer);
+
+#endif  /* __METRICS_H__ */
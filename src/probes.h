@@ -0,0 +1,44 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/* This file contains the macros for static tracepoints (USDT).
+ *
+ * Probes are only compiled in if Icecast was configured with USDT support
+ * (see --enable-usdt). They compile to a single nop in that case and can be
+ * attached to at runtime by tools like bpftrace, perf or SystemTap using
+ * the provider name "icecast". If USDT support is disabled, the macros
+ * expand to nothing and arguments are not evaluated.
+ *
+ * Arguments must be integers or pointers. Connection IDs are passed as
+ * connection_id_t, strings (mount, IP, URI) as char pointers.
+ *
+ * Sample scripts can be found in examples/bpftrace/.
+ */
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define ICECAST_PROBE1(name,a)              DTRACE_PROBE1(icecast, name, a)
+#define ICECAST_PROBE2(name,a,b)            DTRACE_PROBE2(icecast, name, a, b)
+#define ICECAST_PROBE3(name,a,b,c)          DTRACE_PROBE3(icecast, name, a, b, c)
+#define ICECAST_PROBE4(name,a,b,c,d)        DTRACE_PROBE4(icecast, name, a, b, c, d)
+#else
+#define ICECAST_PROBE1(name,a)              do { } while (0)
+#define ICECAST_PROBE2(name,a,b)            do { } while (0)
+#define ICECAST_PROBE3(name,a,b,c)          do { } while (0)
+#define ICECAST_PROBE4(name,a,b,c,d)        do { } while (0)
+#endif
+
+#endif  /* __PROBES_H__ */
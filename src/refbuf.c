@@ -24,40 +24,115 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "common/thread/thread.h"
+
 #include "refbuf.h"
 
 #define CATMODULE "refbuf"
 
 #include "logging.h"
 
+/* Every client gets a buffer of PER_CLIENT_REFBUF_SIZE bytes. Released ones
+ * are kept (with their data) for the next client.
+ */
+#define REFBUF_POOL_MAX     256
+
+static spin_t _refbuf_pool_lock; // protects _refbuf_pool, _refbuf_pool_len
+static refbuf_t *_refbuf_pool = NULL;
+static size_t _refbuf_pool_len = 0;
+static int _initialized = 0;
 
 void refbuf_initialize(void)
 {
+    if (_initialized)
+        return;
+
+    thread_spin_create(&_refbuf_pool_lock);
+    _initialized = 1;
 }
 
 void refbuf_shutdown(void)
 {
+    if (!_initialized)
+        return;
+
+    _initialized = 0;
+
+    thread_spin_lock(&_refbuf_pool_lock);
+    while (_refbuf_pool) {
+        refbuf_t *refbuf = _refbuf_pool;
+        _refbuf_pool = refbuf->next;
+        free(refbuf->data);
+        free(refbuf);
+    }
+    _refbuf_pool_len = 0;
+    thread_spin_unlock(&_refbuf_pool_lock);
+    thread_spin_destroy(&_refbuf_pool_lock);
 }
 
-refbuf_t *refbuf_new (unsigned int size)
+static refbuf_t *refbuf_pool_get(void)
 {
     refbuf_t *refbuf;
 
-    refbuf = (refbuf_t *)malloc(sizeof(refbuf_t));
-    if (refbuf == NULL)
-        abort();
-    refbuf->data = NULL;
-    if (size)
-    {
-        refbuf->data = malloc (size);
-        if (refbuf->data == NULL)
+    if (!_initialized)
+        return NULL;
+
+    thread_spin_lock(&_refbuf_pool_lock);
+    refbuf = _refbuf_pool;
+    if (refbuf) {
+        _refbuf_pool = refbuf->next;
+        _refbuf_pool_len--;
+    }
+    thread_spin_unlock(&_refbuf_pool_lock);
+
+    return refbuf;
+}
+
+/* data may have been grown by realloc() but is never smaller than PER_CLIENT_REFBUF_SIZE */
+static int refbuf_pool_put(refbuf_t *refbuf)
+{
+    int ret = 0;
+
+    if (!_initialized || !refbuf->data)
+        return 0;
+
+    thread_spin_lock(&_refbuf_pool_lock);
+    if (_refbuf_pool_len < REFBUF_POOL_MAX) {
+        refbuf->next = _refbuf_pool;
+        _refbuf_pool = refbuf;
+        _refbuf_pool_len++;
+        ret = 1;
+    }
+    thread_spin_unlock(&_refbuf_pool_lock);
+
+    return ret;
+}
+
+refbuf_t *refbuf_new (unsigned int size)
+{
+    refbuf_t *refbuf = NULL;
+
+    if (size == PER_CLIENT_REFBUF_SIZE)
+        refbuf = refbuf_pool_get();
+
+    if (refbuf == NULL) {
+        refbuf = (refbuf_t *)malloc(sizeof(refbuf_t));
+        if (refbuf == NULL)
             abort();
+        refbuf->data = NULL;
+        if (size)
+        {
+            refbuf->data = malloc (size);
+            if (refbuf->data == NULL)
+                abort();
+        }
     }
     refbuf->len = size;
     refbuf->sync_point = 0;
     refbuf->_count = 1;
     refbuf->next = NULL;
     refbuf->associated = NULL;
+    refbuf->_pooled = size == PER_CLIENT_REFBUF_SIZE;
 
     return refbuf;
 }
@@ -91,6 +166,8 @@ void refbuf_release(refbuf_t *self)
         refbuf_release_associated (self->associated);
         if (self->next)
             ICECAST_LOG_ERROR("next not null");
+        if (self->_pooled && refbuf_pool_put(self))
+            return;
         free(self->data);
         free(self);
     }
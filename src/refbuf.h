@@ -26,6 +26,8 @@ typedef struct _refbuf_tag
     struct _refbuf_tag *associated;
     struct _refbuf_tag *next;
     int sync_point;
+    /* buffer is returned to the pool on release */
+    int _pooled;
 
 } refbuf_t;
 
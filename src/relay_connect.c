@@ -0,0 +1,2216 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/**
+ * Relay connection manager: one thread connecting all relays to their upstreams,
+ * names of upstreams are looked up by a few resolver threads. Hot standby and
+ * shared streams are read by a stream thread of their own.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#ifdef HAVE_POLL
+#include <poll.h>
+#else
+#include <sys/select.h>
+#endif
+
+#include "compat.h"
+
+#include "common/thread/thread.h"
+#include "common/net/sock.h"
+#include "common/httpp/httpp.h"
+#include "common/timing/timing.h"
+
+#include "relay_connect.h"
+#include "cfgfile.h"
+#include "global.h"
+#include "util.h"
+#include "connection.h"
+#include "client.h"
+#include "format.h"
+#include "prng.h"
+
+#include "logging.h"
+#define CATMODULE "relay-connect"
+
+/* delay between starting parallel attempts, in ms */
+#define RELAY_CONNECT_STAGGER           250
+/* timeout for the TCP connect of a single attempt, in ms */
+#define RELAY_CONNECT_TIMEOUT           10000
+#define RELAY_CONNECT_MAX_REDIRECTS     10
+#define RELAY_CONNECT_HEADER_SIZE       4096
+/* poll timeout of the connector thread, in ms */
+#define RELAY_CONNECT_TICK              100
+/* limits of the data a hot standby keeps: the Ogg headers and the data since the last sync point */
+#define RELAY_CONNECT_STANDBY_HEAD      (64*1024)
+#define RELAY_CONNECT_STANDBY_DATA      (1024*1024)
+/* size of reads from a hot standby or shared stream */
+#define RELAY_CONNECT_STANDBY_READ      4096
+/* send buffer towards each relay sharing an upstream */
+#define RELAY_CONNECT_SHARED_BUFFER     (512*1024)
+/* threads resolving upstream names, so a slow lookup does not stall the connector */
+#define RELAY_CONNECT_RESOLVERS         2
+
+/* the ID of EBML Cluster elements */
+static const char __ebml_cluster[4] = {0x1F, 0x43, (char)0xB6, 0x75};
+/* bytes needed to check a Cluster: ID, size, CRC-32 element and Timestamp element */
+#define RELAY_CONNECT_EBML_CLUSTER_PEEK (4 + 8 + 6 + 1 + 8)
+
+typedef struct {
+    char *server;
+    int port;
+    char *mount;
+    char *bind;
+    char *auth_header;
+    int mp3metadata;
+} relay_connect_upstream_t;
+
+#ifdef HAVE_GETADDRINFO
+/* A name lookup done by a resolver thread. All fields but next are
+ * protected by _resolve_mutex.
+ */
+typedef struct relay_connect_resolve_tag relay_connect_resolve_t;
+struct relay_connect_resolve_tag {
+    char *server;
+    int port;
+    char *bind;
+    int done;
+    /* set if the attempt was freed while resolving, the resolver frees the lookup */
+    int cancelled;
+    struct addrinfo *res;
+    struct addrinfo *bind_res;
+    relay_connect_resolve_t *next;
+};
+#endif
+
+typedef enum {
+    /* not yet started, address may still need resolving */
+    ATTEMPT_QUEUED,
+    ATTEMPT_CONNECTING,
+    ATTEMPT_SENDING,
+    ATTEMPT_READING
+} relay_connect_attempt_state_t;
+
+typedef struct relay_connect_attempt_tag relay_connect_attempt_t;
+struct relay_connect_attempt_tag {
+    /* settings this attempt belongs to, owned by the request */
+    const relay_connect_upstream_t *upstream;
+    /* current target, differs from upstream after a redirect */
+    char *server;
+    int port;
+    char *mount;
+    int redirects;
+#ifdef HAVE_GETADDRINFO
+    int resolved;
+    /* name lookup in progress, or NULL */
+    relay_connect_resolve_t *resolve;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct sockaddr_storage bind_addr;
+    socklen_t bind_addrlen;
+#endif
+    relay_connect_attempt_state_t state;
+    sock_t sock;
+    uint64_t deadline;
+    char *request;
+    size_t request_len;
+    size_t request_offset;
+    char header[RELAY_CONNECT_HEADER_SIZE];
+    size_t header_len;
+    relay_connect_attempt_t *next;
+};
+
+typedef enum {
+    ICY_AUDIO,
+    ICY_LENGTH,
+    ICY_META
+} relay_connect_icy_state_t;
+
+/* State of a hot standby or shared stream. Set up by the connector thread,
+ * then only used with the connector locked.
+ */
+typedef struct {
+    client_t *client;
+    format_type_t type;
+    /* Ogg: header pages, EBML: data before the first Cluster. These are
+     * sent in front of the data. head_done is set once they are complete,
+     * or -1 if they did not fit.
+     */
+    char *head;
+    size_t head_len;
+    int head_done;
+    /* data since the last sync point */
+    char *data;
+    size_t data_len;
+    /* set if data starts at a sync point */
+    int synced;
+    /* socket polled by __stream_wait(), or SOCK_ERROR */
+    sock_t polled;
+    /* shared streams: the response header, parsed again for each subscriber */
+    char *response;
+    size_t response_len;
+    /* shared streams with inline metadata: subscribers join after a metadata block */
+    size_t metaint;
+    size_t icy_left;
+    relay_connect_icy_state_t icy_state;
+} relay_connect_stream_t;
+
+struct relay_connect_tag {
+    char *localmount;
+    char *server_id;
+    int header_timeout;
+    relay_connect_upstream_t *upstream;
+    size_t upstreams;
+    /* attempts not yet started, in order */
+    relay_connect_attempt_t *queued;
+    /* attempts in flight */
+    relay_connect_attempt_t *active;
+    uint64_t next_start;
+    /* number of attempts polled by __wait() */
+    size_t polled;
+    /* upstream the stream came from, set before the state changes */
+    const relay_connect_upstream_t *streaming;
+    /* the stream is kept as hot standby instead of calling on_stream */
+    int is_standby;
+    /* The stream is kept and copied to the subscribers. Shared requests
+     * are internal, they use the state RELAY_CONNECT_STANDBY while streaming.
+     */
+    int is_shared;
+    char *key;
+    relay_connect_stream_t stream;
+    /* subscribers of a shared request: the request and the socket the stream
+     * is copied to, only used by the connector thread.
+     */
+    relay_connect_t *shared;
+    sock_t sub_sock;
+    /* protected by _connect_mutex */
+    relay_connect_state_t state;
+    int released;
+    /* subscribers of a shared request, and the link of that list */
+    relay_connect_t *subscribers;
+    relay_connect_t *sub_next;
+    /* Set once the request is on the stream thread's list, the stream
+     * thread frees it after the connector unlinked it.
+     */
+    int streamed;
+    int unlinked;
+    relay_connect_t *stream_next;
+    relay_connect_callback_t on_stream;
+    void *userdata;
+    relay_connect_t *next;
+};
+
+static mutex_t _connect_mutex; /* protects _connect_running, _connect_wakeup, _connect_list, _stream_wakeup, _stream_list, and state, released, subscribers and stream list links of all requests */
+static cond_t _connect_cond;
+static int _connect_running = 0;
+static int _connect_wakeup = 0;
+static relay_connect_t *_connect_list;
+static thread_type *_connect_thread;
+static cond_t _stream_cond;
+static int _stream_wakeup = 0;
+static relay_connect_t *_stream_list;
+static thread_type *_stream_thread;
+
+#ifdef HAVE_GETADDRINFO
+static mutex_t _resolve_mutex; /* protects _resolve_running, _resolve_queue and the lookups */
+static cond_t _resolve_cond;
+static int _resolve_running = 0;
+static relay_connect_resolve_t *_resolve_queue;
+static relay_connect_resolve_t **_resolve_queue_tail;
+static thread_type *_resolve_threads[RELAY_CONNECT_RESOLVERS];
+
+static void *__resolve_thread(void *arg);
+#endif
+static void *__connect_thread(void *arg);
+static void *__stream_thread(void *arg);
+static void __request_free(relay_connect_t *connect);
+
+void relay_connect_initialize(void)
+{
+#ifdef HAVE_GETADDRINFO
+    size_t i;
+
+    thread_mutex_create(&_resolve_mutex);
+    thread_cond_create(&_resolve_cond);
+    _resolve_queue = NULL;
+    _resolve_queue_tail = &_resolve_queue;
+    _resolve_running = 1;
+    for (i = 0; i < RELAY_CONNECT_RESOLVERS; i++)
+        _resolve_threads[i] = thread_create("Relay Resolver", __resolve_thread, NULL, THREAD_ATTACHED);
+#endif
+
+    thread_mutex_create(&_connect_mutex);
+    thread_cond_create(&_connect_cond);
+    thread_cond_create(&_stream_cond);
+    _connect_list = NULL;
+    _stream_list = NULL;
+    _connect_running = 1;
+    _connect_thread = thread_create("Relay Connector", __connect_thread, NULL, THREAD_ATTACHED);
+    _stream_thread = thread_create("Relay Streams", __stream_thread, NULL, THREAD_ATTACHED);
+}
+
+void relay_connect_shutdown(void)
+{
+    thread_mutex_lock(&_connect_mutex);
+    if (!_connect_running) {
+        thread_mutex_unlock(&_connect_mutex);
+        return;
+    }
+    _connect_running = 0;
+    thread_cond_signal(&_connect_cond);
+    thread_cond_signal(&_stream_cond);
+    thread_mutex_unlock(&_connect_mutex);
+
+    thread_join(_connect_thread);
+    thread_join(_stream_thread);
+
+    /* Nobody can add requests anymore. Requests on the stream list that
+     * are still linked are freed with the main list.
+     */
+    while (_stream_list) {
+        relay_connect_t *next = _stream_list->stream_next;
+        if (_stream_list->unlinked)
+            __request_free(_stream_list);
+        _stream_list = next;
+    }
+    while (_connect_list) {
+        relay_connect_t *next = _connect_list->next;
+        __request_free(_connect_list);
+        _connect_list = next;
+    }
+
+#ifdef HAVE_GETADDRINFO
+    {
+        size_t i;
+
+        /* the connector is gone, so all lookups left are cancelled */
+        thread_mutex_lock(&_resolve_mutex);
+        _resolve_running = 0;
+        thread_cond_broadcast(&_resolve_cond);
+        thread_mutex_unlock(&_resolve_mutex);
+
+        for (i = 0; i < RELAY_CONNECT_RESOLVERS; i++)
+            if (_resolve_threads[i])
+                thread_join(_resolve_threads[i]);
+
+        thread_cond_destroy(&_resolve_cond);
+        thread_mutex_destroy(&_resolve_mutex);
+    }
+#endif
+
+    /* resolvers wake up the connector, so this is destroyed last */
+    thread_cond_destroy(&_stream_cond);
+    thread_cond_destroy(&_connect_cond);
+    thread_mutex_destroy(&_connect_mutex);
+}
+
+#ifdef HAVE_GETADDRINFO
+static void __resolve_free(relay_connect_resolve_t *resolve)
+{
+    if (resolve->res)
+        freeaddrinfo(resolve->res);
+    if (resolve->bind_res)
+        freeaddrinfo(resolve->bind_res);
+    free(resolve->server);
+    free(resolve->bind);
+    free(resolve);
+}
+
+/* Drops the lookup of an attempt, a pending one is freed by its resolver. */
+static void __resolve_cancel(relay_connect_resolve_t *resolve)
+{
+    int done;
+
+    thread_mutex_lock(&_resolve_mutex);
+    done = resolve->done;
+    resolve->cancelled = 1;
+    thread_mutex_unlock(&_resolve_mutex);
+
+    if (done)
+        __resolve_free(resolve);
+}
+
+static void *__resolve_thread(void *arg)
+{
+    (void)arg;
+
+    thread_mutex_lock(&_resolve_mutex);
+    while (1) {
+        relay_connect_resolve_t *resolve = _resolve_queue;
+        struct addrinfo hints, *res = NULL, *bind_res = NULL;
+        char service[8];
+        int cancelled;
+
+        if (!resolve) {
+            if (!_resolve_running)
+                break;
+            thread_cond_timedwait_mutex(&_resolve_cond, &_resolve_mutex, 1000);
+            continue;
+        }
+
+        _resolve_queue = resolve->next;
+        if (!_resolve_queue)
+            _resolve_queue_tail = &_resolve_queue;
+        /* nobody waits for cancelled lookups or the ones queued at shutdown */
+        if (resolve->cancelled || !_resolve_running) {
+            __resolve_free(resolve);
+            continue;
+        }
+        thread_mutex_unlock(&_resolve_mutex);
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(service, sizeof(service), "%u", (unsigned int)resolve->port);
+        if (getaddrinfo(resolve->server, service, &hints, &res) != 0)
+            res = NULL;
+        if (res && resolve->bind && getaddrinfo(resolve->bind, NULL, &hints, &bind_res) != 0)
+            bind_res = NULL;
+
+        thread_mutex_lock(&_resolve_mutex);
+        resolve->res = res;
+        resolve->bind_res = bind_res;
+        resolve->done = 1;
+        cancelled = resolve->cancelled;
+        thread_mutex_unlock(&_resolve_mutex);
+
+        if (cancelled) {
+            __resolve_free(resolve);
+        } else {
+            thread_mutex_lock(&_connect_mutex);
+            _connect_wakeup = 1;
+            thread_cond_signal(&_connect_cond);
+            thread_mutex_unlock(&_connect_mutex);
+        }
+
+        thread_mutex_lock(&_resolve_mutex);
+    }
+    thread_mutex_unlock(&_resolve_mutex);
+
+    return NULL;
+}
+#endif
+
+static void __attempt_free(relay_connect_attempt_t *attempt)
+{
+#ifdef HAVE_GETADDRINFO
+    if (attempt->resolve)
+        __resolve_cancel(attempt->resolve);
+#endif
+    if (attempt->sock != SOCK_ERROR)
+        sock_close(attempt->sock);
+    free(attempt->server);
+    free(attempt->mount);
+    free(attempt->request);
+    free(attempt);
+}
+
+static void __attempt_list_free(relay_connect_attempt_t *attempt)
+{
+    while (attempt) {
+        relay_connect_attempt_t *next = attempt->next;
+        __attempt_free(attempt);
+        attempt = next;
+    }
+}
+
+static relay_connect_attempt_t *__attempt_new(const relay_connect_upstream_t *upstream, const char *server, int port, const char *mount, int redirects)
+{
+    relay_connect_attempt_t *attempt = calloc(1, sizeof(*attempt));
+
+    if (!attempt)
+        return NULL;
+
+    attempt->upstream = upstream;
+    attempt->server = strdup(server);
+    attempt->port = port;
+    attempt->mount = strdup(mount);
+    attempt->redirects = redirects;
+    attempt->state = ATTEMPT_QUEUED;
+    attempt->sock = SOCK_ERROR;
+
+    if (!attempt->server || !attempt->mount) {
+        __attempt_free(attempt);
+        return NULL;
+    }
+
+    return attempt;
+}
+
+static void __stream_clear(relay_connect_stream_t *stream)
+{
+    if (stream->client)
+        client_destroy(stream->client);
+    free(stream->head);
+    free(stream->data);
+    free(stream->response);
+    memset(stream, 0, sizeof(*stream));
+}
+
+static void __request_free(relay_connect_t *connect)
+{
+    size_t i;
+
+    __attempt_list_free(connect->queued);
+    __attempt_list_free(connect->active);
+    __stream_clear(&(connect->stream));
+
+    if (connect->sub_sock != SOCK_ERROR)
+        sock_close(connect->sub_sock);
+
+    for (i = 0; i < connect->upstreams; i++) {
+        free(connect->upstream[i].server);
+        free(connect->upstream[i].mount);
+        free(connect->upstream[i].bind);
+        free(connect->upstream[i].auth_header);
+    }
+
+    free(connect->upstream);
+    free(connect->localmount);
+    free(connect->server_id);
+    free(connect->key);
+    free(connect);
+}
+
+#define _GET_UPSTREAM_SETTING(n) ((upstream && upstream->n) ? upstream->n : config->upstream_default.n)
+static int __upstream_copy(relay_connect_upstream_t *dst, const relay_config_t *config, const relay_config_upstream_t *upstream)
+{
+    const char *server = _GET_UPSTREAM_SETTING(server);
+    const char *mount = _GET_UPSTREAM_SETTING(mount);
+    const char *username = _GET_UPSTREAM_SETTING(username);
+    const char *password = _GET_UPSTREAM_SETTING(password);
+    const char *bind = _GET_UPSTREAM_SETTING(bind);
+
+    if (!server || !mount)
+        return -1;
+
+    dst->server = strdup(server);
+    dst->port = _GET_UPSTREAM_SETTING(port);
+    dst->mount = strdup(mount);
+    dst->bind = bind ? strdup(bind) : NULL;
+    dst->mp3metadata = _GET_UPSTREAM_SETTING(mp3metadata);
+
+    /* build any authentication header before connecting */
+    if (username && password) {
+        char *esc_authorisation;
+        char *userpass;
+        size_t len = strlen(username) + strlen(password) + 2;
+
+        userpass = malloc(len);
+        if (userpass) {
+            snprintf(userpass, len, "%s:%s", username, password);
+            esc_authorisation = util_base64_encode(userpass, len);
+            free(userpass);
+            if (esc_authorisation) {
+                len = strlen(esc_authorisation) + 24;
+                dst->auth_header = malloc(len);
+                if (dst->auth_header)
+                    snprintf(dst->auth_header, len, "Authorization: Basic %s\r\n", esc_authorisation);
+                free(esc_authorisation);
+            }
+        }
+    } else {
+        dst->auth_header = strdup("");
+    }
+
+    if (!dst->server || !dst->mount || !dst->auth_header)
+        return -1;
+
+    return 0;
+}
+
+static relay_connect_t *__request_alloc(const relay_config_t *config, relay_connect_callback_t on_stream, void *userdata)
+{
+    relay_connect_t *connect = calloc(1, sizeof(*connect));
+
+    if (!connect)
+        return NULL;
+
+    connect->localmount = strdup(config->localmount);
+    connect->on_stream = on_stream;
+    connect->userdata = userdata;
+    connect->sub_sock = SOCK_ERROR;
+    connect->state = RELAY_CONNECT_CONNECTING;
+
+    if (!connect->localmount) {
+        __request_free(connect);
+        return NULL;
+    }
+
+    return connect;
+}
+
+/* Sets up a request with attempts to all upstreams but the one with the index exclude. */
+static relay_connect_t *__request_new(const relay_config_t *config, relay_connect_callback_t on_stream, void *userdata, ssize_t exclude)
+{
+    relay_connect_t *connect;
+    relay_connect_attempt_t **tail;
+    ice_config_t *ice_config;
+    size_t i;
+
+    connect = __request_alloc(config, on_stream, userdata);
+    if (!connect)
+        return NULL;
+
+    ice_config = config_get_config();
+    connect->server_id = strdup(ice_config->server_id);
+    connect->header_timeout = ice_config->header_timeout;
+    config_release_config();
+
+    /* if we have no upstreams defined, use the default upstream */
+    connect->upstreams = config->upstreams ? config->upstreams : 1;
+    connect->upstream = calloc(connect->upstreams, sizeof(*connect->upstream));
+    if (!connect->server_id || !connect->upstream) {
+        connect->upstreams = 0;
+        __request_free(connect);
+        return NULL;
+    }
+
+    tail = &(connect->queued);
+    for (i = 0; i < connect->upstreams; i++) {
+        relay_connect_upstream_t *upstream = &(connect->upstream[i]);
+
+        if (__upstream_copy(upstream, config, config->upstreams ? &(config->upstream[i]) : NULL) != 0) {
+            ICECAST_LOG_ERROR("Can not set up upstream #%zu for relay on mount %#H", i, connect->localmount);
+            continue;
+        }
+
+        if (exclude >= 0 && i == (size_t)exclude)
+            continue;
+
+        *tail = __attempt_new(upstream, upstream->server, upstream->port, upstream->mount, 0);
+        if (*tail)
+            tail = &((*tail)->next);
+    }
+
+    return connect;
+}
+
+/* Adds the request to the list of the connector thread. Called with the connector locked. */
+static void __request_link(relay_connect_t *connect)
+{
+    connect->next = _connect_list;
+    _connect_list = connect;
+    _connect_wakeup = 1;
+    thread_cond_signal(&_connect_cond);
+}
+
+static relay_connect_t *__request_start(relay_connect_t *connect)
+{
+    if (!connect)
+        return NULL;
+
+    thread_mutex_lock(&_connect_mutex);
+    if (!_connect_running) {
+        thread_mutex_unlock(&_connect_mutex);
+        __request_free(connect);
+        return NULL;
+    }
+    __request_link(connect);
+    thread_mutex_unlock(&_connect_mutex);
+
+    return connect;
+}
+
+relay_connect_t *relay_connect_start(const relay_config_t *config, relay_connect_callback_t on_stream, void *userdata)
+{
+    if (!config || !on_stream)
+        return NULL;
+
+    return __request_start(__request_new(config, on_stream, userdata, -1));
+}
+
+relay_connect_t *relay_connect_start_standby(const relay_config_t *config, ssize_t exclude)
+{
+    relay_connect_t *connect;
+
+    if (!config)
+        return NULL;
+
+    connect = __request_new(config, NULL, NULL, exclude);
+    if (connect)
+        connect->is_standby = 1;
+
+    return __request_start(connect);
+}
+
+#ifndef _WIN32
+/* Builds the key shared requests are found by: all settings used to
+ * connect to the upstreams, in order.
+ */
+static char *__request_key(const relay_connect_t *connect)
+{
+    char *key = NULL;
+    size_t len = 0;
+    size_t i;
+
+    for (i = 0; i < connect->upstreams; i++) {
+        const relay_connect_upstream_t *upstream = &(connect->upstream[i]);
+        char *n;
+        int ret;
+
+        if (!upstream->server || !upstream->mount || !upstream->auth_header)
+            continue;
+
+        ret = snprintf(NULL, 0, "%s\n%d\n%s\n%s\n%d\n%s", upstream->server, upstream->port, upstream->mount,
+                upstream->bind ? upstream->bind : "", upstream->mp3metadata, upstream->auth_header);
+        if (ret < 0 || !(n = realloc(key, len + ret + 1))) {
+            free(key);
+            return NULL;
+        }
+        key = n;
+        snprintf(key + len, ret + 1, "%s\n%d\n%s\n%s\n%d\n%s", upstream->server, upstream->port, upstream->mount,
+                upstream->bind ? upstream->bind : "", upstream->mp3metadata, upstream->auth_header);
+        len += ret;
+    }
+
+    return key;
+}
+#endif
+
+relay_connect_t *relay_connect_start_shared(const relay_config_t *config, relay_connect_callback_t on_stream, void *userdata)
+{
+#ifdef _WIN32
+    /* there is no socketpair() to hand the stream to the relays */
+    return relay_connect_start(config, on_stream, userdata);
+#else
+    relay_connect_t *candidate, *shared, *connect;
+
+    if (!config || !on_stream)
+        return NULL;
+
+    /* A new shared request is set up before looking for an existing one,
+     * as this takes the config lock.
+     */
+    candidate = __request_new(config, NULL, NULL, -1);
+    if (!candidate)
+        return NULL;
+    candidate->is_shared = 1;
+    candidate->key = __request_key(candidate);
+
+    connect = __request_alloc(config, on_stream, userdata);
+    if (!candidate->key || !connect) {
+        __request_free(candidate);
+        if (connect)
+            __request_free(connect);
+        return NULL;
+    }
+
+    thread_mutex_lock(&_connect_mutex);
+    if (!_connect_running) {
+        thread_mutex_unlock(&_connect_mutex);
+        __request_free(candidate);
+        __request_free(connect);
+        return NULL;
+    }
+
+    for (shared = _connect_list; shared; shared = shared->next) {
+        if (shared->is_shared && !shared->released && shared->state != RELAY_CONNECT_FAILED && strcmp(shared->key, candidate->key) == 0)
+            break;
+    }
+    if (!shared) {
+        shared = candidate;
+        candidate = NULL;
+        __request_link(shared);
+    }
+
+    connect->shared = shared;
+    connect->sub_next = shared->subscribers;
+    shared->subscribers = connect;
+    __request_link(connect);
+    thread_mutex_unlock(&_connect_mutex);
+
+    if (candidate) {
+        ICECAST_LOG_INFO("Relay on mount %#H shares the upstream connection of mount %#H", connect->localmount, shared->localmount);
+        __request_free(candidate);
+    }
+
+    return connect;
+#endif
+}
+
+relay_connect_state_t relay_connect_get_state(relay_connect_t *connect)
+{
+    relay_connect_state_t ret;
+
+    thread_mutex_lock(&_connect_mutex);
+    ret = connect->state;
+    thread_mutex_unlock(&_connect_mutex);
+
+    return ret;
+}
+
+ssize_t relay_connect_get_upstream(relay_connect_t *connect)
+{
+    ssize_t ret = -1;
+
+    thread_mutex_lock(&_connect_mutex);
+    if (connect->shared) {
+        if (connect->state == RELAY_CONNECT_STREAMING && connect->shared->streaming)
+            ret = connect->shared->streaming - connect->shared->upstream;
+    } else if (connect->state == RELAY_CONNECT_STREAMING || connect->state == RELAY_CONNECT_STANDBY) {
+        ret = connect->streaming - connect->upstream;
+    }
+    thread_mutex_unlock(&_connect_mutex);
+
+    return ret;
+}
+
+client_t *relay_connect_take_standby(relay_connect_t *connect, format_type_t type, const char *contenttype)
+{
+    relay_connect_stream_t *standby = &(connect->stream);
+    const char *standby_contenttype;
+    client_t *client = NULL;
+
+    thread_mutex_lock(&_connect_mutex);
+    do {
+        if (connect->state != RELAY_CONNECT_STANDBY || connect->released)
+            break;
+
+        /* the formats must match, generic streams must be of the same type */
+        if (standby->type != type) {
+            ICECAST_LOG_WARN("Hot standby for relay on mount %#H is of a different format", connect->localmount);
+            break;
+        }
+        standby_contenttype = httpp_getvar(standby->client->parser, "content-type");
+        if (type == FORMAT_TYPE_GENERIC && (!contenttype || !standby_contenttype || strcasecmp(contenttype, standby_contenttype) != 0)) {
+            ICECAST_LOG_WARN("Hot standby for relay on mount %#H is of a different content type", connect->localmount);
+            break;
+        }
+
+        /* replay the Ogg headers and the data since the last sync point */
+        if (type == FORMAT_TYPE_OGG) {
+            if (standby->head_done != 1 || !standby->synced)
+                break;
+            if (standby->data_len) {
+                char *n = realloc(standby->head, standby->head_len + standby->data_len);
+                if (!n)
+                    break;
+                memcpy(n + standby->head_len, standby->data, standby->data_len);
+                standby->head = n;
+                standby->head_len += standby->data_len;
+            }
+            if (connection_read_put_back(standby->client->con, standby->head, standby->head_len) != 0)
+                break;
+        } else if (type == FORMAT_TYPE_EBML) {
+            if (!standby->synced)
+                break;
+            if (standby->data_len && connection_read_put_back(standby->client->con, standby->data, standby->data_len) != 0)
+                break;
+        }
+
+        client = standby->client;
+        standby->client = NULL;
+        connect->state = RELAY_CONNECT_STREAMING;
+    } while (0);
+    thread_mutex_unlock(&_connect_mutex);
+
+    return client;
+}
+
+void relay_connect_release(relay_connect_t *connect)
+{
+    if (!connect)
+        return;
+
+    /* the connector thread frees the request on its next iteration */
+    thread_mutex_lock(&_connect_mutex);
+    connect->released = 1;
+    thread_mutex_unlock(&_connect_mutex);
+}
+
+#ifdef HAVE_GETADDRINFO
+/* Replaces an unresolved attempt with one attempt per address the target
+ * resolved to. ref is the link of the attempt in the queue.
+ * Returns 0 if there is an attempt for any of the addresses.
+ */
+static int __attempt_expand(relay_connect_attempt_t **ref, const struct addrinfo *res, const struct addrinfo *bind_res)
+{
+    relay_connect_attempt_t *attempt = *ref;
+    relay_connect_attempt_t *head = NULL, **tail = &head;
+    const struct addrinfo *ai;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        const struct addrinfo *bind_ai = NULL;
+        relay_connect_attempt_t *n;
+
+        if (ai->ai_addrlen > sizeof(attempt->addr))
+            continue;
+
+        /* the address bound to must be of the same family */
+        if (attempt->upstream->bind) {
+            for (bind_ai = bind_res; bind_ai; bind_ai = bind_ai->ai_next) {
+                if (bind_ai->ai_family == ai->ai_family && bind_ai->ai_addrlen <= sizeof(attempt->bind_addr))
+                    break;
+            }
+            if (!bind_ai)
+                continue;
+        }
+
+        n = __attempt_new(attempt->upstream, attempt->server, attempt->port, attempt->mount, attempt->redirects);
+        if (!n)
+            continue;
+
+        n->resolved = 1;
+        memcpy(&(n->addr), ai->ai_addr, ai->ai_addrlen);
+        n->addrlen = ai->ai_addrlen;
+        if (bind_ai) {
+            memcpy(&(n->bind_addr), bind_ai->ai_addr, bind_ai->ai_addrlen);
+            n->bind_addrlen = bind_ai->ai_addrlen;
+        }
+        *tail = n;
+        tail = &(n->next);
+    }
+
+    *tail = attempt->next;
+    *ref = head ? head : attempt->next;
+    __attempt_free(attempt);
+
+    return head ? 0 : -1;
+}
+
+/* Hands the name lookup of an attempt to the resolver threads. */
+static int __attempt_resolve(relay_connect_attempt_t *attempt)
+{
+    relay_connect_resolve_t *resolve = calloc(1, sizeof(*resolve));
+
+    if (!resolve)
+        return -1;
+
+    resolve->server = strdup(attempt->server);
+    resolve->port = attempt->port;
+    resolve->bind = attempt->upstream->bind ? strdup(attempt->upstream->bind) : NULL;
+    if (!resolve->server || (attempt->upstream->bind && !resolve->bind)) {
+        __resolve_free(resolve);
+        return -1;
+    }
+
+    thread_mutex_lock(&_resolve_mutex);
+    *_resolve_queue_tail = resolve;
+    _resolve_queue_tail = &(resolve->next);
+    thread_cond_signal(&_resolve_cond);
+    thread_mutex_unlock(&_resolve_mutex);
+
+    attempt->resolve = resolve;
+
+    return 0;
+}
+
+/* Resolves the queued attempts. Numeric addresses are used right away,
+ * names are looked up by the resolver threads, so a slow lookup never
+ * blocks the connector thread.
+ */
+static void __request_resolve(relay_connect_t *connect, uint64_t now)
+{
+    relay_connect_attempt_t **ref = &(connect->queued);
+
+    while (*ref) {
+        relay_connect_attempt_t *attempt = *ref;
+        relay_connect_resolve_t *resolve = attempt->resolve;
+        int done;
+
+        if (attempt->resolved) {
+            ref = &(attempt->next);
+            continue;
+        }
+
+        if (!resolve) {
+            struct addrinfo hints, *res = NULL, *bind_res = NULL;
+            char service[8];
+
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_NUMERICHOST;
+            snprintf(service, sizeof(service), "%u", (unsigned int)attempt->port);
+
+            if (getaddrinfo(attempt->server, service, &hints, &res) == 0 &&
+                (!attempt->upstream->bind || getaddrinfo(attempt->upstream->bind, NULL, &hints, &bind_res) == 0)) {
+                if (__attempt_expand(ref, res, bind_res) != 0)
+                    ICECAST_LOG_WARN("No usable address for %s for relay on mount %#H", attempt->server, connect->localmount);
+                freeaddrinfo(res);
+                if (bind_res)
+                    freeaddrinfo(bind_res);
+                continue;
+            }
+            if (res)
+                freeaddrinfo(res);
+
+            if (__attempt_resolve(attempt) != 0) {
+                ICECAST_LOG_ERROR("Can not resolve %s for relay on mount %#H", attempt->server, connect->localmount);
+                *ref = attempt->next;
+                __attempt_free(attempt);
+                continue;
+            }
+
+            /* later attempts wait for the lookup as long as for a connect */
+            attempt->deadline = now + RELAY_CONNECT_STAGGER;
+            ref = &(attempt->next);
+            continue;
+        }
+
+        thread_mutex_lock(&_resolve_mutex);
+        done = resolve->done;
+        thread_mutex_unlock(&_resolve_mutex);
+
+        if (!done) {
+            ref = &(attempt->next);
+            continue;
+        }
+
+        attempt->resolve = NULL;
+        if (!resolve->res) {
+            ICECAST_LOG_WARN("Failed to resolve %s for relay on mount %#H", attempt->server, connect->localmount);
+            *ref = attempt->next;
+            __attempt_free(attempt);
+        } else if (__attempt_expand(ref, resolve->res, resolve->bind_res) != 0) {
+            ICECAST_LOG_WARN("No usable address for %s for relay on mount %#H", attempt->server, connect->localmount);
+        }
+        __resolve_free(resolve);
+    }
+}
+
+static sock_t __attempt_socket(const relay_connect_attempt_t *attempt)
+{
+    sock_t sock = socket(attempt->addr.ss_family, SOCK_STREAM, 0);
+
+    if (sock == SOCK_ERROR)
+        return SOCK_ERROR;
+
+    sock_set_blocking(sock, 0);
+
+    if (attempt->bind_addrlen && bind(sock, (const struct sockaddr *)&(attempt->bind_addr), attempt->bind_addrlen) < 0) {
+        sock_close(sock);
+        return SOCK_ERROR;
+    }
+
+    if (connect(sock, (struct sockaddr *)&(attempt->addr), attempt->addrlen) < 0 && !sock_recoverable(sock_error())) {
+        sock_close(sock);
+        return SOCK_ERROR;
+    }
+
+    return sock;
+}
+#endif
+
+/* Returns the link of the first queued attempt that can be started, or NULL.
+ * Attempts whose name is still looked up are skipped once they held up the
+ * ones behind them for the stagger delay.
+ */
+static relay_connect_attempt_t **__attempt_ready(relay_connect_t *connect, uint64_t now)
+{
+    relay_connect_attempt_t **ref;
+
+    for (ref = &(connect->queued); *ref; ref = &((*ref)->next)) {
+#ifdef HAVE_GETADDRINFO
+        if (!(*ref)->resolved) {
+            if ((*ref)->deadline > now)
+                return NULL;
+            continue;
+        }
+#else
+        (void)now;
+#endif
+        return ref;
+    }
+
+    return NULL;
+}
+
+/* Starts the queued attempt at ref, returns 0 on success or -1 if it failed immediately. */
+static int __attempt_start(relay_connect_t *connect, relay_connect_attempt_t **ref, uint64_t now)
+{
+    relay_connect_attempt_t *attempt = *ref;
+    ssize_t len;
+
+    *ref = attempt->next;
+
+    ICECAST_LOG_INFO("connecting to %s:%d for relay on mount %#H", attempt->server, attempt->port, connect->localmount);
+
+#ifdef HAVE_GETADDRINFO
+    attempt->sock = __attempt_socket(attempt);
+#else
+    attempt->sock = sock_connect_non_blocking(attempt->server, attempt->port);
+#endif
+    if (attempt->sock == SOCK_ERROR) {
+        ICECAST_LOG_WARN("Failed to connect to %s:%d", attempt->server, attempt->port);
+        __attempt_free(attempt);
+        return -1;
+    }
+
+    /* At this point we may not know if we are relaying an mp3 or vorbis
+     * stream, but only send the icy-metadata header if the relay details
+     * state so (the typical case).  It's harmless in the vorbis case. If
+     * we don't send in this header then relay will not have mp3 metadata.
+     * A hot standby can be taken over at any point of the stream, so it is
+     * requested without inline metadata.
+     */
+    len = snprintf(NULL, 0, "GET %s HTTP/1.0\r\n"
+            "User-Agent: %s\r\n"
+            "Host: %s\r\n"
+            "%s"
+            "%s"
+            "\r\n",
+            attempt->mount, connect->server_id, attempt->server,
+            attempt->upstream->mp3metadata && !connect->is_standby ? "Icy-MetaData: 1\r\n" : "",
+            attempt->upstream->auth_header);
+    attempt->request = malloc(len + 1);
+    if (!attempt->request) {
+        __attempt_free(attempt);
+        return -1;
+    }
+    snprintf(attempt->request, len + 1, "GET %s HTTP/1.0\r\n"
+            "User-Agent: %s\r\n"
+            "Host: %s\r\n"
+            "%s"
+            "%s"
+            "\r\n",
+            attempt->mount, connect->server_id, attempt->server,
+            attempt->upstream->mp3metadata && !connect->is_standby ? "Icy-MetaData: 1\r\n" : "",
+            attempt->upstream->auth_header);
+    attempt->request_len = len;
+
+    attempt->state = ATTEMPT_CONNECTING;
+    attempt->deadline = now + RELAY_CONNECT_TIMEOUT;
+    attempt->next = connect->active;
+    connect->active = attempt;
+
+    return 0;
+}
+
+static void __attempt_remove(relay_connect_t *connect, relay_connect_attempt_t *attempt)
+{
+    relay_connect_attempt_t **ref;
+
+    for (ref = &(connect->active); *ref; ref = &((*ref)->next)) {
+        if (*ref == attempt) {
+            *ref = attempt->next;
+            break;
+        }
+    }
+
+    __attempt_free(attempt);
+}
+
+/* Handles a redirect, the attempt is replaced by one for the new location. */
+static void __attempt_redirect(relay_connect_t *connect, relay_connect_attempt_t *attempt, const char *uri, uint64_t now)
+{
+    relay_connect_attempt_t *n;
+    const char *mountpoint;
+    char *server;
+    size_t len;
+    int port = 80;
+
+    ICECAST_LOG_INFO("redirect received %s", uri);
+
+    if (attempt->redirects >= RELAY_CONNECT_MAX_REDIRECTS) {
+        ICECAST_LOG_WARN("Too many redirects for relay on mount %#H", connect->localmount);
+        return;
+    }
+
+    if (strncmp(uri, "http://", 7) != 0)
+        return;
+
+    uri += 7;
+    mountpoint = strchr(uri, '/');
+    len = strcspn(uri, ":/");
+    if (uri[len] == ':')
+        port = atoi(uri + len + 1);
+
+    server = calloc(1, len + 1);
+    if (!server)
+        return;
+    memcpy(server, uri, len);
+
+    n = __attempt_new(attempt->upstream, server, port, mountpoint ? mountpoint : "/", attempt->redirects + 1);
+    free(server);
+    if (!n)
+        return;
+
+    /* the redirect target is tried next, right away */
+    n->next = connect->queued;
+    connect->queued = n;
+    connect->next_start = now;
+}
+
+/* Creates the client for a connection that is streaming. */
+static client_t *__client_new(connection_t *con, http_parser_t *parser)
+{
+    client_t *client = NULL;
+
+    if (client_create(&client, con, parser) < 0) {
+        client_destroy(client);
+        return NULL;
+    }
+
+    client_set_queue(client, NULL);
+    client_complete(client);
+
+    return client;
+}
+
+/* Turns a successful attempt into a client. */
+static client_t *__attempt_client(relay_connect_t *connect, relay_connect_attempt_t *attempt, http_parser_t *parser, const char *body, size_t body_len)
+{
+    connection_t *con;
+
+    con = connection_create(attempt->sock, NULL, NULL, attempt->server);
+    if (!con) {
+        httpp_destroy(parser);
+        return NULL;
+    }
+    /* the connection owns the socket now */
+    attempt->sock = SOCK_ERROR;
+
+    if (body_len && connection_read_put_back(con, body, body_len) != 0) {
+        connection_close(con);
+        httpp_destroy(parser);
+        return NULL;
+    }
+
+    return __client_new(con, parser);
+}
+
+/* Reads the response header. Returns a client if a stream was found,
+ * sets *failed if the attempt is finished without a stream.
+ */
+static client_t *__attempt_read(relay_connect_t *connect, relay_connect_attempt_t *attempt, int *failed, uint64_t now)
+{
+    http_parser_t *parser;
+    char header[RELAY_CONNECT_HEADER_SIZE];
+    const char *status;
+    client_t *client;
+    size_t header_len = 0;
+    size_t body;
+    size_t i;
+    int ret;
+
+    ret = sock_read_bytes(attempt->sock, attempt->header + attempt->header_len, sizeof(attempt->header) - 1 - attempt->header_len);
+    if (ret <= 0) {
+        if (ret == 0 || !sock_recoverable(sock_error())) {
+            ICECAST_LOG_ERROR("Header read failed for %s (%s:%d%s)", connect->localmount, attempt->server, attempt->port, attempt->mount);
+            *failed = 1;
+        }
+        return NULL;
+    }
+    attempt->header_len += ret;
+    attempt->header[attempt->header_len] = 0;
+
+    /* find the end of the header, the body starts after it */
+    for (body = 0, i = 0; i < attempt->header_len; i++) {
+        if (attempt->header[i] == '\r')
+            continue;
+        header[header_len++] = attempt->header[i];
+        if (header_len > 1 && header[header_len - 1] == '\n' && header[header_len - 2] == '\n') {
+            body = i + 1;
+            break;
+        }
+    }
+
+    if (!body) {
+        if (attempt->header_len >= (sizeof(attempt->header) - 1)) {
+            ICECAST_LOG_ERROR("Header too long for %s (%s:%d%s)", connect->localmount, attempt->server, attempt->port, attempt->mount);
+            *failed = 1;
+        }
+        return NULL;
+    }
+    header[header_len] = 0;
+
+    *failed = 1;
+
+    prng_write(header, header_len);
+    parser = httpp_create_parser();
+    httpp_initialize(parser, NULL);
+    if (!httpp_parse_response(parser, header, header_len, connect->localmount)) {
+        ICECAST_LOG_ERROR("Error parsing relay request for %s (%s:%d%s)", connect->localmount, attempt->server, attempt->port, attempt->mount);
+        httpp_destroy(parser);
+        return NULL;
+    }
+
+    status = httpp_getvar(parser, HTTPP_VAR_ERROR_CODE);
+    if (status && (strcmp(status, "301") == 0 || strcmp(status, "302") == 0 || strcmp(status, "303") == 0 ||
+                   strcmp(status, "307") == 0 || strcmp(status, "308") == 0)) {
+        const char *uri = httpp_getvar(parser, "location");
+
+        if (uri)
+            __attempt_redirect(connect, attempt, uri, now);
+        httpp_destroy(parser);
+        return NULL;
+    }
+
+    if (httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE)) {
+        ICECAST_LOG_ERROR("Error from relay request: %s (%s)", connect->localmount, httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE));
+        httpp_destroy(parser);
+        return NULL;
+    }
+
+    client = __attempt_client(connect, attempt, parser, attempt->header + body, attempt->header_len - body);
+
+    /* each subscriber gets its own parser */
+    if (client && connect->is_shared) {
+        connect->stream.response = strdup(header);
+        connect->stream.response_len = header_len;
+    }
+
+    return client;
+}
+
+/* Progresses an attempt after its socket became ready. */
+static client_t *__attempt_process(relay_connect_t *connect, relay_connect_attempt_t *attempt, uint64_t now)
+{
+    client_t *client = NULL;
+    int failed = 0;
+    int ret;
+
+    switch (attempt->state) {
+        case ATTEMPT_CONNECTING:
+            if (sock_connected(attempt->sock, 0) == 1) {
+                attempt->state = ATTEMPT_SENDING;
+                attempt->deadline = now + (uint64_t)connect->header_timeout * 1000;
+            } else {
+                ICECAST_LOG_WARN("Failed to connect to %s:%d", attempt->server, attempt->port);
+                failed = 1;
+                break;
+            }
+        /* fall through */
+        case ATTEMPT_SENDING:
+            ret = sock_write_bytes(attempt->sock, attempt->request + attempt->request_offset, attempt->request_len - attempt->request_offset);
+            if (ret < 0) {
+                if (!sock_recoverable(sock_error()))
+                    failed = 1;
+                break;
+            }
+            attempt->request_offset += ret;
+            if (attempt->request_offset == attempt->request_len)
+                attempt->state = ATTEMPT_READING;
+        break;
+        case ATTEMPT_READING:
+            client = __attempt_read(connect, attempt, &failed, now);
+        break;
+        default:
+        break;
+    }
+
+    if (client)
+        connect->streaming = attempt->upstream;
+
+    if (client || failed) {
+        __attempt_remove(connect, attempt);
+        /* start the next one without waiting for the stagger delay */
+        if (!client)
+            connect->next_start = now;
+    }
+
+    return client;
+}
+
+/* Times out attempts, starts new ones and detects failure. Called with the connector unlocked. */
+static void __request_step(relay_connect_t *connect, uint64_t now)
+{
+    relay_connect_attempt_t *attempt, *next;
+    relay_connect_attempt_t **ref;
+
+    for (attempt = connect->active; attempt; attempt = next) {
+        next = attempt->next;
+        if (attempt->deadline <= now) {
+            ICECAST_LOG_WARN("Timeout while connecting to %s:%d for relay on mount %#H", attempt->server, attempt->port, connect->localmount);
+            __attempt_remove(connect, attempt);
+            connect->next_start = now;
+        }
+    }
+
+#ifdef HAVE_GETADDRINFO
+    __request_resolve(connect, now);
+#endif
+
+    while ((ref = __attempt_ready(connect, now)) && (!connect->active || connect->next_start <= now)) {
+        if (__attempt_start(connect, ref, now) == 0)
+            connect->next_start = now + RELAY_CONNECT_STAGGER;
+    }
+}
+
+static void __request_stream(relay_connect_t *connect, client_t *client)
+{
+    /* cancel all other attempts */
+    __attempt_list_free(connect->queued);
+    __attempt_list_free(connect->active);
+    connect->queued = connect->active = NULL;
+
+    thread_mutex_lock(&_connect_mutex);
+    if (connect->released) {
+        thread_mutex_unlock(&_connect_mutex);
+        client_destroy(client);
+        return;
+    }
+    if (connect->is_standby || connect->is_shared) {
+        const char *contenttype = httpp_getvar(client->parser, "content-type");
+        const char *metaint = httpp_getvar(client->parser, "icy-metaint");
+
+        if (connect->is_standby)
+            ICECAST_LOG_INFO("Hot standby for relay on mount %#H connected", connect->localmount);
+        else
+            ICECAST_LOG_INFO("Shared upstream for relay on mount %#H connected", connect->localmount);
+        connect->stream.client = client;
+        connect->stream.type = contenttype ? format_get_type(contenttype) : FORMAT_TYPE_GENERIC;
+        /* other streams can be taken over at any byte */
+        if (connect->stream.type != FORMAT_TYPE_OGG && connect->stream.type != FORMAT_TYPE_EBML)
+            connect->stream.synced = 1;
+        /* only shared requests ask for inline metadata */
+        if (metaint && atoi(metaint) > 0) {
+            connect->stream.metaint = atoi(metaint);
+            connect->stream.icy_left = connect->stream.metaint;
+            connect->stream.icy_state = ICY_AUDIO;
+        }
+        connect->state = RELAY_CONNECT_STANDBY;
+        /* from now on the stream thread reads the stream */
+        connect->streamed = 1;
+        connect->stream_next = _stream_list;
+        _stream_list = connect;
+        _stream_wakeup = 1;
+        thread_cond_signal(&_stream_cond);
+    } else {
+        connect->state = RELAY_CONNECT_STREAMING;
+        connect->on_stream(client, connect->userdata);
+    }
+    thread_mutex_unlock(&_connect_mutex);
+}
+
+/* Appends data to the standby buffer. If it would grow too large, the
+ * buffer is dropped and the next sync point is waited for.
+ */
+static int __stream_append(relay_connect_stream_t *stream, const char *buf, size_t len)
+{
+    char *n;
+
+    if ((stream->data_len + len) > RELAY_CONNECT_STANDBY_DATA) {
+        stream->data_len = 0;
+        stream->synced = 0;
+    }
+
+    n = realloc(stream->data, stream->data_len + len);
+    if (!n)
+        return -1;
+    stream->data = n;
+    memcpy(stream->data + stream->data_len, buf, len);
+    stream->data_len += len;
+
+    return 0;
+}
+
+static void __stream_drop(relay_connect_stream_t *stream, size_t len)
+{
+    memmove(stream->data, stream->data + len, stream->data_len - len);
+    stream->data_len -= len;
+}
+
+/* Keeps the Ogg header pages and the current page. */
+static void __stream_feed_ogg(relay_connect_stream_t *stream)
+{
+    while (1) {
+        const unsigned char *page = (const unsigned char *)stream->data;
+        uint64_t granulepos = 0;
+        size_t page_len;
+        size_t i;
+
+        if (!stream->synced) {
+            for (i = 0; (i + 4) <= stream->data_len; i++)
+                if (memcmp(stream->data + i, "OggS", 4) == 0)
+                    break;
+            if ((i + 4) > stream->data_len) {
+                /* keep a possible partial capture pattern */
+                if (stream->data_len > 3)
+                    __stream_drop(stream, stream->data_len - 3);
+                return;
+            }
+            __stream_drop(stream, i);
+            stream->synced = 1;
+        }
+
+        if (stream->data_len < 27)
+            return;
+        if (memcmp(stream->data, "OggS", 4) != 0) {
+            stream->synced = 0;
+            __stream_drop(stream, 1);
+            continue;
+        }
+        page_len = 27 + (size_t)page[26];
+        if (stream->data_len < page_len)
+            return;
+        for (i = 0; i < page[26]; i++)
+            page_len += page[27 + i];
+        if (stream->data_len < page_len)
+            return;
+
+        /* header pages do not have a positive granule position */
+        if (stream->head_done == 0) {
+            for (i = 0; i < 8; i++)
+                granulepos |= (uint64_t)page[6 + i] << (8 * i);
+            if (granulepos == 0 || granulepos == (uint64_t)-1) {
+                char *n = NULL;
+
+                if ((stream->head_len + page_len) <= RELAY_CONNECT_STANDBY_HEAD)
+                    n = realloc(stream->head, stream->head_len + page_len);
+                if (n) {
+                    memcpy(n + stream->head_len, stream->data, page_len);
+                    stream->head = n;
+                    stream->head_len += page_len;
+                } else {
+                    stream->head_done = -1;
+                }
+            } else {
+                stream->head_done = 1;
+            }
+        }
+
+        __stream_drop(stream, page_len);
+    }
+}
+
+/* Returns the length of an EBML variable size integer by its first byte, 0 if invalid. */
+static size_t __ebml_vint_length(unsigned char c)
+{
+    size_t len = 1;
+
+    if (!c)
+        return 0;
+
+    while (!(c & 0x80)) {
+        c <<= 1;
+        len++;
+    }
+
+    return len;
+}
+
+/* Checks the element starting with a Cluster ID: it must have a valid size
+ * and start with a Timestamp (after an optional CRC-32), so payload bytes
+ * that happen to match the ID are not taken for a Cluster.
+ * Returns 1 for a Cluster, 0 for none and -1 if more data is needed.
+ */
+static int __ebml_is_cluster(const unsigned char *data, size_t len)
+{
+    size_t pos = 4;
+    size_t n;
+    size_t i;
+    uint64_t value;
+
+    if (len <= pos)
+        return -1;
+    if (!(n = __ebml_vint_length(data[pos])))
+        return 0;
+    pos += n;
+
+    if (len <= pos)
+        return -1;
+    if (data[pos] == 0xBF) {
+        /* CRC-32, always 4 bytes */
+        if (len <= (pos + 1))
+            return -1;
+        if (data[pos + 1] != 0x84)
+            return 0;
+        pos += 6;
+        if (len <= pos)
+            return -1;
+    }
+
+    if (data[pos] != 0xE7)
+        return 0;
+    pos++;
+
+    if (len <= pos)
+        return -1;
+    if (!(n = __ebml_vint_length(data[pos])))
+        return 0;
+    if (len < (pos + n))
+        return -1;
+    value = data[pos] & (0xFF >> n);
+    for (i = 1; i < n; i++)
+        value = (value << 8) | data[pos + i];
+
+    return value >= 1 && value <= 8;
+}
+
+/* Keeps the data in front of the first EBML Cluster and the data since
+ * the start of the last one.
+ */
+static void __stream_feed_ebml(relay_connect_stream_t *stream, size_t new_len)
+{
+    size_t start = stream->data_len - new_len;
+    size_t first = 0;
+    size_t found = 0;
+    int have = 0;
+    size_t i;
+
+    /* a Cluster may span the previous read */
+    start = start > (RELAY_CONNECT_EBML_CLUSTER_PEEK - 1) ? start - (RELAY_CONNECT_EBML_CLUSTER_PEEK - 1) : 0;
+
+    for (i = start; (i + 4) <= stream->data_len; i++) {
+        if (memcmp(stream->data + i, __ebml_cluster, 4) == 0) {
+            int ret = __ebml_is_cluster((const unsigned char *)stream->data + i, stream->data_len - i);
+
+            /* checked again with the next read */
+            if (ret < 0)
+                break;
+            if (ret == 0)
+                continue;
+            if (!have)
+                first = i;
+            found = i;
+            have = 1;
+        }
+    }
+
+    /* nothing was dropped before the first Cluster was seen */
+    if (have && stream->head_done == 0) {
+        stream->head = malloc(first ? first : 1);
+        if (stream->head) {
+            memcpy(stream->head, stream->data, first);
+            stream->head_len = first;
+            stream->head_done = 1;
+        } else {
+            stream->head_done = -1;
+        }
+    } else if (!have && stream->head_done == 0 && stream->data_len > RELAY_CONNECT_STANDBY_HEAD) {
+        stream->head_done = -1;
+    }
+
+    if (have) {
+        __stream_drop(stream, found);
+        stream->synced = 1;
+    } else if (!stream->synced && stream->head_done != 0 && stream->data_len > (RELAY_CONNECT_EBML_CLUSTER_PEEK - 1)) {
+        __stream_drop(stream, stream->data_len - (RELAY_CONNECT_EBML_CLUSTER_PEEK - 1));
+    }
+}
+
+/* Ends a shared stream. All subscribers see the end of their stream.
+ * Called with the connector locked.
+ */
+static void __shared_fail(relay_connect_t *shared)
+{
+    relay_connect_t *connect;
+
+    shared->state = RELAY_CONNECT_FAILED;
+
+    for (connect = shared->subscribers; connect; connect = connect->sub_next) {
+        if (connect->sub_sock != SOCK_ERROR) {
+            sock_close(connect->sub_sock);
+            connect->sub_sock = SOCK_ERROR;
+        }
+        if (connect->state == RELAY_CONNECT_CONNECTING)
+            connect->state = RELAY_CONNECT_FAILED;
+    }
+}
+
+/* Creates the client of a subscriber. It reads from one end of a socket
+ * pair, starting with the data kept since the last sync point.
+ */
+static client_t *__shared_client(relay_connect_t *shared, relay_connect_t *connect)
+{
+    relay_connect_stream_t *stream = &(shared->stream);
+    http_parser_t *parser;
+    connection_t *con;
+    client_t *client;
+    sock_t socks[2];
+    int size = RELAY_CONNECT_SHARED_BUFFER;
+
+    if (!stream->response)
+        return NULL;
+    if ((stream->type == FORMAT_TYPE_OGG || stream->type == FORMAT_TYPE_EBML) && stream->head_done != 1)
+        return NULL;
+
+    parser = httpp_create_parser();
+    httpp_initialize(parser, NULL);
+    if (!httpp_parse_response(parser, stream->response, stream->response_len, connect->localmount)) {
+        httpp_destroy(parser);
+        return NULL;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) != 0) {
+        httpp_destroy(parser);
+        return NULL;
+    }
+    sock_set_blocking(socks[0], 0);
+    sock_set_blocking(socks[1], 0);
+    setsockopt(socks[1], SOL_SOCKET, SO_SNDBUF, (const void *)&size, sizeof(size));
+
+    con = connection_create(socks[0], NULL, NULL, stream->client->con->ip);
+    if (!con) {
+        sock_close(socks[0]);
+        sock_close(socks[1]);
+        httpp_destroy(parser);
+        return NULL;
+    }
+
+    if ((stream->head_len && connection_read_put_back(con, stream->head, stream->head_len) != 0) ||
+        (stream->data_len && connection_read_put_back(con, stream->data, stream->data_len) != 0)) {
+        connection_close(con);
+        sock_close(socks[1]);
+        httpp_destroy(parser);
+        return NULL;
+    }
+
+    client = __client_new(con, parser);
+    if (!client) {
+        sock_close(socks[1]);
+        return NULL;
+    }
+
+    connect->sub_sock = socks[1];
+
+    return client;
+}
+
+/* Hands the stream to waiting subscribers if it can be joined at this
+ * point. Called with the connector locked.
+ */
+static void __shared_attach(relay_connect_t *shared)
+{
+    relay_connect_stream_t *stream = &(shared->stream);
+    relay_connect_t *connect;
+
+    if (shared->state != RELAY_CONNECT_STANDBY || shared->released)
+        return;
+    if ((stream->type == FORMAT_TYPE_OGG || stream->type == FORMAT_TYPE_EBML) && (stream->head_done == 0 || (stream->head_done == 1 && !stream->synced)))
+        return;
+    /* inline metadata is counted from the start of an audio block */
+    if (stream->metaint && (stream->icy_state != ICY_AUDIO || stream->icy_left != stream->metaint))
+        return;
+
+    for (connect = shared->subscribers; connect; connect = connect->sub_next) {
+        client_t *client;
+
+        if (connect->state != RELAY_CONNECT_CONNECTING || connect->released)
+            continue;
+
+        client = __shared_client(shared, connect);
+        if (client) {
+            connect->state = RELAY_CONNECT_STREAMING;
+            connect->on_stream(client, connect->userdata);
+        } else {
+            ICECAST_LOG_ERROR("Can not join the shared upstream for relay on mount %#H", connect->localmount);
+            connect->state = RELAY_CONNECT_FAILED;
+        }
+    }
+}
+
+static void __shared_send(relay_connect_t *shared, const char *buf, size_t len)
+{
+    relay_connect_t *connect;
+
+    for (connect = shared->subscribers; connect; connect = connect->sub_next) {
+        if (connect->sub_sock == SOCK_ERROR || connect->released)
+            continue;
+
+        /* a relay that does not keep up is disconnected, it will connect again */
+        if (sock_write_bytes(connect->sub_sock, buf, len) != (int)len) {
+            ICECAST_LOG_WARN("Relay on mount %#H does not keep up with the shared upstream", connect->localmount);
+            sock_close(connect->sub_sock);
+            connect->sub_sock = SOCK_ERROR;
+        }
+    }
+}
+
+/* Copies the data to all subscribers. With inline metadata, waiting
+ * subscribers join at the end of each metadata block.
+ * Called with the connector locked.
+ */
+static void __shared_write(relay_connect_t *shared, const char *buf, size_t len)
+{
+    relay_connect_stream_t *stream = &(shared->stream);
+
+    if (!stream->metaint) {
+        __shared_send(shared, buf, len);
+        return;
+    }
+
+    while (len) {
+        size_t chunk = stream->icy_left < len ? stream->icy_left : len;
+
+        __shared_send(shared, buf, chunk);
+        stream->icy_left -= chunk;
+        buf += chunk;
+        len -= chunk;
+
+        if (stream->icy_left)
+            continue;
+
+        switch (stream->icy_state) {
+            case ICY_AUDIO:
+                stream->icy_state = ICY_LENGTH;
+                stream->icy_left = 1;
+            break;
+            case ICY_LENGTH:
+                stream->icy_left = (size_t)((const unsigned char *)buf)[-1] * 16;
+                stream->icy_state = stream->icy_left ? ICY_META : ICY_AUDIO;
+                if (!stream->icy_left)
+                    stream->icy_left = stream->metaint;
+            break;
+            case ICY_META:
+                stream->icy_state = ICY_AUDIO;
+                stream->icy_left = stream->metaint;
+            break;
+        }
+
+        __shared_attach(shared);
+    }
+}
+
+/* Reads from a hot standby or shared stream. Called with the connector locked.
+ * Returns the client if the stream ended, to be destroyed by the caller.
+ */
+static client_t *__stream_read(relay_connect_t *connect)
+{
+    relay_connect_stream_t *stream = &(connect->stream);
+    char buf[RELAY_CONNECT_STANDBY_READ];
+    ssize_t ret;
+
+    ret = client_body_read(stream->client, buf, sizeof(buf));
+    if (ret <= 0) {
+        if (client_body_eof(stream->client)) {
+            client_t *client = stream->client;
+
+            stream->client = NULL;
+            if (connect->is_shared) {
+                ICECAST_LOG_WARN("Shared upstream for relay on mount %#H disconnected", connect->localmount);
+                __shared_fail(connect);
+            } else {
+                ICECAST_LOG_WARN("Hot standby for relay on mount %#H disconnected", connect->localmount);
+                connect->state = RELAY_CONNECT_FAILED;
+            }
+            return client;
+        }
+        return NULL;
+    }
+
+    /* subscribers get the data before it is kept for the ones joining later */
+    if (connect->is_shared)
+        __shared_write(connect, buf, ret);
+
+    switch (stream->type) {
+        case FORMAT_TYPE_OGG:
+            if (__stream_append(stream, buf, ret) == 0)
+                __stream_feed_ogg(stream);
+        break;
+        case FORMAT_TYPE_EBML:
+            if (__stream_append(stream, buf, ret) == 0)
+                __stream_feed_ebml(stream, ret);
+        break;
+        default:
+            /* nothing to keep */
+        break;
+    }
+
+    return NULL;
+}
+
+/* Returns the socket of a hot standby or shared stream, or SOCK_ERROR. */
+static sock_t __stream_sock(relay_connect_t *connect)
+{
+    sock_t sock = SOCK_ERROR;
+
+    thread_mutex_lock(&_connect_mutex);
+    if (connect->state == RELAY_CONNECT_STANDBY && !connect->released)
+        sock = connect->stream.client->con->sock;
+    thread_mutex_unlock(&_connect_mutex);
+
+    return sock;
+}
+
+static void __stream_process(relay_connect_t *connect)
+{
+    client_t *client = NULL;
+
+    thread_mutex_lock(&_connect_mutex);
+    if (connect->state == RELAY_CONNECT_STANDBY && !connect->released)
+        client = __stream_read(connect);
+    thread_mutex_unlock(&_connect_mutex);
+
+    if (client)
+        client_destroy(client);
+}
+
+/* Waits for up to a tick while there are no sockets to watch.
+ * New requests wake up the thread right away.
+ */
+static void __idle(void)
+{
+    thread_mutex_lock(&_connect_mutex);
+    if (!_connect_wakeup && _connect_running)
+        thread_cond_timedwait_mutex(&_connect_cond, &_connect_mutex, RELAY_CONNECT_TICK);
+    _connect_wakeup = 0;
+    thread_mutex_unlock(&_connect_mutex);
+}
+
+/* Same as __idle() for the stream thread, new streams wake it up. */
+static void __stream_idle(void)
+{
+    thread_mutex_lock(&_connect_mutex);
+    if (!_stream_wakeup && _connect_running)
+        thread_cond_timedwait_mutex(&_stream_cond, &_connect_mutex, RELAY_CONNECT_TICK);
+    _stream_wakeup = 0;
+    thread_mutex_unlock(&_connect_mutex);
+}
+
+#ifdef HAVE_POLL
+static void __wait(relay_connect_t *list)
+{
+    static struct pollfd *ufds = NULL;
+    static size_t ufds_len = 0;
+    relay_connect_t *connect;
+    relay_connect_attempt_t *attempt;
+    size_t count = 0;
+
+    for (connect = list; connect; connect = connect->next) {
+        for (attempt = connect->active; attempt; attempt = attempt->next)
+            count++;
+    }
+
+    if (count > ufds_len) {
+        struct pollfd *n = realloc(ufds, count * sizeof(*ufds));
+        if (!n) {
+            thread_sleep(RELAY_CONNECT_TICK * 1000);
+            return;
+        }
+        ufds = n;
+        ufds_len = count;
+    }
+
+    count = 0;
+    for (connect = list; connect; connect = connect->next) {
+        connect->polled = 0;
+        for (attempt = connect->active; attempt; attempt = attempt->next) {
+            ufds[count].fd = attempt->sock;
+            ufds[count].events = attempt->state == ATTEMPT_READING ? POLLIN : POLLOUT;
+            ufds[count].revents = 0;
+            count++;
+            connect->polled++;
+        }
+    }
+
+    if (!count) {
+        __idle();
+        return;
+    }
+
+    if (poll(ufds, count, RELAY_CONNECT_TICK) <= 0)
+        return;
+
+    /* the lists can not have changed: only this thread modifies them */
+    count = 0;
+    for (connect = list; connect; connect = connect->next) {
+        relay_connect_attempt_t *next;
+        size_t base = count;
+        size_t i = 0;
+
+        count += connect->polled;
+
+        for (attempt = connect->active; attempt && i < connect->polled; attempt = next, i++) {
+            next = attempt->next;
+            if (ufds[base + i].revents) {
+                client_t *client = __attempt_process(connect, attempt, timing_get_time());
+
+                if (client) {
+                    __request_stream(connect, client);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void __stream_wait(relay_connect_t *list)
+{
+    static struct pollfd *ufds = NULL;
+    static size_t ufds_len = 0;
+    relay_connect_t *connect;
+    size_t count = 0;
+
+    for (connect = list; connect; connect = connect->stream_next)
+        count++;
+
+    if (count > ufds_len) {
+        struct pollfd *n = realloc(ufds, count * sizeof(*ufds));
+        if (!n) {
+            thread_sleep(RELAY_CONNECT_TICK * 1000);
+            return;
+        }
+        ufds = n;
+        ufds_len = count;
+    }
+
+    count = 0;
+    for (connect = list; connect; connect = connect->stream_next) {
+        connect->stream.polled = __stream_sock(connect);
+        if (connect->stream.polled != SOCK_ERROR) {
+            ufds[count].fd = connect->stream.polled;
+            ufds[count].events = POLLIN;
+            ufds[count].revents = 0;
+            count++;
+        }
+    }
+
+    if (!count) {
+        __stream_idle();
+        return;
+    }
+
+    if (poll(ufds, count, RELAY_CONNECT_TICK) <= 0)
+        return;
+
+    /* the list can not have changed: only this thread unlinks from it */
+    count = 0;
+    for (connect = list; connect; connect = connect->stream_next) {
+        if (connect->stream.polled == SOCK_ERROR)
+            continue;
+        if (ufds[count].revents)
+            __stream_process(connect);
+        count++;
+    }
+}
+#else
+static void __wait(relay_connect_t *list)
+{
+    relay_connect_t *connect;
+    relay_connect_attempt_t *attempt;
+    fd_set rfds, wfds;
+    sock_t max = SOCK_ERROR;
+    struct timeval tv;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+
+    for (connect = list; connect; connect = connect->next) {
+        for (attempt = connect->active; attempt; attempt = attempt->next) {
+            FD_SET(attempt->sock, attempt->state == ATTEMPT_READING ? &rfds : &wfds);
+            if (max == SOCK_ERROR || attempt->sock > max)
+                max = attempt->sock;
+        }
+    }
+
+    if (max == SOCK_ERROR) {
+        __idle();
+        return;
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = RELAY_CONNECT_TICK * 1000;
+    if (select(max + 1, &rfds, &wfds, NULL, &tv) <= 0)
+        return;
+
+    for (connect = list; connect; connect = connect->next) {
+        relay_connect_attempt_t *next;
+
+        for (attempt = connect->active; attempt; attempt = next) {
+            next = attempt->next;
+            if (FD_ISSET(attempt->sock, &rfds) || FD_ISSET(attempt->sock, &wfds)) {
+                client_t *client = __attempt_process(connect, attempt, timing_get_time());
+
+                if (client) {
+                    __request_stream(connect, client);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void __stream_wait(relay_connect_t *list)
+{
+    relay_connect_t *connect;
+    fd_set rfds;
+    sock_t max = SOCK_ERROR;
+    struct timeval tv;
+
+    FD_ZERO(&rfds);
+
+    for (connect = list; connect; connect = connect->stream_next) {
+        connect->stream.polled = __stream_sock(connect);
+        if (connect->stream.polled != SOCK_ERROR) {
+            FD_SET(connect->stream.polled, &rfds);
+            if (max == SOCK_ERROR || connect->stream.polled > max)
+                max = connect->stream.polled;
+        }
+    }
+
+    if (max == SOCK_ERROR) {
+        __stream_idle();
+        return;
+    }
+
+    tv.tv_sec = 0;
+    tv.tv_usec = RELAY_CONNECT_TICK * 1000;
+    if (select(max + 1, &rfds, NULL, NULL, &tv) <= 0)
+        return;
+
+    for (connect = list; connect; connect = connect->stream_next) {
+        if (connect->stream.polled != SOCK_ERROR && FD_ISSET(connect->stream.polled, &rfds))
+            __stream_process(connect);
+    }
+}
+#endif
+
+/* Reads the hot standby and shared streams and copies shared streams to
+ * their subscribers. This is kept apart from the connector, so setting up
+ * connections never holds up the data.
+ */
+static void *__stream_thread(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+        relay_connect_t *list, *released = NULL, **ref;
+
+        /* drop released requests the connector is done with, take a snapshot of the list */
+        thread_mutex_lock(&_connect_mutex);
+        if (!_connect_running) {
+            thread_mutex_unlock(&_connect_mutex);
+            break;
+        }
+        ref = &_stream_list;
+        while (*ref) {
+            relay_connect_t *connect = *ref;
+            if (connect->unlinked) {
+                *ref = connect->stream_next;
+                connect->stream_next = released;
+                released = connect;
+            } else {
+                ref = &(connect->stream_next);
+            }
+        }
+        list = _stream_list;
+        thread_mutex_unlock(&_connect_mutex);
+
+        while (released) {
+            relay_connect_t *next = released->stream_next;
+            __request_free(released);
+            released = next;
+        }
+
+        /* New streams are added at the head of the list and only this thread
+         * unlinks and frees them, so the snapshot can be walked unlocked.
+         */
+        __stream_wait(list);
+    }
+
+    return NULL;
+}
+
+static void *__connect_thread(void *arg)
+{
+    (void)arg;
+
+    ICECAST_LOG_INFO("Relay connector started");
+
+    while (1) {
+        relay_connect_t *list, *released = NULL, **ref;
+        uint64_t now;
+
+        /* drop released requests, take a snapshot of the list */
+        thread_mutex_lock(&_connect_mutex);
+        if (!_connect_running) {
+            thread_mutex_unlock(&_connect_mutex);
+            break;
+        }
+        ref = &_connect_list;
+        while (*ref) {
+            relay_connect_t *connect = *ref;
+            if (connect->released) {
+                *ref = connect->next;
+                /* requests on the stream list are freed by the stream thread */
+                if (connect->streamed) {
+                    connect->unlinked = 1;
+                    _stream_wakeup = 1;
+                    thread_cond_signal(&_stream_cond);
+                } else {
+                    connect->next = released;
+                    released = connect;
+                }
+                /* a shared request is released with its last subscriber */
+                if (connect->shared) {
+                    relay_connect_t **sub;
+
+                    for (sub = &(connect->shared->subscribers); *sub; sub = &((*sub)->sub_next)) {
+                        if (*sub == connect) {
+                            *sub = connect->sub_next;
+                            break;
+                        }
+                    }
+                    if (!connect->shared->subscribers)
+                        connect->shared->released = 1;
+                }
+            } else {
+                ref = &(connect->next);
+            }
+        }
+        list = _connect_list;
+        thread_mutex_unlock(&_connect_mutex);
+
+        /* a shared request released above may only be dropped on the next iteration */
+        while (released) {
+            relay_connect_t *next = released->next;
+            __request_free(released);
+            released = next;
+        }
+
+        /* Requests are only unlinked and freed by this thread, new ones are
+         * added at the head of the list. So it is safe to walk the snapshot
+         * without holding the lock.
+         */
+        now = timing_get_time();
+        for (ref = &list; *ref; ref = &((*ref)->next)) {
+            relay_connect_t *connect = *ref;
+            relay_connect_state_t state;
+
+            thread_mutex_lock(&_connect_mutex);
+            state = connect->state;
+            if (connect->is_shared)
+                __shared_attach(connect);
+            thread_mutex_unlock(&_connect_mutex);
+
+            /* subscribers are handled by their shared request */
+            if (state != RELAY_CONNECT_CONNECTING || connect->shared)
+                continue;
+
+            __request_step(connect, now);
+
+            if (!connect->active && !connect->queued) {
+                ICECAST_LOG_WARN("All upstreams failed for relay on mount %#H", connect->localmount);
+                thread_mutex_lock(&_connect_mutex);
+                if (connect->is_shared)
+                    __shared_fail(connect);
+                else
+                    connect->state = RELAY_CONNECT_FAILED;
+                thread_mutex_unlock(&_connect_mutex);
+            }
+        }
+
+        __wait(list);
+    }
+
+    /* the requests are freed by relay_connect_shutdown() once the stream thread stopped too */
+    ICECAST_LOG_INFO("Relay connector stopped");
+
+    return NULL;
+}
@@ -0,0 +1,74 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/* This file contains the API for the relay connection manager.
+ *
+ * Connecting to upstreams is done by a single thread driving a non-blocking
+ * state machine for all relays: connecting, sending the request, reading the
+ * response headers and following redirects. Upstreams (and all addresses
+ * they resolve to) are tried in parallel with a small delay between attempts.
+ * The first attempt that returns a stream wins.
+ *
+ * Only once a stream is flowing the caller's callback is invoked, which is
+ * expected to hand the client to a relay thread.
+ *
+ * A hot standby connection is made the same way but the stream is kept by
+ * the connector. It reads the stream and keeps the data since the last sync
+ * point, so the stream can be taken over in the middle of a relay.
+ *
+ * Relays with the same upstreams can share a connection. The connector reads
+ * the stream once and copies it to each relay through a socket pair. Relays
+ * joining later start at a sync point, like a hot standby that is taken over.
+ */
+
+#ifndef __RELAY_CONNECT_H__
+#define __RELAY_CONNECT_H__
+
+#include "icecasttypes.h"
+#include "cfgfile.h"
+#include "format.h"
+
+typedef enum {
+    /* attempts are still in progress */
+    RELAY_CONNECT_CONNECTING,
+    /* a stream was found and handed over via the callback */
+    RELAY_CONNECT_STREAMING,
+    /* all attempts failed, or the hot standby stream ended */
+    RELAY_CONNECT_FAILED,
+    /* a stream was found and is kept as hot standby */
+    RELAY_CONNECT_STANDBY
+} relay_connect_state_t;
+
+/* Called from the connector thread with the connector locked.
+ * This must not block and must not call any of the relay_connect_*() functions.
+ */
+typedef void (*relay_connect_callback_t)(client_t *client, void *userdata);
+
+void relay_connect_initialize(void);
+void relay_connect_shutdown(void);
+
+/* Starts connecting the relay. config is copied. */
+relay_connect_t *       relay_connect_start(const relay_config_t *config, relay_connect_callback_t on_stream, void *userdata);
+/* Like relay_connect_start() but shares the connection with other relays
+ * started this way with the same upstreams. The callback gets a client of its own.
+ */
+relay_connect_t *       relay_connect_start_shared(const relay_config_t *config, relay_connect_callback_t on_stream, void *userdata);
+relay_connect_state_t   relay_connect_get_state(relay_connect_t *connect);
+/* Returns the index of the upstream that returned the stream, or -1. */
+ssize_t                 relay_connect_get_upstream(relay_connect_t *connect);
+/* Starts a hot standby connection to any upstream but the one with the index exclude. */
+relay_connect_t *       relay_connect_start_standby(const relay_config_t *config, ssize_t exclude);
+/* Takes over the stream of a hot standby, the client starts at a sync point.
+ * Returns NULL if there is no stream ready for the given type of format.
+ * After this the handle is in state RELAY_CONNECT_STREAMING.
+ */
+client_t *              relay_connect_take_standby(relay_connect_t *connect, format_type_t type, const char *contenttype);
+/* Releases the handle. Pending attempts are cancelled. Once this returns the callback will not be called. */
+void                    relay_connect_release(relay_connect_t *connect);
+
+#endif  /* __RELAY_CONNECT_H__ */
@@ -55,26 +55,55 @@
 #include "source.h"
 #include "format.h"
 #include "prng.h"
+#include "relay_connect.h"
 
 #define CATMODULE "slave"
 
+/* Demand of on-demand relays is a moving average of their listener count,
+ * scaled by this. It decays by 1/RELAY_DEMAND_SCALE every second.
+ */
+#define RELAY_DEMAND_SCALE  64
+
 struct relay_tag {
     relay_config_t *config;
     source_t *source;
     int running;
     int cleanup;
     time_t start;
+    /* connection attempt in progress, see relay_connect.h */
+    relay_connect_t *connect;
+    /* client handed over by the connector for the relay thread */
+    client_t *client;
+    /* recent listener demand of on-demand relays, see RELAY_DEMAND_SCALE */
+    unsigned int demand;
+    /* whether this on-demand relay is kept connected without listeners */
+    int warm;
+    /* hot standby connection to another upstream */
+    relay_connect_t *standby;
+    time_t standby_start;
     thread_type *thread;
     relay_t *next;
 };
 
 static void *_slave_thread(void *arg);
+static void *_master_thread(void *arg);
+static void master_relays_free (relay_config_t **relays, size_t relays_length);
+static int relay_has_shared_upstream (const relay_t *relay);
 static thread_type *_slave_thread_id;
 static int slave_running = 0;
 static volatile int update_settings = 0;
 static volatile int update_all_mounts = 0;
 static volatile unsigned int max_interval = 0;
-static mutex_t _slave_mutex; // protects slave_running, update_settings, update_all_mounts, max_interval
+static int slave_wakeup_req = 0;
+/* stream list from the master not yet applied by the slave thread */
+static relay_config_t **master_relays = NULL;
+static size_t master_relays_length = 0;
+static int master_relays_updated = 0;
+static int master_update_req = 0;
+static mutex_t _slave_mutex; // protects slave_running, update_settings, update_all_mounts, max_interval, slave_wakeup_req, master_relays*, master_update_req
+static cond_t _slave_cond;
+static cond_t _master_cond;
+static thread_type *_master_thread_id;
 
 static inline void relay_config_upstream_free (relay_config_upstream_t *upstream)
 {
@@ -160,6 +189,7 @@ static inline relay_config_t *relay_config_copy (relay_config_t *r)
 
     copy->localmount = (char *)xmlCharStrdup(r->localmount);
     copy->on_demand = r->on_demand;
+    copy->hot_standby = r->hot_standby;
 
     relay_config_upstream_copy(&(copy->upstream_default), &(r->upstream_default));
 
@@ -195,6 +225,20 @@ void slave_update_all_mounts(void)
     max_interval = 0;
     update_all_mounts = 1;
     update_settings = 1;
+    master_update_req = 1;
+    thread_cond_signal(&_master_cond);
+    thread_mutex_unlock(&_slave_mutex);
+}
+
+
+/* Wake up the slave thread to check the relays right away, e.g. because
+ * a listener is waiting for an on-demand relay.
+ */
+void slave_wakeup(void)
+{
+    thread_mutex_lock(&_slave_mutex);
+    slave_wakeup_req = 1;
+    thread_cond_signal(&_slave_cond);
     thread_mutex_unlock(&_slave_mutex);
 }
 
@@ -218,7 +262,11 @@ void slave_initialize(void)
     slave_running = 1;
     max_interval = 0;
     thread_mutex_create (&_slave_mutex);
+    thread_cond_create (&_slave_cond);
+    thread_cond_create (&_master_cond);
+    relay_connect_initialize();
     _slave_thread_id = thread_create("Slave Thread", _slave_thread, NULL, THREAD_ATTACHED);
+    _master_thread_id = thread_create("Master Stream List Thread", _master_thread, NULL, THREAD_ATTACHED);
 }
 
 
@@ -230,262 +278,201 @@ void slave_shutdown(void)
         return;
     }
     slave_running = 0;
+    thread_cond_signal(&_slave_cond);
+    thread_cond_signal(&_master_cond);
     thread_mutex_unlock(&_slave_mutex);
 
     ICECAST_LOG_DEBUG("waiting for slave thread");
+    thread_join (_master_thread_id);
     thread_join (_slave_thread_id);
+    relay_connect_shutdown();
+    if (master_relays_updated)
+        master_relays_free (master_relays, master_relays_length);
+    master_relays = NULL;
+    master_relays_length = 0;
+    master_relays_updated = 0;
+    thread_cond_destroy (&_master_cond);
+    thread_cond_destroy (&_slave_cond);
 }
 
 
-/* Actually open the connection and do some http parsing, handle any 302
- * responses within here.
+/* Handles a relay that could not be started: moves listeners to the
+ * fallback and prevents the relay from starting up again too soon.
+ * The caller must hold the relay lock and, if not called by the slave
+ * thread, the slave lock.
  */
-#define _GET_UPSTREAM_SETTING(n) ((upstream && upstream->n) ? upstream->n : relay->config->upstream_default.n)
-static client_t *open_relay_connection (relay_t *relay, relay_config_upstream_t *upstream)
+static void relay_failed (relay_t *relay)
 {
-    int redirects = 0;
-    char *server_id = NULL;
-    ice_config_t *config;
-    http_parser_t *parser = NULL;
-    connection_t *con=NULL;
-    char *server = strdup (_GET_UPSTREAM_SETTING(server));
-    char *mount = strdup (_GET_UPSTREAM_SETTING(mount));
-    int port = _GET_UPSTREAM_SETTING(port);
-    char *auth_header;
-    char header[4096];
-
-    config = config_get_config ();
-    server_id = strdup (config->server_id);
-    config_release_config ();
-
-    /* build any authentication header before connecting */
-    if (_GET_UPSTREAM_SETTING(username) && _GET_UPSTREAM_SETTING(password))
+    if (relay->source->fallback_mount)
     {
-        char *esc_authorisation;
-        unsigned len = strlen(_GET_UPSTREAM_SETTING(username)) + strlen(_GET_UPSTREAM_SETTING(password)) + 2;
-
-        auth_header = malloc (len);
-        snprintf (auth_header, len, "%s:%s", _GET_UPSTREAM_SETTING(username), _GET_UPSTREAM_SETTING(password));
-        esc_authorisation = util_base64_encode(auth_header, len);
-        free(auth_header);
-        len = strlen (esc_authorisation) + 24;
-        auth_header = malloc (len);
-        snprintf (auth_header, len,
-                "Authorization: Basic %s\r\n", esc_authorisation);
-        free(esc_authorisation);
-    }
-    else
-        auth_header = strdup ("");
+        source_t *fallback_source;
 
-    while (redirects < 10)
-    {
-        sock_t streamsock;
+        ICECAST_LOG_DEBUG("failed relay, fallback to %s", relay->source->fallback_mount);
+        avl_tree_rlock(global.source_tree);
+        fallback_source = source_find_mount(relay->source->fallback_mount);
 
-        ICECAST_LOG_INFO("connecting to %s:%d", server, port);
+        if (fallback_source != NULL)
+            source_move_clients(relay->source, fallback_source, NULL, NAVIGATION_DIRECTION_DOWN);
 
-        streamsock = sock_connect_wto_bind (server, port, _GET_UPSTREAM_SETTING(bind), 10);
-        if (streamsock == SOCK_ERROR)
-        {
-            ICECAST_LOG_WARN("Failed to connect to %s:%d", server, port);
-            break;
-        }
-        con = connection_create(streamsock, NULL, NULL, strdup(server));
-
-        /* At this point we may not know if we are relaying an mp3 or vorbis
-         * stream, but only send the icy-metadata header if the relay details
-         * state so (the typical case).  It's harmless in the vorbis case. If
-         * we don't send in this header then relay will not have mp3 metadata.
-         */
-        sock_write(streamsock, "GET %s HTTP/1.0\r\n"
-                "User-Agent: %s\r\n"
-                "Host: %s\r\n"
-                "%s"
-                "%s"
-                "\r\n",
-                mount,
-                server_id,
-                server,
-                _GET_UPSTREAM_SETTING(mp3metadata) ? "Icy-MetaData: 1\r\n" : "",
-                auth_header);
-        memset (header, 0, sizeof(header));
-        if (util_read_header (con->sock, header, 4096, READ_ENTIRE_HEADER) == 0)
-        {
-            ICECAST_LOG_ERROR("Header read failed for %s (%s:%d%s)", relay->config->localmount, server, port, mount);
-            break;
-        }
-        prng_write(header, strlen(header));
-        parser = httpp_create_parser();
-        httpp_initialize (parser, NULL);
-        if (! httpp_parse_response (parser, header, strlen(header), relay->config->localmount))
-        {
-            ICECAST_LOG_ERROR("Error parsing relay request for %s (%s:%d%s)", relay->config->localmount,
-                    server, port, mount);
-            break;
-        }
-        if (strcmp (httpp_getvar (parser, HTTPP_VAR_ERROR_CODE), "302") == 0)
-        {
-            /* better retry the connection again but with different details */
-            const char *uri, *mountpoint;
-            int len;
+        avl_tree_unlock(global.source_tree);
+    }
 
-            uri = httpp_getvar (parser, "location");
-            ICECAST_LOG_INFO("redirect received %s", uri);
-            if (strncmp (uri, "http://", 7) != 0)
-                break;
-            uri += 7;
-            mountpoint = strchr (uri, '/');
-            free (mount);
-            if (mountpoint)
-                mount = strdup (mountpoint);
-            else
-                mount = strdup ("/");
-
-            len = strcspn (uri, ":/");
-            port = 80;
-            if (uri [len] == ':')
-                port = atoi (uri+len+1);
-            free (server);
-            server = calloc (1, len+1);
-            strncpy (server, uri, len);
-            connection_close (con);
-            httpp_destroy (parser);
-            con = NULL;
-            parser = NULL;
-        }
-        else
-        {
-            client_t *client = NULL;
+    source_clear_source(relay->source);
 
-            if (httpp_getvar (parser, HTTPP_VAR_ERROR_MESSAGE))
-            {
-                ICECAST_LOG_ERROR("Error from relay request: %s (%s)", relay->config->localmount,
-                        httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE));
-                break;
-            }
-            global_lock ();
-            if (client_create (&client, con, parser) < 0)
-            {
-                global_unlock ();
-                /* make sure only the client_destroy frees these */
-                con = NULL;
-                parser = NULL;
-                client_destroy (client);
-                break;
-            }
-            global_unlock ();
-            sock_set_blocking (streamsock, 0);
-            client_set_queue (client, NULL);
-            client_complete(client);
-            free (server);
-            free (mount);
-            free (server_id);
-            free (auth_header);
-
-            return client;
-        }
-        redirects++;
-    }
-    /* failed, better clean up */
-    free (server);
-    free (mount);
-    free (server_id);
-    free (auth_header);
-    if (con)
-        connection_close (con);
-    if (parser)
-        httpp_destroy (parser);
-    return NULL;
+    relay->source->on_demand = 0;
+    relay->start = time(NULL) + max_interval;
+    relay->cleanup = 1;
 }
 
 
-/* This does the actual connection for a relay. A thread is
- * started off if a connection can be acquired
- */
+/* This runs the relay once the connector found a stream. */
 static void *start_relay_stream (void *arg)
 {
     relay_t *relay = arg;
     source_t *src = relay->source;
-    client_t *client;
+    client_t *client = relay->client;
 
     ICECAST_LOG_INFO("Starting relayed source at mountpoint \"%s\"", relay->config->localmount);
-    do
+
+    relay->client = NULL;
+    src->client = client;
+    src->parser = client->parser;
+    src->con = client->con;
+
+    if (connection_complete_source (src, 0) < 0)
     {
-        size_t i;
+        ICECAST_LOG_INFO("Failed to complete source initialisation");
+        client_destroy (client);
+        src->client = NULL;
 
-        for (i = 0; i < relay->config->upstreams; i++) {
-            ICECAST_LOG_DEBUG("For relay on mount \"%s\", trying upstream #%zu", relay->config->localmount, i);
-            client = open_relay_connection(relay, &(relay->config->upstream[i]));
-            if (client)
-                break;
-        }
+        thread_mutex_lock(&_slave_mutex);
+        thread_mutex_lock(&(config_locks()->relay_lock));
+        relay_failed(relay);
+        thread_mutex_unlock(&(config_locks()->relay_lock));
+        thread_mutex_unlock(&_slave_mutex);
+        return NULL;
+    }
+    stats_event_inc(NULL, "source_relay_connections");
+    stats_event (relay->config->localmount, "source_ip", client->con->ip);
 
-        /* if we have no upstreams defined, use the default upstream */
-        if (!relay->config->upstreams) {
-            ICECAST_LOG_DEBUG("For relay on mount \"%s\" with no upstreams trying upstream default", relay->config->localmount);
-            client = open_relay_connection(relay, NULL);
-        }
+    source_main (relay->source);
 
-        if (client == NULL)
-            continue;
+    if (relay->config->on_demand == 0)
+    {
+        /* only keep refreshing YP entries for inactive on-demand relays */
+        yp_remove (relay->config->localmount);
+        relay->source->yp_public = -1;
+        relay->start = time(NULL) + 10; /* prevent busy looping if failing */
+        slave_update_all_mounts();
+    }
 
-        src->client = client;
-        src->parser = client->parser;
-        src->con = client->con;
+    /* we've finished, now get cleaned up */
+    relay->cleanup = 1;
+    slave_rebuild_mounts();
 
-        if (connection_complete_source (src, 0) < 0)
-        {
-            ICECAST_LOG_INFO("Failed to complete source initialisation");
-            client_destroy (client);
-            src->client = NULL;
-            continue;
-        }
-        stats_event_inc(NULL, "source_relay_connections");
-        stats_event (relay->config->localmount, "source_ip", client->con->ip);
+    return NULL;
+}
 
-        source_main (relay->source);
 
-        if (relay->config->on_demand == 0)
-        {
-            /* only keep refreshing YP entries for inactive on-demand relays */
-            yp_remove (relay->config->localmount);
-            relay->source->yp_public = -1;
-            relay->start = time(NULL) + 10; /* prevent busy looping if failing */
-            slave_update_all_mounts();
-        }
+/* Called by the connector once a stream is flowing, hands the client to a
+ * new relay thread.
+ */
+static void relay_on_stream (client_t *client, void *userdata)
+{
+    relay_t *relay = userdata;
 
-        /* we've finished, now get cleaned up */
+    relay->client = client;
+    relay->thread = thread_create ("Relay Thread", start_relay_stream,
+            relay, THREAD_ATTACHED);
+    if (relay->thread == NULL)
+    {
+        ICECAST_LOG_ERROR("Can not start relay thread for \"%s\"", relay->config->localmount);
+        relay->client = NULL;
+        client_destroy (client);
         relay->cleanup = 1;
-        slave_rebuild_mounts();
+    }
+}
 
-        return NULL;
-    } while (0); /* TODO allow looping through multiple servers */
 
-    if (relay->source->fallback_mount)
+/* Drops the hot standby connection of the relay. */
+static void relay_standby_stop (relay_t *relay)
+{
+    if (relay->standby == NULL)
+        return;
+
+    if (relay->source)
     {
-        source_t *fallback_source;
+        thread_mutex_lock (&relay->source->lock);
+        relay->source->standby = NULL;
+        thread_mutex_unlock (&relay->source->lock);
+    }
+    relay_connect_release (relay->standby);
+    relay->standby = NULL;
+}
 
-        ICECAST_LOG_DEBUG("failed relay, fallback to %s", relay->source->fallback_mount);
-        avl_tree_rlock(global.source_tree);
-        fallback_source = source_find_mount(relay->source->fallback_mount);
 
-        if (fallback_source != NULL)
-            source_move_clients(relay->source, fallback_source, NULL, NAVIGATION_DIRECTION_DOWN);
+/* Stops any connection attempt of the relay. After this relay->thread is
+ * no longer changed by the connector.
+ */
+static void relay_connect_stop (relay_t *relay)
+{
+    relay_standby_stop (relay);
+    if (relay->connect)
+    {
+        relay_connect_release (relay->connect);
+        relay->connect = NULL;
+    }
+}
 
-        avl_tree_unlock(global.source_tree);
+
+/* Keeps a hot standby connection to another upstream of a running relay.
+ * Once the source took over the standby it becomes the relay's connection.
+ */
+static void relay_check_standby (relay_t *relay)
+{
+    time_t now = time (NULL);
+    int taken = 0;
+
+    if (relay->standby)
+    {
+        thread_mutex_lock (&relay->source->lock);
+        taken = relay->source->standby == NULL;
+        thread_mutex_unlock (&relay->source->lock);
+
+        if (taken)
+        {
+            relay_connect_release (relay->connect);
+            relay->connect = relay->standby;
+            relay->standby = NULL;
+        }
     }
 
-    source_clear_source(relay->source);
+    if (relay->cleanup || relay->connect == NULL || !relay->config->hot_standby || relay->config->upstreams < 2 ||
+            relay_connect_get_state (relay->connect) != RELAY_CONNECT_STREAMING)
+    {
+        relay_standby_stop (relay);
+        return;
+    }
 
-    /* cleanup relay, but prevent this relay from starting up again too soon */
-    thread_mutex_lock(&_slave_mutex);
-    thread_mutex_lock(&(config_locks()->relay_lock));
-    relay->source->on_demand = 0;
-    relay->start = time(NULL) + max_interval;
-    relay->cleanup = 1;
-    thread_mutex_unlock(&(config_locks()->relay_lock));
-    thread_mutex_unlock(&_slave_mutex);
+    if (relay->standby)
+    {
+        if (relay_connect_get_state (relay->standby) != RELAY_CONNECT_FAILED)
+            return;
+        relay_standby_stop (relay);
+        relay->standby_start = now + 10; /* prevent busy looping if failing */
+    }
 
-    return NULL;
+    if (relay->standby_start > now)
+        return;
+
+    ICECAST_LOG_INFO("Connecting hot standby for relayed source at mountpoint \"%s\"", relay->config->localmount);
+    relay->standby = relay_connect_start_standby (relay->config, relay_connect_get_upstream (relay->connect));
+    if (relay->standby)
+    {
+        thread_mutex_lock (&relay->source->lock);
+        relay->source->standby = relay->standby;
+        thread_mutex_unlock (&relay->source->lock);
+    }
 }
 
 
@@ -534,7 +521,7 @@ static void check_relay_stream (relay_t *relay)
         if (relay->source == NULL || relay->running || relay->start > time(NULL))
             break;
         /* check if an inactive on-demand relay has a fallback that has listeners */
-        if (relay->config->on_demand && source->on_demand_req == 0)
+        if (relay->config->on_demand && source->on_demand_req == 0 && !relay->warm)
         {
             relay->source->on_demand = relay->config->on_demand;
 
@@ -554,16 +541,33 @@ static void check_relay_stream (relay_t *relay)
                 break;
         }
 
+        /* a listener is waiting for this relay */
+        if (relay->config->on_demand && source->on_demand_req)
+            relay->demand += RELAY_DEMAND_SCALE;
+
+        ICECAST_LOG_INFO("Connecting relayed source at mountpoint \"%s\"", relay->config->localmount);
         relay->start = time(NULL) + 5;
         relay->running = 1;
-        relay->thread = thread_create ("Relay Thread", start_relay_stream,
-                relay, THREAD_ATTACHED);
+        if (relay_has_shared_upstream (relay))
+            relay->connect = relay_connect_start_shared (relay->config, relay_on_stream, relay);
+        else
+            relay->connect = relay_connect_start (relay->config, relay_on_stream, relay);
+        if (relay->connect == NULL)
+            relay_failed (relay);
         return;
 
     } while (0);
+    /* the connection attempt may have failed */
+    if (relay->connect && relay_connect_get_state (relay->connect) == RELAY_CONNECT_FAILED)
+    {
+        relay_connect_stop (relay);
+        relay_failed (relay);
+    }
+    relay_check_standby (relay);
     /* the relay thread may of shut down itself */
     if (relay->cleanup)
     {
+        relay_connect_stop (relay);
         if (relay->thread)
         {
             ICECAST_LOG_DEBUG("waiting for relay thread for \"%s\"", relay->config->localmount);
@@ -612,6 +616,47 @@ static int relay_has_changed_upstream(const relay_config_upstream_t *new, const
     return 0;
 }
 
+/* Unlike relay_has_changed_upstream() this also compares the credentials
+ * and the address bound to, as the relay connector does for shared upstreams.
+ */
+static int relay_is_same_upstream(const relay_config_upstream_t *new, const relay_config_upstream_t *old)
+{
+    if (relay_has_changed_upstream(new, old))
+        return 0;
+
+    return _EQ_ATTR(username) && _EQ_ATTR(password) && _EQ_ATTR(bind);
+}
+
+/* Checks if another relay connects to the same upstreams, so both can
+ * share the connection. The caller must hold the relay lock.
+ */
+static int relay_has_shared_upstream (const relay_t *relay)
+{
+    relay_t *lists[2] = {global.relays, global.master_relays};
+    const relay_config_t *config = relay->config;
+    size_t i, j;
+
+    for (i = 0; i < (sizeof(lists)/sizeof(*lists)); i++)
+    {
+        const relay_t *other;
+
+        for (other = lists[i]; other; other = other->next)
+        {
+            if (other == relay || other->config->upstreams != config->upstreams)
+                continue;
+            if (!relay_is_same_upstream(&(other->config->upstream_default), &(config->upstream_default)))
+                continue;
+            for (j = 0; j < config->upstreams; j++)
+                if (!relay_is_same_upstream(&(other->config->upstream[j]), &(config->upstream[j])))
+                    break;
+            if (j == config->upstreams)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
 static int relay_has_changed (const relay_config_t *new, relay_config_t *old)
 {
     size_t i;
@@ -632,6 +677,7 @@ static int relay_has_changed (const relay_config_t *new, relay_config_t *old)
 
     /* Why do we do this here? */
     old->on_demand = new->on_demand;
+    old->hot_standby = new->hot_standby;
 
     return 0;
 }
@@ -716,9 +762,11 @@ static void relay_check_streams (relay_t *to_start,
             {
                 /* relay has been removed from xml, shut down active relay */
                 ICECAST_LOG_DEBUG("source shutdown request on \"%s\"", to_free->config->localmount);
+                relay_connect_stop (to_free);
                 to_free->running = 0;
                 to_free->source->running = 0;
-                thread_join (to_free->thread);
+                if (to_free->thread)
+                    thread_join (to_free->thread);
             }
             else
                 stats_event (to_free->config->localmount, NULL, NULL);
@@ -737,23 +785,152 @@ static void relay_check_streams (relay_t *to_start,
 }
 
 
-static int update_from_master(ice_config_t *config)
+static void relay_set_warm (relay_t *relay, int warm)
+{
+    if (relay->warm == warm)
+        return;
+
+    ICECAST_LOG_INFO("%s warm pool for on-demand relay at mountpoint \"%s\"", warm ? "Adding to" : "Removing from", relay->config->localmount);
+
+    relay->warm = warm;
+    relay->source->on_demand_warm = warm;
+    stats_event (relay->config->localmount, "on_demand_warm", warm ? "1" : NULL);
+
+    /* stop a relay that was only kept running for the pool */
+    if (!warm && relay->source->running && relay->source->listeners == 0)
+        relay->source->running = 0;
+}
+
+static int relay_compare_demand (const void *a, const void *b)
 {
+    const relay_t *x = *(const relay_t * const *)a;
+    const relay_t *y = *(const relay_t * const *)b;
+
+    if (x->demand == y->demand)
+        return 0;
+    return x->demand > y->demand ? -1 : 1;
+}
+
+/* Updates the demand of all on-demand relays and keeps the ones with the
+ * highest demand connected. Called once a second with the relay lock held.
+ */
+static void relay_update_warm_pool (size_t pool_size)
+{
+    relay_t *lists[2] = {global.relays, global.master_relays};
+    relay_t **candidates = NULL;
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i < (sizeof(lists)/sizeof(*lists)); i++)
+    {
+        relay_t *relay;
+
+        for (relay = lists[i]; relay; relay = relay->next)
+        {
+            relay_t **n;
+
+            if (!relay->config->on_demand || !relay->source)
+                continue;
+
+            relay->demand -= relay->demand / RELAY_DEMAND_SCALE;
+            if (relay->source->running)
+                relay->demand += relay->source->listeners;
+
+            if (!pool_size)
+            {
+                relay_set_warm(relay, 0);
+                continue;
+            }
+
+            n = realloc(candidates, sizeof(*candidates)*(count + 1));
+            if (!n)
+                continue;
+            candidates = n;
+            candidates[count++] = relay;
+        }
+    }
+
+    if (!count)
+        return;
+
+    qsort(candidates, count, sizeof(*candidates), relay_compare_demand);
+    for (i = 0; i < count; i++)
+        relay_set_warm(candidates[i], i < pool_size && candidates[i]->demand > 0);
+
+    free(candidates);
+}
+
+
+/* Sleeps for up to a second, returns true if woken up by slave_wakeup(). */
+static int slave_sleep (void)
+{
+    int ret;
+
+    thread_mutex_lock(&_slave_mutex);
+    if (!slave_wakeup_req && slave_running)
+        thread_cond_timedwait_mutex(&_slave_cond, &_slave_mutex, 1000);
+    ret = slave_wakeup_req;
+    slave_wakeup_req = 0;
+    thread_mutex_unlock(&_slave_mutex);
+
+    return ret;
+}
+
+
+/* Waits up to timeout seconds for the master to answer.
+ * Gives up early if the slave is shutting down.
+ */
+static int master_wait_for_data (sock_t sock, unsigned int timeout)
+{
+    int running = 1;
+
+    while (timeout-- && running)
+    {
+        if (util_timed_wait_for_fd (sock, 1000) > 0)
+            return 1;
+        thread_mutex_lock(&_slave_mutex);
+        running = slave_running;
+        thread_mutex_unlock(&_slave_mutex);
+    }
+
+    return 0;
+}
+
+
+static void master_relays_free (relay_config_t **relays, size_t relays_length)
+{
+    size_t i;
+
+    for (i = 0; i < relays_length; i++)
+        relay_config_free (relays[i]);
+    free (relays);
+}
+
+
+/* Fetches the stream list from the master. If *etag is set the master is
+ * asked to answer only if its list changed, waiting up to wait seconds
+ * for a change. *etag is updated from the answer.
+ * Returns 1 and sets the relays if a new list was read, 0 if the list did
+ * not change and -1 on error.
+ */
+static int update_from_master(char **etag, unsigned int wait, relay_config_t ***relays, size_t *relays_length)
+{
+    ice_config_t *config;
     char *master = NULL, *password = NULL, *username= NULL;
     int port;
     sock_t mastersock;
-    int ret = 0;
+    int ret = -1;
     char buf[256];
     do
     {
         char *authheader, *data;
-        relay_t *cleanup_relays;
         relay_config_t **new_relays = NULL;
         size_t new_relays_length = 0;
+        char query[32] = "";
         int len, count = 1;
         int on_demand;
-        size_t i;
 
+        config = config_get_config();
         username = strdup(config->master_username);
         if (config->master_password)
             password = strdup(config->master_password);
@@ -762,12 +939,11 @@ static int update_from_master(ice_config_t *config)
             master = strdup(config->master_server);
 
         port = config->master_server_port;
+        on_demand = config->on_demand;
+        config_release_config();
 
         if (password == NULL || master == NULL || port == 0)
             break;
-        on_demand = config->on_demand;
-        ret = 1;
-        config_release_config();
         mastersock = sock_connect_wto(master, port, 10);
 
         if (mastersock == SOCK_ERROR)
@@ -776,19 +952,38 @@ static int update_from_master(ice_config_t *config)
             break;
         }
 
+        if (*etag && wait)
+            snprintf(query, sizeof(query), "?wait=%u", wait);
+        else
+            wait = 0;
+
         len = strlen(username) + strlen(password) + 2;
         authheader = malloc(len);
         snprintf (authheader, len, "%s:%s", username, password);
         data = util_base64_encode(authheader, len);
         sock_write (mastersock,
-                "GET /admin/streamlist.txt HTTP/1.0\r\n"
+                "GET /admin/streamlist.txt%s HTTP/1.0\r\n"
                 "Authorization: Basic %s\r\n"
-                "\r\n", data);
+                "%s%s%s"
+                "\r\n", query, data,
+                *etag ? "If-None-Match: " : "", *etag ? *etag : "", *etag ? "\r\n" : "");
         free(authheader);
         free(data);
 
-        if (sock_read_line(mastersock, buf, sizeof(buf)) == 0 ||
-                ((strncmp (buf, "HTTP/1.0 200", 12) != 0) && (strncmp (buf, "HTTP/1.1 200", 12) != 0)))
+        if (!master_wait_for_data(mastersock, wait + 10) || sock_read_line(mastersock, buf, sizeof(buf)) == 0)
+        {
+            sock_close (mastersock);
+            ICECAST_LOG_WARN("Master did not answer streamlist request");
+            break;
+        }
+        if ((strncmp (buf, "HTTP/1.0 304", 12) == 0) || (strncmp (buf, "HTTP/1.1 304", 12) == 0))
+        {
+            sock_close (mastersock);
+            ICECAST_LOG_DEBUG("Master streamlist did not change");
+            ret = 0;
+            break;
+        }
+        if ((strncmp (buf, "HTTP/1.0 200", 12) != 0) && (strncmp (buf, "HTTP/1.1 200", 12) != 0))
         {
             sock_close (mastersock);
             ICECAST_LOG_WARN("Master rejected streamlist request");
@@ -797,11 +992,22 @@ static int update_from_master(ice_config_t *config)
             ICECAST_LOG_INFO("Master accepted streamlist request");
         }
 
+        free(*etag);
+        *etag = NULL;
         while (sock_read_line(mastersock, buf, sizeof(buf))) {
             size_t len = strlen(buf);
             if (!len)
                 break;
             prng_write(buf, len);
+            if (strncasecmp(buf, "ETag:", 5) == 0)
+            {
+                const char *value = buf + 5;
+
+                while (*value == ' ')
+                    value++;
+                free(*etag);
+                *etag = strdup(value);
+            }
         }
         while (sock_read_line(mastersock, buf, sizeof(buf))) {
             size_t len = strlen(buf);
@@ -860,18 +1066,9 @@ static int update_from_master(ice_config_t *config)
         }
         sock_close (mastersock);
 
-        thread_mutex_lock (&(config_locks()->relay_lock));
-        cleanup_relays = update_relays (&global.master_relays, new_relays, new_relays_length);
-
-        relay_check_streams (global.master_relays, cleanup_relays, 0);
-
-        for (i = 0; i < new_relays_length; i++) {
-            relay_config_free(new_relays[i]);
-        }
-        free(new_relays);
-
-        thread_mutex_unlock (&(config_locks()->relay_lock));
-
+        *relays = new_relays;
+        *relays_length = new_relays_length;
+        ret = 1;
     } while(0);
 
     if (master)
@@ -885,10 +1082,73 @@ static int update_from_master(ice_config_t *config)
 }
 
 
+/* Keeps the stream list from the master up to date. New lists are handed
+ * to the slave thread. With long-polling the master holds each request
+ * until its list changes, otherwise it is asked every update interval.
+ */
+static void *_master_thread(void *arg)
+{
+    char *etag = NULL;
+    int on_demand = -1;
+
+    (void)arg;
+
+    while (1)
+    {
+        relay_config_t **relays = NULL;
+        size_t relays_length = 0;
+        ice_config_t *config;
+        unsigned int interval, wait;
+        int ret;
+
+        config = config_get_config();
+        interval = config->master_update_interval;
+        wait = config->master_long_poll;
+        /* the relays of the list depend on this, so it is fetched again */
+        if (config->on_demand != on_demand)
+        {
+            on_demand = config->on_demand;
+            free (etag);
+            etag = NULL;
+        }
+        config_release_config();
+
+        ret = update_from_master (&etag, wait, &relays, &relays_length);
+
+        thread_mutex_lock(&_slave_mutex);
+        if (ret > 0)
+        {
+            if (master_relays_updated)
+                master_relays_free (master_relays, master_relays_length);
+            master_relays = relays;
+            master_relays_length = relays_length;
+            master_relays_updated = 1;
+            slave_wakeup_req = 1;
+            thread_cond_signal(&_slave_cond);
+        }
+        /* the next long-poll can start right away if the master supports it */
+        if (slave_running && !master_update_req && !(ret >= 0 && wait && etag))
+            thread_cond_timedwait_mutex(&_master_cond, &_slave_mutex, interval * 1000);
+        master_update_req = 0;
+        if (slave_running == 0)
+        {
+            thread_mutex_unlock(&_slave_mutex);
+            break;
+        }
+        thread_mutex_unlock(&_slave_mutex);
+    }
+
+    free (etag);
+
+    return NULL;
+}
+
+
 static void *_slave_thread(void *arg)
 {
     ice_config_t *config;
     unsigned int interval = 0;
+    time_t last_tick = 0;
 
     (void)arg;
 
@@ -904,8 +1164,14 @@ static void *_slave_thread(void *arg)
 
     while (1)
     {
-        relay_t *cleanup_relays = NULL;
+        relay_t *cleanup_relays = NULL, *cleanup_master_relays = NULL;
+        relay_config_t **new_master_relays = NULL;
+        size_t new_master_relays_length = 0;
+        int master_updated;
         int skip_timer = 0;
+        int woken, tick;
+        size_t warm_pool_size = 0;
+        time_t now;
 
         /* re-read xml file if requested */
         global_lock();
@@ -915,7 +1181,7 @@ static void *_slave_thread(void *arg)
         }
         global_unlock();
 
-        thread_sleep(1000000);
+        woken = slave_sleep();
         prng_auto_reseed();
         thread_mutex_lock(&_slave_mutex);
         if (slave_running == 0) {
@@ -924,13 +1190,33 @@ static void *_slave_thread(void *arg)
         }
         thread_mutex_unlock(&_slave_mutex);
 
-        ++interval;
+        /* a wakeup only checks the relays, the intervals stay once a second */
+        now = time(NULL);
+        if (!woken || now != last_tick) {
+            interval += last_tick ? now - last_tick : 1;
+            last_tick = now;
+            tick = 1;
+            config = config_get_config();
+            warm_pool_size = config->on_demand_warm;
+            config_release_config();
+        } else {
+            tick = 0;
+        }
 
         /* only update relays lists when required */
         thread_mutex_lock(&_slave_mutex);
+        master_updated = master_relays_updated;
+        if (master_updated)
+        {
+            new_master_relays = master_relays;
+            new_master_relays_length = master_relays_length;
+            master_relays = NULL;
+            master_relays_length = 0;
+            master_relays_updated = 0;
+        }
         if (max_interval <= interval)
         {
-            ICECAST_LOG_DEBUG("checking master stream list");
+            ICECAST_LOG_DEBUG("checking relay list");
             config = config_get_config();
 
             if (max_interval == 0)
@@ -939,10 +1225,6 @@ static void *_slave_thread(void *arg)
             max_interval = config->master_update_interval;
             thread_mutex_unlock(&_slave_mutex);
 
-            /* the connection could take some time, so the lock can drop */
-            if (update_from_master (config))
-                config = config_get_config();
-
             thread_mutex_lock (&(config_locks()->relay_lock));
 
             cleanup_relays = update_relays(&global.relays, config->relay, config->relay_length);
@@ -955,8 +1237,18 @@ static void *_slave_thread(void *arg)
             thread_mutex_lock (&(config_locks()->relay_lock));
         }
 
+        /* a new stream list from the master */
+        if (master_updated)
+        {
+            cleanup_master_relays = update_relays (&global.master_relays, new_master_relays, new_master_relays_length);
+            master_relays_free (new_master_relays, new_master_relays_length);
+        }
+
+        if (tick)
+            relay_update_warm_pool(warm_pool_size);
+
         relay_check_streams (global.relays, cleanup_relays, skip_timer);
-        relay_check_streams (global.master_relays, NULL, skip_timer);
+        relay_check_streams (global.master_relays, cleanup_master_relays, skip_timer);
         thread_mutex_unlock (&(config_locks()->relay_lock));
 
         thread_mutex_lock(&_slave_mutex);
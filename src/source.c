@@ -61,6 +61,9 @@
 #include "slave.h"
 #include "acl.h"
 #include "navigation.h"
+#include "metrics.h"
+#include "probes.h"
+#include "relay_connect.h"
 
 #undef CATMODULE
 #define CATMODULE "source"
@@ -387,6 +390,7 @@ static inline int source_move_clients__single(source_t *source, source_t *dest,
 void source_move_clients(source_t *source, source_t *dest, connection_id_t *id, navigation_direction_t direction)
 {
     unsigned long count = 0;
+    int wakeup = 0;
     if (strcmp(source->mount, dest->mount) == 0) {
         ICECAST_LOG_WARN("src and dst are the same \"%s\", skipping", source->mount);
         return;
@@ -459,6 +463,7 @@ void source_move_clients(source_t *source, source_t *dest, connection_id_t *id,
         }
 
         ICECAST_LOG_INFO("passing %lu listeners to \"%s\"", count, dest->mount);
+        ICECAST_PROBE3(source_move_clients, source->mount, dest->mount, count);
 
         source->listeners -= count;
         stats_event_sub(source->mount, "listeners", count);
@@ -468,11 +473,61 @@ void source_move_clients(source_t *source, source_t *dest, connection_id_t *id,
     avl_tree_unlock(source->client_tree);
 
     /* see if we need to wake up an on-demand relay */
-    if (dest->running == 0 && dest->on_demand && count)
+    if (dest->running == 0 && dest->on_demand && count) {
         dest->on_demand_req = 1;
+        wakeup = 1;
+    }
 
     avl_tree_unlock(dest->pending_tree);
     thread_mutex_unlock(&move_clients_mutex);
+
+    if (wakeup)
+        slave_wakeup();
+}
+
+
+/* Continues the source with the hot standby upstream of a relay.
+ * Returns 1 if the source can keep running with the new client.
+ */
+static int source_take_standby (source_t *source)
+{
+    client_t *client = NULL;
+    client_t *old;
+    const char *contenttype;
+
+    thread_mutex_lock(&source->lock);
+    if (source->standby && source->format && source->format->input_reset)
+        client = relay_connect_take_standby(source->standby, source->format->type, source->format->contenttype);
+    /* the slave notices the takeover by this and starts a new standby */
+    if (client)
+        source->standby = NULL;
+    thread_mutex_unlock(&source->lock);
+
+    if (client == NULL)
+        return 0;
+
+    if (source->format->input_reset(source->format, client) != 0)
+    {
+        ICECAST_LOG_WARN("Can not continue \"%s\" with its hot standby", source->mount);
+        client_destroy(client);
+        return 0;
+    }
+
+    ICECAST_LOG_WARN("Upstream of \"%s\" failed, continuing with hot standby from %s", source->mount, client->con->ip);
+
+    old = source->client;
+    source->client = client;
+    source->con = client->con;
+    source->parser = client->parser;
+    contenttype = httpp_getvar(client->parser, "content-type");
+    if (contenttype)
+        source->format->contenttype = contenttype;
+    source->last_read = time(NULL);
+    client_destroy(old);
+
+    stats_event(source->mount, "source_ip", client->con->ip);
+
+    return 1;
 }
 
 
@@ -510,7 +565,7 @@ static refbuf_t *get_next_buffer (source_t *source)
         }
         if (fds < 0)
         {
-            if (! sock_recoverable (sock_error()))
+            if (! sock_recoverable (sock_error()) && !source_take_standby(source))
             {
                 ICECAST_LOG_WARN("Error while waiting on socket, Disconnecting source");
                 source->running = 0;
@@ -522,10 +577,15 @@ static refbuf_t *get_next_buffer (source_t *source)
             thread_mutex_lock(&source->lock);
             if ((source->last_read + (time_t)source->timeout) < current)
             {
-                ICECAST_LOG_DEBUG("last %ld, timeout %d, now %ld", (long)source->last_read,
-                        source->timeout, (long)current);
-                ICECAST_LOG_WARN("Disconnecting source due to socket timeout");
-                source->running = 0;
+                thread_mutex_unlock(&source->lock);
+                if (!source_take_standby(source))
+                {
+                    ICECAST_LOG_DEBUG("last %ld, timeout %d, now %ld", (long)source->last_read,
+                            source->timeout, (long)current);
+                    ICECAST_LOG_WARN("Disconnecting source due to socket timeout");
+                    source->running = 0;
+                }
+                break;
             }
             thread_mutex_unlock(&source->lock);
             break;
@@ -533,6 +593,11 @@ static refbuf_t *get_next_buffer (source_t *source)
         source->last_read = current;
         refbuf = source->format->get_buffer (source);
         if (client_body_eof(source->client)) {
+            if (source_take_standby(source)) {
+                if (refbuf)
+                    break;
+                continue;
+            }
             ICECAST_LOG_INFO("End of Stream %s", source->mount);
             source->running = 0;
             continue;
@@ -576,6 +641,7 @@ static void send_to_listener (source_t *source, client_t *client, int deletion_e
         {
             if (client->check_buffer != format_check_file_buffer)
                 source->short_delay = 1;
+            metrics_counter_inc(METRICS_COUNTER_SEND_LIMITED);
             break;
         }
 
@@ -591,6 +657,8 @@ static void send_to_listener (source_t *source, client_t *client, int deletion_e
         total_written += bytes;
     }
     source->format->sent_bytes += total_written;
+    metrics_histogram_observe(METRICS_HISTOGRAM_SEND_BYTES, total_written);
+    metrics_histogram_observe(METRICS_HISTOGRAM_SEND_ITERATIONS, 10 - loop);
 
     /* the refbuf referenced at head (last in queue) may be marked for deletion
      * if so, check to see if this client is still referring to it */
@@ -599,6 +667,7 @@ static void send_to_listener (source_t *source, client_t *client, int deletion_e
         ICECAST_LOG_INFO("Client %lu (%s) has fallen too far behind, removing",
                 client->con->id, client->con->ip);
         stats_event_inc (source->mount, "slow_listeners");
+        ICECAST_PROBE2(listener_slow, client->con->id, source->mount);
         client->con->error = 1;
     }
 }
@@ -635,6 +704,8 @@ static void source_init (source_t *source)
     char listenurl[512];
     const char *str;
 
+    ICECAST_PROBE1(source_init, source->mount);
+
     str = httpp_getvar(source->parser, "ice-audio-info");
     source->audio_info = util_dict_new();
     if (str)
@@ -737,6 +808,7 @@ void source_main (source_t *source)
                 source->stream_data_tail->next = refbuf;
             source->stream_data_tail = refbuf;
             source->queue_size += refbuf->len;
+            ICECAST_PROBE3(source_refbuf, source->mount, (unsigned int)refbuf->len, source->queue_size);
             /* new buffer is referenced for burst */
             refbuf_addref(refbuf);
 
@@ -772,6 +844,50 @@ void source_main (source_t *source)
         /* acquire write lock on client_tree */
         avl_tree_wlock(source->client_tree);
 
+        /* Add pending clients before sending so they get their burst on
+         * this iteration. Listeners of an on-demand relay are held until the
+         * first data from upstream arrived.
+         */
+        if (source->stream_data || !source->on_demand) {
+            client_node = avl_get_first(source->pending_tree);
+            while (client_node) {
+
+                if(source->max_listeners != -1 &&
+                        source->listeners >= (unsigned long)source->max_listeners)
+                {
+                    /* The common case is caught in the main connection handler,
+                     * this deals with rarer cases (mostly concerning fallbacks)
+                     * and doesn't give the listening client any information about
+                     * why they were disconnected
+                     */
+                    client = (client_t *)client_node->key;
+                    client_node = avl_get_next(client_node);
+                    avl_delete(source->pending_tree, (void *)client, _free_client);
+
+                    ICECAST_LOG_INFO("Client deleted, exceeding maximum listeners for this "
+                            "mountpoint (%s).", source->mount);
+                    continue;
+                }
+
+                /* Otherwise, the client is accepted, add it */
+                avl_insert(source->client_tree, client_node->key);
+                ICECAST_PROBE2(listener_add, ((client_t *)client_node->key)->con->id, source->mount);
+
+                source->listeners++;
+                ICECAST_LOG_DEBUG("Client added for mountpoint (%s)", source->mount);
+                stats_event_inc(source->mount, "connections");
+
+                client_node = avl_get_next(client_node);
+            }
+
+            /** clear pending tree **/
+            while (avl_get_first(source->pending_tree)) {
+                avl_delete(source->pending_tree,
+                        avl_get_first(source->pending_tree)->key,
+                        source_remove_client);
+            }
+        }
+
         client_node = avl_get_first(source->client_tree);
         while (client_node) {
             client = (client_t *) client_node->key;
@@ -782,6 +898,7 @@ void source_main (source_t *source)
                 client_node = avl_get_next(client_node);
                 if (client->respcode == 200)
                     stats_event_dec(NULL, "listeners");
+                ICECAST_PROBE3(listener_remove, client->con->id, source->mount, client->con->sent_bytes);
                 avl_delete(source->client_tree, (void *) client, _free_client);
                 source->listeners--;
                 ICECAST_LOG_DEBUG("Client removed");
@@ -790,44 +907,6 @@ void source_main (source_t *source)
             client_node = avl_get_next(client_node);
         }
 
-        /** add pending clients **/
-        client_node = avl_get_first(source->pending_tree);
-        while (client_node) {
-
-            if(source->max_listeners != -1 &&
-                    source->listeners >= (unsigned long)source->max_listeners)
-            {
-                /* The common case is caught in the main connection handler,
-                 * this deals with rarer cases (mostly concerning fallbacks)
-                 * and doesn't give the listening client any information about
-                 * why they were disconnected
-                 */
-                client = (client_t *)client_node->key;
-                client_node = avl_get_next(client_node);
-                avl_delete(source->pending_tree, (void *)client, _free_client);
-
-                ICECAST_LOG_INFO("Client deleted, exceeding maximum listeners for this "
-                        "mountpoint (%s).", source->mount);
-                continue;
-            }
-
-            /* Otherwise, the client is accepted, add it */
-            avl_insert(source->client_tree, client_node->key);
-
-            source->listeners++;
-            ICECAST_LOG_DEBUG("Client added for mountpoint (%s)", source->mount);
-            stats_event_inc(source->mount, "connections");
-
-            client_node = avl_get_next(client_node);
-        }
-
-        /** clear pending tree **/
-        while (avl_get_first(source->pending_tree)) {
-            avl_delete(source->pending_tree,
-                    avl_get_first(source->pending_tree)->key,
-                    source_remove_client);
-        }
-
         /* release write lock on pending_tree */
         avl_tree_unlock(source->pending_tree);
 
@@ -842,7 +921,8 @@ void source_main (source_t *source)
                 stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
             }
             stats_event_args (source->mount, "listeners", "%lu", source->listeners);
-            if (source->listeners == 0 && source->on_demand)
+            /* listeners are held back until the first data arrived */
+            if (source->listeners == 0 && source->on_demand && !source->on_demand_warm && source->stream_data)
                 source->running = 0;
         }
 
@@ -18,6 +18,7 @@
 #include <stdbool.h>
 
 #include "common/thread/thread.h"
+#include "common/avl/avl.h"
 #include "common/httpp/httpp.h"
 
 #include "icecasttypes.h"
@@ -77,6 +78,10 @@ struct source_tag {
     unsigned timeout;  /* source timeout in seconds */
     int on_demand;
     int on_demand_req;
+    /* on-demand relay that is kept running without listeners, see slave.c */
+    int on_demand_warm;
+    /* hot standby upstream of a relay, owned by slave.c, protected by lock */
+    relay_connect_t *standby;
     int hidden;
     bool allow_direct_access; // copy of mount_proxy->allow_direct_access
     time_t last_read;
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <ctype.h>
 
 #include <libxml/xmlmemory.h>
@@ -29,6 +30,7 @@
 #include "common/avl/avl.h"
 #include "common/httpp/httpp.h"
 #include "common/net/sock.h"
+#include "common/timing/timing.h"
 
 #include "stats.h"
 #include "connection.h"
@@ -40,6 +42,11 @@
 #include "xslt.h"
 #include "util.h"
 #include "auth.h"
+#include "refobject.h"
+#include "metrics.h"
+#ifdef HAVE_SYS_MMAN_H
+#include "statsmap.h"
+#endif
 #define CATMODULE "stats"
 #include "logging.h"
 
@@ -85,8 +92,76 @@ mutex_t _global_event_mutex;
 
 static volatile event_listener_t *_event_listeners;
 
+/* Published stats are kept as immutable snapshots. The stats thread applies
+ * events to the trees in _stats (protected by _stats_mutex) and publishes a
+ * new snapshot once a batch of events is processed. Readers take a reference
+ * on the current snapshot and can walk it without blocking the stats thread.
+ * Nodesets of mounts that did not change are shared between snapshots.
+ */
+struct stats_nodeset_tag {
+    refobject_base_t __base;
+
+    /* NULL for the global nodeset */
+    char *source;
+    int hidden;
+    size_t count;
+    /* sorted by name */
+    stats_node_t *nodes;
+};
+
+typedef struct {
+    refobject_base_t __base;
+
+    uint64_t version;
+    stats_nodeset_t *global;
+    size_t sources_count;
+    /* sorted by mount */
+    stats_nodeset_t **sources;
+} stats_snapshot_t;
+
+static stats_nodeset_t *_global_published;
+static int _stats_dirty;
+static uint64_t _stats_version;
+static stats_snapshot_t *_stats_snapshot;
+static mutex_t _stats_snapshot_mutex;
+
+/* The stream list for slaves is cached and versioned, it only changes when
+ * visible mounts come and go. The version is prefixed by the startup time
+ * so that tags from before a restart do not match. Clients that wait for
+ * a change are parked in _streamlist_waiters, the stats thread hands them
+ * back once the list changed or their time is up. All protected by
+ * _stats_snapshot_mutex.
+ */
+typedef struct streamlist_waiter_tag streamlist_waiter_t;
+struct streamlist_waiter_tag {
+    client_t *client;
+    stats_streams_callback_t callback;
+    /* version the client has */
+    uint64_t version;
+    uint64_t deadline;
+    streamlist_waiter_t *next;
+};
+
+static char *_streamlist;
+static size_t _streamlist_len;
+static uint64_t _streamlist_hash;
+static uint64_t _streamlist_version;
+static time_t _streamlist_epoch;
+static streamlist_waiter_t *_streamlist_waiters;
+/* the waiters only need to be looked at if those changed */
+static uint64_t _streamlist_waiters_version;
+static uint64_t _streamlist_waiters_deadline = UINT64_MAX;
+
+/* stats map export, both protected by _stats_mutex */
+static char *_statsmap_filename;
+static int _statsmap_reopen;
+#ifdef HAVE_SYS_MMAN_H
+static statsmap_t *_statsmap;
+#endif
+
 
 static void *_stats_thread(void *arg);
+static void _streamlist_wake(int all);
 static int _compare_stats(void *arg, void *a, void *b);
 static int _compare_source_stats(void *arg, void *a, void *b);
 static int _free_stats(void *key);
@@ -97,6 +172,146 @@ static stats_source_t *_find_source(avl_tree *tree, const char *source);
 static void _free_event(stats_event_t *event);
 static stats_event_t *_get_event_from_queue(event_queue_t *queue);
 static void __add_metadata(xmlNodePtr node, const char *tag);
+static void _stats_publish(void);
+static void _stats_export(stats_snapshot_t *snapshot);
+
+
+static void __nodeset_free(refobject_t self, void **userdata)
+{
+    stats_nodeset_t *nodeset = REFOBJECT_TO_TYPE(self, stats_nodeset_t *);
+    size_t i;
+
+    for (i = 0; i < nodeset->count; i++) {
+        free(nodeset->nodes[i].name);
+        free(nodeset->nodes[i].value);
+    }
+    free(nodeset->nodes);
+    free(nodeset->source);
+}
+
+REFOBJECT_DEFINE_PRIVATE_TYPE(stats_nodeset_t,
+        REFOBJECT_DEFINE_TYPE_FREE(__nodeset_free)
+        );
+
+static void __snapshot_free(refobject_t self, void **userdata)
+{
+    stats_snapshot_t *snapshot = REFOBJECT_TO_TYPE(self, stats_snapshot_t *);
+    size_t i;
+
+    refobject_unref(REFOBJECT_FROM_TYPE(snapshot->global));
+    for (i = 0; i < snapshot->sources_count; i++)
+        refobject_unref(REFOBJECT_FROM_TYPE(snapshot->sources[i]));
+    free(snapshot->sources);
+}
+
+REFOBJECT_DEFINE_PRIVATE_TYPE(stats_snapshot_t,
+        REFOBJECT_DEFINE_TYPE_FREE(__snapshot_free)
+        );
+
+/* you must have the _stats_mutex locked here */
+static stats_nodeset_t *_nodeset_from_tree(avl_tree *tree, const char *source, int hidden)
+{
+    stats_nodeset_t *nodeset = refobject_new__new(stats_nodeset_t, NULL, NULL, REFOBJECT_NULL);
+    avl_node *node;
+    size_t i = 0;
+
+    if (!nodeset)
+        return NULL;
+
+    nodeset->hidden = hidden;
+    if (source)
+        nodeset->source = strdup(source);
+
+    nodeset->nodes = calloc(tree->length ? tree->length : 1, sizeof(*nodeset->nodes));
+    if (!nodeset->nodes || (source && !nodeset->source)) {
+        refobject_unref(REFOBJECT_FROM_TYPE(nodeset));
+        return NULL;
+    }
+
+    for (node = avl_get_first(tree); node && i < tree->length; node = avl_get_next(node), i++) {
+        stats_node_t *stats = node->key;
+        nodeset->nodes[i].name = strdup(stats->name);
+        nodeset->nodes[i].value = strdup(stats->value);
+        nodeset->nodes[i].hidden = stats->hidden;
+        nodeset->count++;
+    }
+
+    return nodeset;
+}
+
+static stats_node_t *_nodeset_find_node(stats_nodeset_t *nodeset, const char *name)
+{
+    size_t low = 0, high = nodeset->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(name, nodeset->nodes[mid].name);
+
+        if (cmp == 0)
+            return &(nodeset->nodes[mid]);
+        if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+static stats_nodeset_t *_snapshot_find_source(stats_snapshot_t *snapshot, const char *source)
+{
+    size_t low = 0, high = snapshot->sources_count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(source, snapshot->sources[mid]->source);
+
+        if (cmp == 0)
+            return snapshot->sources[mid];
+        if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+/* This returns a new reference to the current snapshot. */
+static stats_snapshot_t *_snapshot_get(void)
+{
+    stats_snapshot_t *snapshot;
+
+    thread_mutex_lock(&_stats_snapshot_mutex);
+    snapshot = _stats_snapshot;
+    if (snapshot)
+        refobject_ref(REFOBJECT_FROM_TYPE(snapshot));
+    thread_mutex_unlock(&_stats_snapshot_mutex);
+
+    return snapshot;
+}
+
+static inline void _snapshot_release(stats_snapshot_t *snapshot)
+{
+    if (snapshot)
+        refobject_unref(REFOBJECT_FROM_TYPE(snapshot));
+}
+
+/* mark the stats of a source as modified, NULL marks the global stats.
+ * you must have the _stats_mutex locked here
+ */
+static void _mark_dirty(stats_source_t *source)
+{
+    stats_nodeset_t **published = source ? &(source->published) : &_global_published;
+
+    if (*published) {
+        refobject_unref(REFOBJECT_FROM_TYPE(*published));
+        *published = NULL;
+    }
+    _stats_dirty = 1;
+}
 
 
 /* simple helper function for creating an event */
@@ -124,6 +339,7 @@ static void queue_global_event (stats_event_t *event)
     thread_mutex_lock(&_global_event_mutex);
     _add_event_to_queue (event, &_global_event_queue);
     thread_mutex_unlock(&_global_event_mutex);
+    metrics_gauge_add(METRICS_GAUGE_STATS_QUEUE_DEPTH, 1);
 }
 
 void stats_initialize(void)
@@ -136,6 +352,14 @@ void stats_initialize(void)
 
     /* set up global mutex */
     thread_mutex_create(&_stats_mutex);
+    thread_mutex_create(&_stats_snapshot_mutex);
+    _streamlist_epoch = time(NULL);
+
+    /* publish the initial, empty snapshot */
+    _stats_dirty = 1;
+    thread_mutex_lock(&_stats_mutex);
+    _stats_publish();
+    thread_mutex_unlock(&_stats_mutex);
 
     /* set up stats queues */
     event_queue_init(&_global_event_queue);
@@ -159,6 +383,9 @@ void stats_shutdown(void)
     thread_mutex_unlock(&_stats_mutex);
     thread_join(_stats_thread_id);
 
+    /* drop stream list requests that still wait for changes */
+    _streamlist_wake(1);
+
     /* wait for other threads to shut down */
     do {
         thread_sleep(300000);
@@ -177,6 +404,24 @@ void stats_shutdown(void)
     avl_tree_free(_stats.source_tree, _free_source_stats);
     avl_tree_free(_stats.global_tree, _free_stats);
 
+#ifdef HAVE_SYS_MMAN_H
+    statsmap_close(_statsmap);
+    _statsmap = NULL;
+#endif
+    free(_statsmap_filename);
+    _statsmap_filename = NULL;
+
+    _snapshot_release(_stats_snapshot);
+    _stats_snapshot = NULL;
+    if (_global_published)
+        refobject_unref(REFOBJECT_FROM_TYPE(_global_published));
+    _global_published = NULL;
+    free(_streamlist);
+    _streamlist = NULL;
+    _streamlist_len = 0;
+    _streamlist_hash = 0;
+    thread_mutex_destroy(&_stats_snapshot_mutex);
+
     while (1)
     {
         stats_event_t *event = _get_event_from_queue (&_global_event_queue);
@@ -288,24 +533,26 @@ void stats_event_args(const char *source, char *name, char *format, ...)
 
 static char *_get_stats(const char *source, const char *name)
 {
+    stats_snapshot_t *snapshot = _snapshot_get();
+    stats_nodeset_t *nodeset = NULL;
     stats_node_t *stats = NULL;
-    stats_source_t *src = NULL;
     char *value = NULL;
 
-    thread_mutex_lock(&_stats_mutex);
+    if (!snapshot)
+        return NULL;
 
     if (source == NULL) {
-        stats = _find_node(_stats.global_tree, name);
+        nodeset = snapshot->global;
     } else {
-        src = _find_source(_stats.source_tree, source);
-        if (src) {
-            stats = _find_node(src->stats_tree, name);
-        }
+        nodeset = _snapshot_find_source(snapshot, source);
     }
 
+    if (nodeset)
+        stats = _nodeset_find_node(nodeset, name);
+
     if (stats) value = (char *)strdup(stats->value);
 
-    thread_mutex_unlock(&_stats_mutex);
+    _snapshot_release(snapshot);
 
     return value;
 }
@@ -493,6 +740,7 @@ static void process_global_event (stats_event_t *event)
     stats_node_t *node;
 
     /* ICECAST_LOG_DEBUG("global event %s %s %d", event->name, event->value, event->action); */
+    _mark_dirty(NULL);
     if (event->action == STATS_EVENT_REMOVE)
     {
         /* we're deleting */
@@ -538,6 +786,7 @@ static void process_source_event (stats_event_t *event)
 
         avl_insert(_stats.source_tree, (void *) snode);
     }
+    _mark_dirty(snode);
     if (event->name)
     {
         stats_node_t *node = _find_node(snode->stats_tree, event->name);
@@ -663,6 +912,17 @@ void stats_global (ice_config_t *config)
     stats_event (NULL, "host", config->hostname);
     stats_event (NULL, "location", config->location);
     stats_event (NULL, "admin", config->admin);
+
+    thread_mutex_lock(&_stats_mutex);
+    if ((_statsmap_filename == NULL) != (config->statsmap_file == NULL) ||
+        (_statsmap_filename && strcmp(_statsmap_filename, config->statsmap_file) != 0)) {
+        free(_statsmap_filename);
+        _statsmap_filename = config->statsmap_file ? strdup(config->statsmap_file) : NULL;
+        _statsmap_reopen = 1;
+        /* force a publish so the stats map is updated right away */
+        _stats_dirty = 1;
+    }
+    thread_mutex_unlock(&_stats_mutex);
 }
 
 
@@ -703,38 +963,47 @@ static void *_stats_thread(void *arg)
 
         thread_mutex_lock(&_global_event_mutex);
         if (_global_event_queue.head != NULL) {
-            /* grab the next event from the queue */
-            event = _get_event_from_queue (&_global_event_queue);
-            thread_mutex_unlock(&_global_event_mutex);
+            /* grab all pending events from the queue */
+            event_queue_t batch = _global_event_queue;
 
-            if (event == NULL)
-                continue;
-            event->next = NULL;
+            event_queue_init(&_global_event_queue);
+            thread_mutex_unlock(&_global_event_mutex);
 
             thread_mutex_lock(&_stats_mutex);
 
-            /* check if we are dealing with a global or source event */
-            if (event->source == NULL)
-                process_global_event (event);
-            else
-                process_source_event (event);
-
-            /* now we have an event that's been processed into the running stats */
-            /* this event should get copied to event listeners' queues */
-            listener = (event_listener_t *)_event_listeners;
-            while (listener) {
-                copy = _copy_event(event);
-                thread_mutex_lock (&listener->mutex);
-                _add_event_to_queue (copy, &listener->queue);
-                thread_mutex_unlock (&listener->mutex);
-
-                listener = listener->next;
+            while ((event = _get_event_from_queue(&batch))) {
+                event->next = NULL;
+                metrics_gauge_add(METRICS_GAUGE_STATS_QUEUE_DEPTH, -1);
+
+                /* check if we are dealing with a global or source event */
+                if (event->source == NULL)
+                    process_global_event (event);
+                else
+                    process_source_event (event);
+
+                /* now we have an event that's been processed into the running stats */
+                /* this event should get copied to event listeners' queues */
+                listener = (event_listener_t *)_event_listeners;
+                while (listener) {
+                    copy = _copy_event(event);
+                    thread_mutex_lock (&listener->mutex);
+                    _add_event_to_queue (copy, &listener->queue);
+                    thread_mutex_unlock (&listener->mutex);
+
+                    listener = listener->next;
+                }
+
+                /* now we need to destroy the event */
+                _free_event(event);
             }
 
-            /* now we need to destroy the event */
-            _free_event(event);
+            /* make the batch visible to readers */
+            _stats_publish();
 
             thread_mutex_unlock(&_stats_mutex);
+
+            /* also when busy, so waiting clients get their answer in time */
+            _streamlist_wake(0);
             continue;
         }
         else
@@ -742,6 +1011,7 @@ static void *_stats_thread(void *arg)
             thread_mutex_unlock(&_global_event_mutex);
         }
 
+        _streamlist_wake(0);
         thread_sleep(300000);
     }
 
@@ -766,7 +1036,7 @@ static void _unregister_listener(event_listener_t *listener)
 }
 
 
-static stats_event_t *_make_event_from_node(stats_node_t *node, char *source)
+static stats_event_t *_make_event_from_node(const stats_node_t *node, const char *source)
 {
     stats_event_t *event = (stats_event_t *)malloc(sizeof(stats_event_t));
 
@@ -858,7 +1128,8 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
     static const char *public_keys_global[] = {"admin", "location", "host", "server_id", "server_start_iso8601", NULL};
     static const char *public_keys_source[] = {"listeners", "server_name", "server_description", "stream_start_iso8601", "subtype", "content-type", "listenurl", "genre", "display-title", NULL};
     int hidden = flags & STATS_XML_FLAG_SHOW_HIDDEN ? 1 : 0;
-    avl_node *avlnode;
+    stats_snapshot_t *snapshot;
+    size_t n, k;
     xmlNodePtr ret = NULL;
     ice_config_t *config;
 
@@ -871,21 +1142,19 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
         config_release_config();
     }
 
-    thread_mutex_lock(&_stats_mutex);
-    /* general stats first */
-    avlnode = avl_get_first(_stats.global_tree);
+    snapshot = _snapshot_get();
+    if (!snapshot)
+        return NULL;
 
-    while (avlnode) {
-        stats_node_t *stat = avlnode->key;
+    /* general stats first */
+    for (n = 0; n < snapshot->global->count; n++) {
+        stats_node_t *stat = &(snapshot->global->nodes[n]);
         if (stat->hidden <=  hidden && __include_node(flags, stat->name, public_keys_global))
             xmlNewTextChild (root, NULL, XMLSTR(stat->name), XMLSTR(stat->value));
-        avlnode = avl_get_next (avlnode);
     }
     /* now per mount stats */
-    avlnode = avl_get_first(_stats.source_tree);
-
-    while (avlnode) {
-        stats_source_t *source = (stats_source_t *)avlnode->key;
+    for (n = 0; n < snapshot->sources_count; n++) {
+        stats_nodeset_t *source = snapshot->sources[n];
 
         if (source->hidden <= hidden &&
                 (show_mount == NULL || strcmp (show_mount, source->source) == 0))
@@ -895,15 +1164,14 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
             mount_proxy *mountproxy;
             int i;
 
-            avl_node *avlnode2 = avl_get_first (source->stats_tree);
             xmlNodePtr xmlnode = xmlNewTextChild (root, NULL, XMLSTR("source"), NULL);
 
             xmlSetProp (xmlnode, XMLSTR("mount"), XMLSTR(source->source));
             if (ret == NULL)
                 ret = xmlnode;
-            while (avlnode2)
+            for (k = 0; k < source->count; k++)
             {
-                stats_node_t *stat = avlnode2->key;
+                stats_node_t *stat = &(source->nodes[k]);
                 if (__include_node(flags, stat->name, public_keys_source)) {
                     if (client && strcmp(stat->name, "listenurl") == 0) {
                         char buf[512];
@@ -913,7 +1181,6 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
                         xmlNewTextChild (xmlnode, NULL, XMLSTR(stat->name), XMLSTR(stat->value));
                     }
                 }
-                avlnode2 = avl_get_next (avlnode2);
             }
 
 
@@ -935,6 +1202,9 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
 
                 if (flags & STATS_XML_FLAG_SHOW_LISTENERS)
                     admin_add_listeners_to_mount(source_real, xmlnode, client->mode);
+
+                if (!(flags & STATS_XML_FLAG_PUBLIC_VIEW))
+                    admin_add_listener_memory_to_mount(source_real, xmlnode);
             }
             avl_tree_unlock(global.source_tree);
 
@@ -946,9 +1216,8 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
                 config_release_config();
             }
         }
-        avlnode = avl_get_next (avlnode);
     }
-    thread_mutex_unlock(&_stats_mutex);
+    _snapshot_release(snapshot);
     return ret;
 }
 
@@ -960,44 +1229,52 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, unsigned int flags, const
 */
 static void _register_listener (event_listener_t *listener)
 {
-    avl_node *node;
-    avl_node *node2;
+    stats_snapshot_t *snapshot;
+    event_queue_t initial;
     stats_event_t *event;
-    stats_source_t *source;
+    size_t i, j;
 
+    /* The published snapshot is always in sync with the events that have been
+     * passed to listeners so far. So we only need the _stats_mutex to grab the
+     * snapshot and register. The queue is filled afterwards.
+     */
     thread_mutex_lock(&_stats_mutex);
+    snapshot = _snapshot_get();
+    listener->next = (event_listener_t *)_event_listeners;
+    _event_listeners = listener;
+    thread_mutex_unlock(&_stats_mutex);
+
+    if (!snapshot)
+        return;
 
-    /* first we fill our queue with the current stats */
+    event_queue_init(&initial);
 
     /* start with the global stats */
-    node = avl_get_first(_stats.global_tree);
-    while (node) {
-        event = _make_event_from_node((stats_node_t *) node->key, NULL);
-        _add_event_to_queue(event, &listener->queue);
-
-        node = avl_get_next(node);
+    for (i = 0; i < snapshot->global->count; i++) {
+        event = _make_event_from_node(&(snapshot->global->nodes[i]), NULL);
+        _add_event_to_queue(event, &initial);
     }
 
     /* now the stats for each source */
-    node = avl_get_first(_stats.source_tree);
-    while (node) {
-        source = (stats_source_t *)node->key;
-        node2 = avl_get_first(source->stats_tree);
-        while (node2) {
-            event = _make_event_from_node((stats_node_t *)node2->key, source->source);
-            _add_event_to_queue (event, &listener->queue);
-
-            node2 = avl_get_next(node2);
+    for (i = 0; i < snapshot->sources_count; i++) {
+        stats_nodeset_t *source = snapshot->sources[i];
+        for (j = 0; j < source->count; j++) {
+            event = _make_event_from_node(&(source->nodes[j]), source->source);
+            _add_event_to_queue(event, &initial);
         }
-
-        node = avl_get_next(node);
     }
 
-    /* now we register to receive future event notices */
-    listener->next = (event_listener_t *)_event_listeners;
-    _event_listeners = listener;
+    _snapshot_release(snapshot);
 
-    thread_mutex_unlock(&_stats_mutex);
+    /* put the current stats in front of all events queued since registration */
+    if (initial.head) {
+        thread_mutex_lock(&listener->mutex);
+        *initial.tail = listener->queue.head;
+        if (listener->queue.head == NULL)
+            listener->queue.tail = initial.tail;
+        listener->queue.head = initial.head;
+        thread_mutex_unlock(&listener->mutex);
+    }
 }
 
 void *stats_connection(void *arg)
@@ -1166,6 +1443,8 @@ static int _free_stats(void *key)
 static int _free_source_stats(void *key)
 {
     stats_source_t *node = (stats_source_t *)key;
+    if (node->published)
+        refobject_unref(REFOBJECT_FROM_TYPE(node->published));
     avl_tree_free(node->stats_tree, _free_stats);
     free(node->source);
     free(node);
@@ -1182,44 +1461,154 @@ static void _free_event(stats_event_t *event)
 }
 
 
-refbuf_t *stats_get_streams (void)
+/* you must have the _stats_snapshot_mutex locked here */
+static void _streamlist_etag(char *etag, size_t len)
 {
-#define STREAMLIST_BLKSIZE  4096
-    avl_node *node;
-    unsigned int remaining = STREAMLIST_BLKSIZE;
-    refbuf_t *start = refbuf_new (remaining), *cur = start;
-    char *buffer = cur->data;
+    snprintf(etag, len, "\"%llx-%llu\"", (unsigned long long int)_streamlist_epoch, (unsigned long long int)_streamlist_version);
+}
 
-    /* now the stats for each source */
-    thread_mutex_lock (&_stats_mutex);
-    node = avl_get_first(_stats.source_tree);
-    while (node)
-    {
-        int ret;
-        stats_source_t *source = (stats_source_t *)node->key;
+/* Returns the list of visible mounts and its entity tag. */
+refbuf_t *stats_get_streams (char *etag, size_t etag_len)
+{
+    refbuf_t *list;
 
-        if (source->hidden == 0)
-        {
-            if (remaining <= strlen (source->source) + 3)
-            {
-                cur->len = STREAMLIST_BLKSIZE - remaining;
-                cur->next = refbuf_new (STREAMLIST_BLKSIZE);
-                remaining = STREAMLIST_BLKSIZE;
-                cur = cur->next;
-                buffer = cur->data;
-            }
-            ret = snprintf (buffer, remaining, "%s\r\n", source->source);
-            if (ret > 0)
-            {
-                buffer += ret;
-                remaining -= ret;
-            }
+    thread_mutex_lock(&_stats_snapshot_mutex);
+    _streamlist_etag(etag, etag_len);
+    list = refbuf_new(_streamlist_len ? _streamlist_len : 1);
+    if (_streamlist_len)
+        memcpy(list->data, _streamlist, _streamlist_len);
+    list->len = _streamlist_len;
+    thread_mutex_unlock(&_stats_snapshot_mutex);
+
+    return list;
+}
+
+int stats_wait_streams (client_t *client, const char *match, unsigned int wait, stats_streams_callback_t callback)
+{
+    streamlist_waiter_t *waiter = calloc(1, sizeof(*waiter));
+    char etag[64];
+
+    if (!waiter)
+        return -1;
+
+    thread_mutex_lock(&_stats_snapshot_mutex);
+    _streamlist_etag(etag, sizeof(etag));
+    if (!_stats_running || strcmp(match, etag) != 0) {
+        thread_mutex_unlock(&_stats_snapshot_mutex);
+        free(waiter);
+        return -1;
+    }
+
+    waiter->client = client;
+    waiter->callback = callback;
+    waiter->version = _streamlist_version;
+    waiter->deadline = timing_get_time() + (uint64_t)wait * 1000;
+    waiter->next = _streamlist_waiters;
+    _streamlist_waiters = waiter;
+    if (waiter->deadline < _streamlist_waiters_deadline)
+        _streamlist_waiters_deadline = waiter->deadline;
+    thread_mutex_unlock(&_stats_snapshot_mutex);
+
+    return 0;
+}
+
+/* Hands back the waiting clients whose list changed or whose time is up.
+ * If all is set all clients are dropped as we are shutting down.
+ * Must be called without any lock held.
+ */
+static void _streamlist_wake(int all)
+{
+    streamlist_waiter_t **link = &_streamlist_waiters;
+    streamlist_waiter_t *woken = NULL;
+    uint64_t now = timing_get_time();
+
+    thread_mutex_lock(&_stats_snapshot_mutex);
+    /* common case, called for every batch of stats events */
+    if (!all && _streamlist_waiters_version == _streamlist_version && now < _streamlist_waiters_deadline) {
+        thread_mutex_unlock(&_stats_snapshot_mutex);
+        return;
+    }
+
+    _streamlist_waiters_version = _streamlist_version;
+    _streamlist_waiters_deadline = UINT64_MAX;
+    while (*link) {
+        streamlist_waiter_t *waiter = *link;
+
+        if (all || waiter->version != _streamlist_version || now >= waiter->deadline) {
+            *link = waiter->next;
+            waiter->next = woken;
+            woken = waiter;
+        } else {
+            if (waiter->deadline < _streamlist_waiters_deadline)
+                _streamlist_waiters_deadline = waiter->deadline;
+            link = &(waiter->next);
         }
-        node = avl_get_next(node);
     }
-    thread_mutex_unlock(&_stats_mutex);
-    cur->len = STREAMLIST_BLKSIZE - remaining;
-    return start;
+    thread_mutex_unlock(&_stats_snapshot_mutex);
+
+    while (woken) {
+        streamlist_waiter_t *next = woken->next;
+
+        if (all) {
+            client_destroy(woken->client);
+        } else {
+            woken->callback(woken->client);
+        }
+        free(woken);
+        woken = next;
+    }
+}
+
+/* Rebuilds the cached stream list if the visible mounts changed.
+ * you must have the _stats_mutex locked here
+ */
+static void _streamlist_update(stats_snapshot_t *snapshot)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t len = 0;
+    char *list, *p;
+    size_t i;
+
+    /* FNV-1a over the names, the list is only built if they changed */
+    for (i = 0; i < snapshot->sources_count; i++) {
+        const char *c;
+
+        if (snapshot->sources[i]->hidden)
+            continue;
+        for (c = snapshot->sources[i]->source; *c; c++) {
+            hash ^= (unsigned char)*c;
+            hash *= 1099511628211ULL;
+        }
+        hash ^= '\n';
+        hash *= 1099511628211ULL;
+        len += strlen(snapshot->sources[i]->source) + 2;
+    }
+
+    if (_streamlist_version && hash == _streamlist_hash)
+        return;
+
+    list = malloc(len ? len : 1);
+    if (!list)
+        return;
+
+    for (p = list, i = 0; i < snapshot->sources_count; i++) {
+        size_t slen;
+
+        if (snapshot->sources[i]->hidden)
+            continue;
+        slen = strlen(snapshot->sources[i]->source);
+        memcpy(p, snapshot->sources[i]->source, slen);
+        memcpy(p + slen, "\r\n", 2);
+        p += slen + 2;
+    }
+
+    thread_mutex_lock(&_stats_snapshot_mutex);
+    free(_streamlist);
+    _streamlist = list;
+    _streamlist_len = len;
+    _streamlist_hash = hash;
+    _streamlist_version++;
+    thread_mutex_unlock(&_stats_snapshot_mutex);
 }
 
 
@@ -1245,11 +1634,137 @@ void stats_clear_virtual_mounts (void)
             snode = avl_get_next (snode);
             ICECAST_LOG_DEBUG("releasing %s stats", src->source);
             avl_delete (_stats.source_tree, src, _free_source_stats);
+            _stats_dirty = 1;
             continue;
         }
 
         snode = avl_get_next (snode);
     }
+    _stats_publish();
     thread_mutex_unlock (&_stats_mutex);
 }
 
+
+static inline uint64_t _nodeset_get_uint(stats_nodeset_t *nodeset, const char *name)
+{
+    stats_node_t *node = _nodeset_find_node(nodeset, name);
+
+    if (!node || !node->value)
+        return 0;
+
+    return strtoull(node->value, NULL, 10);
+}
+
+/* Update the stats map from a freshly published snapshot.
+ * you must have the _stats_mutex locked here
+ */
+static void _stats_export(stats_snapshot_t *snapshot)
+{
+#ifdef HAVE_SYS_MMAN_H
+    size_t i, j;
+
+    if (_statsmap_reopen) {
+        _statsmap_reopen = 0;
+        statsmap_close(_statsmap);
+        _statsmap = NULL;
+        if (_statsmap_filename) {
+            _statsmap = statsmap_open(_statsmap_filename, snapshot->sources_count);
+            if (!_statsmap) {
+                ICECAST_LOG_ERROR("Can not create stats map %H.", _statsmap_filename);
+            } else {
+                ICECAST_LOG_INFO("Exporting stats to %H.", _statsmap_filename);
+            }
+        }
+    }
+
+    if (!_statsmap)
+        return;
+
+    if (statsmap_reserve(_statsmap, snapshot->sources_count) != 0)
+        ICECAST_LOG_ERROR("Can not resize stats map %H, not all mounts will be exported.", _statsmap_filename);
+
+    statsmap_write_begin(_statsmap);
+    for (i = 0; i < STATSMAP_GLOBAL__END; i++)
+        statsmap_set_global(_statsmap, i, _nodeset_get_uint(snapshot->global, statsmap_global_names[i]));
+
+    for (i = 0; i < snapshot->sources_count; i++) {
+        stats_nodeset_t *source = snapshot->sources[i];
+        statsmap_mount_t *mount = statsmap_add_mount(_statsmap, source->source);
+
+        if (!mount)
+            break;
+
+        if (source->hidden)
+            mount->flags |= STATSMAP_MOUNT_FLAG_HIDDEN;
+        for (j = 0; j < STATSMAP_MOUNT__END; j++)
+            mount->counter[j] = _nodeset_get_uint(source, statsmap_mount_names[j]);
+    }
+    statsmap_write_end(_statsmap);
+#else
+    if (_statsmap_reopen) {
+        _statsmap_reopen = 0;
+        if (_statsmap_filename)
+            ICECAST_LOG_ERROR("Stats map %H configured but not supported on this platform.", _statsmap_filename);
+    }
+#endif
+}
+
+/* Publish a new snapshot of the current stats if anything changed since the
+ * last one. Nodesets of unchanged mounts are shared with the old snapshot.
+ * you must have the _stats_mutex locked here
+ */
+static void _stats_publish(void)
+{
+    stats_snapshot_t *snapshot, *old;
+    avl_node *node;
+    size_t i = 0;
+
+    if (!_stats_dirty)
+        return;
+
+    snapshot = refobject_new__new(stats_snapshot_t, NULL, NULL, REFOBJECT_NULL);
+    if (!snapshot)
+        return;
+
+    if (!_global_published)
+        _global_published = _nodeset_from_tree(_stats.global_tree, NULL, 0);
+
+    snapshot->sources = calloc(_stats.source_tree->length ? _stats.source_tree->length : 1, sizeof(*snapshot->sources));
+    if (!_global_published || !snapshot->sources) {
+        ICECAST_LOG_ERROR("Can not allocate stats snapshot.");
+        _snapshot_release(snapshot);
+        return;
+    }
+
+    refobject_ref(REFOBJECT_FROM_TYPE(_global_published));
+    snapshot->global = _global_published;
+
+    for (node = avl_get_first(_stats.source_tree); node && i < _stats.source_tree->length; node = avl_get_next(node)) {
+        stats_source_t *source = node->key;
+
+        if (!source->published)
+            source->published = _nodeset_from_tree(source->stats_tree, source->source, source->hidden);
+        if (!source->published) {
+            ICECAST_LOG_ERROR("Can not allocate stats snapshot for source %H.", source->source);
+            continue;
+        }
+
+        refobject_ref(REFOBJECT_FROM_TYPE(source->published));
+        snapshot->sources[i++] = source->published;
+    }
+    snapshot->sources_count = i;
+    snapshot->version = ++_stats_version;
+
+    _streamlist_update(snapshot);
+
+    thread_mutex_lock(&_stats_snapshot_mutex);
+    old = _stats_snapshot;
+    _stats_snapshot = snapshot;
+    thread_mutex_unlock(&_stats_snapshot_mutex);
+
+    _snapshot_release(old);
+    _stats_dirty = 0;
+
+    _stats_export(snapshot);
+}
+
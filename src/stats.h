@@ -44,11 +44,18 @@ typedef struct _stats_event_tag
     struct _stats_event_tag *next;
 } stats_event_t;
 
+/* Immutable, reference counted copy of a set of stats nodes.
+ * Those are shared between snapshots as long as the set is unchanged.
+ */
+typedef struct stats_nodeset_tag stats_nodeset_t;
+
 typedef struct _stats_source_tag
 {
     char *source;
     int  hidden;
     avl_tree *stats_tree;
+    /* nodeset as seen by the last published snapshot, NULL if modified since */
+    stats_nodeset_t *published;
 } stats_source_t;
 
 typedef struct _stats_tag
@@ -75,12 +82,20 @@ typedef struct _stats_tag
 
 } stats_t;
 
+/* called for clients waiting for a change of the stream list */
+typedef void (*stats_streams_callback_t)(client_t *client);
+
 void stats_initialize(void);
 void stats_shutdown(void);
 
 void stats_global(ice_config_t *config);
 stats_t *stats_get_stats(void);
-refbuf_t *stats_get_streams (void);
+refbuf_t *stats_get_streams (char *etag, size_t etag_len);
+/* Parks the client until the stream list no longer matches the tag match or
+ * wait seconds passed, then callback is called by the stats thread.
+ * Returns -1 if the client was not parked as the list already changed.
+ */
+int stats_wait_streams (client_t *client, const char *match, unsigned int wait, stats_streams_callback_t callback);
 void stats_clear_virtual_mounts (void);
 
 void stats_event(const char *source, const char *name, const char *value);
@@ -0,0 +1,212 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/**
+ * Writer side of the stats map, see statsmap.h for details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "statsmap.h"
+
+struct statsmap_tag {
+    char *filename;
+    int fd;
+    size_t length;
+    statsmap_header_t *header;
+    statsmap_mount_t *mounts;
+};
+
+static inline size_t __length_for_slots(size_t mount_slots)
+{
+    return sizeof(statsmap_header_t) + mount_slots * sizeof(statsmap_mount_t);
+}
+
+/* Creates a new file and maps it. The file is created as tmpname and renamed to filename. */
+static int __map_new_file(statsmap_t *map, const char *filename, size_t mount_slots)
+{
+    size_t tmpname_len = strlen(filename) + 5;
+    char *tmpname = malloc(tmpname_len);
+    size_t length = __length_for_slots(mount_slots);
+    statsmap_header_t *header;
+    int fd;
+
+    if (!tmpname)
+        return -1;
+
+    snprintf(tmpname, tmpname_len, "%s.tmp", filename);
+
+    fd = open(tmpname, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmpname);
+        return -1;
+    }
+
+    if (ftruncate(fd, length) != 0) {
+        close(fd);
+        unlink(tmpname);
+        free(tmpname);
+        return -1;
+    }
+
+    header = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        close(fd);
+        unlink(tmpname);
+        free(tmpname);
+        return -1;
+    }
+
+    memcpy(header->magic, STATSMAP_MAGIC, sizeof(header->magic));
+    header->version = STATSMAP_VERSION;
+    header->header_size = sizeof(statsmap_header_t);
+    header->mount_size = sizeof(statsmap_mount_t);
+    header->mount_slots = mount_slots;
+    header->updated = time(NULL);
+
+    if (rename(tmpname, filename) != 0) {
+        munmap(header, length);
+        close(fd);
+        unlink(tmpname);
+        free(tmpname);
+        return -1;
+    }
+
+    free(tmpname);
+
+    map->fd = fd;
+    map->length = length;
+    map->header = header;
+    map->mounts = (statsmap_mount_t *)(header + 1);
+
+    return 0;
+}
+
+static void __mark_stale_and_unmap(statsmap_t *map)
+{
+    statsmap_write_begin(map);
+    map->header->flags |= STATSMAP_FLAG_STALE;
+    statsmap_write_end(map);
+
+    munmap(map->header, map->length);
+    close(map->fd);
+    map->header = NULL;
+    map->mounts = NULL;
+    map->fd = -1;
+}
+
+statsmap_t *        statsmap_open(const char *filename, size_t mount_slots)
+{
+    statsmap_t *map;
+
+    if (!filename)
+        return NULL;
+
+    if (!mount_slots)
+        mount_slots = STATSMAP_DEFAULT_MOUNT_SLOTS;
+
+    map = calloc(1, sizeof(*map));
+    if (!map)
+        return NULL;
+
+    map->filename = strdup(filename);
+    if (!map->filename || __map_new_file(map, filename, mount_slots) != 0) {
+        free(map->filename);
+        free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+void                statsmap_close(statsmap_t *map)
+{
+    if (!map)
+        return;
+
+    unlink(map->filename);
+    __mark_stale_and_unmap(map);
+    free(map->filename);
+    free(map);
+}
+
+int                 statsmap_reserve(statsmap_t *map, size_t mounts)
+{
+    statsmap_t old;
+    size_t slots;
+
+    if (!map)
+        return -1;
+
+    if (mounts <= map->header->mount_slots)
+        return 0;
+
+    slots = map->header->mount_slots * 2;
+    if (slots < mounts)
+        slots = mounts;
+
+    old = *map;
+    if (__map_new_file(map, map->filename, slots) != 0)
+        return -1;
+
+    /* keep the last known state in the new file for readers switching over */
+    memcpy(map->header->global, old.header->global, sizeof(map->header->global));
+    map->header->mount_count = old.header->mount_count;
+    memcpy(map->mounts, old.mounts, old.header->mount_count * sizeof(statsmap_mount_t));
+
+    __mark_stale_and_unmap(&old);
+
+    return 0;
+}
+
+void                statsmap_write_begin(statsmap_t *map)
+{
+    __atomic_store_n(&(map->header->seq), map->header->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    map->header->mount_count = 0;
+}
+
+void                statsmap_write_end(statsmap_t *map)
+{
+    map->header->updated = time(NULL);
+    __atomic_store_n(&(map->header->seq), map->header->seq + 1, __ATOMIC_RELEASE);
+}
+
+void                statsmap_set_global(statsmap_t *map, statsmap_global_t counter, uint64_t value)
+{
+    if (counter < 0 || counter >= STATSMAP_GLOBAL__END)
+        return;
+
+    map->header->global[counter] = value;
+}
+
+statsmap_mount_t *  statsmap_add_mount(statsmap_t *map, const char *mount)
+{
+    statsmap_mount_t *ret;
+
+    if (map->header->mount_count >= map->header->mount_slots)
+        return NULL;
+
+    ret = &(map->mounts[map->header->mount_count++]);
+    memset(ret, 0, sizeof(*ret));
+    snprintf(ret->mount, sizeof(ret->mount), "%s", mount);
+
+    return ret;
+}
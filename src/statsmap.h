@@ -0,0 +1,205 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/* This file contains the layout and API of the stats map.
+ *
+ * The stats map is a memory mapped file maintained by the stats thread.
+ * It exports the most important global and per mount counters in a fixed
+ * binary layout so that local monitoring agents can poll them at a high
+ * rate without sending requests to the server.
+ *
+ * The writer protects all data by a sequence lock. Readers must use
+ * statsmap_read() (or an equivalent of it) to get a consistent copy.
+ *
+ * This header does not depend on any other Icecast header so it can be
+ * copied into external monitoring agents.
+ */
+
+#ifndef __STATSMAP_H__
+#define __STATSMAP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define STATSMAP_MAGIC                  "ICESTMAP"
+#define STATSMAP_VERSION                1
+#define STATSMAP_MOUNT_NAME_LENGTH      256
+#define STATSMAP_DEFAULT_MOUNT_SLOTS    64
+/* Attempts of statsmap_read() to get a consistent copy before it gives up. */
+#define STATSMAP_READ_RETRIES           4096
+
+/* Set in the header's flags when the file is no longer updated.
+ * This happens on shutdown and when the file was replaced by a larger one.
+ * Readers should re-open the file to continue.
+ */
+#define STATSMAP_FLAG_STALE             0x0001U
+
+/* Set in a mount's flags if the mount is hidden. */
+#define STATSMAP_MOUNT_FLAG_HIDDEN      0x0001U
+
+typedef enum {
+    STATSMAP_GLOBAL_CLIENTS = 0,
+    STATSMAP_GLOBAL_CONNECTIONS,
+    STATSMAP_GLOBAL_SOURCES,
+    STATSMAP_GLOBAL_LISTENERS,
+    STATSMAP_GLOBAL_STATS,
+    STATSMAP_GLOBAL_CLIENT_CONNECTIONS,
+    STATSMAP_GLOBAL_LISTENER_CONNECTIONS,
+    STATSMAP_GLOBAL_SOURCE_CLIENT_CONNECTIONS,
+    STATSMAP_GLOBAL_SOURCE_RELAY_CONNECTIONS,
+    STATSMAP_GLOBAL_SOURCE_TOTAL_CONNECTIONS,
+    STATSMAP_GLOBAL_FILE_CONNECTIONS,
+    STATSMAP_GLOBAL_STATS_CONNECTIONS,
+    STATSMAP_GLOBAL__END /* must be last element */
+} statsmap_global_t;
+
+typedef enum {
+    STATSMAP_MOUNT_LISTENERS = 0,
+    STATSMAP_MOUNT_LISTENER_PEAK,
+    STATSMAP_MOUNT_SLOW_LISTENERS,
+    STATSMAP_MOUNT_LISTENER_CONNECTIONS,
+    STATSMAP_MOUNT_TOTAL_BYTES_READ,
+    STATSMAP_MOUNT_TOTAL_BYTES_SENT,
+    STATSMAP_MOUNT__END /* must be last element */
+} statsmap_mount_counter_t;
+
+/* Names of the counters, those match the names used by the stats engine. */
+static const char * const statsmap_global_names[STATSMAP_GLOBAL__END] = {
+    "clients",
+    "connections",
+    "sources",
+    "listeners",
+    "stats",
+    "client_connections",
+    "listener_connections",
+    "source_client_connections",
+    "source_relay_connections",
+    "source_total_connections",
+    "file_connections",
+    "stats_connections"
+};
+
+static const char * const statsmap_mount_names[STATSMAP_MOUNT__END] = {
+    "listeners",
+    "listener_peak",
+    "slow_listeners",
+    "listener_connections",
+    "total_bytes_read",
+    "total_bytes_sent"
+};
+
+/* The file starts with this header, followed by mount_slots times statsmap_mount_t. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t mount_size;
+    uint32_t mount_slots;
+    uint32_t flags;
+    uint32_t mount_count;
+    uint64_t seq;
+    /* UNIX time of the last update */
+    uint64_t updated;
+    uint64_t global[STATSMAP_GLOBAL__END];
+} statsmap_header_t;
+
+typedef struct {
+    char mount[STATSMAP_MOUNT_NAME_LENGTH];
+    uint64_t flags;
+    uint64_t counter[STATSMAP_MOUNT__END];
+} statsmap_mount_t;
+
+/* This checks if a mapping of length bytes holds a stats map this code can read. */
+static inline int statsmap_check(const void *map, size_t length)
+{
+    const statsmap_header_t *header = map;
+
+    if (length < sizeof(statsmap_header_t))
+        return -1;
+    if (memcmp(header->magic, STATSMAP_MAGIC, sizeof(header->magic)) != 0 || header->version != STATSMAP_VERSION)
+        return -1;
+    if (header->header_size != sizeof(statsmap_header_t) || header->mount_size != sizeof(statsmap_mount_t))
+        return -1;
+    if (length < (sizeof(statsmap_header_t) + header->mount_slots * sizeof(statsmap_mount_t)))
+        return -1;
+
+    return 0;
+}
+
+/* This copies a consistent view of the stats map.
+ * Parameters:
+ *  map
+ *      The mapped file as checked by statsmap_check().
+ *  header
+ *      The header is copied into this.
+ *  mounts, mounts_length
+ *      Up to mounts_length mounts are copied into mounts.
+ * Returns:
+ *  The number of mounts copied, -1 if the file is stale or -2 if no
+ *  consistent copy could be taken within STATSMAP_READ_RETRIES attempts.
+ *  The latter happens if the writer is busy or died within an update,
+ *  the caller may try again later.
+ */
+static inline ssize_t statsmap_read(const void *map, statsmap_header_t *header, statsmap_mount_t *mounts, size_t mounts_length)
+{
+    const statsmap_header_t *src = map;
+    const statsmap_mount_t *src_mounts = (const statsmap_mount_t *)(src + 1);
+    uint64_t seq;
+    size_t count;
+    size_t retries = 0;
+
+    while (1) {
+        if (retries++ == STATSMAP_READ_RETRIES)
+            return -2;
+
+        seq = __atomic_load_n(&(src->seq), __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        memcpy(header, src, sizeof(*header));
+        count = header->mount_count;
+        if (count > header->mount_slots)
+            count = header->mount_slots;
+        if (count > mounts_length)
+            count = mounts_length;
+        if (count)
+            memcpy(mounts, src_mounts, count * sizeof(*mounts));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(src->seq), __ATOMIC_RELAXED) == seq)
+            break;
+    }
+
+    if (header->flags & STATSMAP_FLAG_STALE)
+        return -1;
+
+    return count;
+}
+
+/* The writer API is used by the stats thread. It is not thread safe. */
+typedef struct statsmap_tag statsmap_t;
+
+/* This creates (or truncates) the file and maps it. */
+statsmap_t *        statsmap_open(const char *filename, size_t mount_slots);
+/* This marks the file stale, unlinks it and frees the map. */
+void                statsmap_close(statsmap_t *map);
+/* This makes sure at least mounts slots are available.
+ * If the map needs to grow a new file is created and atomically renamed
+ * over the old one. The old one is marked stale.
+ */
+int                 statsmap_reserve(statsmap_t *map, size_t mounts);
+/* Start and end an update, all writes must happen between those calls. */
+void                statsmap_write_begin(statsmap_t *map);
+void                statsmap_write_end(statsmap_t *map);
+void                statsmap_set_global(statsmap_t *map, statsmap_global_t counter, uint64_t value);
+/* This returns the mount slot for the next mount or NULL if there are no free slots left. */
+statsmap_mount_t *  statsmap_add_mount(statsmap_t *map, const char *mount);
+
+#endif
@@ -0,0 +1,224 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/**
+ * icecast-statsmap: small tool to read the stats map exported by Icecast.
+ * It also serves as an example for monitoring agents.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "statsmap.h"
+
+typedef struct {
+    int fd;
+    size_t length;
+    void *map;
+} mapping_t;
+
+static void __usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-j] [-i interval] [-n count] statsmapfile\n"
+                    "  -j           output one JSON object per line\n"
+                    "  -i interval  repeat every interval milliseconds\n"
+                    "  -n count     stop after count reads (default: 1, or endless with -i)\n", progname);
+}
+
+static void __unmap(mapping_t *mapping)
+{
+    if (mapping->map)
+        munmap(mapping->map, mapping->length);
+    if (mapping->fd >= 0)
+        close(mapping->fd);
+    mapping->map = NULL;
+    mapping->fd = -1;
+}
+
+static int __map(mapping_t *mapping, const char *filename)
+{
+    struct stat st;
+
+    mapping->fd = open(filename, O_RDONLY);
+    if (mapping->fd < 0)
+        return -1;
+
+    if (fstat(mapping->fd, &st) != 0) {
+        __unmap(mapping);
+        return -1;
+    }
+
+    mapping->length = st.st_size;
+    mapping->map = mmap(NULL, mapping->length, PROT_READ, MAP_SHARED, mapping->fd, 0);
+    if (mapping->map == MAP_FAILED) {
+        mapping->map = NULL;
+        __unmap(mapping);
+        return -1;
+    }
+
+    if (statsmap_check(mapping->map, mapping->length) != 0) {
+        __unmap(mapping);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void __print_json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            printf("\\u%.4x", (unsigned int)(unsigned char)*str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+static void __print(const statsmap_header_t *header, const statsmap_mount_t *mounts, size_t count, int json)
+{
+    size_t i, j;
+
+    if (json) {
+        printf("{\"updated\":%llu,\"global\":{", (unsigned long long int)header->updated);
+        for (i = 0; i < STATSMAP_GLOBAL__END; i++)
+            printf("%s\"%s\":%llu", i ? "," : "", statsmap_global_names[i], (unsigned long long int)header->global[i]);
+        printf("},\"mounts\":{");
+        for (i = 0; i < count; i++) {
+            printf("%s", i ? "," : "");
+            __print_json_string(mounts[i].mount);
+            printf(":{\"hidden\":%s", (mounts[i].flags & STATSMAP_MOUNT_FLAG_HIDDEN) ? "true" : "false");
+            for (j = 0; j < STATSMAP_MOUNT__END; j++)
+                printf(",\"%s\":%llu", statsmap_mount_names[j], (unsigned long long int)mounts[i].counter[j]);
+            printf("}");
+        }
+        printf("}}\n");
+    } else {
+        printf("updated %llu\n", (unsigned long long int)header->updated);
+        for (i = 0; i < STATSMAP_GLOBAL__END; i++)
+            printf("global %s %llu\n", statsmap_global_names[i], (unsigned long long int)header->global[i]);
+        for (i = 0; i < count; i++) {
+            for (j = 0; j < STATSMAP_MOUNT__END; j++)
+                printf("%s %s %llu\n", mounts[i].mount, statsmap_mount_names[j], (unsigned long long int)mounts[i].counter[j]);
+        }
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    mapping_t mapping = {.fd = -1, .map = NULL};
+    statsmap_header_t header;
+    statsmap_mount_t *mounts = NULL;
+    size_t mounts_length = 0;
+    const char *filename;
+    long interval = 0;
+    long count = -1;
+    int json = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ji:n:h")) != -1) {
+        switch (opt) {
+            case 'j':
+                json = 1;
+            break;
+            case 'i':
+                interval = atol(optarg);
+            break;
+            case 'n':
+                count = atol(optarg);
+            break;
+            default:
+                __usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+            break;
+        }
+    }
+
+    if (optind != (argc - 1)) {
+        __usage(argv[0]);
+        return 1;
+    }
+
+    filename = argv[optind];
+    if (count < 0)
+        count = interval > 0 ? 0 : 1;
+
+    while (1) {
+        ssize_t ret;
+
+        if (!mapping.map && __map(&mapping, filename) != 0) {
+            fprintf(stderr, "Can not open stats map %s\n", filename);
+            free(mounts);
+            return 1;
+        }
+
+        if (mounts_length < ((const statsmap_header_t *)mapping.map)->mount_slots) {
+            statsmap_mount_t *n;
+
+            mounts_length = ((const statsmap_header_t *)mapping.map)->mount_slots;
+            n = realloc(mounts, mounts_length * sizeof(*mounts));
+            if (!n) {
+                fprintf(stderr, "Can not allocate memory\n");
+                free(mounts);
+                __unmap(&mapping);
+                return 1;
+            }
+            mounts = n;
+        }
+
+        ret = statsmap_read(mapping.map, &header, mounts, mounts_length);
+        if (ret == -2) {
+            /* Icecast is within an update for too long, try again later. */
+            if (interval <= 0) {
+                fprintf(stderr, "Stats map %s is busy\n", filename);
+                free(mounts);
+                __unmap(&mapping);
+                return 1;
+            }
+            usleep(interval * 1000);
+            continue;
+        } else if (ret < 0) {
+            /* file got replaced or Icecast is shutting down, try to re-open. */
+            __unmap(&mapping);
+            if (interval <= 0) {
+                fprintf(stderr, "Stats map %s is stale\n", filename);
+                free(mounts);
+                return 1;
+            }
+            usleep(interval * 1000);
+            continue;
+        }
+
+        __print(&header, mounts, ret, json);
+
+        if (count && --count == 0)
+            break;
+
+        usleep(interval * 1000);
+    }
+
+    free(mounts);
+    __unmap(&mapping);
+
+    return 0;
+}
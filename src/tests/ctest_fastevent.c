@@ -0,0 +1,146 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ctest_lib.h"
+
+#include "../fastevent.h"
+
+#define TEST_EMITTERS       4
+#define TEST_REGISTRARS     2
+#define TEST_ROUNDS         10000
+#define TEST_MAGIC_ALIVE    0x600d
+#define TEST_MAGIC_DEAD     0xdead
+
+/* fastevent.c logs to the error log, which is not opened here */
+int errorlog = -1;
+
+typedef struct {
+    int magic;
+} test_userdata_t;
+
+static test_userdata_t *test_userdata[TEST_REGISTRARS * TEST_ROUNDS];
+static int test_running;
+static int test_registered;
+static int test_calls;
+static int test_dead_calls;
+
+static void __cb(const void *userdata, fastevent_type_t type, fastevent_flag_t flags, fastevent_datatype_t datatype, va_list ap)
+{
+    const test_userdata_t *data = userdata;
+
+    (void)type;
+    (void)flags;
+    (void)datatype;
+    (void)ap;
+
+    if (__atomic_load_n(&(data->magic), __ATOMIC_SEQ_CST) != TEST_MAGIC_ALIVE)
+        __atomic_add_fetch(&test_dead_calls, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&test_calls, 1, __ATOMIC_RELAXED);
+}
+
+/* Marks the userdata as dead and keeps it, so late calls can be detected. */
+static void __freecb(void **userdata)
+{
+    test_userdata_t *data = *userdata;
+
+    __atomic_store_n(&(data->magic), TEST_MAGIC_DEAD, __ATOMIC_SEQ_CST);
+    *userdata = NULL;
+}
+
+static void *__emitter(void *arg)
+{
+    (void)arg;
+
+    while (__atomic_load_n(&test_running, __ATOMIC_SEQ_CST))
+        fastevent_emit(FASTEVENT_TYPE_CLIENT_READ, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_NONE, NULL);
+
+    return NULL;
+}
+
+static void *__registrar(void *arg)
+{
+    test_userdata_t **userdata = arg;
+    size_t i;
+
+    for (i = 0; i < TEST_ROUNDS; i++) {
+        refobject_t registration;
+
+        userdata[i] = malloc(sizeof(*userdata[i]));
+        if (!userdata[i]) {
+            __atomic_store_n(&test_registered, 0, __ATOMIC_SEQ_CST);
+            break;
+        }
+        userdata[i]->magic = TEST_MAGIC_ALIVE;
+
+        registration = fastevent_register(FASTEVENT_TYPE_CLIENT_READ, __cb, __freecb, userdata[i]);
+        if (REFOBJECT_IS_NULL(registration)) {
+            free(userdata[i]);
+            userdata[i] = NULL;
+            __atomic_store_n(&test_registered, 0, __ATOMIC_SEQ_CST);
+            break;
+        }
+
+        fastevent_emit(FASTEVENT_TYPE_CLIENT_READ, FASTEVENT_FLAG_NONE, FASTEVENT_DATATYPE_NONE, NULL);
+        refobject_unref(registration);
+    }
+
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    pthread_t emitters[TEST_EMITTERS];
+    pthread_t registrars[TEST_REGISTRARS];
+    size_t i;
+
+    test_running = 1;
+    test_registered = 1;
+
+    for (i = 0; i < TEST_EMITTERS; i++)
+        pthread_create(&(emitters[i]), NULL, __emitter, NULL);
+    for (i = 0; i < TEST_REGISTRARS; i++)
+        pthread_create(&(registrars[i]), NULL, __registrar, &(test_userdata[i * TEST_ROUNDS]));
+
+    for (i = 0; i < TEST_REGISTRARS; i++)
+        pthread_join(registrars[i], NULL);
+
+    __atomic_store_n(&test_running, 0, __ATOMIC_SEQ_CST);
+    for (i = 0; i < TEST_EMITTERS; i++)
+        pthread_join(emitters[i], NULL);
+
+    ctest_test("registered and unregistered concurrently", test_registered);
+    ctest_test("callbacks called", test_calls > 0);
+    ctest_test("no callback after unregister", test_dead_calls == 0);
+    ctest_test("no event active after unregister", fastevent_active == 0);
+
+    for (i = 0; i < (sizeof(test_userdata)/sizeof(*test_userdata)); i++)
+        free(test_userdata[i]);
+}
+
+int main (void)
+{
+    ctest_init();
+
+    if (fastevent_initialize() != 0) {
+        ctest_bail_out("Can not initialize fast events");
+    } else {
+        test_concurrent();
+        fastevent_shutdown();
+    }
+
+    ctest_fin();
+
+    return 0;
+}
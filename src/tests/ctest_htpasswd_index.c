@@ -0,0 +1,219 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctest_lib.h"
+
+#include "../htpasswd_index.h"
+
+#define TEST_FILENAME   "ctest_htpasswd_index.txt"
+#define TEST_USERS      100
+
+static void test_index(void)
+{
+    htpasswd_index *index;
+    htpasswd_index *copy;
+    htpasswd_user *user;
+    htpasswd_user *users[4];
+    char name[32];
+    size_t i;
+    int inserted = 1;
+    int found = 1;
+
+    index = htpasswd_index_new(0);
+    ctest_test("index created", index != NULL);
+    if (!index)
+        return;
+
+    ctest_test("empty index has no users", htpasswd_index_lookup(index, "a") == NULL);
+
+    user = htpasswd_user_new("a", "pass");
+    ctest_test("user created", user != NULL);
+    if (user) {
+        ctest_test("user a inserted", htpasswd_index_insert(index, user) == 0);
+        ctest_test("user a found", htpasswd_index_lookup(index, "a") == user);
+        ctest_test("password kept", strcmp(user->pass, "pass") == 0);
+        ctest_test("line length", user->length == strlen("a:pass"));
+    }
+    ctest_test("unknown user not found", htpasswd_index_lookup(index, "b") == NULL);
+
+    /* fill the index until it asks to be copied into a larger one */
+    for (i = 0; i < TEST_USERS; i++) {
+        snprintf(name, sizeof(name), "user%zu", i);
+        user = htpasswd_user_new(name, "pass");
+        if (!user) {
+            inserted = 0;
+            break;
+        }
+
+        if (htpasswd_index_insert(index, user) != 0) {
+            copy = htpasswd_index_copy(index, index->count + 1);
+            if (!copy || htpasswd_index_insert(copy, user) != 0) {
+                htpasswd_index_free(copy, 0);
+                htpasswd_user_free(user);
+                inserted = 0;
+                break;
+            }
+            htpasswd_index_free(index, 0);
+            index = copy;
+        }
+    }
+    ctest_test("users inserted", inserted);
+    ctest_test("user count", index->count == (TEST_USERS + 1));
+    ctest_test("half of the slots free", index->used * 2 <= index->size);
+
+    for (i = 0; i < TEST_USERS; i++) {
+        snprintf(name, sizeof(name), "user%zu", i);
+        user = htpasswd_index_lookup(index, name);
+        if (!user || strcmp(user->name, name) != 0)
+            found = 0;
+    }
+    ctest_test("users found after growing", found);
+    ctest_test("users listed", htpasswd_index_users(index, users, 4) == 4);
+
+    htpasswd_index_free(index, 1);
+}
+
+/* Returns a new user whose hash uses the same slot of an empty index as hash. */
+static htpasswd_user *__colliding_user(htpasswd_index *index, uint32_t hash, unsigned int *seq)
+{
+    char name[32];
+
+    while (*seq < 100000) {
+        htpasswd_user *user;
+
+        snprintf(name, sizeof(name), "user%u", (*seq)++);
+        user = htpasswd_user_new(name, "pass");
+        if (!user)
+            return NULL;
+        if ((user->hash & (index->size - 1)) == (hash & (index->size - 1)))
+            return user;
+        htpasswd_user_free(user);
+    }
+
+    return NULL;
+}
+
+static void test_tombstones(void)
+{
+    htpasswd_index *index = htpasswd_index_new(0);
+    htpasswd_user *first;
+    htpasswd_user *second;
+    htpasswd_user *third;
+    unsigned int seq = 0;
+    size_t used;
+
+    ctest_test("index created", index != NULL);
+    if (!index)
+        return;
+
+    /* all three users share one probe chain, in the order they are inserted */
+    first = htpasswd_user_new("first", "1");
+    second = first ? __colliding_user(index, first->hash, &seq) : NULL;
+    third = first ? __colliding_user(index, first->hash, &seq) : NULL;
+    if (!first || !second || !third) {
+        ctest_test("colliding users created", 0);
+        if (first)
+            htpasswd_user_free(first);
+        if (second)
+            htpasswd_user_free(second);
+        htpasswd_index_free(index, 0);
+        return;
+    }
+
+    htpasswd_index_insert(index, first);
+    htpasswd_index_insert(index, second);
+    htpasswd_index_insert(index, third);
+    used = index->used;
+
+    ctest_test("first removed", htpasswd_index_remove(index, "first") == first);
+    ctest_test("first gone", htpasswd_index_lookup(index, "first") == NULL);
+    ctest_test("first not removed twice", htpasswd_index_remove(index, "first") == NULL);
+    ctest_test("user behind tombstone found", htpasswd_index_lookup(index, second->name) == second);
+    ctest_test("second user behind tombstone found", htpasswd_index_lookup(index, third->name) == third);
+    ctest_test("user count after remove", index->count == 2);
+    ctest_test("tombstone keeps its slot used", index->used == used);
+
+    ctest_test("tombstone reused", htpasswd_index_insert(index, first) == 0 && index->used == used);
+    ctest_test("reinserted user found", htpasswd_index_lookup(index, "first") == first);
+    ctest_test("other users still found", htpasswd_index_lookup(index, second->name) == second && htpasswd_index_lookup(index, third->name) == third);
+
+    htpasswd_index_free(index, 1);
+}
+
+static int __file_is(const char *content)
+{
+    char buf[256];
+    FILE *file = fopen(TEST_FILENAME, "rb");
+    size_t len;
+
+    if (!file)
+        return 0;
+
+    len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = 0;
+
+    return strcmp(buf, content) == 0;
+}
+
+static void test_delete_inplace(void)
+{
+    static const char content[] = "a:1234\nbob:abcd\nc:ef\n";
+    htpasswd_user *user;
+    FILE *file;
+
+    file = fopen(TEST_FILENAME, "wb");
+    if (!file) {
+        ctest_test("test file created", 0);
+        return;
+    }
+    fputs(content, file);
+    fclose(file);
+
+    user = htpasswd_user_new("bob", "abcd");
+    if (!user) {
+        ctest_test("user created", 0);
+        remove(TEST_FILENAME);
+        return;
+    }
+
+    ctest_test("no delete without offset", htpasswd_user_delete_inplace(TEST_FILENAME, user) == -1);
+
+    user->offset = 2;
+    ctest_test("no delete at wrong offset", htpasswd_user_delete_inplace(TEST_FILENAME, user) == -1);
+    ctest_test("file unchanged", __file_is(content));
+
+    user->offset = 7;
+    ctest_test("deleted in place", htpasswd_user_delete_inplace(TEST_FILENAME, user) == 0);
+    ctest_test("line commented out", __file_is("a:1234\n#       \nc:ef\n"));
+    ctest_test("no delete of commented line", htpasswd_user_delete_inplace(TEST_FILENAME, user) == -1);
+
+    htpasswd_user_free(user);
+    remove(TEST_FILENAME);
+}
+
+int main (void)
+{
+    ctest_init();
+
+    test_index();
+    test_tombstones();
+    test_delete_inplace();
+
+    ctest_fin();
+
+    return 0;
+}
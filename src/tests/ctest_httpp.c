@@ -0,0 +1,184 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ctest_lib.h"
+
+#include "../src/common/httpp/httpp.h"
+
+static const char request[] =
+    "GET /stream.mp3?a=1&b=x%20y&a=2 HTTP/1.1\r\n"
+    "Host: example.org\r\n"
+    "User-Agent: test/1.0\r\n"
+    "Icy-MetaData: 1\r\n"
+    "X-Custom: custom value\r\n"
+    "\r\n";
+
+static void test_parse(void)
+{
+    http_parser_t *parser = httpp_create_parser();
+    const http_var_t *var;
+
+    ctest_test("parser created", parser != NULL);
+    httpp_initialize(parser, NULL);
+    ctest_test("request parsed", httpp_parse(parser, request, strlen(request)) == 1);
+
+    ctest_test("request type", parser->req_type == httpp_req_get);
+    ctest_test("uri", parser->uri && strcmp(parser->uri, "/stream.mp3") == 0);
+    ctest_test("uri var", strcmp(httpp_getvar(parser, HTTPP_VAR_URI), "/stream.mp3") == 0);
+    ctest_test("protocol", strcmp(httpp_getvar(parser, HTTPP_VAR_PROTOCOL), "HTTP") == 0);
+    ctest_test("version", strcmp(httpp_getvar(parser, HTTPP_VAR_VERSION), "1.1") == 0);
+
+    ctest_test("known header", strcmp(httpp_getvar(parser, "host"), "example.org") == 0);
+    ctest_test("known header lowercased", strcmp(httpp_getvar(parser, "icy-metadata"), "1") == 0);
+    ctest_test("known header not set", httpp_getvar(parser, "range") == NULL);
+    ctest_test("other header", strcmp(httpp_getvar(parser, "x-custom"), "custom value") == 0);
+    ctest_test("unknown header", httpp_getvar(parser, "x-missing") == NULL);
+
+    ctest_test("query param", strcmp(httpp_get_query_param(parser, "a"), "1") == 0);
+    ctest_test("query param unescaped", strcmp(httpp_get_query_param(parser, "b"), "x y") == 0);
+    var = httpp_get_param_var(parser, "a");
+    ctest_test("query param values", var && var->values == 2 && strcmp(var->value[1], "2") == 0);
+
+    ctest_test("header not a var", httpp_get_any_var(parser, HTTPP_NS_VAR, "host") == NULL);
+    ctest_test("var not a header", httpp_get_any_var(parser, HTTPP_NS_HEADER, HTTPP_VAR_URI) == NULL);
+
+    ctest_test("released", httpp_release(parser) == 0);
+}
+
+static void test_setvar(void)
+{
+    http_parser_t *parser = httpp_create_parser();
+    char value[64];
+    size_t i;
+
+    httpp_initialize(parser, NULL);
+    ctest_test("request parsed", httpp_parse(parser, request, strlen(request)) == 1);
+
+    httpp_setvar(parser, "user-agent", "other/2.0");
+    ctest_test("known header replaced", strcmp(httpp_getvar(parser, "user-agent"), "other/2.0") == 0);
+
+    httpp_setvar(parser, "content-type", "audio/mpeg");
+    ctest_test("known header added", strcmp(httpp_getvar(parser, "content-type"), "audio/mpeg") == 0);
+
+    httpp_deletevar(parser, "host");
+    ctest_test("known header deleted", httpp_getvar(parser, "host") == NULL);
+    ctest_test("known header kept", strcmp(httpp_getvar(parser, "icy-metadata"), "1") == 0);
+    ctest_test("known header kept after delete", strcmp(httpp_getvar(parser, "content-type"), "audio/mpeg") == 0);
+
+    /* enough to need more arena chunks and larger tables */
+    for (i = 0; i < 200; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "x-header-%u", (unsigned int)i);
+        snprintf(value, sizeof(value), "value %u", (unsigned int)i);
+        httpp_setvar(parser, name, value);
+    }
+    ctest_test("first added header", strcmp(httpp_getvar(parser, "x-header-0"), "value 0") == 0);
+    ctest_test("last added header", strcmp(httpp_getvar(parser, "x-header-199"), "value 199") == 0);
+    ctest_test("known header after growth", strcmp(httpp_getvar(parser, "content-type"), "audio/mpeg") == 0);
+
+    httpp_set_query_param(parser, "mount", "/other%2emp3");
+    ctest_test("query param set", strcmp(httpp_get_query_param(parser, "mount"), "/other.mp3") == 0);
+
+    ctest_test("released", httpp_release(parser) == 0);
+}
+
+static void test_iterate(void)
+{
+    http_parser_t *parser = httpp_create_parser();
+    const http_var_t *var;
+    size_t pos = 0;
+    size_t headers = 0;
+    char **keys;
+    size_t i;
+
+    httpp_initialize(parser, NULL);
+    ctest_test("request parsed", httpp_parse(parser, request, strlen(request)) == 1);
+
+    while ((var = httpp_next_any_var(parser, HTTPP_NS_HEADER, &pos))) {
+        if (var->name[0] == '_')
+            break;
+        headers++;
+    }
+    ctest_test("headers iterated", var == NULL && headers == 4);
+
+    keys = httpp_get_any_key(parser, HTTPP_NS_QUERY_STRING);
+    for (i = 0; keys && keys[i]; i++);
+    ctest_test("query keys", keys && i == 2);
+    httpp_free_any_key(keys);
+
+    ctest_test("released", httpp_release(parser) == 0);
+}
+
+static void test_response(void)
+{
+    static const char response[] =
+        "HTTP/1.0 404 Not Found\r\n"
+        "Content-Type: text/html\r\n"
+        "\r\n";
+    http_parser_t *parser = httpp_create_parser();
+
+    httpp_initialize(parser, NULL);
+    ctest_test("response parsed", httpp_parse_response(parser, response, strlen(response), "/x") == 1);
+    ctest_test("error code", strcmp(httpp_getvar(parser, HTTPP_VAR_ERROR_CODE), "404") == 0);
+    ctest_test("error message", strcmp(httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE), "Not Found") == 0);
+    ctest_test("content type", strcmp(httpp_getvar(parser, "content-type"), "text/html") == 0);
+    ctest_test("released", httpp_release(parser) == 0);
+}
+
+static void test_compact(void)
+{
+    http_parser_t *parser = httpp_create_parser();
+    size_t before;
+    size_t i;
+
+    httpp_initialize(parser, NULL);
+    ctest_test("request parsed", httpp_parse(parser, request, strlen(request)) == 1);
+    for (i = 0; i < 50; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "x-header-%u", (unsigned int)i);
+        httpp_setvar(parser, name, "value");
+    }
+    before = httpp_memory_usage(parser);
+
+    parser = httpp_compact(parser);
+    ctest_test("compacted", parser != NULL);
+    ctest_test("smaller", httpp_memory_usage(parser) < before);
+    ctest_test("uri kept", parser->uri && strcmp(parser->uri, "/stream.mp3") == 0);
+    ctest_test("request type kept", parser->req_type == httpp_req_get);
+    ctest_test("known header kept", strcmp(httpp_getvar(parser, "host"), "example.org") == 0);
+    ctest_test("other header kept", strcmp(httpp_getvar(parser, "x-custom"), "custom value") == 0);
+    ctest_test("added header kept", strcmp(httpp_getvar(parser, "x-header-49"), "value") == 0);
+    ctest_test("query params dropped", httpp_get_query_param(parser, "a") == NULL);
+
+    httpp_setvar(parser, "x-late", "late value");
+    ctest_test("header added after compact", strcmp(httpp_getvar(parser, "x-late"), "late value") == 0);
+
+    ctest_test("released", httpp_release(parser) == 0);
+}
+
+int main (void)
+{
+    ctest_init();
+
+    test_parse();
+    test_setvar();
+    test_iterate();
+    test_response();
+    test_compact();
+
+    ctest_fin();
+
+    return 0;
+}
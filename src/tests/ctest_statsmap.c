@@ -0,0 +1,188 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ctest_lib.h"
+
+#include "../src/statsmap.h"
+
+#define TEST_FILENAME   "ctest_statsmap.map"
+#define TEST_ROUNDS     20000
+
+static void *__map_file(size_t *length)
+{
+    struct stat st;
+    void *map;
+    int fd = open(TEST_FILENAME, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    *length = st.st_size;
+    return map;
+}
+
+static void test_write_read(void)
+{
+    statsmap_t *map;
+    statsmap_header_t header;
+    statsmap_mount_t mounts[4];
+    statsmap_mount_t *mount;
+    void *reader;
+    size_t length;
+    ssize_t ret;
+
+    map = statsmap_open(TEST_FILENAME, 2);
+    ctest_test("stats map created", map != NULL);
+    if (!map)
+        return;
+
+    statsmap_write_begin(map);
+    statsmap_set_global(map, STATSMAP_GLOBAL_LISTENERS, 42);
+    mount = statsmap_add_mount(map, "/a");
+    ctest_test("mount /a added", mount != NULL);
+    if (mount)
+        mount->counter[STATSMAP_MOUNT_TOTAL_BYTES_SENT] = 1234;
+    ctest_test("mount /b added", statsmap_add_mount(map, "/b") != NULL);
+    ctest_test("no third slot", statsmap_add_mount(map, "/c") == NULL);
+    statsmap_write_end(map);
+
+    reader = __map_file(&length);
+    ctest_test("stats map mapped", reader != NULL);
+    if (reader) {
+        ctest_test("stats map valid", statsmap_check(reader, length) == 0);
+        ret = statsmap_read(reader, &header, mounts, 4);
+        ctest_test("two mounts read", ret == 2);
+        ctest_test("global counter matches", header.global[STATSMAP_GLOBAL_LISTENERS] == 42);
+        ctest_test("mount name matches", strcmp(mounts[0].mount, "/a") == 0);
+        ctest_test("mount counter matches", mounts[0].counter[STATSMAP_MOUNT_TOTAL_BYTES_SENT] == 1234);
+
+        ctest_test("stats map resized", statsmap_reserve(map, 3) == 0);
+        ctest_test("old stats map is stale", statsmap_read(reader, &header, mounts, 4) == -1);
+        munmap(reader, length);
+    }
+
+    reader = __map_file(&length);
+    ctest_test("new stats map mapped", reader != NULL);
+    if (reader) {
+        ctest_test("new stats map valid", statsmap_check(reader, length) == 0);
+        ret = statsmap_read(reader, &header, mounts, 4);
+        ctest_test("state was kept", ret == 2 && header.global[STATSMAP_GLOBAL_LISTENERS] == 42);
+        ctest_test("enough slots", header.mount_slots >= 3);
+
+        /* a writer that never finishes its update must not block readers */
+        statsmap_write_begin(map);
+        ctest_test("read within update gives up", statsmap_read(reader, &header, mounts, 4) == -2);
+        statsmap_write_end(map);
+        ctest_test("read after update", statsmap_read(reader, &header, mounts, 4) >= 0);
+        munmap(reader, length);
+    }
+
+    statsmap_close(map);
+    ctest_test("stats map removed on close", access(TEST_FILENAME, F_OK) != 0);
+}
+
+static void *__writer(void *arg)
+{
+    statsmap_t *map = arg;
+    uint64_t i;
+    size_t j;
+
+    for (i = 1; i <= TEST_ROUNDS; i++) {
+        statsmap_mount_t *mount;
+
+        statsmap_write_begin(map);
+        for (j = 0; j < STATSMAP_GLOBAL__END; j++)
+            statsmap_set_global(map, j, i);
+        mount = statsmap_add_mount(map, "/x");
+        for (j = 0; j < STATSMAP_MOUNT__END; j++)
+            mount->counter[j] = i;
+        statsmap_write_end(map);
+    }
+
+    return NULL;
+}
+
+static void test_concurrent(void)
+{
+    statsmap_t *map;
+    statsmap_header_t header;
+    statsmap_mount_t mount;
+    pthread_t thread;
+    void *reader;
+    size_t length;
+    size_t i;
+    int consistent = 1;
+    uint64_t last = 0;
+
+    map = statsmap_open(TEST_FILENAME, 1);
+    ctest_test("stats map created", map != NULL);
+    if (!map)
+        return;
+
+    reader = __map_file(&length);
+    ctest_test("stats map mapped", reader != NULL);
+    if (!reader) {
+        statsmap_close(map);
+        return;
+    }
+
+    pthread_create(&thread, NULL, __writer, map);
+    while (last < TEST_ROUNDS) {
+        if (statsmap_read(reader, &header, &mount, 1) != 1)
+            continue;
+        for (i = 0; i < STATSMAP_GLOBAL__END; i++)
+            if (header.global[i] != header.global[0])
+                consistent = 0;
+        for (i = 0; i < STATSMAP_MOUNT__END; i++)
+            if (mount.counter[i] != header.global[0])
+                consistent = 0;
+        if (header.global[0] < last)
+            consistent = 0;
+        last = header.global[0];
+    }
+    pthread_join(thread, NULL);
+
+    ctest_test("all reads were consistent", consistent);
+
+    munmap(reader, length);
+    statsmap_close(map);
+}
+
+int main (void)
+{
+    ctest_init();
+
+    test_write_read();
+    test_concurrent();
+
+    ctest_fin();
+
+    return 0;
+}
@@ -17,12 +17,24 @@
 #ifdef HAVE_OPENSSL
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <time.h>
+
+#include "common/thread/thread.h"
 
 #include "tls.h"
+#include "metrics.h"
 
 #include "logging.h"
 #define CATMODULE "tls"
@@ -46,29 +58,385 @@ int        tls_check_impl(const char *impl)
 struct tls_ctx_tag {
     size_t refc;
     SSL_CTX *ctx;
+    int ktls;
 };
 
 struct tls_tag {
     size_t refc;
     SSL *ssl;
     tls_ctx_t *ctx;
+    /* kTLS was requested and the state is not yet known */
+    int ktls_pending;
+};
+
+#define TLS_SESSION_ID_CONTEXT  "icecast"
+#define TLS_SESSION_BUCKETS     4096
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define TLS_SESSION_ID_CONST
+#else
+#define TLS_SESSION_ID_CONST const
+#endif
+
+/* The session cache and the ticket keys are shared by all contexts,
+ * so resumption keeps working when the certificate is reloaded.
+ */
+typedef struct tls_session_tag tls_session_t;
+struct tls_session_tag {
+    /* next session in the same bucket */
+    tls_session_t *next;
+    /* sessions in the order they were added */
+    tls_session_t *newer;
+    tls_session_t *older;
+    time_t expires;
+    unsigned int id_len;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    size_t der_len;
+    unsigned char der[];
 };
 
+typedef struct {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    time_t created;
+} tls_ticket_key_t;
+
+static mutex_t tls_session_lock; // protects the session cache
+static tls_session_t *tls_session_buckets[TLS_SESSION_BUCKETS];
+static tls_session_t *tls_session_oldest;
+static tls_session_t *tls_session_newest;
+static size_t tls_session_count;
+static size_t tls_session_max;
+
+static mutex_t tls_ticket_lock; // protects the ticket keys
+/* [0] is the current key, [1] the previous one which is still accepted */
+static tls_ticket_key_t tls_ticket_keys[2];
+static size_t tls_ticket_keys_len;
+static time_t tls_ticket_rotation;
+
 void       tls_initialize(void)
 {
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     SSL_load_error_strings(); /* readable error messages */
     SSL_library_init(); /* initialize library */
 #endif
+    thread_mutex_create(&tls_session_lock);
+    thread_mutex_create(&tls_ticket_lock);
 }
 
+static void __session_unlink(tls_session_t *session);
+
 void       tls_shutdown(void)
 {
+    thread_mutex_lock(&tls_session_lock);
+    while (tls_session_oldest)
+        __session_unlink(tls_session_oldest);
+    thread_mutex_unlock(&tls_session_lock);
+    thread_mutex_destroy(&tls_session_lock);
+
+    thread_mutex_lock(&tls_ticket_lock);
+    OPENSSL_cleanse(tls_ticket_keys, sizeof(tls_ticket_keys));
+    tls_ticket_keys_len = 0;
+    thread_mutex_unlock(&tls_ticket_lock);
+    thread_mutex_destroy(&tls_ticket_lock);
+
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     ERR_free_strings();
 #endif
 }
 
+static inline tls_session_t **__session_bucket(const unsigned char *id, unsigned int id_len)
+{
+    size_t hash = 0;
+    unsigned int i;
+
+    /* session IDs are random, the first bytes are good enough */
+    for (i = 0; i < id_len && i < 8; i++)
+        hash = (hash << 8) | id[i];
+
+    return &(tls_session_buckets[hash % TLS_SESSION_BUCKETS]);
+}
+
+/* Must be called with tls_session_lock locked. */
+static tls_session_t *__session_find(const unsigned char *id, unsigned int id_len)
+{
+    tls_session_t *session;
+
+    for (session = *__session_bucket(id, id_len); session; session = session->next) {
+        if (session->id_len == id_len && memcmp(session->id, id, id_len) == 0)
+            return session;
+    }
+
+    return NULL;
+}
+
+/* Removes the session from the cache and frees it.
+ * Must be called with tls_session_lock locked.
+ */
+static void __session_unlink(tls_session_t *session)
+{
+    tls_session_t **prev;
+
+    for (prev = __session_bucket(session->id, session->id_len); *prev; prev = &((*prev)->next)) {
+        if (*prev == session) {
+            *prev = session->next;
+            break;
+        }
+    }
+
+    if (session->older) {
+        session->older->newer = session->newer;
+    } else {
+        tls_session_oldest = session->newer;
+    }
+
+    if (session->newer) {
+        session->newer->older = session->older;
+    } else {
+        tls_session_newest = session->older;
+    }
+
+    tls_session_count--;
+    metrics_gauge_add(METRICS_GAUGE_TLS_SESSION_CACHE, -1);
+    OPENSSL_cleanse(session->der, session->der_len);
+    free(session);
+}
+
+static int __session_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    tls_session_t *session;
+    tls_session_t *old;
+    tls_session_t **bucket;
+    const unsigned char *id;
+    unsigned int id_len;
+    unsigned char *p;
+    int der_len;
+
+    (void)ssl;
+
+    id = SSL_SESSION_get_id(sess, &id_len);
+    der_len = i2d_SSL_SESSION(sess, NULL);
+    if (!id || !id_len || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH || der_len <= 0)
+        return 0;
+
+    session = calloc(1, sizeof(*session) + der_len);
+    if (!session)
+        return 0;
+
+    session->expires = time(NULL) + SSL_SESSION_get_timeout(sess);
+    session->id_len = id_len;
+    memcpy(session->id, id, id_len);
+    p = session->der;
+    session->der_len = i2d_SSL_SESSION(sess, &p);
+
+    thread_mutex_lock(&tls_session_lock);
+    if (!tls_session_max) {
+        thread_mutex_unlock(&tls_session_lock);
+        free(session);
+        return 0;
+    }
+
+    old = __session_find(id, id_len);
+    if (old)
+        __session_unlink(old);
+
+    while (tls_session_count >= tls_session_max)
+        __session_unlink(tls_session_oldest);
+
+    bucket = __session_bucket(id, id_len);
+    session->next = *bucket;
+    *bucket = session;
+    session->older = tls_session_newest;
+    if (tls_session_newest) {
+        tls_session_newest->newer = session;
+    } else {
+        tls_session_oldest = session;
+    }
+    tls_session_newest = session;
+    tls_session_count++;
+    metrics_gauge_add(METRICS_GAUGE_TLS_SESSION_CACHE, 1);
+    thread_mutex_unlock(&tls_session_lock);
+
+    /* we did not keep a reference */
+    return 0;
+}
+
+static SSL_SESSION *__session_get_cb(SSL *ssl, TLS_SESSION_ID_CONST unsigned char *id, int id_len, int *copy)
+{
+    SSL_SESSION *sess = NULL;
+    tls_session_t *session;
+
+    (void)ssl;
+
+    *copy = 0;
+
+    if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+
+    thread_mutex_lock(&tls_session_lock);
+    session = __session_find(id, id_len);
+    if (session && session->expires < time(NULL)) {
+        __session_unlink(session);
+        session = NULL;
+    }
+    if (session) {
+        const unsigned char *p = session->der;
+        sess = d2i_SSL_SESSION(NULL, &p, session->der_len);
+    }
+    thread_mutex_unlock(&tls_session_lock);
+
+    return sess;
+}
+
+static void __session_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    tls_session_t *session;
+    const unsigned char *id;
+    unsigned int id_len;
+
+    (void)ctx;
+
+    id = SSL_SESSION_get_id(sess, &id_len);
+    if (!id || !id_len)
+        return;
+
+    thread_mutex_lock(&tls_session_lock);
+    session = __session_find(id, id_len);
+    if (session)
+        __session_unlink(session);
+    thread_mutex_unlock(&tls_session_lock);
+}
+
+/* Starts using a new ticket key if the current one is due.
+ * Must be called with tls_ticket_lock locked.
+ */
+static void __ticket_keys_rotate(time_t now)
+{
+    tls_ticket_key_t key;
+
+    if (tls_ticket_keys_len && (now - tls_ticket_keys[0].created) < tls_ticket_rotation)
+        return;
+
+    if (RAND_bytes(key.name, sizeof(key.name)) <= 0 ||
+        RAND_bytes(key.aes_key, sizeof(key.aes_key)) <= 0 ||
+        RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) <= 0) {
+        ICECAST_LOG_ERROR("Can not generate TLS ticket key, keeping the old one.");
+        OPENSSL_cleanse(&key, sizeof(key));
+        return;
+    }
+    key.created = now;
+
+    if (tls_ticket_keys_len) {
+        tls_ticket_keys[1] = tls_ticket_keys[0];
+        tls_ticket_keys_len = 2;
+        metrics_counter_inc(METRICS_COUNTER_TLS_TICKET_KEY_ROTATION);
+    } else {
+        tls_ticket_keys_len = 1;
+    }
+    tls_ticket_keys[0] = key;
+    OPENSSL_cleanse(&key, sizeof(key));
+}
+
+/* Selects the key to encrypt a new ticket or the one to decrypt the ticket with key_name.
+ * Returns 1 if the key was found, 2 if the ticket should be renewed, 0 if the key is unknown and -1 on error.
+ */
+static int __ticket_key_get(unsigned char key_name[16], int enc, tls_ticket_key_t *key)
+{
+    int ret = -1;
+    size_t i;
+
+    thread_mutex_lock(&tls_ticket_lock);
+    __ticket_keys_rotate(time(NULL));
+
+    if (enc) {
+        if (tls_ticket_keys_len) {
+            *key = tls_ticket_keys[0];
+            memcpy(key_name, key->name, sizeof(key->name));
+            ret = 1;
+        }
+    } else {
+        ret = 0;
+        for (i = 0; i < tls_ticket_keys_len; i++) {
+            if (memcmp(key_name, tls_ticket_keys[i].name, sizeof(tls_ticket_keys[i].name)) == 0) {
+                *key = tls_ticket_keys[i];
+                /* tickets of the old key are replaced with tickets of the current one */
+                ret = i == 0 ? 1 : 2;
+                break;
+            }
+        }
+    }
+    thread_mutex_unlock(&tls_ticket_lock);
+
+    return ret;
+}
+
+static int __ticket_cipher_init(EVP_CIPHER_CTX *cctx, const tls_ticket_key_t *key, unsigned char *iv, int enc)
+{
+    if (enc) {
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+            return -1;
+        return EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) ? 0 : -1;
+    } else {
+        return EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv) ? 0 : -1;
+    }
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int __ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char iv[EVP_MAX_IV_LENGTH], EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+{
+    tls_ticket_key_t key;
+    OSSL_PARAM params[3];
+    int ret;
+
+    (void)ssl;
+
+    ret = __ticket_key_get(key_name, enc, &key);
+    if (ret <= 0)
+        return ret;
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"sha256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+
+    if (__ticket_cipher_init(cctx, &key, iv, enc) != 0 || !EVP_MAC_CTX_set_params(hctx, params))
+        ret = -1;
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    return ret;
+}
+#else
+static int __ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv, EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+{
+    tls_ticket_key_t key;
+    int ret;
+
+    (void)ssl;
+
+    ret = __ticket_key_get(key_name, enc, &key);
+    if (ret <= 0)
+        return ret;
+
+    if (__ticket_cipher_init(cctx, &key, iv, enc) != 0 || !HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL))
+        ret = -1;
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    return ret;
+}
+#endif
+
+static void __info_cb(const SSL *ssl, int where, int ret)
+{
+    (void)ret;
+
+    if (!(where & SSL_CB_HANDSHAKE_DONE))
+        return;
+
+    metrics_counter_inc(METRICS_COUNTER_TLS_HANDSHAKE);
+    if (SSL_session_reused((SSL *)ssl))
+        metrics_counter_inc(METRICS_COUNTER_TLS_RESUMED);
+}
+
 tls_ctx_t *tls_ctx_new(const char *cert_file, const char *key_file, const char *cipher_list)
 {
     tls_ctx_t *ctx;
@@ -101,6 +469,13 @@ tls_ctx_t *tls_ctx_new(const char *cert_file, const char *key_file, const char *
      * Calling SSL_CTX_get_options is not needed here, therefore.
      */
     SSL_CTX_set_options(ctx->ctx, ssl_opts);
+#ifdef SSL_MODE_RELEASE_BUFFERS
+    /* Most listeners are idle most of the time, don't keep the read and
+     * write buffers (about 34kB per connection) around while they are.
+     */
+    SSL_CTX_set_mode(ctx->ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif
+    SSL_CTX_set_info_callback(ctx->ctx, __info_cb);
     do {
         if (SSL_CTX_use_certificate_chain_file(ctx->ctx, cert_file) <= 0) {
             ICECAST_LOG_WARN("Invalid cert file %s", cert_file);
@@ -151,6 +526,61 @@ void       tls_ctx_unref(tls_ctx_t *ctx)
     free(ctx);
 }
 
+void       tls_ctx_set_session_cache(tls_ctx_t *ctx, size_t cache_size, unsigned int ticket_key_rotation)
+{
+    if (!ctx)
+        return;
+
+    SSL_CTX_set_session_id_context(ctx->ctx, (const unsigned char *)TLS_SESSION_ID_CONTEXT, strlen(TLS_SESSION_ID_CONTEXT));
+
+    thread_mutex_lock(&tls_session_lock);
+    tls_session_max = cache_size;
+    while (tls_session_count > tls_session_max)
+        __session_unlink(tls_session_oldest);
+    thread_mutex_unlock(&tls_session_lock);
+
+    if (cache_size) {
+        SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_SERVER|SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx->ctx, __session_new_cb);
+        SSL_CTX_sess_set_get_cb(ctx->ctx, __session_get_cb);
+        SSL_CTX_sess_set_remove_cb(ctx->ctx, __session_remove_cb);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    if (ticket_key_rotation) {
+        thread_mutex_lock(&tls_ticket_lock);
+        tls_ticket_rotation = ticket_key_rotation;
+        thread_mutex_unlock(&tls_ticket_lock);
+
+        /* sessions are valid for one rotation, the previous key is kept
+         * so tickets made just before a rotation can still be used
+         */
+        SSL_CTX_set_timeout(ctx->ctx, ticket_key_rotation);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx->ctx, __ticket_key_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx->ctx, __ticket_key_cb);
+#endif
+    } else {
+        SSL_CTX_set_options(ctx->ctx, SSL_OP_NO_TICKET);
+    }
+}
+
+int        tls_ctx_enable_ktls(tls_ctx_t *ctx)
+{
+    if (!ctx)
+        return -1;
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    SSL_CTX_set_options(ctx->ctx, SSL_OP_ENABLE_KTLS);
+    ctx->ktls = 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 tls_t     *tls_new(tls_ctx_t *ctx)
 {
     tls_t *tls;
@@ -174,6 +604,7 @@ tls_t     *tls_new(tls_ctx_t *ctx)
     tls->refc = 1;
     tls->ssl  = ssl;
     tls->ctx  = ctx;
+    tls->ktls_pending = ctx->ktls;
 
     return tls;
 }
@@ -239,6 +670,47 @@ int        tls_want_io(tls_t *tls)
     }
 }
 
+int        tls_handshake(tls_t *tls, int *want_write)
+{
+    int ret;
+
+    if (want_write)
+        *want_write = 0;
+
+    if (!tls)
+        return -1;
+
+    if (SSL_is_init_finished(tls->ssl))
+        return 1;
+
+    ERR_clear_error();
+    ret = SSL_do_handshake(tls->ssl);
+    if (ret == 1)
+        return 1;
+
+    switch (SSL_get_error(tls->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return 0;
+        break;
+        case SSL_ERROR_WANT_WRITE:
+            if (want_write)
+                *want_write = 1;
+            return 0;
+        break;
+        default:
+            return -1;
+        break;
+    }
+}
+
+int        tls_handshake_done(tls_t *tls)
+{
+    if (!tls)
+        return -1;
+
+    return SSL_is_init_finished(tls->ssl) ? 1 : 0;
+}
+
 int        tls_got_shutdown(tls_t *tls)
 {
     if (!tls)
@@ -281,6 +753,30 @@ ssize_t    tls_write(tls_t *tls, const void *buffer, size_t len)
 
     return ret;
 }
+
+int        tls_ktls_send(tls_t *tls)
+{
+    BIO *wbio;
+
+    if (!tls)
+        return -1;
+
+    if (!tls->ktls_pending)
+        return 0;
+
+    /* kTLS is set up during the handshake, wait for it and anything OpenSSL still has to write */
+    if (!SSL_is_init_finished(tls->ssl) || SSL_want(tls->ssl) != SSL_NOTHING)
+        return 0;
+
+    wbio = SSL_get_wbio(tls->ssl);
+    if (!wbio || BIO_wpending(wbio))
+        return 0;
+
+    /* it will not be enabled later on */
+    tls->ktls_pending = 0;
+
+    return BIO_get_ktls_send(wbio) ? 1 : 0;
+}
 #else
 void       tls_initialize(void)
 {
@@ -299,6 +795,13 @@ void       tls_ctx_ref(tls_ctx_t *ctx)
 void       tls_ctx_unref(tls_ctx_t *ctx)
 {
 }
+void       tls_ctx_set_session_cache(tls_ctx_t *ctx, size_t cache_size, unsigned int ticket_key_rotation)
+{
+}
+int        tls_ctx_enable_ktls(tls_ctx_t *ctx)
+{
+    return -1;
+}
 
 tls_t     *tls_new(tls_ctx_t *ctx)
 {
@@ -322,6 +825,14 @@ int        tls_want_io(tls_t *tls)
 {
     return -1;
 }
+int        tls_handshake(tls_t *tls, int *want_write)
+{
+    return -1;
+}
+int        tls_handshake_done(tls_t *tls)
+{
+    return -1;
+}
 
 int        tls_got_shutdown(tls_t *tls)
 {
@@ -337,4 +848,9 @@ ssize_t    tls_write(tls_t *tls, const void *buffer, size_t len)
     return -1;
 }
 
+int        tls_ktls_send(tls_t *tls)
+{
+    return -1;
+}
+
 #endif
@@ -29,6 +29,17 @@ void       tls_shutdown(void);
 tls_ctx_t *tls_ctx_new(const char *cert_file, const char *key_file, const char *cipher_list);
 void       tls_ctx_ref(tls_ctx_t *ctx);
 void       tls_ctx_unref(tls_ctx_t *ctx);
+/* Sets up session resumption. The session cache and ticket keys are shared by
+ * all contexts. A cache_size of 0 disables the cache, a ticket_key_rotation
+ * of 0 disables tickets. Otherwise a new ticket key is used every
+ * ticket_key_rotation seconds and the previous one is still accepted.
+ */
+void       tls_ctx_set_session_cache(tls_ctx_t *ctx, size_t cache_size, unsigned int ticket_key_rotation);
+/* Lets the kernel do the record layer (kTLS) once the handshake is done.
+ * Connections fall back to userspace TLS if the kernel or cipher does not support it.
+ * Returns 0 on success and -1 if not supported by the TLS library.
+ */
+int        tls_ctx_enable_ktls(tls_ctx_t *ctx);
 
 tls_t     *tls_new(tls_ctx_t *ctx);
 void       tls_ref(tls_t *tls);
@@ -38,10 +49,23 @@ void       tls_set_incoming(tls_t *tls);
 void       tls_set_socket(tls_t *tls, sock_t sock);
 
 int        tls_want_io(tls_t *tls);
+/* Advances the handshake of a non-blocking connection.
+ * Returns 1 once it is complete, 0 if it is waiting for the peer and -1 on error.
+ * If want_write is not NULL it is set to 1 if the socket must become writable before trying again.
+ */
+int        tls_handshake(tls_t *tls, int *want_write);
+/* Returns 1 if the handshake is complete, 0 if not and -1 on error. */
+int        tls_handshake_done(tls_t *tls);
 
 int        tls_got_shutdown(tls_t *tls);
 
 ssize_t    tls_read(tls_t *tls, void *buffer, size_t len);
 ssize_t    tls_write(tls_t *tls, const void *buffer, size_t len);
 
+/* Returns 1 if the kernel encrypts data sent on the socket, so it can be
+ * written to directly. Returns 0 if not (yet) and -1 on error.
+ * Once this returned 1 tls_write() must not be used anymore.
+ */
+int        tls_ktls_send(tls_t *tls);
+
 #endif
@@ -38,6 +38,9 @@
 
 #define CATMODULE "yp"
 
+/* number of requests performed at the same time per YP server */
+#define YP_MAX_CONNECTIONS  4
+
 struct yp_server
 {
     char        *url;
@@ -46,11 +49,13 @@ struct yp_server
     unsigned    touch_interval;
     int         remove;
     char        *listen_socket_id;
+    /* the server is not contacted until then after it failed */
+    time_t      down_until;
+    /* number of requests currently running */
+    unsigned    in_progress;
 
-    CURL *curl;
     struct ypdata_tag *mounts, *pending_mounts;
     struct yp_server *next;
-    char curl_error[CURL_ERROR_SIZE];
 };
 
 
@@ -81,12 +86,26 @@ typedef struct ypdata_tag
     char *error_msg;
     int (*process)(struct ypdata_tag *yp, char *s, unsigned len);
 
+    /* state of the current request, the fields written by the header
+     * callback must not be touched while a request is in progress
+     */
+    CURL *curl;
+    int in_progress;
+    const char *cmd;
+    CURLcode result;
+    struct ypdata_tag *done_next;
+    char curl_error[CURL_ERROR_SIZE];
+
     struct ypdata_tag *next;
 } ypdata_t;
 
 
 static rwlock_t yp_lock;
 static mutex_t yp_pending_lock;
+/* protects the list of finished requests */
+static mutex_t yp_done_lock;
+static cond_t yp_done_cond;
+static ypdata_t *yp_done;
 
 static volatile struct yp_server *active_yps = NULL, *pending_yps = NULL;
 static volatile int yp_update = 0;
@@ -104,6 +123,7 @@ static int do_yp_touch(ypdata_t *yp, char *s, unsigned len);
 static void add_pending_yp (struct yp_server *server);
 static void delete_marked_yp(struct yp_server *server);
 static void yp_destroy_ypdata(ypdata_t *ypdata);
+static void yp_wait_server(struct yp_server *server);
 
 
 /* curl callback used to parse headers coming back from the YP server */
@@ -189,6 +209,7 @@ static void destroy_yp_server (struct yp_server *server)
      * then remove all marked entries.
      */
     add_pending_yp(server);
+    yp_wait_server(server);
     yp = server->mounts;
     while (yp) {
         yp->remove = 1;
@@ -196,7 +217,6 @@ static void destroy_yp_server (struct yp_server *server)
     }
     delete_marked_yp(server);
 
-    icecast_curl_free(server->curl);
     if (server->mounts) ICECAST_LOG_WARN("active ypdata not freed");
     if (server->pending_mounts) ICECAST_LOG_WARN("pending ypdata not freed");
     free (server->url);
@@ -255,17 +275,10 @@ void yp_recheck_config (ice_config_t *config)
             server->url_timeout = yp->timeout;
             server->touch_interval = yp->touch_interval;
             server->listen_socket_id = yp->listen_socket_id;
-            server->curl = icecast_curl_new(server->url, &(server->curl_error[0]));
-            if (server->curl == NULL)
-            {
-                destroy_yp_server (server);
-                break;
-            }
             if (server->url_timeout > 10 || server->url_timeout < 1)
                 server->url_timeout = 6;
             if (server->touch_interval < 30)
                 server->touch_interval = 30;
-            curl_easy_setopt (server->curl, CURLOPT_HEADERFUNCTION, handle_returned_header);
             server->next = (struct yp_server *)pending_yps;
             pending_yps = server;
             ICECAST_LOG_INFO("Adding new YP server \"%s\" (timeout %ds, default interval %ds)",
@@ -288,6 +301,8 @@ void yp_initialize(void)
     ice_config_t *config = config_get_config();
     thread_rwlock_create (&yp_lock);
     thread_mutex_create (&yp_pending_lock);
+    thread_mutex_create (&yp_done_lock);
+    thread_cond_create (&yp_done_cond);
     yp_recheck_config (config);
     config_release_config ();
     yp_thread = thread_create("YP Touch Thread", yp_update_thread,
@@ -296,25 +311,75 @@ void yp_initialize(void)
 
 
 
-/* handler for curl, checks if successful handling occurred
- * return 0 for ok, -1 for this entry failed, -2 for server fail.
- * On failure case, update and process are modified
+/* called from the HTTP client thread, hands the request back to the YP thread */
+static void yp_request_complete (CURL *handle, CURLcode result, void *userdata)
+{
+    ypdata_t *yp = userdata;
+
+    (void)handle;
+
+    thread_mutex_lock (&yp_done_lock);
+    yp->result = result;
+    yp->done_next = yp_done;
+    yp_done = yp;
+    thread_cond_signal (&yp_done_cond);
+    thread_mutex_unlock (&yp_done_lock);
+}
+
+
+/* start a request to the YP server, the response is handled by yp_request_done()
+ * return 0 for ok, -2 if the request could not be started.
  */
 static int send_to_yp (const char *cmd, ypdata_t *yp, char *post)
 {
-    int curlcode;
     struct yp_server *server = yp->server;
 
+    if (yp->curl == NULL)
+    {
+        yp->curl = icecast_curl_new (server->url, &(yp->curl_error[0]));
+        if (yp->curl)
+        {
+            curl_easy_setopt (yp->curl, CURLOPT_HEADERFUNCTION, handle_returned_header);
+            curl_easy_setopt (yp->curl, CURLOPT_WRITEHEADER, yp);
+            curl_easy_setopt (yp->curl, CURLOPT_TIMEOUT, (long)server->url_timeout);
+        }
+    }
+
     /* ICECAST_LOG_DEBUG("send YP (%s):%s", cmd, post); */
     yp->cmd_ok = 0;
-    curl_easy_setopt (server->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (server->curl, CURLOPT_WRITEHEADER, yp);
-    curlcode = curl_easy_perform (server->curl);
-    if (curlcode)
+    yp->cmd = cmd;
+    yp->in_progress = 1;
+    server->in_progress++;
+    if (yp->curl)
+        curl_easy_setopt (yp->curl, CURLOPT_COPYPOSTFIELDS, post);
+    if (yp->curl == NULL ||
+        icecast_curl_submit (yp->curl, server->url, YP_MAX_CONNECTIONS, yp_request_complete, yp) != 0)
     {
+        yp->in_progress = 0;
+        server->in_progress--;
         yp->process = do_yp_add;
         yp->next_update = now + 1200;
-        ICECAST_LOG_ERROR("connection to %s failed with \"%s\"", server->url, server->curl_error);
+        ICECAST_LOG_ERROR("can not start YP %s on %s", cmd, server->url);
+        return -2;
+    }
+    return 0;
+}
+
+
+/* checks if successful handling occurred
+ * return 0 for ok, -1 for this entry failed, -2 for server fail.
+ * On failure case, update and process are modified
+ */
+static int check_yp_response (ypdata_t *yp)
+{
+    struct yp_server *server = yp->server;
+    const char *cmd = yp->cmd;
+
+    if (yp->result)
+    {
+        yp->process = do_yp_add;
+        yp->next_update = now + 1200;
+        ICECAST_LOG_ERROR("connection to %s failed with \"%s\"", server->url, yp->curl_error);
         return -2;
     }
     if (yp->cmd_ok == 0)
@@ -350,6 +415,99 @@ static int send_to_yp (const char *cmd, ypdata_t *yp, char *post)
 }
 
 
+/* handle the response to a request started by send_to_yp() */
+static void yp_request_done (ypdata_t *yp)
+{
+    struct yp_server *server = yp->server;
+    int (*process)(ypdata_t *yp, char *s, unsigned len) = yp->process;
+    int ret;
+
+    yp->in_progress = 0;
+    server->in_progress--;
+    now = time (NULL);
+
+    ret = check_yp_response (yp);
+    if (process == do_yp_add)
+    {
+        if (ret == 0)
+        {
+            yp->process = do_yp_touch;
+            /* force first touch in 5 secs */
+            yp->next_update = now + 5;
+        }
+    }
+    else if (process == do_yp_touch)
+    {
+        if (ret == 0)
+            yp->next_update = now + yp->touch_interval;
+    }
+    else if (process == do_yp_remove)
+    {
+        free (yp->sid);
+        yp->sid = NULL;
+        yp->remove = 1;
+        yp->process = do_yp_add;
+        yp_update = 1;
+    }
+
+    /* if one of the streams shows that the server cannot be contacted then mark the
+     * other entries for an update later. Assume YP server is dead and skip it for now
+     */
+    if (ret == -2 && now >= server->down_until)
+    {
+        ypdata_t *other;
+
+        server->down_until = now + 900;
+        for (other = server->mounts; other; other = other->next)
+        {
+            if (other != yp && !other->in_progress)
+                other->process = do_yp_add;
+        }
+    }
+}
+
+
+/* wait at most timeout ms for a response to arrive */
+static void yp_wait_done (unsigned int timeout)
+{
+    thread_mutex_lock (&yp_done_lock);
+    if (yp_done == NULL)
+        thread_cond_timedwait_mutex (&yp_done_cond, &yp_done_lock, timeout);
+    thread_mutex_unlock (&yp_done_lock);
+}
+
+
+/* handle the responses that arrived */
+static void yp_process_done (void)
+{
+    ypdata_t *list;
+
+    thread_mutex_lock (&yp_done_lock);
+    list = yp_done;
+    yp_done = NULL;
+    thread_mutex_unlock (&yp_done_lock);
+
+    while (list)
+    {
+        ypdata_t *yp = list;
+        list = yp->done_next;
+        yp->done_next = NULL;
+        yp_request_done (yp);
+    }
+}
+
+
+/* wait for all requests to the server to finish */
+static void yp_wait_server (struct yp_server *server)
+{
+    while (server->in_progress)
+    {
+        yp_wait_done (1000);
+        yp_process_done ();
+    }
+}
+
+
 /* routines for building and issues requests to the YP server */
 static int do_yp_remove (ypdata_t *yp, char *s, unsigned len)
 {
@@ -363,6 +521,8 @@ static int do_yp_remove (ypdata_t *yp, char *s, unsigned len)
 
         ICECAST_LOG_INFO("clearing up YP entry for %s", yp->mount);
         ret = send_to_yp ("remove", yp, s);
+        if (ret == 0)
+            return 0;
         free (yp->sid);
         yp->sid = NULL;
     }
@@ -429,14 +589,7 @@ static int do_yp_add (ypdata_t *yp, char *s, unsigned len)
 
     if (ret >= (signed)len)
         return ret+1;
-    ret = send_to_yp ("add", yp, s);
-    if (ret == 0)
-    {
-        yp->process = do_yp_touch;
-        /* force first touch in 5 secs */
-        yp->next_update = time(NULL) + 5;
-    }
-    return ret;
+    return send_to_yp ("add", yp, s);
 }
 
 
@@ -497,12 +650,7 @@ static int do_yp_touch (ypdata_t *yp, char *s, unsigned len)
     if (ret >= (signed)len)
         return ret+1; /* space required for above text and nul*/
 
-    if (send_to_yp ("touch", yp, s) == 0)
-    {
-        yp->next_update = now + yp->touch_interval;
-        return 0;
-    }
-    return -1;
+    return send_to_yp ("touch", yp, s);
 }
 
 
@@ -544,24 +692,18 @@ static int process_ypdata(struct yp_server *server, ypdata_t *yp)
 static void yp_process_server (struct yp_server *server)
 {
     ypdata_t *yp;
-    int state = 0;
 
     /* ICECAST_LOG_DEBUG("processing yp server %s", server->url); */
+    now = time (NULL);
+    if (now < server->down_until)
+        return;
+
+    /* requests are started here and handled once the response arrived */
     yp = server->mounts;
     while (yp)
     {
-        now = time (NULL);
-        /* if one of the streams shows that the server cannot be contacted then mark the
-         * other entries for an update later. Assume YP server is dead and skip it for now
-         */
-        if (state == -2)
-        {
-            ICECAST_LOG_DEBUG("skipping %s on %s", yp->mount, server->url);
-            yp->process = do_yp_add;
-            yp->next_update += 900;
-        }
-        else
-            state = process_ypdata (server, yp);
+        if (yp->in_progress == 0)
+            process_ypdata (server, yp);
         yp = yp->next;
     }
 }
@@ -587,6 +729,7 @@ static ypdata_t *create_yp_entry (struct yp_server *server, const char *mount)
 
         if (yp == NULL)
             break;
+        yp->server = server;
         yp->mount = strdup (mount);
         yp->server_name = strdup ("");
         yp->server_desc = strdup ("");
@@ -731,7 +874,8 @@ static void delete_marked_yp(struct yp_server *server)
 
     while (yp)
     {
-        if (yp->remove)
+        /* entries with a request running are removed once it finished */
+        if (yp->remove && yp->in_progress == 0)
         {
             ypdata_t *to_go = yp;
             ICECAST_LOG_DEBUG("removed %s from YP server %s", yp->mount, server->url);
@@ -757,10 +901,11 @@ static void *yp_update_thread(void *arg)
     while (running) {
         struct yp_server *server;
 
-        thread_sleep (200000);
+        yp_wait_done (200);
 
-        /* do the YP communication */
+        /* handle responses and do the YP communication */
         thread_rwlock_rlock (&yp_lock);
+        yp_process_done ();
         server = (struct yp_server *)active_yps;
         while (server)
         {
@@ -796,6 +941,8 @@ static void *yp_update_thread(void *arg)
         active_yps = server->next;
         destroy_yp_server (server);
     }
+    thread_cond_destroy (&yp_done_cond);
+    thread_mutex_destroy (&yp_done_lock);
 
     return NULL;
 }
@@ -843,6 +990,7 @@ static void yp_destroy_ypdata(ypdata_t *ypdata)
         }
         free(ypdata->subtype);
         free(ypdata->error_msg);
+        icecast_curl_free(ypdata->curl);
         free(ypdata);
     }
 }
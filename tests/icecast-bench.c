@@ -0,0 +1,1367 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2026,      Icecast contributors (see AUTHORS for details).
+ */
+
+/**
+ * icecast-bench: load generator and fan-out benchmark.
+ *
+ * This starts a local Icecast from a generated configuration, feeds it
+ * synthetic sources (MP3 with ICY metadata updates, Ogg/Opus, WebM) and
+ * attaches loopback listeners that read either as fast as possible or at a
+ * limited rate. The result is printed as a single JSON object.
+ *
+ * All network I/O is done by a single poll() loop so the load generator
+ * itself stays cheap compared to the server under test.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* base64 of "source:hackme" and "admin:hackme" */
+#define BENCH_SOURCE_AUTH   "c291cmNlOmhhY2ttZQ=="
+#define BENCH_ADMIN_AUTH    "YWRtaW46aGFja21l"
+
+typedef enum {
+    FORMAT_MP3 = 0,
+    FORMAT_OPUS,
+    FORMAT_WEBM,
+    FORMAT__END
+} bench_format_t;
+
+static const struct {
+    const char *name;
+    const char *extension;
+    const char *content_type;
+} formats[FORMAT__END] = {
+    {"mp3",  "mp3",  "audio/mpeg"},
+    {"opus", "opus", "audio/ogg"},
+    {"webm", "webm", "audio/webm"}
+};
+
+typedef enum {
+    STATE_CONNECTING = 0,
+    STATE_SENDING_REQUEST,
+    STATE_READING_RESPONSE,
+    STATE_STREAMING,
+    STATE_DONE,
+    STATE_FAILED
+} bench_state_t;
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t off;
+    size_t alloc;
+} bench_buf_t;
+
+typedef struct {
+    int is_source;
+    int fd;
+    bench_state_t state;
+    bench_format_t format;
+    char mount[64];
+
+    char request[1024];
+    size_t request_len;
+    size_t request_off;
+
+    char response[4096];
+    size_t response_len;
+
+    /* source */
+    bench_buf_t pending;
+    uint64_t stream_start;
+    uint64_t bytes_sent;
+    uint64_t units;
+    uint64_t granule;
+    uint32_t page_seq;
+    uint64_t timecode;
+
+    /* listener */
+    int slow;
+    uint64_t connect_start;
+    uint64_t headers;
+    uint64_t first_byte;
+    uint64_t bytes;
+    uint64_t read_allowance_start;
+    int dropped;
+} bench_conn_t;
+
+typedef struct {
+    const char *icecast;
+    int port;
+    int sources;
+    int format_mask;
+    int listeners;
+    int slow_percent;
+    int slow_rate;
+    int bitrate;
+    int duration;
+    int metadata_interval;
+    int queue_size;
+    int burst_size;
+    int keep;
+    const char *output;
+} bench_options_t;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void __usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+                    "  -x path      Icecast binary to start (default: ../src/icecast)\n"
+                    "  -p port      port to use (default: 18000)\n"
+                    "  -s count     number of sources (default: 3)\n"
+                    "  -f formats   comma separated list of source formats: mp3,opus,webm (default: all)\n"
+                    "  -l count     number of listeners (default: 20)\n"
+                    "  -S percent   percent of listeners that read slowly (default: 0)\n"
+                    "  -r rate      read rate of slow listeners in bytes per second (default: 4000)\n"
+                    "  -b kbps      source bitrate in kbit/s (default: 128)\n"
+                    "  -d seconds   duration of the measurement (default: 10)\n"
+                    "  -m seconds   interval of ICY metadata updates on MP3 sources, 0 to disable (default: 2)\n"
+                    "  -q bytes     queue size limit of the server (default: 262144)\n"
+                    "  -B bytes     burst size of the server (default: 65536)\n"
+                    "  -k           keep the working directory\n"
+                    "  -o file      write the JSON result to file (default: stdout)\n"
+                    "\n"
+                    "Icecast refuses to run as root, so this must be run as an unprivileged user.\n", progname);
+}
+
+/* ---- buffers ---- */
+
+static int bb_reserve(bench_buf_t *buf, size_t len)
+{
+    unsigned char *n;
+    size_t alloc;
+
+    if ((buf->len + len) <= buf->alloc)
+        return 0;
+
+    alloc = buf->alloc ? buf->alloc : 4096;
+    while (alloc < (buf->len + len))
+        alloc *= 2;
+
+    n = realloc(buf->data, alloc);
+    if (!n)
+        return -1;
+
+    buf->data = n;
+    buf->alloc = alloc;
+    return 0;
+}
+
+static void bb_push(bench_buf_t *buf, const void *data, size_t len)
+{
+    if (bb_reserve(buf, len) != 0) {
+        fprintf(stderr, "Can not allocate memory\n");
+        exit(1);
+    }
+    if (data) {
+        memcpy(buf->data + buf->len, data, len);
+    } else {
+        memset(buf->data + buf->len, 0, len);
+    }
+    buf->len += len;
+}
+
+static void bb_push_byte(bench_buf_t *buf, unsigned char c)
+{
+    bb_push(buf, &c, 1);
+}
+
+/* drops already sent data from the start of the buffer */
+static void bb_compact(bench_buf_t *buf)
+{
+    if (buf->off == buf->len) {
+        buf->off = buf->len = 0;
+    } else if (buf->off > (buf->alloc / 2)) {
+        memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+        buf->len -= buf->off;
+        buf->off = 0;
+    }
+}
+
+/* ---- MP3 generator ---- */
+
+static const int mp3_bitrates[] = {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320};
+
+static int mp3_bitrate_index(int kbps)
+{
+    size_t i;
+
+    for (i = 1; i < (sizeof(mp3_bitrates)/sizeof(*mp3_bitrates)); i++) {
+        if (mp3_bitrates[i] >= kbps)
+            return i;
+    }
+
+    return 14;
+}
+
+/* one MPEG-1 Layer III frame at 44.1kHz with silent (zero) payload */
+static void gen_mp3_frame(bench_conn_t *conn, int kbps)
+{
+    int index = mp3_bitrate_index(kbps);
+    size_t len = 144000 * mp3_bitrates[index] / 44100;
+    unsigned char header[4] = {0xFF, 0xFB, (unsigned char)(index << 4), 0x00};
+
+    bb_push(&conn->pending, header, sizeof(header));
+    bb_push(&conn->pending, NULL, len - sizeof(header));
+    conn->units++;
+}
+
+/* ---- Ogg/Opus generator ---- */
+
+static uint32_t ogg_crc_table[256];
+
+static void ogg_crc_init(void)
+{
+    uint32_t i, j, r;
+
+    for (i = 0; i < 256; i++) {
+        r = i << 24;
+        for (j = 0; j < 8; j++)
+            r = (r & 0x80000000U) ? ((r << 1) ^ 0x04c11db7U) : (r << 1);
+        ogg_crc_table[i] = r;
+    }
+}
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    put_le16(p, v & 0xFFFF);
+    put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    put_le32(p, v & 0xFFFFFFFFU);
+    put_le32(p + 4, v >> 32);
+}
+
+/* Writes one Ogg page holding count packets of the given sizes. */
+static void ogg_page(bench_conn_t *conn, unsigned char flags, uint64_t granule, const unsigned char * const *packets, const size_t *sizes, size_t count)
+{
+    unsigned char header[27 + 255];
+    size_t segments = 0;
+    size_t start = conn->pending.len;
+    size_t i, len;
+    uint32_t crc = 0;
+
+    memcpy(header, "OggS", 4);
+    header[4] = 0;
+    header[5] = flags;
+    put_le64(header + 6, granule);
+    put_le32(header + 14, 0x42454e43); /* serial */
+    put_le32(header + 18, conn->page_seq++);
+    put_le32(header + 22, 0);
+
+    for (i = 0; i < count; i++) {
+        len = sizes[i];
+        while (len >= 255) {
+            header[27 + segments++] = 255;
+            len -= 255;
+        }
+        header[27 + segments++] = len;
+    }
+    header[26] = segments;
+
+    bb_push(&conn->pending, header, 27 + segments);
+    for (i = 0; i < count; i++)
+        bb_push(&conn->pending, packets[i], sizes[i]);
+
+    for (i = start; i < conn->pending.len; i++)
+        crc = (crc << 8) ^ ogg_crc_table[((crc >> 24) & 0xFF) ^ conn->pending.data[i]];
+    put_le32(conn->pending.data + start + 22, crc);
+}
+
+static size_t opus_head(unsigned char *p)
+{
+    memcpy(p, "OpusHead", 8);
+    p[8] = 1; /* version */
+    p[9] = 2; /* channels */
+    put_le16(p + 10, 312); /* pre-skip */
+    put_le32(p + 12, 48000);
+    put_le16(p + 16, 0); /* gain */
+    p[18] = 0; /* mapping family */
+    return 19;
+}
+
+/* size of a 20ms Opus packet at the given bitrate */
+static size_t opus_packet_size(int kbps)
+{
+    size_t len = kbps * 1000 / 8 / 50;
+    return len < 3 ? 3 : len;
+}
+
+#define OPUS_PACKETS_PER_UNIT   10
+
+static void gen_opus_headers(bench_conn_t *conn)
+{
+    static const char vendor[] = "icecast-bench";
+    static const char comment[] = "TITLE=icecast-bench";
+    unsigned char head[19];
+    unsigned char tags[64];
+    const unsigned char *packet;
+    size_t len;
+
+    len = opus_head(head);
+    packet = head;
+    ogg_page(conn, 0x02, 0, &packet, &len, 1);
+
+    memcpy(tags, "OpusTags", 8);
+    put_le32(tags + 8, strlen(vendor));
+    memcpy(tags + 12, vendor, strlen(vendor));
+    len = 12 + strlen(vendor);
+    put_le32(tags + len, 1);
+    put_le32(tags + len + 4, strlen(comment));
+    memcpy(tags + len + 8, comment, strlen(comment));
+    len += 8 + strlen(comment);
+    packet = tags;
+    ogg_page(conn, 0x00, 0, &packet, &len, 1);
+}
+
+static void gen_opus_page(bench_conn_t *conn, int kbps)
+{
+    static unsigned char packet[2048];
+    const unsigned char *packets[OPUS_PACKETS_PER_UNIT];
+    size_t sizes[OPUS_PACKETS_PER_UNIT];
+    size_t len = opus_packet_size(kbps);
+    size_t i;
+
+    if (len > sizeof(packet))
+        len = sizeof(packet);
+
+    packet[0] = 0xFC; /* CELT fullband 20ms, stereo, one frame */
+
+    for (i = 0; i < OPUS_PACKETS_PER_UNIT; i++) {
+        packets[i] = packet;
+        sizes[i] = len;
+    }
+
+    conn->granule += 960 * OPUS_PACKETS_PER_UNIT;
+    ogg_page(conn, 0x00, conn->granule, packets, sizes, OPUS_PACKETS_PER_UNIT);
+    conn->units++;
+}
+
+/* ---- WebM generator ---- */
+
+static void ebml_id(bench_buf_t *buf, uint32_t id)
+{
+    if (id > 0xFFFFFF)
+        bb_push_byte(buf, id >> 24);
+    if (id > 0xFFFF)
+        bb_push_byte(buf, (id >> 16) & 0xFF);
+    if (id > 0xFF)
+        bb_push_byte(buf, (id >> 8) & 0xFF);
+    bb_push_byte(buf, id & 0xFF);
+}
+
+/* Starts a master element, returns the offset of its 8 byte size field. */
+static size_t ebml_master_start(bench_buf_t *buf, uint32_t id)
+{
+    size_t ret;
+
+    ebml_id(buf, id);
+    ret = buf->len;
+    bb_push(buf, NULL, 8);
+    return ret;
+}
+
+static void ebml_master_end(bench_buf_t *buf, size_t sizepos)
+{
+    uint64_t size = buf->len - sizepos - 8;
+    int i;
+
+    buf->data[sizepos] = 0x01;
+    for (i = 7; i > 0; i--) {
+        buf->data[sizepos + i] = size & 0xFF;
+        size >>= 8;
+    }
+}
+
+static void ebml_bin(bench_buf_t *buf, uint32_t id, const void *data, size_t len)
+{
+    ebml_id(buf, id);
+    if (len < 0x7F) {
+        bb_push_byte(buf, 0x80 | len);
+    } else {
+        bb_push_byte(buf, 0x40 | (len >> 8));
+        bb_push_byte(buf, len & 0xFF);
+    }
+    bb_push(buf, data, len);
+}
+
+static void ebml_uint(bench_buf_t *buf, uint32_t id, uint64_t value)
+{
+    unsigned char data[8];
+    size_t len = 1;
+    size_t i;
+
+    while (len < 8 && (value >> (8 * len)))
+        len++;
+
+    for (i = 0; i < len; i++)
+        data[i] = (value >> (8 * (len - i - 1))) & 0xFF;
+
+    ebml_bin(buf, id, data, len);
+}
+
+static void ebml_float(bench_buf_t *buf, uint32_t id, double value)
+{
+    unsigned char data[8];
+    uint64_t bits;
+    size_t i;
+
+    memcpy(&bits, &value, sizeof(bits));
+    for (i = 0; i < 8; i++)
+        data[i] = (bits >> (8 * (7 - i))) & 0xFF;
+
+    ebml_bin(buf, id, data, 8);
+}
+
+static void ebml_string(bench_buf_t *buf, uint32_t id, const char *value)
+{
+    ebml_bin(buf, id, value, strlen(value));
+}
+
+static void gen_webm_headers(bench_conn_t *conn)
+{
+    static const unsigned char unknown_size[8] = {0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    bench_buf_t *buf = &(conn->pending);
+    unsigned char head[19];
+    size_t pos, entry, audio;
+
+    pos = ebml_master_start(buf, 0x1A45DFA3);
+    ebml_uint(buf, 0x4286, 1);
+    ebml_uint(buf, 0x42F7, 1);
+    ebml_uint(buf, 0x42F2, 4);
+    ebml_uint(buf, 0x42F3, 8);
+    ebml_string(buf, 0x4282, "webm");
+    ebml_uint(buf, 0x4287, 2);
+    ebml_uint(buf, 0x4285, 2);
+    ebml_master_end(buf, pos);
+
+    /* Segment of unknown size */
+    ebml_id(buf, 0x18538067);
+    bb_push(buf, unknown_size, sizeof(unknown_size));
+
+    pos = ebml_master_start(buf, 0x1549A966);
+    ebml_uint(buf, 0x2AD7B1, 1000000);
+    ebml_string(buf, 0x4D80, "icecast-bench");
+    ebml_string(buf, 0x5741, "icecast-bench");
+    ebml_master_end(buf, pos);
+
+    pos = ebml_master_start(buf, 0x1654AE6B);
+    entry = ebml_master_start(buf, 0xAE);
+    ebml_uint(buf, 0xD7, 1);
+    ebml_uint(buf, 0x73C5, 1);
+    ebml_uint(buf, 0x83, 2);
+    ebml_string(buf, 0x86, "A_OPUS");
+    ebml_bin(buf, 0x63A2, head, opus_head(head));
+    audio = ebml_master_start(buf, 0xE1);
+    ebml_float(buf, 0xB5, 48000.);
+    ebml_uint(buf, 0x9F, 2);
+    ebml_master_end(buf, audio);
+    ebml_master_end(buf, entry);
+    ebml_master_end(buf, pos);
+}
+
+static void gen_webm_cluster(bench_conn_t *conn, int kbps)
+{
+    static unsigned char block[2048];
+    bench_buf_t *buf = &(conn->pending);
+    size_t len = opus_packet_size(kbps);
+    size_t pos;
+    size_t i;
+
+    if ((len + 4) > sizeof(block))
+        len = sizeof(block) - 4;
+
+    pos = ebml_master_start(buf, 0x1F43B675);
+    ebml_uint(buf, 0xE7, conn->timecode);
+    for (i = 0; i < OPUS_PACKETS_PER_UNIT; i++) {
+        block[0] = 0x81; /* track 1 */
+        block[1] = ((i * 20) >> 8) & 0xFF;
+        block[2] = (i * 20) & 0xFF;
+        block[3] = 0x80; /* keyframe */
+        block[4] = 0xFC;
+        ebml_bin(buf, 0xA3, block, len + 4);
+    }
+    ebml_master_end(buf, pos);
+
+    conn->timecode += 20 * OPUS_PACKETS_PER_UNIT;
+    conn->units++;
+}
+
+static void gen_unit(bench_conn_t *conn, int kbps)
+{
+    switch (conn->format) {
+        case FORMAT_MP3:
+            gen_mp3_frame(conn, kbps);
+        break;
+        case FORMAT_OPUS:
+            gen_opus_page(conn, kbps);
+        break;
+        case FORMAT_WEBM:
+            gen_webm_cluster(conn, kbps);
+        break;
+        default:
+        break;
+    }
+}
+
+/* bytes per second actually produced by the generator of the given format */
+static double format_byte_rate(bench_format_t format, int kbps)
+{
+    switch (format) {
+        case FORMAT_MP3:
+            return (double)(144000 * mp3_bitrates[mp3_bitrate_index(kbps)] / 44100) * 44100. / 1152.;
+        break;
+        default:
+            return (double)opus_packet_size(kbps) * 50.;
+        break;
+    }
+}
+
+/* ---- sockets ---- */
+
+static int connect_nonblocking(int port, int rcvbuf)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+
+    if (fd < 0)
+        return -1;
+
+    if (rcvbuf > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Simple blocking request, used for metadata updates. Returns the HTTP status or -1. */
+static int http_request(int port, const char *request)
+{
+    struct sockaddr_in addr;
+    struct timeval tv = {.tv_sec = 2, .tv_usec = 0};
+    char buf[512];
+    ssize_t ret;
+    int status = -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        send(fd, request, strlen(request), MSG_NOSIGNAL) == (ssize_t)strlen(request)) {
+        ret = recv(fd, buf, sizeof(buf) - 1, 0);
+        if (ret > 0) {
+            buf[ret] = 0;
+            if (sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1)
+                status = -1;
+        }
+    }
+
+    close(fd);
+    return status;
+}
+
+/* ---- connections ---- */
+
+static void conn_fail(bench_conn_t *conn)
+{
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+    conn->state = STATE_FAILED;
+}
+
+static void conn_start(bench_conn_t *conn, int port)
+{
+    conn->fd = connect_nonblocking(port, conn->slow ? 8192 : 0);
+    conn->connect_start = now_us();
+    conn->state = conn->fd < 0 ? STATE_FAILED : STATE_CONNECTING;
+}
+
+/* Checks the status line once the response header is complete.
+ * Returns the header length, 0 if incomplete or -1 on error.
+ */
+static ssize_t conn_parse_response(bench_conn_t *conn, int expected)
+{
+    char *end;
+    int status;
+
+    conn->response[conn->response_len] = 0;
+    end = strstr(conn->response, "\r\n\r\n");
+    if (!end)
+        return conn->response_len >= (sizeof(conn->response) - 1) ? -1 : 0;
+
+    if (sscanf(conn->response, "HTTP/%*d.%*d %d", &status) != 1 || status != expected)
+        return -1;
+
+    return end + 4 - conn->response;
+}
+
+static void source_step(bench_conn_t *conn, const bench_options_t *options, uint64_t now)
+{
+    double rate = format_byte_rate(conn->format, options->bitrate);
+    uint64_t allowed;
+    ssize_t ret;
+
+    if (conn->state != STATE_STREAMING)
+        return;
+
+    /* send one second ahead so the server has some data to burst */
+    allowed = (uint64_t)(rate * ((double)(now - conn->stream_start) / 1000000. + 1.));
+
+    while (conn->bytes_sent < allowed) {
+        if (conn->pending.off == conn->pending.len)
+            gen_unit(conn, options->bitrate);
+
+        ret = send(conn->fd, conn->pending.data + conn->pending.off, conn->pending.len - conn->pending.off, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                conn_fail(conn);
+            break;
+        }
+
+        conn->pending.off += ret;
+        conn->bytes_sent += ret;
+        bb_compact(&conn->pending);
+    }
+}
+
+static void conn_handle(bench_conn_t *conn, const bench_options_t *options, short revents, uint64_t now, int measuring)
+{
+    char buf[65536];
+    ssize_t ret;
+
+    if (conn->state == STATE_CONNECTING && (revents & (POLLOUT|POLLERR|POLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            conn_fail(conn);
+            return;
+        }
+        conn->state = STATE_SENDING_REQUEST;
+    }
+
+    if (conn->state == STATE_SENDING_REQUEST && (revents & POLLOUT)) {
+        ret = send(conn->fd, conn->request + conn->request_off, conn->request_len - conn->request_off, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                conn_fail(conn);
+            return;
+        }
+        conn->request_off += ret;
+        if (conn->request_off == conn->request_len)
+            conn->state = STATE_READING_RESPONSE;
+        return;
+    }
+
+    if (conn->state == STATE_READING_RESPONSE && (revents & (POLLIN|POLLERR|POLLHUP))) {
+        ssize_t header_len;
+
+        ret = recv(conn->fd, conn->response + conn->response_len, sizeof(conn->response) - 1 - conn->response_len, 0);
+        if (ret <= 0) {
+            if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                conn_fail(conn);
+            return;
+        }
+        conn->response_len += ret;
+
+        header_len = conn_parse_response(conn, conn->is_source ? 100 : 200);
+        if (header_len < 0) {
+            conn_fail(conn);
+        } else if (header_len > 0) {
+            conn->state = STATE_STREAMING;
+            if (conn->is_source) {
+                conn->stream_start = now;
+                return;
+            }
+            conn->headers = now;
+            if ((size_t)header_len < conn->response_len) {
+                conn->first_byte = now;
+                if (measuring)
+                    conn->bytes += conn->response_len - header_len;
+            }
+        }
+        return;
+    }
+
+    if (conn->state == STATE_STREAMING && conn->is_source && (revents & POLLOUT)) {
+        source_step(conn, options, now);
+        return;
+    }
+
+    if (conn->state == STATE_STREAMING && !conn->is_source && (revents & (POLLIN|POLLERR|POLLHUP))) {
+        size_t len = sizeof(buf);
+
+        if (conn->slow) {
+            uint64_t allowance = (uint64_t)options->slow_rate * (now - conn->read_allowance_start) / 1000000;
+
+            if (allowance <= conn->bytes)
+                return;
+            if ((allowance - conn->bytes) < len)
+                len = allowance - conn->bytes;
+        }
+
+        ret = recv(conn->fd, buf, len, 0);
+        if (ret <= 0) {
+            if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                conn->dropped = 1;
+                conn_fail(conn);
+            }
+            return;
+        }
+
+        if (!conn->first_byte)
+            conn->first_byte = now;
+        if (measuring || conn->slow)
+            conn->bytes += ret;
+    }
+}
+
+/* ---- server ---- */
+
+static int write_config(const char *dir, const bench_options_t *options)
+{
+    char path[PATH_MAX];
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/icecast.xml", dir);
+    file = fopen(path, "w");
+    if (!file)
+        return -1;
+
+    fprintf(file,
+            "<icecast>\n"
+            "    <location>icecast-bench</location>\n"
+            "    <admin>bench@localhost</admin>\n"
+            "    <limits>\n"
+            "        <clients>%d</clients>\n"
+            "        <sources>%d</sources>\n"
+            "        <queue-size>%d</queue-size>\n"
+            "        <client-timeout>30</client-timeout>\n"
+            "        <header-timeout>15</header-timeout>\n"
+            "        <source-timeout>10</source-timeout>\n"
+            "        <burst-size>%d</burst-size>\n"
+            "    </limits>\n"
+            "    <authentication>\n"
+            "        <source-password>hackme</source-password>\n"
+            "        <admin-user>admin</admin-user>\n"
+            "        <admin-password>hackme</admin-password>\n"
+            "    </authentication>\n"
+            "    <hostname>127.0.0.1</hostname>\n"
+            "    <listen-socket>\n"
+            "        <port>%d</port>\n"
+            "        <bind-address>127.0.0.1</bind-address>\n"
+            "    </listen-socket>\n"
+            "    <paths>\n"
+            "        <logdir>%s</logdir>\n"
+            "        <webroot>%s</webroot>\n"
+            "        <adminroot>%s</adminroot>\n"
+            "    </paths>\n"
+            "    <logging>\n"
+            "        <accesslog>access.log</accesslog>\n"
+            "        <errorlog>error.log</errorlog>\n"
+            "        <loglevel>2</loglevel>\n"
+            "    </logging>\n"
+            "    <security>\n"
+            "        <chroot>0</chroot>\n"
+            "    </security>\n"
+            "</icecast>\n",
+            options->sources + options->listeners + 16, options->sources,
+            options->queue_size, options->burst_size, options->port,
+            dir, dir, dir);
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static pid_t start_server(const char *dir, const char *icecast)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int fd = open("/dev/null", O_RDWR);
+
+        if (fd >= 0) {
+            dup2(fd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        if (chdir(dir) != 0)
+            _exit(126);
+        execl(icecast, "icecast", "-c", "icecast.xml", (char *)NULL);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+static int wait_for_server(pid_t pid, int port)
+{
+    uint64_t deadline = now_us() + 10000000;
+    struct sockaddr_in addr;
+    int status;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    while (now_us() < deadline) {
+        int fd;
+
+        if (waitpid(pid, &status, WNOHANG) == pid)
+            return -1;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0) {
+            if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+                close(fd);
+                return 0;
+            }
+            close(fd);
+        }
+        usleep(100000);
+    }
+
+    return -1;
+}
+
+/* CPU time used by the process in seconds or -1 if unknown. */
+static double process_cpu(pid_t pid)
+{
+    char path[64];
+    char buf[1024];
+    unsigned long utime, stime;
+    char *p;
+    FILE *file;
+    size_t len;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", (long int)pid);
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+
+    len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = 0;
+
+    /* skip pid and comm, the latter may contain spaces */
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double percentile(const double *values, size_t count, double p)
+{
+    size_t index;
+
+    if (!count)
+        return 0.;
+
+    index = (size_t)(p * (count - 1) + 0.5);
+    return values[index];
+}
+
+/* Prints the distribution of sorted latency values as a JSON member. */
+static void print_latency(FILE *out, const char *name, const double *values, size_t count)
+{
+    double sum = 0.;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        sum += values[i];
+
+    fprintf(out, ",\"%s\":{\"count\":%zu,\"min\":%.3f,\"avg\":%.3f,\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+            name, count, count ? values[0] : 0., count ? sum / count : 0.,
+            percentile(values, count, .5), percentile(values, count, .95),
+            percentile(values, count, .99), count ? values[count - 1] : 0.);
+}
+
+static int parse_formats(const char *list)
+{
+    char *copy = strdup(list);
+    char *token, *save = NULL;
+    int mask = 0;
+    size_t i;
+
+    for (token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        for (i = 0; i < FORMAT__END; i++) {
+            if (strcmp(token, formats[i].name) == 0)
+                break;
+        }
+        if (i == FORMAT__END) {
+            free(copy);
+            return -1;
+        }
+        mask |= 1 << i;
+    }
+
+    free(copy);
+    return mask;
+}
+
+static void remove_dir(const char *dir)
+{
+    static const char *files[] = {"icecast.xml", "error.log", "access.log", "icecast.pid"};
+    char path[PATH_MAX];
+    size_t i;
+
+    for (i = 0; i < (sizeof(files)/sizeof(*files)); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options_t options = {
+        .icecast = "../src/icecast",
+        .port = 18000,
+        .sources = 3,
+        .format_mask = (1 << FORMAT__END) - 1,
+        .listeners = 20,
+        .slow_percent = 0,
+        .slow_rate = 4000,
+        .bitrate = 128,
+        .duration = 10,
+        .metadata_interval = 2,
+        .queue_size = 262144,
+        .burst_size = 65536,
+        .keep = 0,
+        .output = NULL
+    };
+    char dir[] = "/tmp/icecast-bench.XXXXXX";
+    char icecast[PATH_MAX];
+    bench_format_t source_formats[FORMAT__END];
+    size_t source_formats_count = 0;
+    bench_conn_t *conns;
+    struct pollfd *pfds;
+    size_t *pfd_conn;
+    size_t conn_count;
+    size_t i;
+    pid_t pid;
+    int opt;
+    int ret = 0;
+    uint64_t start, listeners_start = 0, measure_start = 0, measure_end = 0, next_metadata = 0;
+    unsigned int metadata_updates = 0, metadata_failed = 0;
+    double cpu_start = -1, cpu_end = -1;
+    FILE *out;
+
+    while ((opt = getopt(argc, argv, "x:p:s:f:l:S:r:b:d:m:q:B:ko:h")) != -1) {
+        switch (opt) {
+            case 'x': options.icecast = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 's': options.sources = atoi(optarg); break;
+            case 'f':
+                options.format_mask = parse_formats(optarg);
+                if (options.format_mask <= 0) {
+                    fprintf(stderr, "Invalid format list: %s\n", optarg);
+                    return 1;
+                }
+            break;
+            case 'l': options.listeners = atoi(optarg); break;
+            case 'S': options.slow_percent = atoi(optarg); break;
+            case 'r': options.slow_rate = atoi(optarg); break;
+            case 'b': options.bitrate = atoi(optarg); break;
+            case 'd': options.duration = atoi(optarg); break;
+            case 'm': options.metadata_interval = atoi(optarg); break;
+            case 'q': options.queue_size = atoi(optarg); break;
+            case 'B': options.burst_size = atoi(optarg); break;
+            case 'k': options.keep = 1; break;
+            case 'o': options.output = optarg; break;
+            default:
+                __usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+            break;
+        }
+    }
+
+    if (optind != argc || options.sources < 1 || options.listeners < 0 || options.duration < 1 ||
+        options.bitrate < 8 || options.slow_percent < 0 || options.slow_percent > 100 || options.slow_rate < 1) {
+        __usage(argv[0]);
+        return 1;
+    }
+
+    if (!realpath(options.icecast, icecast)) {
+        fprintf(stderr, "Can not find Icecast binary %s: %s\n", options.icecast, strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < FORMAT__END; i++) {
+        if (options.format_mask & (1 << i))
+            source_formats[source_formats_count++] = i;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    ogg_crc_init();
+
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "Can not create working directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (write_config(dir, &options) != 0) {
+        fprintf(stderr, "Can not write configuration to %s\n", dir);
+        remove_dir(dir);
+        return 1;
+    }
+
+    pid = start_server(dir, icecast);
+    if (pid < 0 || wait_for_server(pid, options.port) != 0) {
+        fprintf(stderr, "Icecast did not start, see %s/error.log\n", dir);
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+        return 1;
+    }
+
+    conn_count = options.sources + options.listeners;
+    conns = calloc(conn_count, sizeof(*conns));
+    pfds = calloc(conn_count, sizeof(*pfds));
+    pfd_conn = calloc(conn_count, sizeof(*pfd_conn));
+    if (!conns || !pfds || !pfd_conn) {
+        fprintf(stderr, "Can not allocate memory\n");
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+
+    for (i = 0; i < conn_count; i++) {
+        bench_conn_t *conn = &(conns[i]);
+
+        conn->fd = -1;
+
+        if (i < (size_t)options.sources) {
+            conn->is_source = 1;
+            conn->format = source_formats[i % source_formats_count];
+            snprintf(conn->mount, sizeof(conn->mount), "/bench%zu.%s", i, formats[conn->format].extension);
+            conn->request_len = snprintf(conn->request, sizeof(conn->request),
+                    "PUT %s HTTP/1.1\r\n"
+                    "Host: 127.0.0.1:%d\r\n"
+                    "Authorization: Basic " BENCH_SOURCE_AUTH "\r\n"
+                    "User-Agent: icecast-bench\r\n"
+                    "Content-Type: %s\r\n"
+                    "Ice-Name: icecast-bench %zu\r\n"
+                    "Ice-Public: 0\r\n"
+                    "Expect: 100-continue\r\n"
+                    "\r\n", conn->mount, options.port, formats[conn->format].content_type, i);
+
+            if (conn->format == FORMAT_OPUS) {
+                gen_opus_headers(conn);
+            } else if (conn->format == FORMAT_WEBM) {
+                gen_webm_headers(conn);
+            }
+
+            conn_start(conn, options.port);
+        } else {
+            size_t listener = i - options.sources;
+            const bench_conn_t *source = &(conns[listener % options.sources]);
+
+            conn->format = source->format;
+            conn->slow = listener < ((size_t)options.listeners * options.slow_percent / 100);
+            snprintf(conn->mount, sizeof(conn->mount), "%s", source->mount);
+            conn->request_len = snprintf(conn->request, sizeof(conn->request),
+                    "GET %s HTTP/1.0\r\n"
+                    "Host: 127.0.0.1:%d\r\n"
+                    "User-Agent: icecast-bench\r\n"
+                    "%s"
+                    "\r\n", conn->mount, options.port, conn->format == FORMAT_MP3 ? "Icy-MetaData: 1\r\n" : "");
+        }
+    }
+
+    start = now_us();
+
+    while (1) {
+        uint64_t now = now_us();
+        int timeout = 50;
+        size_t nfds = 0;
+        int measuring = measure_start && now < measure_end;
+
+        if (measure_end && now >= measure_end)
+            break;
+
+        /* start listeners once all sources are streaming, or after a timeout */
+        if (!listeners_start) {
+            int ready = 1;
+
+            for (i = 0; i < (size_t)options.sources; i++) {
+                if (conns[i].state != STATE_STREAMING && conns[i].state != STATE_FAILED)
+                    ready = 0;
+            }
+
+            if ((ready && (now - start) > 500000) || (now - start) > 5000000) {
+                listeners_start = now;
+                for (i = options.sources; i < conn_count; i++)
+                    conn_start(&(conns[i]), options.port);
+                cpu_start = process_cpu(pid);
+                measure_start = now;
+                measure_end = now + (uint64_t)options.duration * 1000000;
+                next_metadata = now + (uint64_t)options.metadata_interval * 1000000;
+                measuring = 1;
+                for (i = options.sources; i < conn_count; i++)
+                    conns[i].read_allowance_start = now;
+            }
+        }
+
+        if (measuring && options.metadata_interval > 0 && now >= next_metadata) {
+            for (i = 0; i < (size_t)options.sources; i++) {
+                char request[512];
+                int status;
+
+                if (conns[i].format != FORMAT_MP3 || conns[i].state != STATE_STREAMING)
+                    continue;
+
+                snprintf(request, sizeof(request),
+                        "GET /admin/metadata?mount=%s&mode=updinfo&song=icecast-bench+%u HTTP/1.0\r\n"
+                        "Authorization: Basic " BENCH_ADMIN_AUTH "\r\n"
+                        "\r\n", conns[i].mount, metadata_updates + metadata_failed);
+                status = http_request(options.port, request);
+                if (status == 200) {
+                    metadata_updates++;
+                } else {
+                    metadata_failed++;
+                }
+            }
+            next_metadata = now + (uint64_t)options.metadata_interval * 1000000;
+        }
+
+        for (i = 0; i < conn_count; i++) {
+            bench_conn_t *conn = &(conns[i]);
+            short events = 0;
+
+            switch (conn->state) {
+                case STATE_CONNECTING:
+                case STATE_SENDING_REQUEST:
+                    events = POLLOUT;
+                break;
+                case STATE_READING_RESPONSE:
+                    events = POLLIN;
+                break;
+                case STATE_STREAMING:
+                    if (conn->is_source) {
+                        source_step(conn, &options, now);
+                        if (conn->state == STATE_STREAMING && conn->pending.off != conn->pending.len)
+                            events = POLLOUT;
+                    } else if (conn->slow) {
+                        uint64_t allowance = (uint64_t)options.slow_rate * (now - conn->read_allowance_start) / 1000000;
+                        if (allowance > conn->bytes)
+                            events = POLLIN;
+                    } else {
+                        events = POLLIN;
+                    }
+                break;
+                default:
+                break;
+            }
+
+            if (events) {
+                pfds[nfds].fd = conn->fd;
+                pfds[nfds].events = events;
+                pfds[nfds].revents = 0;
+                pfd_conn[nfds] = i;
+                nfds++;
+            }
+        }
+
+        if (poll(pfds, nfds, timeout) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+            ret = 1;
+            break;
+        }
+
+        now = now_us();
+        for (i = 0; i < nfds; i++) {
+            if (pfds[i].revents)
+                conn_handle(&(conns[pfd_conn[i]]), &options, pfds[i].revents, now, measuring);
+        }
+    }
+
+    cpu_end = process_cpu(pid);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    /* ---- report ---- */
+    {
+        unsigned int sources_streaming = 0, sources_failed = 0;
+        unsigned int connected[2] = {0, 0}, failed[2] = {0, 0}, dropped[2] = {0, 0}, count[2] = {0, 0};
+        uint64_t bytes[2] = {0, 0};
+        uint64_t source_bytes = 0;
+        double *latency = calloc(options.listeners ? options.listeners : 1, sizeof(double));
+        double *header_latency = calloc(options.listeners ? options.listeners : 1, sizeof(double));
+        size_t latency_count = 0, header_latency_count = 0;
+        double wall = measure_end > measure_start ? (double)(measure_end - measure_start) / 1000000. : 0.;
+        double cpu = (cpu_start >= 0 && cpu_end >= 0) ? cpu_end - cpu_start : -1;
+        size_t f;
+
+        for (i = 0; i < conn_count; i++) {
+            bench_conn_t *conn = &(conns[i]);
+
+            if (conn->is_source) {
+                if (conn->state == STATE_STREAMING) {
+                    sources_streaming++;
+                } else {
+                    sources_failed++;
+                }
+                source_bytes += conn->bytes_sent;
+                continue;
+            }
+
+            count[conn->slow]++;
+            if (conn->headers)
+                header_latency[header_latency_count++] = (double)(conn->headers - conn->connect_start) / 1000.;
+            if (conn->first_byte)
+                latency[latency_count++] = (double)(conn->first_byte - conn->connect_start) / 1000.;
+            if (conn->headers) {
+                connected[conn->slow]++;
+            } else {
+                failed[conn->slow]++;
+            }
+            if (conn->dropped)
+                dropped[conn->slow]++;
+            bytes[conn->slow] += conn->bytes;
+        }
+
+        qsort(latency, latency_count, sizeof(*latency), compare_double);
+        qsort(header_latency, header_latency_count, sizeof(*header_latency), compare_double);
+
+        out = options.output ? fopen(options.output, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "Can not open %s: %s\n", options.output, strerror(errno));
+            out = stdout;
+        }
+
+        fprintf(out, "{\"version\":1");
+        fprintf(out, ",\"config\":{\"sources\":%d,\"formats\":[", options.sources);
+        for (f = 0; f < source_formats_count; f++)
+            fprintf(out, "%s\"%s\"", f ? "," : "", formats[source_formats[f]].name);
+        fprintf(out, "],\"listeners\":%d,\"slow_listeners\":%u,\"slow_rate\":%d,\"bitrate_kbps\":%d,\"duration\":%d,\"queue_size\":%d,\"burst_size\":%d}",
+                options.listeners, count[1], options.slow_rate, options.bitrate, options.duration, options.queue_size, options.burst_size);
+        fprintf(out, ",\"sources\":{\"streaming\":%u,\"failed\":%u,\"bytes_sent\":%llu,\"metadata_updates\":%u,\"metadata_failed\":%u}",
+                sources_streaming, sources_failed, (unsigned long long int)source_bytes, metadata_updates, metadata_failed);
+        fprintf(out, ",\"listeners\":{\"connected\":%u,\"failed\":%u,\"dropped\":%u,\"bytes\":%llu,\"bytes_per_second\":%.1f",
+                connected[0] + connected[1], failed[0] + failed[1], dropped[0] + dropped[1],
+                (unsigned long long int)(bytes[0] + bytes[1]), wall > 0 ? (double)(bytes[0] + bytes[1]) / wall : 0.);
+        for (f = 0; f < 2; f++) {
+            fprintf(out, ",\"%s\":{\"count\":%u,\"connected\":%u,\"failed\":%u,\"dropped\":%u,\"bytes\":%llu,\"bytes_per_second\":%.1f}",
+                    f ? "slow" : "fast", count[f], connected[f], failed[f], dropped[f],
+                    (unsigned long long int)bytes[f], wall > 0 ? (double)bytes[f] / wall : 0.);
+        }
+        fprintf(out, "}");
+        print_latency(out, "header_latency_ms", header_latency, header_latency_count);
+        print_latency(out, "join_latency_ms", latency, latency_count);
+        if (cpu >= 0 && wall > 0) {
+            fprintf(out, ",\"cpu\":{\"seconds\":%.3f,\"percent\":%.2f,\"per_listener_percent\":%.4f}",
+                    cpu, cpu * 100. / wall, options.listeners ? cpu * 100. / wall / options.listeners : 0.);
+        } else {
+            fprintf(out, ",\"cpu\":null");
+        }
+        fprintf(out, "}\n");
+
+        if (out != stdout)
+            fclose(out);
+
+        if (!sources_streaming)
+            ret = 1;
+
+        free(latency);
+        free(header_latency);
+    }
+
+    for (i = 0; i < conn_count; i++) {
+        if (conns[i].fd >= 0)
+            close(conns[i].fd);
+        free(conns[i].pending.data);
+    }
+    free(conns);
+    free(pfds);
+    free(pfd_conn);
+
+    if (options.keep || ret != 0) {
+        fprintf(stderr, "Working directory: %s\n", dir);
+    } else {
+        remove_dir(dir);
+    }
+
+    return ret;
+}